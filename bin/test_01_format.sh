@@ -1,15 +1,47 @@
 #!/bin/bash
 
+# Formatting discards the image when the host can punch holes, writing only
+# the superblock, the free maps and the superblock again once they are
+# clean; otherwise every block after the superblock is zeroed as well.
+PROBE=$(mktemp data/.punch.XXXXXX)
+head -c 4096 /dev/zero > $PROBE
+if fallocate --punch-hole --offset 0 --length 4096 $PROBE 2> /dev/null; then
+    PUNCH_HOLE=1
+fi
+rm -f $PROBE
+
+format-writes() {
+    BLOCKS=$1
+
+    if [ -n "$PUNCH_HOLE" ]; then
+	echo 3
+    else
+	echo $((BLOCKS + 2))
+    fi
+}
+
+# A freshly formatted inode table: every inode is invalid.
+inode-table() {
+    INODE_BLOCKS=$1
+
+    for ((b = 0; b < INODE_BLOCKS; b++)); do
+	for ((i = 0; i < 128; i++)); do
+	    echo "inodes[$b][$i]:     valid: 0"
+	done
+    done
+}
+
 image-5-output() {
     cat <<EOF
 disk formatted.
 SuperBlock:
-    magic number is valid
     5 blocks
     1 inode blocks
     128 inodes
-2 disk block reads
-5 disk block writes
+    1 bitmap blocks (clean)
+$(inode-table 1)
+1 disk block reads
+$(format-writes 5) disk block writes
 EOF
 }
 
@@ -17,12 +49,13 @@ image-20-output() {
     cat <<EOF
 disk formatted.
 SuperBlock:
-    magic number is valid
     20 blocks
     2 inode blocks
     256 inodes
-3 disk block reads
-20 disk block writes
+    1 bitmap blocks (clean)
+$(inode-table 2)
+2 disk block reads
+$(format-writes 20) disk block writes
 EOF
 }
 
@@ -30,12 +63,13 @@ image-200-output() {
     cat <<EOF
 disk formatted.
 SuperBlock:
-    magic number is valid
     200 blocks
     20 inode blocks
     2560 inodes
-21 disk block reads
-200 disk block writes
+    1 bitmap blocks (clean)
+$(inode-table 20)
+20 disk block reads
+$(format-writes 200) disk block writes
 EOF
 }
 
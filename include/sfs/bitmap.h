@@ -0,0 +1,60 @@
+/* bitmap.h: SimpleFS free-space bitmaps */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Bitmap Constants */
+
+#define BITMAP_WORD_BITS   (64) /* Bits per bitmap word */
+#define BITMAP_LEVELS      (8)  /* Most levels (64^8 bits) */
+#define BITMAP_REGION_BITS (BITMAP_WORD_BITS * BITMAP_WORD_BITS) /* Bits per counted region */
+
+/* Bitmap Structures */
+
+typedef struct Bitmap Bitmap;
+
+struct Bitmap
+{
+  size_t bits;                          /* Number of bits	*/
+  size_t nwords;                        /* Number of words	*/
+  uint64_t *words;                      /* Bits, lowest first (bits past the end stay clear)	*/
+  size_t nlevels;                       /* Number of levels (words are level 0)	*/
+  uint64_t *levels[BITMAP_LEVELS];      /* Bit i of level k is set if word i of level k - 1 is nonzero	*/
+  size_t level_words[BITMAP_LEVELS];    /* Words of each level	*/
+  uint32_t *regions;                    /* Set bits in each BITMAP_REGION_BITS region	*/
+  size_t set;                           /* Set bits in the whole bitmap	*/
+};
+
+/* Bitmap Functions
+ *
+ * The file system sets a bit for every free block or inode.  Above the
+ * words sit summary levels, each holding one bit per word of the level
+ * below that is set while that word is nonzero, up to a single top word.
+ * A search takes the lowest set bit (count trailing zeros) of the first
+ * nonzero word it meets, climbing a level whenever a word is empty and
+ * descending again once it finds a set bit, so finding a free item costs
+ * O(log64 n) word reads however full the map is.  Set bit counts are kept
+ * per region and in total so counting needs no scan.  After filling the
+ * words directly (say from disk), call bitmap_summarize. */
+
+Bitmap *bitmap_create(size_t bits, bool set);
+void bitmap_destroy(Bitmap *bitmap);
+
+bool bitmap_test(const Bitmap *bitmap, size_t bit);
+void bitmap_set(Bitmap *bitmap, size_t bit);
+void bitmap_clear(Bitmap *bitmap, size_t bit);
+void bitmap_clear_range(Bitmap *bitmap, size_t start, size_t count);
+
+ssize_t bitmap_find(const Bitmap *bitmap, size_t start);
+size_t bitmap_count(const Bitmap *bitmap);
+size_t bitmap_count_range(const Bitmap *bitmap, size_t start, size_t count);
+void bitmap_summarize(Bitmap *bitmap);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
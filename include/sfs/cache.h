@@ -0,0 +1,62 @@
+/* cache.h: SimpleFS write-back block buffer cache */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "sfs/disk.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Cache Constants */
+
+#define CACHE_NONE ((size_t)-1) /* Null entry index */
+
+/* Cache Structures */
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry
+{
+  size_t block;      /* Block number held by this entry	*/
+  bool valid;        /* Whether or not entry holds a block	*/
+  bool dirty;        /* Whether or not entry must be written back	*/
+  size_t hash_next;  /* Next entry in hash chain	*/
+  size_t lru_prev;   /* More recently used entry	*/
+  size_t lru_next;   /* Less recently used entry	*/
+  char *data;        /* BLOCK_SIZE frame	*/
+};
+
+typedef struct Cache Cache;
+
+struct Cache
+{
+  size_t capacity;        /* Number of entries	*/
+  CacheEntry *entries;    /* Entry table	*/
+  char *frames;           /* DISK_ALIGNMENT aligned frame memory	*/
+  size_t *buckets;        /* Hash buckets (entry index or CACHE_NONE)	*/
+  size_t nbuckets;        /* Number of hash buckets (power of two)	*/
+  size_t lru_head;        /* Most recently used entry	*/
+  size_t lru_tail;        /* Least recently used entry	*/
+  size_t dirty;           /* Number of dirty entries	*/
+  pthread_mutex_t lock;   /* Protects everything above	*/
+};
+
+/* Cache Functions */
+
+Cache *cache_create(size_t capacity);
+void cache_destroy(Cache *cache);
+
+ssize_t cache_read(Cache *cache, Disk *disk, size_t block, char *data);
+ssize_t cache_write(Cache *cache, Disk *disk, size_t block, char *data);
+ssize_t cache_readv(Cache *cache, Disk *disk, size_t block, size_t count, char **data);
+ssize_t cache_writev(Cache *cache, Disk *disk, size_t block, size_t count, char **data);
+
+int cache_flush(Cache *cache, Disk *disk);
+void cache_discard(Cache *cache, size_t block, size_t count);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
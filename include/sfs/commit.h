@@ -0,0 +1,48 @@
+/* commit.h: SimpleFS group commit */
+
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include "sfs/disk.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Commit Structures */
+
+typedef struct Commit Commit;
+
+struct Commit
+{
+  size_t batch;            /* Commits that end the wait for a group	*/
+  uint64_t delay;          /* Longest wait for a group to fill (ns)	*/
+  uint64_t requested;      /* Commits asked for (numbered from 1)	*/
+  uint64_t completed;      /* Commits covered by a finished flush	*/
+  uint64_t durable;        /* Commits covered by a successful flush	*/
+  size_t last_group;       /* Commits in the last group	*/
+  bool flushing;           /* Whether a leader is gathering or flushing	*/
+  int error;               /* errno of the first failed flush (0 if none)	*/
+  pthread_mutex_t lock;    /* Protects the counters	*/
+  pthread_cond_t arrived;  /* Signalled when a commit is asked for	*/
+  pthread_cond_t done;     /* Broadcast when a group is flushed	*/
+};
+
+/* Commit Functions
+ *
+ * The first caller to find no flush running becomes the leader of a group:
+ * it waits up to delay for batch commits to gather (only when the last
+ * group had company, so a lone committer never waits), then flushes once
+ * for every commit asked for so far.  Callers arriving while it flushes
+ * form the next group. */
+
+Commit *commit_create(size_t batch, uint64_t delay);
+void commit_destroy(Commit *commit);
+
+int commit_wait(Commit *commit, Disk *disk);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,22 @@
+/* crc32c.h: SimpleFS CRC32C (Castagnoli) checksums */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C Functions
+ *
+ * crc32c continues a checksum: pass 0 to start one, and the previous result
+ * to extend it over more data.  It uses the SSE4.2 or ARMv8 CRC
+ * instructions when the processor has them and slicing-by-8 tables
+ * otherwise; crc32c_portable always uses the tables. */
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t length);
+const char *crc32c_implementation(void);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,7 +3,10 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 
@@ -12,27 +15,390 @@
 #define BLOCK_SIZE (1 << 12)
 #define DISK_FAILURE (-1)
 
-/* Disk Structure */
+#define DISK_MODE_FILE (0) /* pread/pwrite on the image file */
+#define DISK_MODE_MMAP (1) /* Whole image mapped with mmap */
+#define DISK_MODE_URING (2) /* Asynchronous I/O through io_uring */
+#define DISK_MODE_RAM (3) /* Anonymous memory, never persisted */
+
+#define DISK_QUEUE_DEPTH (64) /* Default asynchronous queue depth */
+#define DISK_POOL_BUFFERS (64) /* Default aligned buffers for O_DIRECT */
+#define DISK_READAHEAD_BLOCKS (64) /* Suggested readahead buffer capacity */
+#define DISK_WRITE_QUEUE_BLOCKS (64) /* Suggested write queue capacity */
+#define DISK_WRITE_QUEUE_DELAY (10) /* Default write queue delay (ms) */
+#define DISK_STRIPE_BLOCKS (16) /* Suggested stripe unit (blocks) */
+#define DISK_COMMIT_BATCH (16) /* Default commits that end the wait for a group */
+#define DISK_COMMIT_DELAY (1000) /* Default longest wait for a group (us) */
+
+#define DISK_ALIGNMENT BLOCK_SIZE /* Buffer alignment required by O_DIRECT */
+#define DISK_ALIGNED(p) (((uintptr_t)(p) & (DISK_ALIGNMENT - 1)) == 0)
+
+#define DISK_JITTER_UNIFORM     (0) /* Random latency uniform in [0, 2 * jitter) */
+#define DISK_JITTER_EXPONENTIAL (1) /* Exponential random latency */
+#define DISK_JITTER_PARETO      (2) /* Heavy-tailed random latency (Pareto, alpha 2) */
+
+#define DISK_CHECKSUM_NONE  (0) /* No checksums */
+#define DISK_CHECKSUM_READ  (1) /* Store checksums, verify every backend read */
+#define DISK_CHECKSUM_SCRUB (2) /* Store checksums, verify only in disk_scrub */
+
+#define DISK_DURABILITY_NONE  (0) /* disk_commit does nothing */
+#define DISK_DURABILITY_SYNC  (1) /* disk_commit flushes every time */
+#define DISK_DURABILITY_GROUP (2) /* disk_commit joins a group sharing one flush */
+
+#define DISK_HISTOGRAM_BITS (3) /* Linear sub-buckets per power of two (log2) */
+#define DISK_HISTOGRAM_BUCKETS ((64 - DISK_HISTOGRAM_BITS + 1) << DISK_HISTOGRAM_BITS)
+
+/* Disk Latency Histogram
+ *
+ * Log-linear buckets: values below 2^(DISK_HISTOGRAM_BITS + 1) get a bucket
+ * each, and every larger power of two is split into 2^DISK_HISTOGRAM_BITS
+ * equal buckets, so any recorded value is known to within 12.5%. */
+
+typedef struct DiskHistogram DiskHistogram;
+
+struct DiskHistogram
+{
+  size_t count;                            /* Number of samples	*/
+  uint64_t total;                          /* Sum of samples (ns)	*/
+  uint64_t max;                            /* Largest sample (ns)	*/
+  size_t buckets[DISK_HISTOGRAM_BUCKETS];  /* Samples per bucket	*/
+};
+
+/* Disk Statistics (snapshot returned by disk_stats) */
+
+typedef struct DiskStats DiskStats;
+
+struct DiskStats
+{
+  size_t reads;          /* Blocks read from the backend	*/
+  size_t writes;         /* Blocks written to the backend	*/
+  size_t bytes_read;     /* Bytes read from the backend	*/
+  size_t bytes_written;  /* Bytes written to the backend	*/
+  size_t discards;       /* Blocks discarded	*/
+  size_t sequential;     /* Operations starting right after the previous one	*/
+  size_t random;         /* All other operations	*/
+  size_t cache_hits;     /* Reads served by the buffer cache	*/
+  size_t cache_misses;   /* Reads that missed the buffer cache	*/
+  size_t readahead_hits; /* Reads served by the readahead buffer	*/
+  size_t writes_absorbed; /* Queued writes overwritten before reaching the backend	*/
+  size_t write_queue_flushes; /* Write queue sweeps	*/
+  size_t checksum_errors; /* Blocks that failed checksum verification	*/
+  size_t compressed_blocks; /* Blocks stored compressed	*/
+  size_t compressed_bytes;  /* Bytes those blocks were compressed to	*/
+  size_t mirror_failures;   /* Mirror members left out after errors	*/
+  size_t mirror_resyncs;    /* Mirror members brought back up to date	*/
+  size_t commits;           /* disk_commit calls that asked for durability	*/
+  size_t commit_flushes;    /* Flushes those commits took	*/
+  DiskHistogram read_latency;  /* Latency per read operation	*/
+  DiskHistogram write_latency; /* Latency per write operation	*/
+};
+
+/* Disk Shape (service time model of disk_shaped_ops)
+ *
+ * Device time of an operation is its seek (none when it starts at the block
+ * after the previous operation, otherwise track_seek plus the rest of
+ * full_seek scaled by the square root of the distance over the disk size),
+ * a random fraction of a rotation (also skipped when sequential) and its
+ * transfer at bandwidth, but at least 1 / iops.  Device time is spent one
+ * operation at a time; latency plus a random jitter is then added to each
+ * operation independently, like a network round trip. */
+
+typedef struct DiskShape DiskShape;
+
+struct DiskShape
+{
+  uint64_t latency;    /* Fixed latency per operation (ns)	*/
+  uint64_t jitter;     /* Mean random latency per operation (ns)	*/
+  int distribution;    /* Random latency distribution (DISK_JITTER_*)	*/
+  uint64_t bandwidth;  /* Transfer rate (bytes/s, 0 for unlimited)	*/
+  uint64_t iops;       /* Operation rate (ops/s, 0 for unlimited)	*/
+  uint64_t track_seek; /* Seek to a nearby block (ns)	*/
+  uint64_t full_seek;  /* Seek across the whole disk (ns, 0 for no seeks)	*/
+  uint64_t rotation;   /* Time per revolution (ns)	*/
+  uint64_t seed;       /* Random seed	*/
+};
+
+extern const DiskShape disk_shape_hdd;     /* 7200 rpm hard disk	*/
+extern const DiskShape disk_shape_network; /* Network volume over 1 GbE	*/
+extern const DiskShape disk_shape_cloud;   /* Throttled cloud block volume	*/
+
+/* Disk Completion Callback */
 
 typedef struct Disk Disk;
+typedef void (*DiskCallback)(Disk *disk, size_t block, ssize_t result, void *arg);
+
+/* Disk Options */
+
+typedef struct DiskOps DiskOps;
+typedef struct DiskOptions DiskOptions;
+
+struct DiskOptions
+{
+  int mode;            /* Built-in backend (DISK_MODE_*)	*/
+  const DiskOps *ops;  /* Custom backend (overrides mode)	*/
+  size_t queue_depth;  /* Asynchronous queue depth (0 for DISK_QUEUE_DEPTH)	*/
+  bool direct;         /* Bypass the host page cache with O_DIRECT	*/
+  size_t pool_buffers; /* Aligned pool buffers (0 for DISK_POOL_BUFFERS)	*/
+  size_t cache_blocks; /* Buffer cache capacity in blocks (0 for none)	*/
+  bool huge_pages;     /* Back a RAM disk with huge pages if possible	*/
+  size_t readahead_blocks; /* Readahead buffer capacity in blocks (0 for none)	*/
+  size_t write_queue_blocks; /* Write queue capacity in blocks (0 for none)	*/
+  unsigned write_queue_delay; /* Write queue delay in ms (0 for DISK_WRITE_QUEUE_DELAY)	*/
+  const char *trace_path; /* Record a block I/O trace to this file (NULL for none)	*/
+  const DiskShape *shape; /* Shape service times of the backend (NULL for none)	*/
+  int checksums;       /* Per-block checksums (DISK_CHECKSUM_*)	*/
+  bool compress;       /* Compress blocks (changes the image format)	*/
+  size_t stripe_blocks; /* Stripe unit across the images in path (0 for none)	*/
+  bool mirror;         /* Mirror the disk across the images in path	*/
+  int durability;      /* What disk_commit does (DISK_DURABILITY_*)	*/
+  size_t commit_batch; /* Commits that end the wait for a group (0 for DISK_COMMIT_BATCH)	*/
+  unsigned commit_delay; /* Longest wait for a group in us (0 for DISK_COMMIT_DELAY)	*/
+};
+
+/* Disk Backend Operations
+ *
+ * Backends only move bytes: the generic layer in disk.c performs sanity
+ * checks, counts reads and writes, and runs the buffer cache, readahead
+ * buffer, write queue and asynchronous queue on top of them.  Blocks passed in are always in range.
+ * Optional operations may be NULL. */
+
+struct DiskOps
+{
+  const char *name; /* Backend name	*/
+
+  /* Open or create the image (0 on success, DISK_FAILURE on failure) */
+  int (*open)(Disk *disk, const char *path, const DiskOptions *options);
+  /* Transfer one block (BLOCK_SIZE on success, DISK_FAILURE on failure) */
+  ssize_t (*read)(Disk *disk, size_t block, char *data);
+  ssize_t (*write)(Disk *disk, size_t block, char *data);
+  /* Transfer count contiguous blocks (optional, count * BLOCK_SIZE) */
+  ssize_t (*readv)(Disk *disk, size_t block, size_t count, char **data);
+  ssize_t (*writev)(Disk *disk, size_t block, size_t count, char **data);
+  /* Make completed writes durable (optional, 0 or DISK_FAILURE) */
+  int (*flush)(Disk *disk);
+  /* Release storage behind count blocks (optional, 0 or DISK_FAILURE) */
+  int (*discard)(Disk *disk, size_t block, size_t count);
+  /* Zero-copy pointer to block (optional) */
+  char *(*ptr)(Disk *disk, size_t block);
+  /* Release the image and any backend state */
+  void (*close)(Disk *disk);
+};
+
+extern const DiskOps disk_file_ops;  /* pread/pwrite (DISK_MODE_FILE)	*/
+extern const DiskOps disk_mmap_ops;  /* mmap (DISK_MODE_MMAP)	*/
+extern const DiskOps disk_uring_ops; /* pread/pwrite + io_uring (DISK_MODE_URING)	*/
+extern const DiskOps disk_ram_ops;   /* anonymous memory (DISK_MODE_RAM)	*/
+extern const DiskOps disk_shaped_ops; /* another backend, slowed down (DiskOptions.shape)	*/
+extern const DiskOps disk_checked_ops; /* another backend, checksummed (DiskOptions.checksums)	*/
+extern const DiskOps disk_compressed_ops; /* another backend, compressed (DiskOptions.compress)	*/
+extern const DiskOps disk_striped_ops; /* several images of another backend (DiskOptions.stripe_blocks)	*/
+extern const DiskOps disk_mirrored_ops; /* copies on several images of another backend (DiskOptions.mirror)	*/
+
+/* Disk Structure */
 
 struct Disk
 {
-  int fd;        /* File descriptor of disk image	*/
+  int fd;        /* File descriptor of disk image (-1 if none)	*/
   size_t blocks; /* Number of blocks in disk image	*/
-  size_t reads;  /* Number of reads to disk image	*/
-  size_t writes; /* Number of writes to disk image	*/
+  size_t reads;  /* Number of reads to disk image (atomic)	*/
+  size_t writes; /* Number of writes to disk image (atomic)	*/
+  size_t cache_hits;   /* Number of reads served by the cache (atomic)	*/
+  size_t cache_misses; /* Number of reads that missed the cache (atomic)	*/
   bool mounted;  /* Whether or not disk is mounted       */
+
+  const DiskOps *ops;           /* Backend operations	*/
+  void *private;                /* Backend state	*/
+
+  struct Ring *ring;            /* io_uring instance (disk_uring_ops)	*/
+  struct DiskRequest *requests; /* Asynchronous request slots	*/
+  size_t *free_slots;           /* Stack of free request slots	*/
+  size_t nfree;                 /* Number of free request slots	*/
+  size_t *done_slots;           /* Stack of completed, unreported slots	*/
+  size_t ndone;                 /* Number of completed, unreported slots	*/
+  size_t queue_depth;           /* Number of request slots	*/
+
+  bool direct;                  /* Whether image is opened O_DIRECT	*/
+  char *pool;                   /* Aligned buffer pool memory	*/
+  char **pool_free;             /* Stack of free pool buffers	*/
+  size_t pool_nfree;            /* Number of free pool buffers	*/
+  size_t pool_buffers;          /* Number of pool buffers	*/
+  pthread_mutex_t pool_lock;    /* Protects pool_free	*/
+
+  struct Cache *cache;          /* Write-back buffer cache (or NULL)	*/
+  struct Readahead *readahead;  /* Readahead buffer (or NULL)	*/
+  size_t readahead_hits;        /* Reads served by readahead (atomic)	*/
+  struct Elevator *elevator;    /* Elevator write queue (or NULL)	*/
+  size_t writes_absorbed;       /* Queued writes overwritten (atomic)	*/
+  size_t write_queue_flushes;   /* Write queue sweeps (atomic)	*/
+  size_t checksum_errors;       /* Blocks failing verification (atomic)	*/
+  size_t compressed_blocks;     /* Blocks stored compressed (atomic)	*/
+  size_t compressed_bytes;      /* Their compressed size (atomic)	*/
+  size_t mirror_failures;       /* Mirror members left out (atomic)	*/
+  size_t mirror_resyncs;        /* Mirror members resynced (atomic)	*/
+  int durability;               /* DISK_DURABILITY_* of disk_commit	*/
+  struct Commit *commit;        /* Group commit state (or NULL)	*/
+  size_t commits;               /* Commits asking for durability (atomic)	*/
+  size_t commit_flushes;        /* Flushes taken by commits (atomic)	*/
+  struct Trace *trace;          /* Block I/O trace being recorded (or NULL)	*/
+
+  size_t bytes_read;            /* Bytes read from the backend (atomic)	*/
+  size_t bytes_written;         /* Bytes written to the backend (atomic)	*/
+  size_t discards;              /* Blocks discarded (atomic)	*/
+  size_t sequential;            /* Sequential operations (atomic)	*/
+  size_t random;                /* Random operations (atomic)	*/
+  size_t next_block;            /* Block following the last operation (atomic)	*/
+  DiskHistogram read_latency;   /* Read latency histogram (atomic)	*/
+  DiskHistogram write_latency;  /* Write latency histogram (atomic)	*/
+};
+
+/* Disk Scatter-Gather Entry */
+
+typedef struct DiskIO DiskIO;
+
+struct DiskIO
+{
+  size_t block; /* Block number to perform operation on	*/
+  char *data;   /* Data buffer (must be BLOCK_SIZE)	*/
 };
 
 /* Disk Functions */
 
+/* disk_read and disk_write use positional I/O and atomic counters, so a
+ * single Disk may be shared by several threads issuing block I/O at once. */
+
 Disk *disk_open(const char *path, size_t blocks);
+Disk *disk_open_with(const char *path, size_t blocks, const DiskOptions *options);
+const DiskOps *disk_backend(int mode);
 void disk_close(Disk *disk);
+void disk_release(Disk *disk);
+int disk_flush(Disk *disk);
+int disk_discard(Disk *disk, size_t block, size_t count);
+ssize_t disk_prefetch(Disk *disk, const size_t *blocks, size_t count);
 
 ssize_t disk_read(Disk *disk, size_t block, char *data);
 ssize_t disk_write(Disk *disk, size_t block, char *data);
 
+ssize_t disk_readv(Disk *disk, size_t block, size_t count, char **data);
+ssize_t disk_writev(Disk *disk, size_t block, size_t count, char **data);
+
+ssize_t disk_read_list(Disk *disk, const DiskIO *ios, size_t count);
+ssize_t disk_write_list(Disk *disk, const DiskIO *ios, size_t count);
+
+char *disk_block_ptr(Disk *disk, size_t block);
+
+/* RAM disks: disk_open_with loads path into memory if it exists, and the
+ * contents are lost at close unless saved to an image first. */
+
+int disk_ram_load(Disk *disk, const char *path);
+int disk_ram_save(Disk *disk, const char *path);
+
+/* Uncached transfers (used by the buffer cache to reach the image), and raw
+ * backend transfers that also skip the sanity checks, readahead buffer and
+ * write queue (used by those two to reach the image). */
+
+ssize_t disk_io(Disk *disk, size_t block, char *data, bool write);
+ssize_t disk_iov(Disk *disk, size_t block, size_t count, char **data, bool write);
+ssize_t disk_transfer(Disk *disk, size_t block, size_t count, char **data, bool write);
+
+/* Write queue: with write_queue_blocks set, uncached writes are queued in
+ * block order and written in elevator sweeps, consecutive blocks coalesced
+ * into vectored writes, when the queue fills up, when its oldest write is
+ * older than write_queue_delay (checked as writes arrive), on disk_barrier,
+ * disk_flush and disk_close.  Reads see queued writes.  The asynchronous
+ * queue never uses io_uring on such a disk. */
+
+int disk_barrier(Disk *disk);
+
+/* Durability: disk_write never syncs; callers that finish an operation
+ * (fs_create, fs_remove, fs_write) call disk_commit, and durability decides
+ * what that costs.  DISK_DURABILITY_NONE leaves syncing to disk_flush and
+ * disk_close, DISK_DURABILITY_SYNC flushes on every commit, and
+ * DISK_DURABILITY_GROUP gathers the commits of concurrent callers into one
+ * flush: the first caller to find no flush running waits up to
+ * commit_delay for commit_batch commits (only when the previous group had
+ * more than one, so a lone caller never waits) and flushes for all of
+ * them, while later callers queue for the next group.  Either way
+ * disk_commit returns once the caller's writes are durable, and after a
+ * failed flush every later commit fails. */
+
+int disk_commit(Disk *disk);
+
+/* Traces: with trace_path set, every disk_read, disk_write, disk_readv,
+ * disk_writev, disk_discard, disk_barrier and disk_flush call is recorded
+ * with its start time and latency (see trace.h and bin/sfs_replay). */
+
+/* Checksums: with checksums set, disk_checked_ops keeps a CRC32C of every
+ * block in an area after the data blocks of the image (the file grows by
+ * one header block plus 4 bytes per block).  Checksums are computed as
+ * blocks reach the backend and, with DISK_CHECKSUM_READ, verified as they
+ * come back from it; a mismatch fails the read with EIO.  disk_scrub
+ * verifies a range of blocks directly against the image, so a background
+ * thread can sweep the disk a slice at a time.  The area is rebuilt from
+ * the data when the image was not closed cleanly. */
+
+ssize_t disk_scrub(Disk *disk, size_t block, size_t count);
+
+/* Compression: with compress set, disk_compressed_ops stores each block
+ * LZ-compressed, packed with others into 256-byte units of shared blocks
+ * and found through a block map saved in the image (a compressed image has
+ * its own layout; blank images are initialised, others refused).  Blocks
+ * that do not compress, and blocks declared metadata with
+ * disk_mark_metadata, are stored whole and overwritten in place.  Packed
+ * blocks are written when their shared block fills up and on disk_flush. */
+
+void disk_mark_metadata(Disk *disk, size_t block, size_t count, bool metadata);
+
+/* Striping: with stripe_blocks set, path is a comma-separated list of
+ * images (ideally on different devices) and disk_striped_ops deals
+ * stripe_blocks-block units of the disk to them in turn, like RAID-0.  A
+ * multi-block transfer becomes one contiguous transfer per member, and the
+ * members run theirs at the same time on per-member worker threads.  Each
+ * member is opened with the selected backend (and shape), and checksums or
+ * compression apply to the striped disk as a whole. */
+
+/* Mirroring: with mirror set, path is a comma-separated list of images and
+ * disk_mirrored_ops keeps a full copy of the disk on each, like RAID-1, with
+ * a header block after the data recording its generation.  Writes go to
+ * every copy in parallel; a read goes to the copy with the fewest reads
+ * running (then the one whose last transfer ended nearest), and a large
+ * vectored read is split across all copies.  A copy that fails is left out
+ * and its reads retried on another.  Copies that are missing at open are
+ * left out too; copies that are behind (or blank) are resynced at open, and
+ * disk_resync reopens and resyncs the ones left out while the disk is in
+ * use.  A new mirror, or one that was not closed cleanly, is resynced from
+ * its first copy.
+ * Mirroring and striping do not combine. */
+
+ssize_t disk_resync(Disk *disk);
+
+/* Statistics: every backend operation (one disk_io, one vectored run, one
+ * asynchronous request or one disk_block_ptr) is timed and classified as
+ * sequential or random.  disk_close prints the totals. */
+
+void disk_stats(Disk *disk, DiskStats *stats);
+void disk_stats_print(const DiskStats *stats, FILE *stream);
+uint64_t disk_histogram_percentile(const DiskHistogram *histogram, double percentile);
+
+uint64_t disk_clock(void);
+void disk_account(Disk *disk, size_t block, size_t count, bool write, uint64_t start);
+
+/* Aligned buffers: O_DIRECT transfers need DISK_ALIGNMENT aligned memory.
+ * Unaligned caller buffers are bounced through the pool transparently. */
+
+char *disk_buffer_get(Disk *disk);
+void disk_buffer_put(Disk *disk, char *buffer);
+
+/* Asynchronous block I/O: requests are queued, handed to the kernel in
+ * batches by disk_submit, and completed by disk_poll, which invokes each
+ * request's callback.  Without io_uring (other modes, or when the kernel
+ * refuses io_uring_setup) requests are served with pread/pwrite at queue
+ * time and still complete through disk_poll.  Not thread-safe. */
+
+int disk_queue_read(Disk *disk, size_t block, char *data, DiskCallback callback, void *arg);
+int disk_queue_write(Disk *disk, size_t block, char *data, DiskCallback callback, void *arg);
+int disk_submit(Disk *disk);
+ssize_t disk_poll(Disk *disk, bool wait);
+int disk_drain(Disk *disk);
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
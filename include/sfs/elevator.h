@@ -0,0 +1,52 @@
+/* elevator.h: SimpleFS elevator write queue */
+
+#ifndef ELEVATOR_H
+#define ELEVATOR_H
+
+#include "sfs/disk.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Elevator Structures */
+
+typedef struct ElevatorEntry ElevatorEntry;
+
+struct ElevatorEntry
+{
+  size_t block;  /* Block number waiting to be written	*/
+  char *data;    /* BLOCK_SIZE frame holding the block	*/
+  bool failed;   /* Whether the last sweep failed to write it	*/
+};
+
+typedef struct Elevator Elevator;
+
+struct Elevator
+{
+  size_t capacity;         /* Number of frames	*/
+  size_t count;            /* Number of queued blocks (atomic)	*/
+  ElevatorEntry *entries;  /* Queued blocks, sorted by block number	*/
+  char *frames;            /* DISK_ALIGNMENT aligned frame memory	*/
+  char **free_frames;      /* Stack of unused frames	*/
+  uint64_t delay;          /* Queue age that forces a flush (ns)	*/
+  uint64_t oldest;         /* Time the oldest queued block arrived	*/
+  pthread_mutex_t lock;    /* Serializes queueing and flushing	*/
+};
+
+/* Elevator Functions */
+
+Elevator *elevator_create(size_t capacity, uint64_t delay);
+void elevator_destroy(Elevator *elevator);
+
+ssize_t elevator_write(Elevator *elevator, Disk *disk, size_t block, size_t count, char **data);
+bool elevator_read(Elevator *elevator, size_t block, char *data);
+bool elevator_queued(Elevator *elevator, size_t block);
+void elevator_discard(Elevator *elevator, size_t block, size_t count);
+int elevator_flush(Elevator *elevator, Disk *disk);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
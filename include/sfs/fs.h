@@ -3,8 +3,10 @@
 #ifndef FS_H
 #define FS_H
 
+#include "sfs/bitmap.h"
 #include "sfs/disk.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -12,18 +14,32 @@
 /* File System Constants */
 
 #define MAGIC_NUMBER (0xf0f03410)
-#define INODES_PER_BLOCK (128)    /* Number of inodes per block */
 #define POINTERS_PER_INODE (5)    /* Number of direct pointers per inode */
-#define POINTERS_PER_BLOCK (1024) /* Number of pointers per block */
+
+/* File system blocks are whole runs of disk blocks: any power of two from
+ * BLOCK_SIZE to FS_MAX_BLOCK_SIZE, chosen by fs_format_with and recorded in
+ * the SuperBlock.  Per-block geometry lives in the mounted FileSystem. */
+#define FS_MIN_BLOCK_SIZE (BLOCK_SIZE)
+#define FS_MAX_BLOCK_SIZE (1 << 16)
 
 #define INODE_AVAILABLE (true)
 #define INODE_UNAVAILABLE (false)
 
+#define FS_STREAMS (8)          /* Sequential read streams tracked for readahead */
+#define FS_READAHEAD_MIN (4)    /* Initial readahead window (blocks) */
+#define FS_READAHEAD_MAX (32)   /* Largest readahead window (blocks) */
+#define FS_MOUNT_THREADS_MAX (64) /* Most threads scanning the inode table at mount */
+
 #define FS_FAILURE (-1)
 #define FS_SUCCESS (0)
 
 /* File System Structures */
 
+/* On disk, the SuperBlock is followed by the inode table (inode_blocks),
+ * then the free maps (bitmap_blocks: the words of the free block map, then
+ * those of the free inode map, a set bit marking a free block or inode),
+ * then data blocks.  The maps on disk are trusted only when clean is set;
+ * mounting clears it until the next clean unmount. */
 typedef struct SuperBlock SuperBlock;
 struct SuperBlock
 {
@@ -37,6 +53,9 @@ struct SuperBlock
     // InodeBlocks: The third field is the number of blocks set aside for storing inodes. The format routine is responsible for choosing this value, which should always be 10% of the Blocks, rounding up.
 
     uint32_t inodes; /* Number of inodes in file system */
+    uint32_t block_size; /* Bytes per block (0 in older images: BLOCK_SIZE) */
+    uint32_t bitmap_blocks; /* Blocks of free maps after the inode table (0 in older images: none) */
+    uint32_t clean;      /* Whether the free maps were saved by a clean unmount */
 };
 
 typedef struct Inode Inode;
@@ -48,51 +67,137 @@ struct Inode
     uint32_t indirect;                   /* Indirect pointers */
 };
 
+/* Blocks are DISK_ALIGNMENT aligned so they can be handed to an O_DIRECT
+ * disk without bouncing.  A Block holds the largest block size, which is too
+ * large for the stack: allocate Blocks with fs_alloc_blocks at the mounted
+ * block size, the only size read or written, at which arrays of Blocks are
+ * packed (see fs_block_at). */
 typedef union Block Block;
 union Block
 {
-    SuperBlock super;                      /* View block as superblock */
-    Inode inodes[INODES_PER_BLOCK];        /* View block as inode */
-    uint32_t pointers[POINTERS_PER_BLOCK]; /* View block as pointers */
-    char data[BLOCK_SIZE];                 /* View block as data */
+    SuperBlock super;                                         /* View block as superblock */
+    Inode inodes[FS_MAX_BLOCK_SIZE / sizeof(Inode)];          /* View block as inode */
+    uint32_t pointers[FS_MAX_BLOCK_SIZE / sizeof(uint32_t)];  /* View block as pointers */
+    char data[FS_MAX_BLOCK_SIZE];                             /* View block as data */
+} __attribute__((aligned(DISK_ALIGNMENT)));
+
+/* Readahead state of one inode being read: a read starting where the
+ * previous one ended doubles the window, any other read halves it. */
+typedef struct FileStream FileStream;
+struct FileStream
+{
+    bool valid;          /* Whether or not stream is tracked */
+    size_t inode_number; /* Inode being read */
+    size_t next;         /* Logical block a sequential read starts at */
+    size_t ahead;        /* Logical block prefetching has reached */
+    size_t window;       /* Readahead window (blocks, 0 when random) */
+    size_t used;         /* Last use (for replacement) */
+};
+
+/* Space usage of a mounted file system (see fs_statfs) */
+typedef struct FileSystemStats FileSystemStats;
+struct FileSystemStats
+{
+    size_t block_size;   /* Bytes per block */
+    size_t blocks;       /* Number of blocks */
+    size_t free_blocks;  /* Number of free data blocks */
+    size_t inodes;       /* Number of inodes */
+    size_t free_inodes;  /* Number of free inodes */
 };
 
 typedef struct FileSystem FileSystem;
 struct FileSystem
 {
     Disk *disk;           /* Disk file system is mounted on */
-    bool *free_blocks;    /* Free block bitmap */
-    bool *free_inodes;    /* Free block bitmap */
+    Bitmap *free_blocks;  /* Free block bitmap (set when free) */
+    Bitmap *free_inodes;  /* Free inode bitmap (set when free) */
+    Bitmap *dirty_maps;   /* Free map blocks changed since last saved (NULL without on-disk maps) */
     SuperBlock meta_data; /* File system meta data */
+    size_t block_size;    /* Bytes per block */
+    size_t disk_blocks;   /* Disk blocks per block */
+    size_t inodes_per_block;   /* Inodes per inode table block */
+    size_t pointers_per_block; /* Pointers per indirect block */
+    size_t max_file_size; /* Largest file (direct and indirect blocks) */
+    FileStream streams[FS_STREAMS]; /* Readahead streams */
+    size_t stream_clock;  /* Stream use counter */
+};
+
+/* One thread's share of the mount scan (see fs_scan_inode_table) */
+typedef struct FileSystemScan FileSystemScan;
+struct FileSystemScan
+{
+    FileSystem *fs;       /* File system being mounted */
+    size_t start;         /* First inode table block of the share */
+    size_t end;           /* Inode table block after the share */
+    Bitmap *used;         /* Blocks the share's inodes use (set when used) */
+    uint32_t *indirect;   /* Indirect blocks found (sorted once read) */
+    size_t nindirect;     /* Number of indirect blocks found */
+    size_t inodes;        /* Valid inodes found */
+    bool failed;          /* Whether the share could not be scanned */
+    size_t first_word;    /* First free block map word the thread merges */
+    size_t last_word;     /* Word after the last one it merges */
+    FileSystemScan *shares; /* All shares (for the merge) */
+    size_t nshares;       /* Number of shares */
+    pthread_t thread;     /* Thread running the share */
+    bool started;         /* Whether the thread was started */
 };
 
 /* File System Functions */
 
 void fs_debug(Disk *disk);
 bool fs_format(Disk *disk);
+bool fs_format_with(Disk *disk, size_t block_size);
 
 /* Helper function */
 void print_direct_blocks(uint32_t *pDirect);
-void print_indirect_blocks(uint32_t *pIndir);
+void print_indirect_blocks(uint32_t *pIndir, size_t count);
 
 bool fs_mount(FileSystem *fs, Disk *disk);
+bool fs_mount_with(FileSystem *fs, Disk *disk, size_t threads);
 void fs_unmount(FileSystem *fs);
 
 ssize_t fs_create(FileSystem *fs);
 bool fs_remove(FileSystem *fs, size_t inode_number);
 ssize_t fs_stat(FileSystem *fs, size_t inode_number);
+bool fs_statfs(FileSystem *fs, FileSystemStats *stats);
 
 ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 
-ssize_t fs_build_free_inode_map(FileSystem *fs, Disk *disk);
-
-int fs_build_free_block_map(FileSystem *fs, Disk *disk);
-ssize_t fs_count_inodes(FileSystem *fs);
-size_t fs_count_inodes_from_block(Block *block);
+ssize_t fs_scan_inode_table(FileSystem *fs, size_t threads);
+void fs_scan_run(FileSystemScan *scans, size_t count, void *(*phase)(void *));
+void *fs_scan_share(void *arg);
+void *fs_scan_merge(void *arg);
+bool fs_scan_indirect_blocks(FileSystem *fs, Bitmap *used, uint32_t *indirect, size_t count, Block *scratch, size_t batch);
+bool fs_set_geometry(FileSystem *fs, size_t block_size);
+Block *fs_alloc_blocks(size_t count, size_t block_size);
+Block *fs_block_at(Block *blocks, size_t index, size_t block_size);
+ssize_t fs_read_blocks(FileSystem *fs, size_t block, size_t count, char *data);
+ssize_t fs_write_blocks(FileSystem *fs, size_t block, size_t count, char *data);
+void fs_mark_metadata(FileSystem *fs, size_t block, size_t count, bool metadata);
+bool fs_commit(FileSystem *fs);
+Block *fs_read_inode_blocks(FileSystem *fs, size_t start, size_t count, Block *scratch);
+Block *fs_read_block(FileSystem *fs, size_t block, Block *scratch);
 ssize_t fs_find_first_available_inode(FileSystem *fs);
 ssize_t fs_mark_inode_status(FileSystem *fs, size_t inode_num, bool available);
 size_t fs_get_total_inodes(FileSystem *fs);
+void fs_discard_blocks(FileSystem *fs, uint32_t *blocks, size_t count);
+int fs_compare_blocks(const void *a, const void *b);
+bool fs_load_inode(FileSystem *fs, size_t inode_number, Inode *inode);
+uint32_t fs_block_pointer(FileSystem *fs, Inode *inode, Block *indirect, size_t logical);
+void fs_readahead(FileSystem *fs, size_t inode_number, Inode *inode, Block *indirect, size_t start, size_t end);
+ssize_t fs_allocate_block(FileSystem *fs);
+size_t fs_data_start(FileSystem *fs);
+bool fs_data_block(FileSystem *fs, uint32_t block);
+size_t fs_bitmap_blocks(size_t blocks, size_t inodes, size_t block_size);
+void fs_bitmap_transfer(FileSystem *fs, size_t block, char *data, bool save);
+bool fs_load_bitmaps(FileSystem *fs);
+bool fs_save_bitmaps(FileSystem *fs, bool all);
+void fs_dirty_bitmap(FileSystem *fs, const Bitmap *bitmap, size_t bit);
+bool fs_write_super(FileSystem *fs, bool clean);
+bool fs_format_bitmaps(FileSystem *fs);
+bool fs_mount_finish(FileSystem *fs, bool rebuilt);
+bool fs_mount_abort(FileSystem *fs);
 
 #endif
 
@@ -0,0 +1,24 @@
+/* lz.h: SimpleFS LZ77 block compression */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* LZ Constants */
+
+#define LZ_MAX_INPUT (1 << 16) /* Largest buffer lz_compress accepts */
+
+/* LZ Functions
+ *
+ * Single-pass greedy LZ77 with a hash table of 4-byte sequences, emitting
+ * the LZ4 block format (token, literals, 16-bit offset, match length), so
+ * compression runs at memory speed and decompression is a copy loop. */
+
+size_t lz_compress(const void *source, size_t length, void *destination, size_t capacity);
+ssize_t lz_decompress(const void *source, size_t length, void *destination, size_t capacity);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
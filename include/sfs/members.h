@@ -0,0 +1,83 @@
+/* members.h: SimpleFS member disks of a multi-image backend */
+
+#ifndef MEMBERS_H
+#define MEMBERS_H
+
+#include "sfs/disk.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Members Constants */
+
+#define MEMBERS_MAX (32) /* Most images one backend spans */
+
+#define MEMBER_READ    (0)
+#define MEMBER_WRITE   (1)
+#define MEMBER_FLUSH   (2)
+#define MEMBER_DISCARD (3)
+
+/* Members Structures */
+
+/* One member's share of a request (see members_submit) */
+typedef struct MemberJob MemberJob;
+
+struct MemberJob
+{
+  MemberJob *next;   /* Next job queued for the same member	*/
+  size_t member;     /* Member index	*/
+  int operation;     /* MEMBER_*	*/
+  size_t block;      /* First member block	*/
+  size_t count;      /* Number of member blocks	*/
+  char **data;       /* Array of count data buffers	*/
+  ssize_t result;    /* Result of the member operation	*/
+  int error;         /* errno after a failure	*/
+  size_t *pending;   /* Shares of the request still running	*/
+};
+
+typedef struct Member Member;
+
+struct Member
+{
+  Disk *disk;            /* Member image (NULL if it could not be opened)	*/
+  char *path;            /* Path of the member image	*/
+  struct Members *owner; /* Members the member belongs to	*/
+  pthread_t thread;      /* Worker running queued jobs	*/
+  bool started;          /* Whether the worker is running	*/
+  MemberJob *head;       /* Queued jobs (oldest first)	*/
+  MemberJob *tail;       /* Newest queued job	*/
+  pthread_cond_t ready;  /* Signalled when a job is queued or on close	*/
+};
+
+typedef struct Members Members;
+
+struct Members
+{
+  size_t count;                  /* Number of members	*/
+  size_t blocks;                 /* Blocks per member	*/
+  Member members[MEMBERS_MAX];   /* Member images	*/
+  DiskOptions options;           /* Options members are (re)opened with	*/
+  DiskShape shape;               /* Copy of options.shape	*/
+  pthread_mutex_t lock;          /* Protects the job queues and pending counts	*/
+  pthread_cond_t done;           /* Broadcast when a job completes	*/
+  bool stop;                     /* Workers exit once their queue is empty	*/
+};
+
+/* Members Functions
+ *
+ * Each member has a worker thread so one request can keep every member
+ * busy at once: members_submit queues all shares but the first, runs the
+ * first on the calling thread and waits for the rest. */
+
+Members *members_open(const char *paths, size_t blocks, const DiskOptions *options, bool partial);
+void members_close(Members *members);
+bool members_reopen(Members *members, size_t member);
+ssize_t members_submit(Members *members, MemberJob *jobs, size_t njobs);
+void members_run(Members *members, MemberJob *job);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
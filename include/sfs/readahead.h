@@ -0,0 +1,53 @@
+/* readahead.h: SimpleFS block readahead buffer */
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "sfs/disk.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Readahead Constants */
+
+#define READAHEAD_EMPTY   (0) /* Slot holds nothing */
+#define READAHEAD_PENDING (1) /* Prefetch in flight */
+#define READAHEAD_READY   (2) /* Prefetched block waiting to be read */
+#define READAHEAD_STALE   (3) /* Prefetch in flight, block since overwritten */
+
+/* Readahead Structures */
+
+typedef struct ReadaheadSlot ReadaheadSlot;
+
+struct ReadaheadSlot
+{
+  size_t block;  /* Block number held by this slot	*/
+  int state;     /* READAHEAD_* (atomic)	*/
+  char *data;    /* BLOCK_SIZE frame	*/
+};
+
+typedef struct Readahead Readahead;
+
+struct Readahead
+{
+  size_t capacity;        /* Number of slots	*/
+  ReadaheadSlot *slots;   /* Slot table	*/
+  char *frames;           /* DISK_ALIGNMENT aligned frame memory	*/
+  size_t hand;            /* Next slot to consider for reuse	*/
+  pthread_mutex_t lock;   /* Serializes lookups and prefetches	*/
+};
+
+/* Readahead Functions */
+
+Readahead *readahead_create(size_t capacity);
+void readahead_destroy(Readahead *readahead);
+
+size_t readahead_prefetch(Readahead *readahead, Disk *disk, const size_t *blocks, size_t count);
+bool readahead_read(Readahead *readahead, Disk *disk, size_t block, char *data);
+void readahead_invalidate(Readahead *readahead, size_t block, size_t count);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,77 @@
+/* trace.h: SimpleFS block I/O traces */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Trace Constants */
+
+#define TRACE_MAGIC (0x53465354) /* "SFST" */
+#define TRACE_VERSION (1)
+
+#define TRACE_READ    (0) /* disk_read, disk_readv */
+#define TRACE_WRITE   (1) /* disk_write, disk_writev */
+#define TRACE_DISCARD (2) /* disk_discard */
+#define TRACE_BARRIER (3) /* disk_barrier */
+#define TRACE_FLUSH   (4) /* disk_flush */
+
+/* Trace File Layout
+ *
+ * A TraceHeader followed by one fixed-size TraceRecord per operation, in
+ * host byte order, appended as operations complete. */
+
+typedef struct TraceHeader TraceHeader;
+
+struct TraceHeader
+{
+  uint32_t magic;       /* TRACE_MAGIC	*/
+  uint16_t version;     /* TRACE_VERSION	*/
+  uint16_t record_size; /* sizeof(TraceRecord)	*/
+  uint32_t block_size;  /* BLOCK_SIZE of the traced disk	*/
+  uint32_t reserved;    /* Zero	*/
+  uint64_t blocks;      /* Number of blocks of the traced disk	*/
+  uint64_t created;     /* Wall clock time recording began (ns since epoch)	*/
+};
+
+typedef struct TraceRecord TraceRecord;
+
+struct TraceRecord
+{
+  uint64_t timestamp; /* Operation start (ns since recording began)	*/
+  uint32_t block;     /* First block	*/
+  uint32_t count;     /* Number of blocks (0 for barriers and flushes)	*/
+  uint32_t latency;   /* Time to serve the operation (ns, saturated)	*/
+  uint8_t op;         /* TRACE_*	*/
+  uint8_t failed;     /* Whether the operation failed	*/
+  uint16_t reserved;  /* Zero	*/
+};
+
+/* Trace Structure */
+
+typedef struct Trace Trace;
+
+struct Trace
+{
+  FILE *stream;       /* Trace file	*/
+  TraceHeader header; /* Header written or read	*/
+  uint64_t origin;    /* disk_clock when recording began	*/
+  bool writing;       /* Whether trace is being recorded	*/
+};
+
+/* Trace Functions */
+
+Trace *trace_create(const char *path, size_t blocks);
+void trace_record(Trace *trace, int op, size_t block, size_t count, uint64_t start, bool failed);
+
+Trace *trace_open(const char *path);
+bool trace_next(Trace *trace, TraceRecord *record);
+
+int trace_close(Trace *trace);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,50 @@
+/* uring.h: Minimal io_uring submission/completion ring */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Ring Structure */
+
+typedef struct Ring Ring;
+
+struct Ring
+{
+  int fd;               /* io_uring file descriptor	*/
+  unsigned entries;     /* Number of submission queue entries	*/
+  unsigned pending;     /* Prepared but not yet submitted entries	*/
+
+  unsigned *sq_head;    /* Submission queue head (kernel)	*/
+  unsigned *sq_tail;    /* Submission queue tail (user)	*/
+  unsigned *sq_mask;    /* Submission queue index mask	*/
+  unsigned *sq_array;   /* Submission queue index array	*/
+  struct io_uring_sqe *sqes; /* Submission queue entries	*/
+
+  unsigned *cq_head;    /* Completion queue head (user)	*/
+  unsigned *cq_tail;    /* Completion queue tail (kernel)	*/
+  unsigned *cq_mask;    /* Completion queue index mask	*/
+  struct io_uring_cqe *cqes; /* Completion queue entries	*/
+
+  void *sq_ring;        /* Submission ring mapping	*/
+  void *cq_ring;        /* Completion ring mapping	*/
+  size_t sq_ring_size;  /* Size of submission ring mapping	*/
+  size_t cq_ring_size;  /* Size of completion ring mapping	*/
+  size_t sqes_size;     /* Size of submission entries mapping	*/
+};
+
+/* Ring Functions */
+
+Ring *ring_open(unsigned entries);
+void ring_close(Ring *ring);
+
+bool ring_prep(Ring *ring, bool write, int fd, char *data, size_t length, off_t offset, uint64_t user_data);
+int ring_submit(Ring *ring, unsigned wait);
+bool ring_reap(Ring *ring, uint64_t *user_data, int32_t *result);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
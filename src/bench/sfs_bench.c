@@ -0,0 +1,198 @@
+/* sfs_bench.c: SimpleFS block checksum overhead benchmark */
+
+#include "sfs/crc32c.h"
+#include "sfs/disk.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Macros */
+
+#define streq(a, b) (strcmp((a), (b)) == 0)
+#define GIB (1024.0 * 1024.0 * 1024.0)
+#define RUN (64) /* Blocks per vectored transfer */
+
+/* Benchmark Results */
+
+typedef struct Result Result;
+
+struct Result {
+  double write; /* Seconds per GiB written */
+  double read;  /* Seconds per GiB read */
+};
+
+/* Utility Prototypes */
+
+void usage(const char *program);
+int parse_mode(const char *name);
+double bench_crc(uint32_t (*function)(uint32_t, const void *, size_t), const char *buffer, size_t bytes,
+                 size_t rounds);
+bool bench_disk(const char *path, size_t blocks, size_t rounds, DiskOptions *options, char **data,
+                Result *result);
+void print_overhead(const char *name, const Result *result, const Result *baseline);
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+  DiskOptions options = {.mode = DISK_MODE_RAM};
+  size_t blocks = 16384;
+  size_t rounds = 4;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:b:r:dh")) != -1) {
+    switch (opt) {
+    case 'm':
+      options.mode = parse_mode(optarg);
+      if (options.mode < 0) {
+        fprintf(stderr, "Unknown mode: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'b':
+      blocks = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      rounds = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      options.direct = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 1 || blocks < RUN || rounds == 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  char *buffer;
+  char *data[RUN];
+  if (posix_memalign((void **)&buffer, DISK_ALIGNMENT, RUN * BLOCK_SIZE) != 0) {
+    fprintf(stderr, "Unable to allocate transfer buffers\n");
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < RUN * BLOCK_SIZE; i++) {
+    buffer[i] = rand();
+  }
+  for (size_t i = 0; i < RUN; i++) {
+    data[i] = buffer + i * BLOCK_SIZE;
+  }
+
+  /* Raw checksum throughput over the transfer buffers (stays in cache) */
+  size_t crc_rounds = rounds * blocks / RUN;
+  double hardware = bench_crc(crc32c, buffer, RUN * BLOCK_SIZE, crc_rounds);
+  double portable = bench_crc(crc32c_portable, buffer, RUN * BLOCK_SIZE, crc_rounds);
+  printf("crc32c %-14s %8.1f ms/GiB (%.2f GiB/s)\n", crc32c_implementation(), hardware * 1e3,
+         1 / hardware);
+  printf("crc32c %-14s %8.1f ms/GiB (%.2f GiB/s)\n", "slicing-by-8", portable * 1e3, 1 / portable);
+
+  /* The same transfers without checksums, then in each checksum mode */
+  const char *path = argv[optind];
+  Result unchecked, verified, scrubbed;
+  options.checksums = DISK_CHECKSUM_NONE;
+  bool ok = bench_disk(path, blocks, rounds, &options, data, &unchecked);
+  options.checksums = DISK_CHECKSUM_READ;
+  ok = ok && bench_disk(path, blocks, rounds, &options, data, &verified);
+  options.checksums = DISK_CHECKSUM_SCRUB;
+  ok = ok && bench_disk(path, blocks, rounds, &options, data, &scrubbed);
+  free(buffer);
+  if (!ok) {
+    return EXIT_FAILURE;
+  }
+
+  printf("%-6s %-14s %8.1f ms/GiB written, %8.1f ms/GiB read\n", "disk", "unchecked",
+         unchecked.write * 1e3, unchecked.read * 1e3);
+  print_overhead("verified", &verified, &unchecked);
+  print_overhead("scrub-only", &scrubbed, &unchecked);
+  return EXIT_SUCCESS;
+}
+
+/* Utility Functions */
+
+void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [options] <diskfile>\n\n", program);
+  fprintf(stderr, "Measures the cost of block checksums per GiB transferred.\n\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "    -m MODE    Disk backend: file, mmap, uring or ram (default ram)\n");
+  fprintf(stderr, "    -b BLOCKS  Disk size in blocks (default 16384)\n");
+  fprintf(stderr, "    -r ROUNDS  Passes over the disk per measurement (default 4)\n");
+  fprintf(stderr, "    -d         Open the image with O_DIRECT\n");
+}
+
+int parse_mode(const char *name) {
+  if (streq(name, "file")) {
+    return DISK_MODE_FILE;
+  } else if (streq(name, "mmap")) {
+    return DISK_MODE_MMAP;
+  } else if (streq(name, "uring")) {
+    return DISK_MODE_URING;
+  } else if (streq(name, "ram")) {
+    return DISK_MODE_RAM;
+  }
+  return -1;
+}
+
+/* Checksum bytes of buffer rounds times, returning seconds per GiB. */
+double bench_crc(uint32_t (*function)(uint32_t, const void *, size_t), const char *buffer, size_t bytes,
+                 size_t rounds) {
+  volatile uint32_t sink = 0;
+  uint64_t start = disk_clock();
+  for (size_t i = 0; i < rounds; i++) {
+    sink += function(0, buffer, bytes);
+  }
+  double elapsed = (disk_clock() - start) / 1e9;
+  (void)sink;
+  return elapsed / (rounds * bytes / GIB);
+}
+
+/* Write then read the whole disk rounds times in RUN-block transfers,
+ * returning seconds per GiB for each direction. */
+bool bench_disk(const char *path, size_t blocks, size_t rounds, DiskOptions *options, char **data,
+                Result *result) {
+  Disk *disk = disk_open_with(path, blocks, options);
+  if (!disk) {
+    fprintf(stderr, "disk not opened\n");
+    return false;
+  }
+
+  size_t last = blocks - blocks % RUN;
+  double gib = rounds * last * (double)BLOCK_SIZE / GIB;
+  bool ok = true;
+
+  uint64_t start = disk_clock();
+  for (size_t round = 0; ok && round < rounds; round++) {
+    for (size_t block = 0; ok && block < last; block += RUN) {
+      ok = disk_writev(disk, block, RUN, data) != DISK_FAILURE;
+    }
+  }
+  ok = ok && disk_flush(disk) == 0;
+  result->write = (disk_clock() - start) / 1e9 / gib;
+
+  start = disk_clock();
+  for (size_t round = 0; ok && round < rounds; round++) {
+    for (size_t block = 0; ok && block < last; block += RUN) {
+      ok = disk_readv(disk, block, RUN, data) != DISK_FAILURE;
+    }
+  }
+  result->read = (disk_clock() - start) / 1e9 / gib;
+
+  if (!ok) {
+    fprintf(stderr, "disk transfer failed\n");
+  }
+  disk_release(disk);
+  return ok;
+}
+
+/* Print a checksum mode's cost relative to the unchecked transfers. */
+void print_overhead(const char *name, const Result *result, const Result *baseline) {
+  printf("%-6s %-14s %8.1f ms/GiB written (%+.1f ms, %+.1f%%), %8.1f ms/GiB read (%+.1f ms, %+.1f%%)\n",
+         "disk", name, result->write * 1e3, (result->write - baseline->write) * 1e3,
+         (result->write / baseline->write - 1) * 100, result->read * 1e3,
+         (result->read - baseline->read) * 1e3, (result->read / baseline->read - 1) * 100);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,289 @@
+/* bitmap.c: SimpleFS free-space bitmaps */
+
+#include "sfs/bitmap.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <string.h>
+
+/* Internal Prototyes */
+
+void bitmap_update(Bitmap *bitmap, size_t index, uint64_t word);
+
+/* External Functions */
+
+/**
+ * Create a bitmap by doing the following:
+ *
+ *  1. Allocating the words, with every bit set or clear.
+ *
+ *  2. Allocating one summary level after another, each with one bit per
+ *  word of the level below, until a level fits in a single word.
+ *
+ *  3. Computing the summaries and set bit counts (see bitmap_summarize).
+ *
+ * @param       bits        Number of bits.
+ * @param       set         Whether every bit starts out set.
+ *
+ * @return      Pointer to newly allocated Bitmap (NULL on failure).
+ **/
+Bitmap *bitmap_create(size_t bits, bool set)
+{
+    Bitmap *bitmap = calloc(1, sizeof(Bitmap));
+    if (!bitmap)
+    {
+        error("failed on calloc for Bitmap");
+        return NULL;
+    }
+
+    bitmap->bits = bits;
+    bitmap->nwords = (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    bitmap->words = calloc(max(bitmap->nwords, (size_t)1), sizeof(uint64_t));
+    bitmap->regions = calloc(max((bitmap->nwords + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS, (size_t)1), sizeof(uint32_t));
+    if (!bitmap->words || !bitmap->regions)
+        goto failure;
+
+    bitmap->levels[0] = bitmap->words;
+    bitmap->level_words[0] = bitmap->nwords;
+    bitmap->nlevels = 1;
+    for (size_t n = bitmap->nwords; n > 1; bitmap->nlevels++)
+    {
+        if (bitmap->nlevels == BITMAP_LEVELS)
+            goto failure;
+        n = (n + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+        bitmap->levels[bitmap->nlevels] = calloc(n, sizeof(uint64_t));
+        bitmap->level_words[bitmap->nlevels] = n;
+        if (!bitmap->levels[bitmap->nlevels])
+            goto failure;
+    }
+
+    if (set)
+        memset(bitmap->words, 0xff, bitmap->nwords * sizeof(uint64_t));
+    bitmap_summarize(bitmap);
+    return bitmap;
+
+failure:
+    error("failed to allocate bitmap of %zu bits", bits);
+    bitmap_destroy(bitmap);
+    return NULL;
+}
+
+/**
+ * Release a bitmap.
+ *
+ * @param       bitmap      Pointer to Bitmap structure (may be NULL).
+ **/
+void bitmap_destroy(Bitmap *bitmap)
+{
+    if (!bitmap)
+        return;
+    for (size_t k = 1; k < BITMAP_LEVELS; k++)
+        free(bitmap->levels[k]);
+    free(bitmap->words);
+    free(bitmap->regions);
+    free(bitmap);
+}
+
+/**
+ * Return whether a bit is set (false past the end).
+ **/
+bool bitmap_test(const Bitmap *bitmap, size_t bit)
+{
+    if (bit >= bitmap->bits)
+        return false;
+    return (bitmap->words[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+/**
+ * Set a bit (bits past the end are ignored).
+ **/
+void bitmap_set(Bitmap *bitmap, size_t bit)
+{
+    if (bit < bitmap->bits)
+        bitmap_update(bitmap, bit / BITMAP_WORD_BITS,
+                      bitmap->words[bit / BITMAP_WORD_BITS] | UINT64_C(1) << (bit % BITMAP_WORD_BITS));
+}
+
+/**
+ * Clear a bit (bits past the end are ignored).
+ **/
+void bitmap_clear(Bitmap *bitmap, size_t bit)
+{
+    if (bit < bitmap->bits)
+        bitmap_update(bitmap, bit / BITMAP_WORD_BITS,
+                      bitmap->words[bit / BITMAP_WORD_BITS] & ~(UINT64_C(1) << (bit % BITMAP_WORD_BITS)));
+}
+
+/**
+ * Clear count bits starting at start, a word at a time where possible
+ * (bits past the end are ignored).
+ **/
+void bitmap_clear_range(Bitmap *bitmap, size_t start, size_t count)
+{
+    size_t end = start + min(count, bitmap->bits - min(start, bitmap->bits));
+    while (start < end && start % BITMAP_WORD_BITS)
+        bitmap_clear(bitmap, start++);
+    for (; start + BITMAP_WORD_BITS <= end; start += BITMAP_WORD_BITS)
+        bitmap_update(bitmap, start / BITMAP_WORD_BITS, 0);
+    while (start < end)
+        bitmap_clear(bitmap, start++);
+}
+
+/**
+ * Find the first set bit at or after start by doing the following:
+ *
+ *  1. Masking off the bits below start in its word and, if any are left,
+ *  taking the lowest (count trailing zeros).
+ *
+ *  2. Otherwise climbing a level and looking at the bits for the words
+ *  after that one, until some level has one set.
+ *
+ *  3. Descending from that bit to the first nonzero word below it, one
+ *  count trailing zeros per level.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit to consider.
+ *
+ * @return      Bit number (-1 if no bit at or after start is set).
+ **/
+ssize_t bitmap_find(const Bitmap *bitmap, size_t start)
+{
+    if (start >= bitmap->bits)
+        return -1;
+
+    size_t position = start;
+    for (size_t k = 0; k < bitmap->nlevels; k++)
+    {
+        size_t index = position / BITMAP_WORD_BITS;
+        if (index >= bitmap->level_words[k])
+            return -1;
+
+        uint64_t word = bitmap->levels[k][index] & (~UINT64_C(0) << (position % BITMAP_WORD_BITS));
+        if (word)
+        {
+            position = index * BITMAP_WORD_BITS + __builtin_ctzll(word);
+            while (k-- > 0)
+                position = position * BITMAP_WORD_BITS + __builtin_ctzll(bitmap->levels[k][position]);
+            return position;
+        }
+
+        /* Nothing left in this word: look at the next one a level up */
+        position = index + 1;
+    }
+    return -1;
+}
+
+/**
+ * Count the set bits (kept up to date on every change).
+ **/
+size_t bitmap_count(const Bitmap *bitmap)
+{
+    return bitmap->set;
+}
+
+/**
+ * Count the set bits among count bits starting at start, a region at a time
+ * where possible (bits past the end are not counted).
+ **/
+size_t bitmap_count_range(const Bitmap *bitmap, size_t start, size_t count)
+{
+    size_t end = start + min(count, bitmap->bits - min(start, bitmap->bits));
+    size_t total = 0;
+    while (start < end)
+    {
+        if (start % BITMAP_REGION_BITS == 0 && start + BITMAP_REGION_BITS <= end)
+        {
+            total += bitmap->regions[start / BITMAP_REGION_BITS];
+            start += BITMAP_REGION_BITS;
+        }
+        else if (start % BITMAP_WORD_BITS == 0 && start + BITMAP_WORD_BITS <= end)
+        {
+            total += __builtin_popcountll(bitmap->words[start / BITMAP_WORD_BITS]);
+            start += BITMAP_WORD_BITS;
+        }
+        else
+        {
+            total += bitmap_test(bitmap, start++);
+        }
+    }
+    return total;
+}
+
+/**
+ * Recompute the summary levels and set bit counts from the words, clearing
+ * any bits past the end first.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ **/
+void bitmap_summarize(Bitmap *bitmap)
+{
+    if (bitmap->bits % BITMAP_WORD_BITS)
+        bitmap->words[bitmap->nwords - 1] &= (UINT64_C(1) << (bitmap->bits % BITMAP_WORD_BITS)) - 1;
+    for (size_t k = 1; k < bitmap->nlevels; k++)
+        memset(bitmap->levels[k], 0, bitmap->level_words[k] * sizeof(uint64_t));
+    memset(bitmap->regions, 0, (bitmap->nwords + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * sizeof(uint32_t));
+    bitmap->set = 0;
+
+    for (size_t i = 0; i < bitmap->nwords; i++)
+    {
+        size_t count = __builtin_popcountll(bitmap->words[i]);
+        bitmap->regions[i / BITMAP_WORD_BITS] += count;
+        bitmap->set += count;
+    }
+
+    for (size_t k = 1; k < bitmap->nlevels; k++)
+    {
+        for (size_t i = 0; i < bitmap->level_words[k - 1]; i++)
+        {
+            if (bitmap->levels[k - 1][i])
+                bitmap->levels[k][i / BITMAP_WORD_BITS] |= UINT64_C(1) << (i % BITMAP_WORD_BITS);
+        }
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Replace one word by doing the following:
+ *
+ *  1. Adjusting its region's and the total set bit counts.
+ *
+ *  2. If the word turned zero or nonzero, flipping its bit in the level
+ *  above, and so on up for as long as that word turns zero or nonzero too.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       index       Word index.
+ * @param       word        New value of the word.
+ **/
+void bitmap_update(Bitmap *bitmap, size_t index, uint64_t word)
+{
+    uint64_t old = bitmap->words[index];
+    if (old == word)
+        return;
+
+    size_t added = __builtin_popcountll(word);
+    size_t removed = __builtin_popcountll(old);
+    bitmap->regions[index / BITMAP_WORD_BITS] += added - removed;
+    bitmap->set += added - removed;
+    bitmap->words[index] = word;
+
+    bool nonzero = word != 0;
+    if (nonzero == (old != 0))
+        return;
+
+    for (size_t k = 1; k < bitmap->nlevels; k++)
+    {
+        uint64_t *summary = &bitmap->levels[k][index / BITMAP_WORD_BITS];
+        bool was_nonzero = *summary != 0;
+        if (nonzero)
+            *summary |= UINT64_C(1) << (index % BITMAP_WORD_BITS);
+        else
+            *summary &= ~(UINT64_C(1) << (index % BITMAP_WORD_BITS));
+        nonzero = *summary != 0;
+        if (nonzero == was_nonzero)
+            break;
+        index /= BITMAP_WORD_BITS;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
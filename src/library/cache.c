@@ -0,0 +1,586 @@
+/* cache.c: SimpleFS write-back block buffer cache */
+
+#include "sfs/cache.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Internal Constants */
+
+#define CACHE_BATCH (64) /* Blocks examined per vectored batch */
+
+/* Internal Structures */
+
+typedef struct CacheDirty CacheDirty;
+
+struct CacheDirty
+{
+    size_t block; /* Block number of dirty entry */
+    size_t index; /* Entry index */
+};
+
+/* Internal Prototyes */
+
+size_t cache_hash(Cache *cache, size_t block);
+size_t cache_lookup(Cache *cache, size_t block);
+void cache_unhash(Cache *cache, size_t index);
+void cache_lru_remove(Cache *cache, size_t index);
+void cache_lru_push(Cache *cache, size_t index);
+void cache_lru_append(Cache *cache, size_t index);
+size_t cache_victim(Cache *cache, Disk *disk);
+void cache_insert(Cache *cache, size_t index, size_t block);
+int cache_compare_dirty(const void *a, const void *b);
+
+/* External Functions */
+
+/**
+ * Create a buffer cache by doing the following:
+ *
+ *  1. Allocating capacity entries and DISK_ALIGNMENT aligned frames.
+ *
+ *  2. Sizing the hash table to the next power of two at or above twice the
+ *  capacity.
+ *
+ *  3. Threading every (invalid) entry onto the LRU list.
+ *
+ * @param       capacity    Number of blocks the cache can hold.
+ *
+ * @return      Pointer to newly allocated Cache (NULL on failure).
+ **/
+Cache *cache_create(size_t capacity)
+{
+    Cache *cache = calloc(1, sizeof(Cache));
+    if (!cache)
+    {
+        error("failed on calloc for Cache");
+        return NULL;
+    }
+
+    cache->capacity = capacity;
+    cache->nbuckets = 1;
+    while (cache->nbuckets < 2 * capacity)
+        cache->nbuckets <<= 1;
+
+    cache->entries = calloc(capacity, sizeof(CacheEntry));
+    cache->buckets = malloc(cache->nbuckets * sizeof(size_t));
+    if (!cache->entries || !cache->buckets ||
+        posix_memalign((void **)&cache->frames, DISK_ALIGNMENT, capacity * BLOCK_SIZE) != 0)
+    {
+        error("failed to allocate cache of %zu blocks", capacity);
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+
+    for (size_t b = 0; b < cache->nbuckets; b++)
+        cache->buckets[b] = CACHE_NONE;
+
+    cache->lru_head = CACHE_NONE;
+    cache->lru_tail = CACHE_NONE;
+    for (size_t i = 0; i < capacity; i++)
+    {
+        cache->entries[i].data = cache->frames + i * BLOCK_SIZE;
+        cache->entries[i].hash_next = CACHE_NONE;
+        cache_lru_push(cache, i);
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/**
+ * Release buffer cache memory.  Dirty entries are discarded, so callers
+ * must cache_flush first.
+ *
+ * @param       cache       Pointer to Cache structure.
+ **/
+void cache_destroy(Cache *cache)
+{
+    if (!cache)
+        return;
+
+    if (cache->dirty > 0)
+        error("destroying cache with %zu dirty blocks", cache->dirty);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->frames);
+    free(cache->buckets);
+    free(cache->entries);
+    free(cache);
+}
+
+/**
+ * Read block through the cache by doing the following:
+ *
+ *  1. Looking up block in the hash table; on a hit, copying the frame and
+ *  moving the entry to the head of the LRU list.
+ *
+ *  2. On a miss, evicting the least recently used entry (writing it back
+ *  if dirty) and reading block into its frame.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to read.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes read.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t cache_read(Cache *cache, Disk *disk, size_t block, char *data)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    size_t index = cache_lookup(cache, block);
+    if (index != CACHE_NONE)
+    {
+        cache_lru_remove(cache, index);
+        cache_lru_push(cache, index);
+        memcpy(data, cache->entries[index].data, BLOCK_SIZE);
+        pthread_mutex_unlock(&cache->lock);
+        __atomic_fetch_add(&disk->cache_hits, 1, __ATOMIC_RELAXED);
+        return BLOCK_SIZE;
+    }
+
+    __atomic_fetch_add(&disk->cache_misses, 1, __ATOMIC_RELAXED);
+    index = cache_victim(cache, disk);
+    if (index == CACHE_NONE || disk_io(disk, block, cache->entries[index].data, false) == DISK_FAILURE)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return DISK_FAILURE;
+    }
+
+    cache_insert(cache, index, block);
+    memcpy(data, cache->entries[index].data, BLOCK_SIZE);
+    pthread_mutex_unlock(&cache->lock);
+    return BLOCK_SIZE;
+}
+
+/**
+ * Write block into the cache and mark it dirty.  The block reaches the disk
+ * when its entry is evicted or on cache_flush.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to write.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes written.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t cache_write(Cache *cache, Disk *disk, size_t block, char *data)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    size_t index = cache_lookup(cache, block);
+    if (index != CACHE_NONE)
+    {
+        cache_lru_remove(cache, index);
+        cache_lru_push(cache, index);
+    }
+    else
+    {
+        /* Whole-block writes need no read before allocation */
+        index = cache_victim(cache, disk);
+        if (index == CACHE_NONE)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return DISK_FAILURE;
+        }
+        cache_insert(cache, index, block);
+    }
+
+    CacheEntry *entry = &cache->entries[index];
+    memcpy(entry->data, data, BLOCK_SIZE);
+    if (!entry->dirty)
+    {
+        entry->dirty = true;
+        cache->dirty++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return BLOCK_SIZE;
+}
+
+/**
+ * Read count contiguous blocks through the cache.  Cached blocks are copied
+ * from their frames; runs of missing blocks are read with one vectored read
+ * each and then inserted as clean entries.  Like cache_read, the lock is
+ * held across the reads so that a block written, written back or discarded
+ * meanwhile cannot be cached as it was before.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number to read.
+ * @param       count       Number of blocks to read.
+ * @param       data        Array of count data buffers.
+ *
+ * @return      Number of bytes read.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t cache_readv(Cache *cache, Disk *disk, size_t block, size_t count, char **data)
+{
+    if (!data || count == 0 || block + count > disk->blocks)
+        return disk_iov(disk, block, count, data, false);
+
+    for (size_t start = 0; start < count; start += CACHE_BATCH)
+    {
+        size_t n = min((size_t)CACHE_BATCH, count - start);
+        bool cached[CACHE_BATCH];
+
+        pthread_mutex_lock(&cache->lock);
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t index = cache_lookup(cache, block + start + i);
+            cached[i] = index != CACHE_NONE;
+            if (cached[i])
+            {
+                cache_lru_remove(cache, index);
+                cache_lru_push(cache, index);
+                memcpy(data[start + i], cache->entries[index].data, BLOCK_SIZE);
+                __atomic_fetch_add(&disk->cache_hits, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        size_t i = 0;
+        while (i < n)
+        {
+            if (cached[i])
+            {
+                i++;
+                continue;
+            }
+
+            size_t run = 1;
+            while (i + run < n && !cached[i + run])
+                run++;
+
+            size_t first = block + start + i;
+            if (disk_iov(disk, first, run, data + start + i, false) == DISK_FAILURE)
+            {
+                pthread_mutex_unlock(&cache->lock);
+                return DISK_FAILURE;
+            }
+            __atomic_fetch_add(&disk->cache_misses, run, __ATOMIC_RELAXED);
+
+            for (size_t r = 0; r < run; r++)
+            {
+                size_t index = cache_victim(cache, disk);
+                if (index == CACHE_NONE)
+                    break;
+                memcpy(cache->entries[index].data, data[start + i + r], BLOCK_SIZE);
+                cache_insert(cache, index, first + r);
+            }
+            i += run;
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Write count contiguous blocks straight to the disk with vectored writes.
+ * Cached copies of those blocks are updated first so that a later write
+ * back of a dirty entry cannot resurrect stale data, and the lock is held
+ * until the write completes so that a concurrent miss cannot cache the
+ * blocks as they were before it.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number to write.
+ * @param       count       Number of blocks to write.
+ * @param       data        Array of count data buffers.
+ *
+ * @return      Number of bytes written.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t cache_writev(Cache *cache, Disk *disk, size_t block, size_t count, char **data)
+{
+    if (!data || count == 0 || block + count > disk->blocks)
+        return disk_iov(disk, block, count, data, true);
+
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t index = cache_lookup(cache, block + i);
+        if (index != CACHE_NONE && data[i])
+            memcpy(cache->entries[index].data, data[i], BLOCK_SIZE);
+    }
+    ssize_t result = disk_iov(disk, block, count, data, true);
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+/**
+ * Write back every dirty entry in ascending block order, coalescing runs of
+ * consecutive blocks into vectored writes.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int cache_flush(Cache *cache, Disk *disk)
+{
+    int status = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->dirty == 0)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    CacheDirty *dirty = malloc(cache->dirty * sizeof(CacheDirty));
+    if (!dirty)
+    {
+        error("failed on malloc for dirty list");
+        pthread_mutex_unlock(&cache->lock);
+        return DISK_FAILURE;
+    }
+
+    size_t ndirty = 0;
+    for (size_t i = 0; i < cache->capacity; i++)
+    {
+        if (cache->entries[i].valid && cache->entries[i].dirty)
+        {
+            dirty[ndirty].block = cache->entries[i].block;
+            dirty[ndirty].index = i;
+            ndirty++;
+        }
+    }
+    qsort(dirty, ndirty, sizeof(CacheDirty), cache_compare_dirty);
+
+    size_t i = 0;
+    while (i < ndirty)
+    {
+        char *data[CACHE_BATCH];
+        size_t run = 0;
+        do
+        {
+            data[run] = cache->entries[dirty[i + run].index].data;
+            run++;
+        } while (i + run < ndirty && run < CACHE_BATCH &&
+                 dirty[i + run].block == dirty[i].block + run);
+
+        if (disk_iov(disk, dirty[i].block, run, data, true) == DISK_FAILURE)
+        {
+            status = DISK_FAILURE;
+        }
+        else
+        {
+            for (size_t r = 0; r < run; r++)
+                cache->entries[dirty[i + r].index].dirty = false;
+            cache->dirty -= run;
+        }
+        i += run;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    free(dirty);
+    return status;
+}
+
+/**
+ * Drop any cached copies of count blocks starting at block, discarding
+ * dirty data instead of writing it back, and make their entries the next
+ * eviction victims.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ **/
+void cache_discard(Cache *cache, size_t block, size_t count)
+{
+    pthread_mutex_lock(&cache->lock);
+    for (size_t index = 0; index < cache->capacity; index++)
+    {
+        CacheEntry *entry = &cache->entries[index];
+        if (!entry->valid || entry->block < block || entry->block - block >= count)
+            continue;
+
+        if (entry->dirty)
+        {
+            entry->dirty = false;
+            cache->dirty--;
+        }
+        cache_unhash(cache, index);
+        cache_lru_remove(cache, index);
+        cache_lru_append(cache, index);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Internal Functions */
+
+/**
+ * Hash a block number into a bucket index (Fibonacci hashing).
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number.
+ *
+ * @return      Bucket index.
+ **/
+size_t cache_hash(Cache *cache, size_t block)
+{
+    return (size_t)(((uint64_t)block * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->nbuckets - 1);
+}
+
+/**
+ * Find the entry holding block.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number.
+ *
+ * @return      Entry index (CACHE_NONE if block is not cached).
+ **/
+size_t cache_lookup(Cache *cache, size_t block)
+{
+    size_t index = cache->buckets[cache_hash(cache, block)];
+    while (index != CACHE_NONE && cache->entries[index].block != block)
+        index = cache->entries[index].hash_next;
+    return index;
+}
+
+/**
+ * Remove a valid entry from its hash chain and mark it invalid.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       index       Entry index.
+ **/
+void cache_unhash(Cache *cache, size_t index)
+{
+    size_t *link = &cache->buckets[cache_hash(cache, cache->entries[index].block)];
+    while (*link != index)
+        link = &cache->entries[*link].hash_next;
+    *link = cache->entries[index].hash_next;
+    cache->entries[index].hash_next = CACHE_NONE;
+    cache->entries[index].valid = false;
+}
+
+/**
+ * Unlink an entry from the LRU list.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       index       Entry index.
+ **/
+void cache_lru_remove(Cache *cache, size_t index)
+{
+    CacheEntry *entry = &cache->entries[index];
+    if (entry->lru_prev != CACHE_NONE)
+        cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+    if (entry->lru_next != CACHE_NONE)
+        cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+}
+
+/**
+ * Insert an entry at the most recently used end of the LRU list.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       index       Entry index.
+ **/
+void cache_lru_push(Cache *cache, size_t index)
+{
+    CacheEntry *entry = &cache->entries[index];
+    entry->lru_prev = CACHE_NONE;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != CACHE_NONE)
+        cache->entries[cache->lru_head].lru_prev = index;
+    else
+        cache->lru_tail = index;
+    cache->lru_head = index;
+}
+
+/**
+ * Insert an entry at the least recently used end of the LRU list.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       index       Entry index.
+ **/
+void cache_lru_append(Cache *cache, size_t index)
+{
+    CacheEntry *entry = &cache->entries[index];
+    entry->lru_next = CACHE_NONE;
+    entry->lru_prev = cache->lru_tail;
+    if (cache->lru_tail != CACHE_NONE)
+        cache->entries[cache->lru_tail].lru_next = index;
+    else
+        cache->lru_head = index;
+    cache->lru_tail = index;
+}
+
+/**
+ * Evict the least recently used entry, writing it back first if dirty.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Index of the now invalid entry (CACHE_NONE on failure).
+ **/
+size_t cache_victim(Cache *cache, Disk *disk)
+{
+    size_t index = cache->lru_tail;
+    if (index == CACHE_NONE)
+    {
+        error("cache has no entries");
+        return CACHE_NONE;
+    }
+
+    CacheEntry *entry = &cache->entries[index];
+    if (!entry->valid)
+        return index;
+
+    if (entry->dirty)
+    {
+        if (disk_io(disk, entry->block, entry->data, true) == DISK_FAILURE)
+        {
+            error("failed to write back block %zu", entry->block);
+            return CACHE_NONE;
+        }
+        entry->dirty = false;
+        cache->dirty--;
+    }
+
+    cache_unhash(cache, index);
+    return index;
+}
+
+/**
+ * Make an (invalid) entry hold block and move it to the head of the LRU.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       index       Entry index.
+ * @param       block       Block number.
+ **/
+void cache_insert(Cache *cache, size_t index, size_t block)
+{
+    CacheEntry *entry = &cache->entries[index];
+    size_t bucket = cache_hash(cache, block);
+
+    entry->block = block;
+    entry->valid = true;
+    entry->dirty = false;
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = index;
+
+    cache_lru_remove(cache, index);
+    cache_lru_push(cache, index);
+}
+
+/**
+ * qsort comparator ordering dirty entries by block number.
+ **/
+int cache_compare_dirty(const void *a, const void *b)
+{
+    size_t x = ((const CacheDirty *)a)->block;
+    size_t y = ((const CacheDirty *)b)->block;
+    return (x > y) - (x < y);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,132 @@
+/* commit.c: SimpleFS group commit */
+
+#include "sfs/commit.h"
+#include "sfs/logging.h"
+
+#include <errno.h>
+#include <time.h>
+
+/* External Functions */
+
+/**
+ * Create a group commit state.
+ *
+ * @param       batch       Commits that end the wait for a group.
+ * @param       delay       Longest wait for a group to fill (ns).
+ *
+ * @return      Pointer to newly allocated Commit (NULL on failure).
+ **/
+Commit *commit_create(size_t batch, uint64_t delay)
+{
+    Commit *commit = calloc(1, sizeof(Commit));
+    if (!commit)
+    {
+        error("failed on calloc for Commit");
+        return NULL;
+    }
+
+    commit->batch = batch;
+    commit->delay = delay;
+    pthread_mutex_init(&commit->lock, NULL);
+
+    /* Leaders wait against disk_clock */
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&commit->arrived, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_cond_init(&commit->done, NULL);
+    return commit;
+}
+
+/**
+ * Release group commit state.  No commit may be waiting.
+ *
+ * @param       commit      Pointer to Commit structure (may be NULL).
+ **/
+void commit_destroy(Commit *commit)
+{
+    if (!commit)
+        return;
+
+    pthread_cond_destroy(&commit->done);
+    pthread_cond_destroy(&commit->arrived);
+    pthread_mutex_destroy(&commit->lock);
+    free(commit);
+}
+
+/**
+ * Wait until every write issued before the call is durable by doing the
+ * following:
+ *
+ *  1. Taking a commit number.
+ *
+ *  2. Until a flush covers it: leading a group if no flush is running
+ *  (gathering commits, then flushing the disk once for all of them), or
+ *  waiting for the running group to finish otherwise.
+ *
+ * A failed flush fails its group and every later commit: which writes
+ * reached the image is unknown from then on.
+ *
+ * @param       commit      Pointer to Commit structure.
+ * @param       disk        Disk to flush (see disk_flush).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int commit_wait(Commit *commit, Disk *disk)
+{
+    pthread_mutex_lock(&commit->lock);
+    uint64_t ticket = ++commit->requested;
+    pthread_cond_signal(&commit->arrived);
+
+    while (commit->completed < ticket && !commit->error)
+    {
+        if (commit->flushing)
+        {
+            pthread_cond_wait(&commit->done, &commit->lock);
+            continue;
+        }
+
+        commit->flushing = true;
+        if (commit->last_group > 1)
+        {
+            uint64_t deadline = disk_clock() + commit->delay;
+            struct timespec until = {.tv_sec = deadline / 1000000000ULL, .tv_nsec = deadline % 1000000000ULL};
+            while (commit->requested - commit->completed < commit->batch && disk_clock() < deadline)
+                pthread_cond_timedwait(&commit->arrived, &commit->lock, &until);
+        }
+
+        uint64_t target = commit->requested;
+        pthread_mutex_unlock(&commit->lock);
+        int result = disk_flush(disk);
+        int saved = errno;
+        __atomic_fetch_add(&disk->commit_flushes, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&commit->lock);
+
+        if (result == DISK_FAILURE)
+        {
+            error("group commit flush failed");
+            commit->error = saved ? saved : EIO;
+        }
+        else
+        {
+            commit->durable = target;
+        }
+        commit->last_group = target - commit->completed;
+        commit->completed = target;
+        commit->flushing = false;
+        pthread_cond_broadcast(&commit->done);
+    }
+
+    bool durable = commit->durable >= ticket;
+    int saved = commit->error;
+    pthread_mutex_unlock(&commit->lock);
+    if (!durable)
+    {
+        errno = saved;
+        return DISK_FAILURE;
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,287 @@
+/* crc32c.c: SimpleFS CRC32C (Castagnoli) checksums */
+
+#include "sfs/crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define CRC32C_ARM
+#endif
+
+/* Internal Constants */
+
+#define CRC32C_POLYNOMIAL (0x82f63b78) /* Castagnoli, bit reversed */
+#define CRC32C_LANE (1360) /* Bytes per lane of the interleaved hardware loops */
+
+/* Internal Variables */
+
+uint32_t crc32c_table[8][256];
+uint32_t crc32c_shift[2][4][256]; /* Advance a CRC over 1 or 2 lanes of zeros */
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+uint32_t (*crc32c_update)(uint32_t, const unsigned char *, size_t);
+const char *crc32c_name;
+
+/* Internal Prototyes */
+
+void crc32c_init(void);
+uint32_t crc32c_multiply(uint32_t a, uint32_t b);
+uint32_t crc32c_advance(int lanes, uint32_t crc);
+uint32_t crc32c_slicing(uint32_t crc, const unsigned char *data, size_t length);
+#if defined(CRC32C_X86)
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length);
+#elif defined(CRC32C_ARM)
+uint32_t crc32c_armv8(uint32_t crc, const unsigned char *data, size_t length);
+#endif
+
+/* External Functions */
+
+/**
+ * Continue a CRC32C over length bytes of data with the fastest
+ * implementation the processor supports.
+ *
+ * @param       crc         Checksum so far (0 to start a new one).
+ * @param       data        Data to checksum.
+ * @param       length      Number of bytes.
+ *
+ * @return      Checksum of everything so far.
+ **/
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~crc, data, length);
+}
+
+/**
+ * Continue a CRC32C with the slicing-by-8 tables only (same result as
+ * crc32c, used to compare implementations).
+ *
+ * @param       crc         Checksum so far (0 to start a new one).
+ * @param       data        Data to checksum.
+ * @param       length      Number of bytes.
+ *
+ * @return      Checksum of everything so far.
+ **/
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_slicing(~crc, data, length);
+}
+
+/**
+ * Name the implementation crc32c uses on this processor.
+ *
+ * @return      "sse4.2", "armv8" or "slicing-by-8".
+ **/
+const char *crc32c_implementation(void)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_name;
+}
+
+/* Internal Functions */
+
+/**
+ * Build the slicing-by-8 tables and pick the implementation: table k maps a
+ * byte to the CRC of that byte followed by k zero bytes.
+ **/
+void crc32c_init(void)
+{
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & -(crc & 1));
+        crc32c_table[0][byte] = crc;
+    }
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+        for (int k = 1; k < 8; k++)
+            crc32c_table[k][byte] = (crc32c_table[k - 1][byte] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][byte] & 0xff];
+    }
+
+    /* x^(8 * CRC32C_LANE) and its square, by repeated squaring of x^8 */
+    uint32_t power = 1u << 31, square = 1u << 23;
+    for (size_t bytes = CRC32C_LANE; bytes; bytes >>= 1)
+    {
+        if (bytes & 1)
+            power = crc32c_multiply(power, square);
+        square = crc32c_multiply(square, square);
+    }
+    uint32_t powers[2] = {power, crc32c_multiply(power, power)};
+    for (int lanes = 0; lanes < 2; lanes++)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            for (uint32_t byte = 0; byte < 256; byte++)
+                crc32c_shift[lanes][k][byte] = crc32c_multiply(powers[lanes], byte << (8 * k));
+        }
+    }
+
+    crc32c_update = crc32c_slicing;
+    crc32c_name = "slicing-by-8";
+#if defined(CRC32C_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32c_update = crc32c_sse42;
+        crc32c_name = "sse4.2";
+    }
+#elif defined(CRC32C_ARM)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        crc32c_update = crc32c_armv8;
+        crc32c_name = "armv8";
+    }
+#endif
+}
+
+/**
+ * Multiply two polynomials modulo the CRC polynomial (bit reversed, so
+ * 1u << 31 is 1 and 1u << 30 is x).
+ **/
+uint32_t crc32c_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit; bit >>= 1)
+    {
+        if (a & bit)
+            product ^= b;
+        b = (b >> 1) ^ (CRC32C_POLYNOMIAL & -(b & 1));
+    }
+    return product;
+}
+
+/**
+ * Advance a CRC register as if lanes * CRC32C_LANE zero bytes followed
+ * (lanes is 1 or 2).  The register is linear in its previous value, so
+ * this is four table lookups.
+ **/
+uint32_t crc32c_advance(int lanes, uint32_t crc)
+{
+    const uint32_t (*shift)[256] = crc32c_shift[lanes - 1];
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^
+           shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+/**
+ * Update a (pre-inverted) CRC eight bytes at a time with the
+ * slicing-by-8 tables.
+ **/
+uint32_t crc32c_slicing(uint32_t crc, const unsigned char *data, size_t length)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+#endif
+    while (length--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+#if defined(CRC32C_X86)
+/**
+ * Update a (pre-inverted) CRC with the SSE4.2 crc32 instruction.  The
+ * instruction has a latency of three cycles but a throughput of one, so
+ * three lanes are checksummed at once and combined with crc32c_advance.
+ **/
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+#if defined(__x86_64__)
+    while (length >= 3 * CRC32C_LANE)
+    {
+        uint64_t lane[3] = {crc, 0, 0};
+        for (size_t i = 0; i < CRC32C_LANE; i += 8)
+        {
+            uint64_t word[3];
+            memcpy(word, data + i, sizeof(uint64_t));
+            memcpy(word + 1, data + CRC32C_LANE + i, sizeof(uint64_t));
+            memcpy(word + 2, data + 2 * CRC32C_LANE + i, sizeof(uint64_t));
+            lane[0] = _mm_crc32_u64(lane[0], word[0]);
+            lane[1] = _mm_crc32_u64(lane[1], word[1]);
+            lane[2] = _mm_crc32_u64(lane[2], word[2]);
+        }
+        crc = crc32c_advance(2, lane[0]) ^ crc32c_advance(1, lane[1]) ^ lane[2];
+        data += 3 * CRC32C_LANE;
+        length -= 3 * CRC32C_LANE;
+    }
+
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = crc64;
+#endif
+    while (length--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#elif defined(CRC32C_ARM)
+/**
+ * Update a (pre-inverted) CRC with the ARMv8 crc32c instructions, three
+ * lanes at once like crc32c_sse42.
+ **/
+__attribute__((target("+crc")))
+uint32_t crc32c_armv8(uint32_t crc, const unsigned char *data, size_t length)
+{
+    while (length >= 3 * CRC32C_LANE)
+    {
+        uint32_t lane[3] = {crc, 0, 0};
+        for (size_t i = 0; i < CRC32C_LANE; i += 8)
+        {
+            uint64_t word[3];
+            memcpy(word, data + i, sizeof(uint64_t));
+            memcpy(word + 1, data + CRC32C_LANE + i, sizeof(uint64_t));
+            memcpy(word + 2, data + 2 * CRC32C_LANE + i, sizeof(uint64_t));
+            lane[0] = __crc32cd(lane[0], word[0]);
+            lane[1] = __crc32cd(lane[1], word[1]);
+            lane[2] = __crc32cd(lane[2], word[2]);
+        }
+        crc = crc32c_advance(2, lane[0]) ^ crc32c_advance(1, lane[1]) ^ lane[2];
+        data += 3 * CRC32C_LANE;
+        length -= 3 * CRC32C_LANE;
+    }
+
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = __crc32cb(crc, *data++);
+    return crc;
+}
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
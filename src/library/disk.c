@@ -1,18 +1,71 @@
 /* disk.c: SimpleFS disk emulator */
 
+#include "sfs/cache.h"
+#include "sfs/commit.h"
 #include "sfs/disk.h"
+#include "sfs/elevator.h"
 #include "sfs/logging.h"
+#include "sfs/readahead.h"
+#include "sfs/trace.h"
+#include "sfs/uring.h"
+#include "sfs/utils.h"
 
-#include <fcntl.h>
-#include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+/* Internal Constants */
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+/* Internal Structures */
+
+typedef struct DiskRequest DiskRequest;
+
+struct DiskRequest
+{
+    bool write;            /* Whether request is a write */
+    size_t block;          /* Block number */
+    char *data;            /* Data buffer */
+    char *bounce;          /* Aligned bounce buffer (O_DIRECT) or NULL */
+    ssize_t result;        /* Result (BLOCK_SIZE or DISK_FAILURE) */
+    DiskCallback callback; /* Completion callback */
+    void *arg;             /* Completion callback argument */
+    uint64_t start;        /* Time request was queued (disk_clock) */
+};
 
 /* Internal Prototyes */
 
 bool disk_sanity_check(Disk *disk, size_t blocknum, const char *data);
+void disk_shutdown(Disk *disk);
+bool disk_read_buffered(Disk *disk, size_t block, char *data);
+ssize_t disk_list(Disk *disk, const DiskIO *ios, size_t count, bool write);
+bool disk_queue_init(Disk *disk, size_t queue_depth);
+bool disk_pool_init(Disk *disk, size_t buffers);
+void disk_pool_free(Disk *disk);
+int disk_queue(Disk *disk, size_t block, char *data, DiskCallback callback, void *arg, bool write);
+void disk_complete(Disk *disk, size_t slot, ssize_t result);
 
 /* External Functions */
 
+/**
+ *
+ * Opens disk at specified path with the specified number of blocks using the
+ * default DISK_MODE_FILE mode (see disk_open_with).
+ *
+ * @param       path        Path to disk image to create.
+ * @param       blocks      Number of blocks to allocate for disk image.
+ *
+ * @return      Pointer to newly allocated and configured Disk structure (NULL
+ *              on failure).
+ **/
+Disk *disk_open(const char *path, size_t blocks)
+{
+    return disk_open_with(path, blocks, NULL);
+}
+
 /**
  *
  * Opens disk at specified path with the specified number of blocks by doing
@@ -20,20 +73,60 @@ bool disk_sanity_check(Disk *disk, size_t blocknum, const char *data);
  *
  *  1. Allocates Disk structure and sets appropriate attributes.
  *
- *  2. Opens file descriptor to specified path.
+ *  2. Attaches the backend: options->ops if given, otherwise the built-in
+ *  backend for options->mode (see disk_backend).  The backend opens and
+ *  sizes the image.  With options->shape, disk_shaped_ops wraps that
+ *  backend instead, with options->stripe_blocks, disk_striped_ops spreads
+ *  the disk over several of the result (or with options->mirror,
+ *  disk_mirrored_ops copies it to several of them), with options->checksums,
+ *  disk_checked_ops wraps that, and with options->compress,
+ *  disk_compressed_ops wraps that.
+ *
+ *  3. Allocates queue_depth asynchronous request slots.
+ *
+ *  4. Allocates the aligned buffer pool when the image is opened O_DIRECT
+ *  (or a pool size was requested).
  *
- *  3. Truncates file to desired file size (blocks * BLOCK_SIZE).
+ *  5. Attaches a write-back buffer cache of cache_blocks blocks, if any.
+ *
+ *  6. Attaches a readahead buffer of readahead_blocks blocks, if any.
+ *
+ *  7. Attaches a write queue of write_queue_blocks blocks, if any.
+ *
+ *  8. Sets up group commit when durability asks for it.
+ *
+ *  9. Starts recording a trace to trace_path, if any.
  *
  * @param       path        Path to disk image to create.
  * @param       blocks      Number of blocks to allocate for disk image.
+ * @param       options     Disk options (NULL for defaults).
  *
  * @return      Pointer to newly allocated and configured Disk structure (NULL
  *              on failure).
  **/
-Disk *disk_open(const char *path, size_t blocks)
+Disk *disk_open_with(const char *path, size_t blocks, const DiskOptions *options)
 {
-    // malloc
-    Disk *disk = malloc(sizeof(Disk));
+    const DiskOps *ops = options && options->ops ? options->ops : disk_backend(options ? options->mode : DISK_MODE_FILE);
+    if (ops && options && options->compress)
+        ops = &disk_compressed_ops;
+    else if (ops && options && options->checksums)
+        ops = &disk_checked_ops;
+    else if (ops && options && options->mirror)
+        ops = &disk_mirrored_ops;
+    else if (ops && options && options->stripe_blocks)
+        ops = &disk_striped_ops;
+    else if (ops && options && options->shape)
+        ops = &disk_shaped_ops;
+    size_t queue_depth = options && options->queue_depth ? options->queue_depth : DISK_QUEUE_DEPTH;
+    size_t pool_buffers = options && options->pool_buffers ? options->pool_buffers : DISK_POOL_BUFFERS;
+    if (!ops)
+    {
+        error("unknown disk mode %d", options->mode);
+        goto cleanup;
+    }
+
+    // calloc
+    Disk *disk = calloc(1, sizeof(Disk));
     if (!disk)
     {
         error("failed on malloc for Disk");
@@ -41,37 +134,116 @@ Disk *disk_open(const char *path, size_t blocks)
     }
 
     disk->blocks = blocks;
+    disk->reads = 0;
+    disk->writes = 0;
     // FIXME: Should I modify disk->mounted here ?
     disk->mounted = false;
-    disk->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (disk->fd == -1)
-    {
-        error("failed to open file %s", path);
+    disk->fd = -1;
+    disk->ops = ops;
+    if (ops->open(disk, path, options) == DISK_FAILURE)
         goto cleanup_free_disk;
+
+    if (!disk_queue_init(disk, queue_depth))
+        goto cleanup_close;
+
+    if ((disk->direct || (options && options->pool_buffers)) && !disk_pool_init(disk, pool_buffers))
+        goto cleanup_close;
+
+    if (options && options->cache_blocks)
+    {
+        disk->cache = cache_create(options->cache_blocks);
+        if (!disk->cache)
+            goto cleanup_close;
     }
 
-    if (ftruncate(disk->fd, blocks * BLOCK_SIZE) == -1)
+    if (options && options->readahead_blocks)
     {
-        int errsv = errno;
-        error("failed to truncate file %s, errno: [%d]", path, errsv);
-        goto cleanup_close_fd;
+        disk->readahead = readahead_create(options->readahead_blocks);
+        if (!disk->readahead)
+            goto cleanup_close;
+    }
+
+    if (options && options->write_queue_blocks)
+    {
+        unsigned delay = options->write_queue_delay ? options->write_queue_delay : DISK_WRITE_QUEUE_DELAY;
+        disk->elevator = elevator_create(options->write_queue_blocks, delay * 1000000ULL);
+        if (!disk->elevator)
+            goto cleanup_close;
+    }
+
+    disk->durability = options ? options->durability : DISK_DURABILITY_NONE;
+    if (disk->durability == DISK_DURABILITY_GROUP)
+    {
+        size_t batch = options->commit_batch ? options->commit_batch : DISK_COMMIT_BATCH;
+        unsigned delay = options->commit_delay ? options->commit_delay : DISK_COMMIT_DELAY;
+        disk->commit = commit_create(batch, delay * 1000ULL);
+        if (!disk->commit)
+            goto cleanup_close;
+    }
+    else if (disk->durability != DISK_DURABILITY_NONE && disk->durability != DISK_DURABILITY_SYNC)
+    {
+        error("unknown durability mode %d", disk->durability);
+        goto cleanup_close;
+    }
+
+    if (options && options->trace_path)
+    {
+        disk->trace = trace_create(options->trace_path, blocks);
+        if (!disk->trace)
+            goto cleanup_close;
     }
 
     return disk;
 
-cleanup_close_fd:
-    close(disk->fd);
+cleanup_close:
+    commit_destroy(disk->commit);
+    elevator_destroy(disk->elevator);
+    readahead_destroy(disk->readahead);
+    cache_destroy(disk->cache);
+    disk_pool_free(disk);
+    free(disk->requests);
+    free(disk->free_slots);
+    free(disk->done_slots);
+    ops->close(disk);
 cleanup_free_disk:
     free(disk);
 cleanup:
     return NULL;
 }
+
+/**
+ * Return the built-in backend for a disk mode.
+ *
+ * @param       mode        Disk mode (DISK_MODE_*).
+ *
+ * @return      Pointer to backend operations (NULL for unknown modes).
+ **/
+const DiskOps *disk_backend(int mode)
+{
+    switch (mode)
+    {
+    case DISK_MODE_FILE:
+        return &disk_file_ops;
+    case DISK_MODE_MMAP:
+        return &disk_mmap_ops;
+    case DISK_MODE_URING:
+        return &disk_uring_ops;
+    case DISK_MODE_RAM:
+        return &disk_ram_ops;
+    default:
+        return NULL;
+    }
+}
+
 /**
  * Close disk structure by doing the following:
  *
- *  1. Close disk file descriptor.
+ *  1. Complete outstanding asynchronous requests, write back and release
+ *  the buffer cache and then the write queue, then let the backend flush
+ *  and release the image (see disk_shutdown).
  *
- *  2. Report number of disk reads and writes.
+ *  2. Report number of disk reads and writes on stdout, followed by the
+ *  full statistics (see disk_stats) on stderr.
  *
  *  3. Releasing disk structure memory.
  *
@@ -79,10 +251,26 @@ cleanup:
  */
 void disk_close(Disk *disk)
 {
-    if (close(disk->fd) == -1)
-        error("failed to close fd");
-    disk->reads--;
-    disk->writes--;
+    disk_shutdown(disk);
+
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    printf("%zu disk block reads\n", stats.reads);
+    printf("%zu disk block writes\n", stats.writes);
+    disk_stats_print(&stats, stderr);
+    free(disk);
+}
+
+/**
+ * Close disk structure like disk_close, but without reporting anything
+ * (for disks opened internally, such as the one a wrapping backend stacks
+ * on).
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void disk_release(Disk *disk)
+{
+    disk_shutdown(disk);
     free(disk);
 }
 
@@ -92,9 +280,11 @@ void disk_close(Disk *disk)
  *
  *  1. Performing sanity check.
  *
- *  2. Seeking to specified block.
+ *  2. Serving the block from the buffer cache, if one is attached.
  *
- *  3. Reading from block to data buffer (must be BLOCK_SIZE).
+ *  3. Otherwise reading from block to data buffer (must be BLOCK_SIZE) with
+ *  a positional read, so the shared file offset is never touched and
+ *  several threads may read from the same Disk concurrently.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
@@ -110,77 +300,734 @@ ssize_t disk_read(Disk *disk, size_t block, char *data)
         error("disk_read: disk_sanity_check failed");
         return DISK_FAILURE;
     }
-    off_t offset = (off_t)block * BLOCK_SIZE;
-    if (lseek(disk->fd, offset, SEEK_SET) == -1)
+
+    uint64_t start = disk->trace ? disk_clock() : 0;
+    ssize_t result = disk->cache ? cache_read(disk->cache, disk, block, data)
+                                 : disk_io(disk, block, data, false);
+    if (disk->trace)
+        trace_record(disk->trace, TRACE_READ, block, 1, start, result == DISK_FAILURE);
+    return result;
+}
+
+/**
+ * Write data to disk at specified block from data buffer by doing the
+ * following:
+ *
+ *  1. Performing sanity check.
+ *
+ *  2. Writing into the buffer cache, if one is attached (the block reaches
+ *  the image on eviction or disk_flush).
+ *
+ *  3. Otherwise writing data buffer (must be BLOCK_SIZE) to disk block with
+ *  a positional write (safe to call concurrently on the same Disk).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes written.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_write(Disk *disk, size_t block, char *data)
+{
+    if (!disk_sanity_check(disk, block, data))
     {
-        error("disk_read: lseek failed: failed to seek to offset %lld", offset);
+        error("disk_write: disk_sanity_check failed");
         return DISK_FAILURE;
     }
 
-    ssize_t nread = read(disk->fd, data, BLOCK_SIZE);
-    if (nread == -1)
+    uint64_t start = disk->trace ? disk_clock() : 0;
+    ssize_t result = disk->cache ? cache_write(disk->cache, disk, block, data)
+                                 : disk_io(disk, block, data, true);
+    if (disk->trace)
+        trace_record(disk->trace, TRACE_WRITE, block, 1, start, result == DISK_FAILURE);
+    return result;
+}
+
+/**
+ * Read count contiguous blocks starting at block into the count buffers in
+ * data (each must be BLOCK_SIZE) using vectored positional reads (one preadv
+ * per IOV_MAX blocks).  With a buffer cache attached, cached blocks are
+ * copied from the cache and only the missing runs are read.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number to read.
+ * @param       count       Number of blocks to read.
+ * @param       data        Array of count data buffers.
+ *
+ * @return      Number of bytes read.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_readv(Disk *disk, size_t block, size_t count, char **data)
+{
+    uint64_t start = disk && disk->trace ? disk_clock() : 0;
+    ssize_t result = disk && disk->cache ? cache_readv(disk->cache, disk, block, count, data)
+                                         : disk_iov(disk, block, count, data, false);
+    if (disk && disk->trace)
+        trace_record(disk->trace, TRACE_READ, block, count, start, result == DISK_FAILURE);
+    return result;
+}
+
+/**
+ * Write count data buffers (each must be BLOCK_SIZE) to the contiguous
+ * blocks starting at block using vectored positional writes.  Bulk writes
+ * go straight to the image; cached copies are updated in place.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number to write.
+ * @param       count       Number of blocks to write.
+ * @param       data        Array of count data buffers.
+ *
+ * @return      Number of bytes written.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_writev(Disk *disk, size_t block, size_t count, char **data)
+{
+    uint64_t start = disk && disk->trace ? disk_clock() : 0;
+    ssize_t result = disk && disk->cache ? cache_writev(disk->cache, disk, block, count, data)
+                                         : disk_iov(disk, block, count, data, true);
+    if (disk && disk->trace)
+        trace_record(disk->trace, TRACE_WRITE, block, count, start, result == DISK_FAILURE);
+    return result;
+}
+
+/**
+ * Read a list of (block, buffer) pairs.  Runs of entries with consecutive
+ * block numbers are coalesced into a single vectored read.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       ios         Array of scatter-gather entries.
+ * @param       count       Number of entries.
+ *
+ * @return      Number of bytes read.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_read_list(Disk *disk, const DiskIO *ios, size_t count)
+{
+    return disk_list(disk, ios, count, false);
+}
+
+/**
+ * Write a list of (block, buffer) pairs.  Runs of entries with consecutive
+ * block numbers are coalesced into a single vectored write.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       ios         Array of scatter-gather entries.
+ * @param       count       Number of entries.
+ *
+ * @return      Number of bytes written.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_write_list(Disk *disk, const DiskIO *ios, size_t count)
+{
+    return disk_list(disk, ios, count, true);
+}
+
+/**
+ * Return a pointer to the specified block inside the backend's memory (the
+ * image mapping for DISK_MODE_MMAP), so it can be read without copying it
+ * into a separate buffer.  If the block has a queued write the queue is
+ * flushed first so the pointer sees it.  Every call counts
+ * as one disk read.  Stores through the pointer reach the image on the next
+ * disk_flush (or disk_close).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to access.
+ *
+ * @return      Pointer to BLOCK_SIZE bytes of block (NULL if the backend has
+ *              no ptr operation, the disk has a buffer cache that could hold
+ *              a newer copy, block is out of range, or its queued write
+ *              could not be flushed).
+ **/
+char *disk_block_ptr(Disk *disk, size_t block)
+{
+    if (!disk || !disk->ops->ptr || disk->cache || block >= disk->blocks)
+        return NULL;
+    if (disk->elevator && elevator_queued(disk->elevator, block) &&
+        elevator_flush(disk->elevator, disk) == DISK_FAILURE)
+        return NULL;
+
+    char *pointer = disk->ops->ptr(disk, block);
+    disk_account(disk, block, 1, false, disk_clock());
+    return pointer;
+}
+
+/**
+ * Flush outstanding writes to stable storage: write back dirty buffer cache
+ * blocks and queued writes, then let the backend flush (msync for
+ * DISK_MODE_MMAP, fdatasync for the image file).
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_flush(Disk *disk)
+{
+    if (!disk || !disk->ops)
     {
-        error("disk_read: read failed: failed to read at offset [%d]", offset);
+        error("disk_flush: invalid disk");
         return DISK_FAILURE;
     }
-    else if (nread != (ssize_t)BLOCK_SIZE)
+
+    uint64_t start = disk->trace ? disk_clock() : 0;
+    int result = 0;
+    if (disk->cache && cache_flush(disk->cache, disk) == DISK_FAILURE)
+    {
+        error("disk_flush: cache_flush failed");
+        result = DISK_FAILURE;
+    }
+    else if (disk->elevator && elevator_flush(disk->elevator, disk) == DISK_FAILURE)
     {
-        error("disk_read: read incomplete (%zd/%zu bytes)", nread, BLOCK_SIZE);
+        error("disk_flush: write queue flush failed");
+        result = DISK_FAILURE;
+    }
+    else if (disk->ops->flush)
+    {
+        result = disk->ops->flush(disk);
+    }
+
+    if (disk->trace)
+        trace_record(disk->trace, TRACE_FLUSH, 0, 0, start, result == DISK_FAILURE);
+    return result;
+}
+
+/**
+ * Write every queued write to the backend, so writes issued before the
+ * barrier reach the image before any issued after it.  Unlike disk_flush,
+ * dirty buffer cache blocks stay cached and nothing is made durable.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_barrier(Disk *disk)
+{
+    if (!disk || !disk->ops)
+    {
+        error("disk_barrier: invalid disk");
         return DISK_FAILURE;
     }
 
-    disk->reads++;
+    uint64_t start = disk->trace ? disk_clock() : 0;
+    int result = 0;
+    if (disk->elevator && elevator_flush(disk->elevator, disk) == DISK_FAILURE)
+    {
+        error("disk_barrier: write queue flush failed");
+        result = DISK_FAILURE;
+    }
 
-    return nread;
+    if (disk->trace)
+        trace_record(disk->trace, TRACE_BARRIER, 0, 0, start, result == DISK_FAILURE);
+    return result;
 }
 
 /**
- * Write data to disk at specified block from data buffer by doing the
+ * Make every write issued before the call durable as the disk's durability
+ * mode asks, for a caller that has finished an operation:
+ *
+ *  1. DISK_DURABILITY_NONE: nothing (the writes become durable on the next
+ *  disk_flush or disk_close).
+ *
+ *  2. DISK_DURABILITY_SYNC: flushing the disk (see disk_flush).
+ *
+ *  3. DISK_DURABILITY_GROUP: joining a group of concurrent commits that
+ *  share one flush (see commit_wait).
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_commit(Disk *disk)
+{
+    if (!disk || !disk->ops)
+    {
+        error("disk_commit: invalid disk");
+        return DISK_FAILURE;
+    }
+
+    switch (disk->durability)
+    {
+    case DISK_DURABILITY_SYNC:
+        __atomic_fetch_add(&disk->commits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&disk->commit_flushes, 1, __ATOMIC_RELAXED);
+        return disk_flush(disk);
+    case DISK_DURABILITY_GROUP:
+        __atomic_fetch_add(&disk->commits, 1, __ATOMIC_RELAXED);
+        return commit_wait(disk->commit, disk);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Release the storage behind count blocks starting at block by doing the
  * following:
  *
- *  1. Performing sanity check.
+ *  1. Sanity checking the range.
+ *
+ *  2. Dropping any cached copies and queued writes (neither is written
+ *  back).
+ *
+ *  3. Letting the backend release the range (punching a hole in the image
+ *  file, or returning the pages of a mapping or RAM disk), then dropping
+ *  prefetched copies again in case a prefetch read the range meanwhile.
+ *
+ * Discarded blocks read back as zeroes.  Discard is an optimization, so
+ * callers that only free blocks may ignore failures; callers that rely on
+ * the zeroes must fall back to writing them.
  *
- *  2. Seeking to specified block.
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
  *
- *  3. Writing data buffer (must be BLOCK_SIZE) to disk block.
+ * @return      0 on success, DISK_FAILURE on failure (errno is EOPNOTSUPP
+ *              if the backend or host file system cannot discard).
+ **/
+int disk_discard(Disk *disk, size_t block, size_t count)
+{
+    if (count == 0 || !disk_sanity_check(disk, block + count - 1, ""))
+    {
+        error("disk_discard: disk_sanity_check failed");
+        return DISK_FAILURE;
+    }
+
+    uint64_t start = disk->trace ? disk_clock() : 0;
+    if (disk->cache)
+        cache_discard(disk->cache, block, count);
+    if (disk->elevator)
+        elevator_discard(disk->elevator, block, count);
+    if (disk->readahead)
+        readahead_invalidate(disk->readahead, block, count);
+
+    int result = DISK_FAILURE;
+    if (!disk->ops->discard)
+        errno = EOPNOTSUPP;
+    else
+        result = disk->ops->discard(disk, block, count);
+    if (disk->readahead)
+        readahead_invalidate(disk->readahead, block, count);
+
+    if (result != DISK_FAILURE)
+        __atomic_fetch_add(&disk->discards, count, __ATOMIC_RELAXED);
+    if (disk->trace)
+    {
+        int saved = errno;
+        trace_record(disk->trace, TRACE_DISCARD, block, count, start, result == DISK_FAILURE);
+        errno = saved;
+    }
+    return result;
+}
+
+/**
+ * Take a DISK_ALIGNMENT aligned BLOCK_SIZE buffer from the disk's pool.
+ * When the pool is exhausted (or the disk has none) the buffer is allocated
+ * on the heap instead; either way it must be returned with disk_buffer_put.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Pointer to aligned buffer (NULL on failure).
+ **/
+char *disk_buffer_get(Disk *disk)
+{
+    char *buffer = NULL;
+
+    if (disk && disk->pool)
+    {
+        pthread_mutex_lock(&disk->pool_lock);
+        if (disk->pool_nfree > 0)
+            buffer = disk->pool_free[--disk->pool_nfree];
+        pthread_mutex_unlock(&disk->pool_lock);
+    }
+
+    if (!buffer && posix_memalign((void **)&buffer, DISK_ALIGNMENT, BLOCK_SIZE) != 0)
+    {
+        error("failed on posix_memalign for aligned buffer");
+        return NULL;
+    }
+    return buffer;
+}
+
+/**
+ * Return a buffer obtained from disk_buffer_get.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       buffer      Buffer to release (NULL is ignored).
+ **/
+void disk_buffer_put(Disk *disk, char *buffer)
+{
+    if (!buffer)
+        return;
+
+    if (disk && disk->pool && buffer >= disk->pool &&
+        buffer < disk->pool + disk->pool_buffers * BLOCK_SIZE)
+    {
+        pthread_mutex_lock(&disk->pool_lock);
+        disk->pool_free[disk->pool_nfree++] = buffer;
+        pthread_mutex_unlock(&disk->pool_lock);
+        return;
+    }
+    free(buffer);
+}
+
+/**
+ * Queue an asynchronous read of block into data.  callback is invoked from
+ * disk_poll once the read completes.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to read.
+ * @param       data        Data buffer (must stay valid until completion).
+ * @param       callback    Completion callback (may be NULL).
+ * @param       arg         Argument passed to callback.
+ *
+ * @return      0 on success, DISK_FAILURE if the request was rejected.
+ **/
+int disk_queue_read(Disk *disk, size_t block, char *data, DiskCallback callback, void *arg)
+{
+    return disk_queue(disk, block, data, callback, arg, false);
+}
+
+/**
+ * Queue an asynchronous write of data to block.  callback is invoked from
+ * disk_poll once the write completes.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to write.
+ * @param       data        Data buffer (must stay valid until completion).
+ * @param       callback    Completion callback (may be NULL).
+ * @param       arg         Argument passed to callback.
+ *
+ * @return      0 on success, DISK_FAILURE if the request was rejected.
+ **/
+int disk_queue_write(Disk *disk, size_t block, char *data, DiskCallback callback, void *arg)
+{
+    return disk_queue(disk, block, data, callback, arg, true);
+}
+
+/**
+ * Hand every queued request to the kernel in one io_uring_enter.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Number of requests submitted (DISK_FAILURE on failure).
+ **/
+int disk_submit(Disk *disk)
+{
+    if (!disk || !disk->ring || disk->ring->pending == 0)
+        return 0;
+
+    int n = ring_submit(disk->ring, 0);
+    return n < 0 ? DISK_FAILURE : n;
+}
+
+/**
+ * Reap completed asynchronous requests and invoke their callbacks.  Queued
+ * requests that have not been submitted yet are submitted first.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       wait        Whether to block until at least one request
+ *                          completes (when any are outstanding).
+ *
+ * @return      Number of requests completed (DISK_FAILURE on failure).
+ **/
+ssize_t disk_poll(Disk *disk, bool wait)
+{
+    if (!disk || !disk->requests)
+        return DISK_FAILURE;
+
+    ssize_t completed = 0;
+    while (disk->ndone > 0)
+    {
+        size_t slot = disk->done_slots[--disk->ndone];
+        disk_complete(disk, slot, disk->requests[slot].result);
+        completed++;
+    }
+
+    if (!disk->ring)
+        return completed;
+
+    size_t inflight = disk->queue_depth - disk->nfree;
+    unsigned min_complete = (wait && completed == 0 && inflight > 0) ? 1 : 0;
+    if ((disk->ring->pending > 0 || min_complete > 0) && ring_submit(disk->ring, min_complete) < 0)
+        return DISK_FAILURE;
+
+    uint64_t slot;
+    int32_t result;
+    while (ring_reap(disk->ring, &slot, &result))
+    {
+        DiskRequest *request = &disk->requests[slot];
+        bool failed = result != BLOCK_SIZE;
+        if (failed)
+            error("%s: async %s failed at block [%zu]: %s",
+                  request->write ? "disk_write" : "disk_read",
+                  request->write ? "write" : "read", request->block,
+                  result < 0 ? strerror(-result) : "short transfer");
+        else
+            disk_account(disk, request->block, 1, request->write, request->start);
+
+        /* Like disk_transfer, drop copies prefetched while the write ran */
+        if (request->write && disk->readahead)
+            readahead_invalidate(disk->readahead, request->block, 1);
+        if (disk->trace)
+            trace_record(disk->trace, request->write ? TRACE_WRITE : TRACE_READ, request->block, 1,
+                         request->start, failed);
+        disk_complete(disk, slot, failed ? DISK_FAILURE : BLOCK_SIZE);
+        completed++;
+    }
+
+    return completed;
+}
+
+/**
+ * Submit and wait for every outstanding asynchronous request.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_drain(Disk *disk)
+{
+    if (!disk || !disk->requests)
+        return DISK_FAILURE;
+
+    while (disk->nfree < disk->queue_depth)
+    {
+        if (disk_poll(disk, true) == DISK_FAILURE)
+            return DISK_FAILURE;
+    }
+    return 0;
+}
+
+/**
+ * Sanity check and transfer a single block, bypassing the buffer cache.
+ * Reads are served from the write queue or readahead buffer when they hold
+ * the block; writes are queued when the disk has a write queue.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
- * @param       data        Data buffer.
+ * @param       data        Data buffer (must be BLOCK_SIZE).
+ * @param       write       Whether to write (true) or read (false).
  *
- * @return      Number of bytes written.
+ * @return      Number of bytes transferred.
  *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
  **/
-ssize_t disk_write(Disk *disk, size_t block, char *data)
+ssize_t disk_io(Disk *disk, size_t block, char *data, bool write)
 {
+    const char *name = write ? "disk_write" : "disk_read";
+
     if (!disk_sanity_check(disk, block, data))
     {
-        error("failed on disk_sanity_check");
+        error("%s: disk_sanity_check failed", name);
         return DISK_FAILURE;
     }
-    off_t offset = (off_t)block * BLOCK_SIZE;
-    if (lseek(disk->fd, offset, SEEK_SET) == -1)
+
+    if (write)
     {
-        error("failed on lseek: failed to seek to offset %d", offset);
-        return DISK_FAILURE;
+        if (disk->readahead)
+            readahead_invalidate(disk->readahead, block, 1);
+        if (disk->elevator)
+            return elevator_write(disk->elevator, disk, block, 1, &data);
     }
-    ssize_t nwrite = write(disk->fd, data, BLOCK_SIZE);
-    if (nwrite == -1)
+    else if (disk_read_buffered(disk, block, data))
+        return BLOCK_SIZE;
+
+    return disk_transfer(disk, block, 1, &data, write);
+}
+
+/**
+ * Sanity check and transfer count contiguous blocks, bypassing the buffer
+ * cache, with the backend's vectored operation when it has one.  Like
+ * disk_io, reads use the write queue and readahead buffer and writes are
+ * queued.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ * @param       data        Array of count data buffers.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t disk_iov(Disk *disk, size_t block, size_t count, char **data, bool write)
+{
+    const char *name = write ? "disk_writev" : "disk_readv";
+
+    if (!data || count == 0 || !disk_sanity_check(disk, block + count - 1, data[0]))
     {
-        error("disk_read: read failed: failed to read at offset [%lld]", offset);
+        error("%s: disk_sanity_check failed", name);
         return DISK_FAILURE;
     }
-    else if (nwrite != (ssize_t)BLOCK_SIZE)
+    for (size_t i = 0; i < count; i++)
     {
-        error("failed on write: write incomplete (%zd/%zu bytes)", nwrite, BLOCK_SIZE);
-        return DISK_FAILURE;
+        if (!data[i])
+        {
+            error("%s: data[%zu] should not be NULL", name, i);
+            return DISK_FAILURE;
+        }
+    }
+
+    if (write)
+    {
+        if (disk->readahead)
+            readahead_invalidate(disk->readahead, block, count);
+        if (disk->elevator)
+            return elevator_write(disk->elevator, disk, block, count, data);
+        return disk_transfer(disk, block, count, data, write);
+    }
+
+    if (!disk->readahead && !disk->elevator)
+        return disk_transfer(disk, block, count, data, write);
+
+    /* Serve queued and prefetched blocks from memory, read runs of the rest */
+    size_t i = 0;
+    while (i < count)
+    {
+        if (disk_read_buffered(disk, block + i, data[i]))
+        {
+            i++;
+            continue;
+        }
+
+        size_t end = i + 1;
+        while (end < count && !disk_read_buffered(disk, block + end, data[end]))
+            end++;
+        if (disk_transfer(disk, block + i, end - i, data + i, false) == DISK_FAILURE)
+            return DISK_FAILURE;
+        i = end + 1;
     }
-    disk->writes++;
-    return nwrite;
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Start prefetching blocks into the readahead buffer so later reads of them
+ * complete from memory (see readahead_prefetch).  Blocks need not be
+ * contiguous.  Does nothing on a disk without a readahead buffer, or on a
+ * backend with a zero-copy pointer, whose reads are memory copies anyway.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to prefetch.
+ * @param       count       Number of block numbers.
+ *
+ * @return      Number of prefetches started (DISK_FAILURE if a block is
+ *              out of range).
+ **/
+ssize_t disk_prefetch(Disk *disk, const size_t *blocks, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!disk_sanity_check(disk, blocks[i], ""))
+        {
+            error("disk_prefetch: disk_sanity_check failed");
+            return DISK_FAILURE;
+        }
+    }
+
+    if (!disk->readahead || disk->ops->ptr || count == 0)
+        return 0;
+    return readahead_prefetch(disk->readahead, disk, blocks, count);
 }
 
 /* Internal Functions */
 
+/**
+ * Transfer count contiguous blocks with the backend (its vectored operation
+ * when it has one) and account the operation.  Writes invalidate the
+ * readahead buffer again once they complete, since a prefetch issued while
+ * they were in progress may have read the old contents.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number (already sanity checked).
+ * @param       count       Number of blocks.
+ * @param       data        Array of count data buffers.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t disk_transfer(Disk *disk, size_t block, size_t count, char **data, bool write)
+{
+    uint64_t start = disk_clock();
+    ssize_t (*vector)(Disk *, size_t, size_t, char **) = write ? disk->ops->writev : disk->ops->readv;
+    bool failed = false;
+    if (vector && count > 1)
+        failed = vector(disk, block, count, data) != (ssize_t)(count * BLOCK_SIZE);
+    else
+    {
+        /* Backend has no vectored operation: transfer block by block */
+        for (size_t i = 0; i < count && !failed; i++)
+        {
+            ssize_t nbytes = write ? disk->ops->write(disk, block + i, data[i])
+                                   : disk->ops->read(disk, block + i, data[i]);
+            failed = nbytes != (ssize_t)BLOCK_SIZE;
+        }
+    }
+
+    if (write && disk->readahead)
+        readahead_invalidate(disk->readahead, block, count);
+    if (failed)
+        return DISK_FAILURE;
+
+    disk_account(disk, block, count, write, start);
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Tear down everything disk_open_with attached: complete outstanding
+ * asynchronous requests, write back and release the buffer cache and then
+ * the write queue, then let the backend flush and release the image and
+ * finish the trace.
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void disk_shutdown(Disk *disk)
+{
+    if (disk_drain(disk) == DISK_FAILURE)
+        error("failed to drain asynchronous requests");
+    if (disk->cache)
+    {
+        if (cache_flush(disk->cache, disk) == DISK_FAILURE)
+            error("failed to write back buffer cache");
+        cache_destroy(disk->cache);
+    }
+    if (disk->elevator)
+    {
+        if (elevator_flush(disk->elevator, disk) == DISK_FAILURE)
+            error("failed to write back write queue");
+        elevator_destroy(disk->elevator);
+    }
+    readahead_destroy(disk->readahead);
+    commit_destroy(disk->commit);
+    free(disk->requests);
+    free(disk->free_slots);
+    free(disk->done_slots);
+    disk_pool_free(disk);
+
+    disk->ops->close(disk);
+    if (trace_close(disk->trace) == DISK_FAILURE)
+        error("failed to finish block I/O trace");
+}
+
+/**
+ * Serve a read from memory: the write queue first, as it holds the newest
+ * copy of a block, then the readahead buffer.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to read (already sanity checked).
+ * @param       data        Data buffer.
+ *
+ * @return      Whether block was served without reaching the backend.
+ **/
+bool disk_read_buffered(Disk *disk, size_t block, char *data)
+{
+    if (disk->elevator && elevator_read(disk->elevator, block, data))
+        return true;
+
+    if (disk->readahead && readahead_read(disk->readahead, disk, block, data))
+    {
+        __atomic_fetch_add(&disk->readahead_hits, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    return false;
+}
+
 /**
  * Perform sanity check before read or write operation:
  *
@@ -204,9 +1051,9 @@ bool disk_sanity_check(Disk *disk, size_t block, const char *data)
         error("disk should not be NULL");
         return false;
     }
-    if (disk->fd == -1)
+    if (!disk->ops)
     {
-        error("invalid fd: %d", disk->fd);
+        error("disk has no backend");
         return false;
     }
     // disk block shuold be sufficient
@@ -224,4 +1071,227 @@ bool disk_sanity_check(Disk *disk, size_t block, const char *data)
     return true;
 }
 
+/**
+ * Transfer a list of (block, buffer) pairs, coalescing runs of consecutive
+ * block numbers into single vectored submissions.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       ios         Array of scatter-gather entries.
+ * @param       count       Number of entries.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t disk_list(Disk *disk, const DiskIO *ios, size_t count, bool write)
+{
+    char *data[IOV_MAX];
+
+    if (!ios)
+    {
+        error("ios should not be NULL");
+        return DISK_FAILURE;
+    }
+
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t n = 0;
+        do
+        {
+            data[n] = ios[i + n].data;
+            n++;
+        } while (i + n < count && n < IOV_MAX && ios[i + n].block == ios[i].block + n);
+
+        ssize_t nbytes = write ? disk_writev(disk, ios[i].block, n, data)
+                               : disk_readv(disk, ios[i].block, n, data);
+        if (nbytes == DISK_FAILURE)
+            return DISK_FAILURE;
+        i += n;
+    }
+
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Allocate the asynchronous request slots and their free/done stacks.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       queue_depth Number of request slots.
+ *
+ * @return      Whether or not allocation succeeded.
+ **/
+bool disk_queue_init(Disk *disk, size_t queue_depth)
+{
+    disk->requests = calloc(queue_depth, sizeof(DiskRequest));
+    disk->free_slots = calloc(queue_depth, sizeof(size_t));
+    disk->done_slots = calloc(queue_depth, sizeof(size_t));
+    if (!disk->requests || !disk->free_slots || !disk->done_slots)
+    {
+        error("failed on calloc for %zu request slots", queue_depth);
+        return false;
+    }
+
+    disk->queue_depth = queue_depth;
+    for (size_t i = 0; i < queue_depth; i++)
+        disk->free_slots[i] = queue_depth - 1 - i;
+    disk->nfree = queue_depth;
+    return true;
+}
+
+/**
+ * Allocate the aligned buffer pool as one contiguous region.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       buffers     Number of BLOCK_SIZE buffers.
+ *
+ * @return      Whether or not allocation succeeded.
+ **/
+bool disk_pool_init(Disk *disk, size_t buffers)
+{
+    if (posix_memalign((void **)&disk->pool, DISK_ALIGNMENT, buffers * BLOCK_SIZE) != 0)
+    {
+        error("failed on posix_memalign for %zu pool buffers", buffers);
+        disk->pool = NULL;
+        return false;
+    }
+
+    disk->pool_free = calloc(buffers, sizeof(char *));
+    if (!disk->pool_free)
+    {
+        error("failed on calloc for pool free list");
+        free(disk->pool);
+        disk->pool = NULL;
+        return false;
+    }
+
+    for (size_t i = 0; i < buffers; i++)
+        disk->pool_free[i] = disk->pool + (buffers - 1 - i) * BLOCK_SIZE;
+    disk->pool_nfree = buffers;
+    disk->pool_buffers = buffers;
+    pthread_mutex_init(&disk->pool_lock, NULL);
+    return true;
+}
+
+/**
+ * Release the aligned buffer pool, if any.
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void disk_pool_free(Disk *disk)
+{
+    if (!disk->pool)
+        return;
+
+    if (disk->pool_nfree != disk->pool_buffers)
+        error("%zu pool buffers still in use", disk->pool_buffers - disk->pool_nfree);
+    pthread_mutex_destroy(&disk->pool_lock);
+    free(disk->pool_free);
+    free(disk->pool);
+    disk->pool = NULL;
+}
+
+/**
+ * Queue an asynchronous request by doing the following:
+ *
+ *  1. Performing sanity check.
+ *
+ *  2. Reaping completions until a request slot is free.
+ *
+ *  3. Preparing an io_uring entry, or performing the transfer synchronously
+ *  and recording the result for the next disk_poll.  Requests on the ring
+ *  are accounted, traced and (for writes) invalidated in the readahead
+ *  buffer when disk_poll reaps them, as disk_read and disk_write do for the
+ *  synchronous ones.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ * @param       callback    Completion callback.
+ * @param       arg         Argument passed to callback.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_queue(Disk *disk, size_t block, char *data, DiskCallback callback, void *arg, bool write)
+{
+    if (!disk_sanity_check(disk, block, data))
+    {
+        error("disk_queue: disk_sanity_check failed");
+        return DISK_FAILURE;
+    }
+
+    while (disk->nfree == 0)
+    {
+        if (disk_poll(disk, true) == DISK_FAILURE)
+            return DISK_FAILURE;
+    }
+
+    size_t slot = disk->free_slots[--disk->nfree];
+    DiskRequest *request = &disk->requests[slot];
+    request->write = write;
+    request->block = block;
+    request->data = data;
+    request->callback = callback;
+    request->arg = arg;
+    request->start = disk_clock();
+
+    request->bounce = NULL;
+
+    /* io_uring would bypass the buffer cache and write queue, so such disks
+     * stay synchronous */
+    if (disk->ring && !disk->cache && !disk->elevator)
+    {
+        char *buffer = data;
+        if (disk->direct && !DISK_ALIGNED(data))
+        {
+            buffer = request->bounce = disk_buffer_get(disk);
+            if (!buffer)
+            {
+                disk->free_slots[disk->nfree++] = slot;
+                return DISK_FAILURE;
+            }
+            if (write)
+                memcpy(buffer, data, BLOCK_SIZE);
+        }
+        if (write && disk->readahead)
+            readahead_invalidate(disk->readahead, block, 1);
+
+        off_t offset = (off_t)block * BLOCK_SIZE;
+        if (!ring_prep(disk->ring, write, disk->fd, buffer, BLOCK_SIZE, offset, slot))
+        {
+            /* Ring is at least queue_depth deep, so this cannot happen */
+            error("disk_queue: io_uring submission queue full");
+            disk_buffer_put(disk, request->bounce);
+            disk->free_slots[disk->nfree++] = slot;
+            return DISK_FAILURE;
+        }
+        return 0;
+    }
+
+    request->result = write ? disk_write(disk, block, data) : disk_read(disk, block, data);
+    disk->done_slots[disk->ndone++] = slot;
+    return 0;
+}
+
+/**
+ * Release a request slot and invoke its completion callback.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       slot        Request slot that completed.
+ * @param       result      Result of request (BLOCK_SIZE or DISK_FAILURE).
+ **/
+void disk_complete(Disk *disk, size_t slot, ssize_t result)
+{
+    DiskRequest request = disk->requests[slot];
+    if (request.bounce)
+    {
+        if (!request.write && result == BLOCK_SIZE)
+            memcpy(request.data, request.bounce, BLOCK_SIZE);
+        disk_buffer_put(disk, request.bounce);
+    }
+    disk->free_slots[disk->nfree++] = slot;
+    if (request.callback)
+        request.callback(disk, request.block, result, request.arg);
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,511 @@
+/* disk_checked.c: SimpleFS disk backend that checksums another backend's blocks */
+
+#include "sfs/crc32c.h"
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Internal Constants */
+
+#define DISK_CHECKED_MAGIC   (0x53465343) /* "SFSC" */
+#define DISK_CHECKED_VERSION (1)
+#define DISK_CHECKED_ENTRIES (BLOCK_SIZE / sizeof(uint32_t)) /* Checksums per table block */
+#define DISK_CHECKED_RUN     (64) /* Blocks read at once by rebuilds and scrubs */
+#define DISK_CHECKED_RETRIES (2)  /* Re-reads before a mismatch is reported */
+
+/* Internal Structures */
+
+typedef struct DiskCheckedHeader DiskCheckedHeader;
+
+struct DiskCheckedHeader
+{
+    uint32_t magic;   /* DISK_CHECKED_MAGIC */
+    uint16_t version; /* DISK_CHECKED_VERSION */
+    uint16_t clean;   /* Whether the table matches the data (closed cleanly) */
+    uint64_t blocks;  /* Number of data blocks covered */
+};
+
+typedef struct DiskChecked DiskChecked;
+
+struct DiskChecked
+{
+    Disk *inner;          /* Wrapped disk: data blocks, header, table */
+    int mode;             /* DISK_CHECKSUM_READ or DISK_CHECKSUM_SCRUB */
+    char *header;         /* Header block buffer */
+    uint32_t *table;      /* Checksum per data block */
+    size_t table_blocks;  /* Blocks holding the table */
+    bool *dirty;          /* Table blocks changed since written (atomic) */
+    uint32_t zero;        /* Checksum of a discarded (zeroed) block */
+    pthread_mutex_t lock; /* Serializes table write-back */
+};
+
+/* Internal Prototyes */
+
+int disk_checked_open(Disk *disk, const char *path, const DiskOptions *options);
+ssize_t disk_checked_read(Disk *disk, size_t block, char *data);
+ssize_t disk_checked_write(Disk *disk, size_t block, char *data);
+ssize_t disk_checked_readv(Disk *disk, size_t block, size_t count, char **data);
+ssize_t disk_checked_writev(Disk *disk, size_t block, size_t count, char **data);
+int disk_checked_flush(Disk *disk);
+int disk_checked_discard(Disk *disk, size_t block, size_t count);
+void disk_checked_close(Disk *disk);
+ssize_t disk_checked_transfer(Disk *disk, size_t block, size_t count, char **data, bool write);
+bool disk_checked_verify(Disk *disk, size_t block, char *data);
+void disk_checked_set(DiskChecked *checked, size_t block, uint32_t crc);
+bool disk_checked_load(DiskChecked *checked, size_t blocks);
+bool disk_checked_rebuild(DiskChecked *checked, size_t blocks);
+int disk_checked_sync(DiskChecked *checked, size_t blocks);
+int disk_checked_mark(DiskChecked *checked, size_t blocks, bool clean);
+void disk_checked_free(DiskChecked *checked);
+
+/* Backends */
+
+const DiskOps disk_checked_ops = {
+    .name = "checked",
+    .open = disk_checked_open,
+    .read = disk_checked_read,
+    .write = disk_checked_write,
+    .readv = disk_checked_readv,
+    .writev = disk_checked_writev,
+    .flush = disk_checked_flush,
+    .discard = disk_checked_discard,
+    .close = disk_checked_close,
+};
+
+/* External Functions */
+
+/**
+ * Verify count blocks starting at block against their checksums by doing
+ * the following:
+ *
+ *  1. Reading them straight from the image, DISK_CHECKED_RUN blocks at a
+ *  time (the buffer cache, readahead buffer and write queue are bypassed:
+ *  queued writes have not reached the image or the table yet).
+ *
+ *  2. Checking each one like a verified read, reporting every mismatch.
+ *
+ * Works in any checksum mode, and may run in a background thread while
+ * other threads use the disk.
+ *
+ * @param       disk        Pointer to Disk structure (opened with checksums).
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ *
+ * @return      Number of blocks that failed verification (DISK_FAILURE if
+ *              the disk has no checksums, the range is invalid or a read
+ *              failed).
+ **/
+ssize_t disk_scrub(Disk *disk, size_t block, size_t count)
+{
+    if (!disk || disk->ops != &disk_checked_ops)
+    {
+        error("disk_scrub: disk has no checksums");
+        return DISK_FAILURE;
+    }
+    if (block >= disk->blocks || count > disk->blocks - block)
+    {
+        error("disk_scrub: blocks %zu..%zu out of range", block, block + count);
+        return DISK_FAILURE;
+    }
+
+    DiskChecked *checked = disk->private;
+    char *buffer;
+    if (posix_memalign((void **)&buffer, DISK_ALIGNMENT, DISK_CHECKED_RUN * BLOCK_SIZE) != 0)
+    {
+        error("disk_scrub: failed to allocate buffer");
+        return DISK_FAILURE;
+    }
+    char *data[DISK_CHECKED_RUN];
+    for (size_t i = 0; i < DISK_CHECKED_RUN; i++)
+        data[i] = buffer + i * BLOCK_SIZE;
+
+    ssize_t errors = 0;
+    for (size_t done = 0; done < count; done += DISK_CHECKED_RUN)
+    {
+        size_t run = min(count - done, (size_t)DISK_CHECKED_RUN);
+        if (disk_transfer(checked->inner, block + done, run, data, false) == DISK_FAILURE)
+        {
+            errors = DISK_FAILURE;
+            break;
+        }
+        for (size_t i = 0; i < run; i++)
+        {
+            if (!disk_checked_verify(disk, block + done + i, data[i]))
+                errors++;
+        }
+    }
+
+    free(buffer);
+    return errors;
+}
+
+/* Backend Functions */
+
+/**
+ * Attach the checksumming backend by doing the following:
+ *
+ *  1. Opening the wrapped disk at path with the backend (and shape) the
+ *  options select, one header block and the checksum table larger than
+ *  the data blocks.
+ *
+ *  2. Loading the table if the header says the image was closed cleanly
+ *  with checksums for this many blocks, otherwise rebuilding it by reading
+ *  every data block.
+ *
+ *  3. Marking the header not clean until disk_checked_close, so a crash
+ *  before then triggers a rebuild.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image.
+ * @param       options     Disk options (options->checksums is required).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_checked_open(Disk *disk, const char *path, const DiskOptions *options)
+{
+    if (!options || (options->checksums != DISK_CHECKSUM_READ && options->checksums != DISK_CHECKSUM_SCRUB))
+    {
+        error("disk_checked_ops needs DiskOptions.checksums");
+        return DISK_FAILURE;
+    }
+
+    DiskChecked *checked = calloc(1, sizeof(DiskChecked));
+    if (!checked)
+    {
+        error("failed on calloc for DiskChecked");
+        return DISK_FAILURE;
+    }
+    checked->mode = options->checksums;
+    checked->table_blocks = (disk->blocks + DISK_CHECKED_ENTRIES - 1) / DISK_CHECKED_ENTRIES;
+    pthread_mutex_init(&checked->lock, NULL);
+
+    char zero[BLOCK_SIZE] = {0};
+    checked->zero = crc32c(0, zero, BLOCK_SIZE);
+
+    checked->dirty = calloc(checked->table_blocks, sizeof(bool));
+    if (!checked->dirty ||
+        posix_memalign((void **)&checked->header, DISK_ALIGNMENT, BLOCK_SIZE) != 0 ||
+        posix_memalign((void **)&checked->table, DISK_ALIGNMENT, max(checked->table_blocks, (size_t)1) * BLOCK_SIZE) != 0)
+    {
+        error("failed to allocate checksum table");
+        disk_checked_free(checked);
+        return DISK_FAILURE;
+    }
+
+    DiskOptions inner = {
+        .mode = options->mode,
+        .ops = options->ops == &disk_checked_ops ? NULL : options->ops,
+        .direct = options->direct,
+        .pool_buffers = options->pool_buffers,
+        .huge_pages = options->huge_pages,
+        .shape = options->shape,
+        .stripe_blocks = options->stripe_blocks,
+        .mirror = options->mirror,
+    };
+    checked->inner = disk_open_with(path, disk->blocks + 1 + checked->table_blocks, &inner);
+    if (!checked->inner)
+    {
+        disk_checked_free(checked);
+        return DISK_FAILURE;
+    }
+
+    if (!disk_checked_load(checked, disk->blocks))
+    {
+        info("%s: rebuilding block checksums", path);
+        if (!disk_checked_rebuild(checked, disk->blocks))
+        {
+            disk_release(checked->inner);
+            disk_checked_free(checked);
+            return DISK_FAILURE;
+        }
+    }
+
+    if (disk_checked_mark(checked, disk->blocks, false) == DISK_FAILURE)
+    {
+        disk_release(checked->inner);
+        disk_checked_free(checked);
+        return DISK_FAILURE;
+    }
+
+    disk->private = checked;
+    return 0;
+}
+
+/**
+ * Read one block, verifying it in DISK_CHECKSUM_READ mode.
+ **/
+ssize_t disk_checked_read(Disk *disk, size_t block, char *data)
+{
+    return disk_checked_transfer(disk, block, 1, &data, false);
+}
+
+/**
+ * Write one block and record its checksum.
+ **/
+ssize_t disk_checked_write(Disk *disk, size_t block, char *data)
+{
+    return disk_checked_transfer(disk, block, 1, &data, true);
+}
+
+/**
+ * Read contiguous blocks, verifying them in DISK_CHECKSUM_READ mode.
+ **/
+ssize_t disk_checked_readv(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_checked_transfer(disk, block, count, data, false);
+}
+
+/**
+ * Write contiguous blocks and record their checksums.
+ **/
+ssize_t disk_checked_writev(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_checked_transfer(disk, block, count, data, true);
+}
+
+/**
+ * Write changed table blocks, then flush the wrapped disk (data and table
+ * reach stable storage together).
+ **/
+int disk_checked_flush(Disk *disk)
+{
+    DiskChecked *checked = disk->private;
+    if (disk_checked_sync(checked, disk->blocks) == DISK_FAILURE)
+        return DISK_FAILURE;
+    return disk_flush(checked->inner);
+}
+
+/**
+ * Discard blocks of the wrapped disk; they read back as zeros, so their
+ * checksums become that of a zero block.
+ **/
+int disk_checked_discard(Disk *disk, size_t block, size_t count)
+{
+    DiskChecked *checked = disk->private;
+    if (disk_discard(checked->inner, block, count) == DISK_FAILURE)
+        return DISK_FAILURE;
+
+    for (size_t i = 0; i < count; i++)
+        disk_checked_set(checked, block + i, checked->zero);
+    return 0;
+}
+
+/**
+ * Write back the table, mark the header clean and close the wrapped disk
+ * (without reporting its statistics).
+ **/
+void disk_checked_close(Disk *disk)
+{
+    DiskChecked *checked = disk->private;
+    if (!checked)
+        return;
+
+    if (disk_checked_sync(checked, disk->blocks) == DISK_FAILURE ||
+        disk_flush(checked->inner) == DISK_FAILURE ||
+        disk_checked_mark(checked, disk->blocks, true) == DISK_FAILURE)
+        error("failed to save block checksums: they are rebuilt at next open");
+
+    disk_release(checked->inner);
+    disk_checked_free(checked);
+    disk->private = NULL;
+}
+
+/* Internal Functions */
+
+/**
+ * Transfer count contiguous blocks with the wrapped disk, then record the
+ * checksums of written blocks or verify read ones (DISK_CHECKSUM_READ).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ * @param       data        Array of count data buffers.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure, with
+ *              errno EIO if a block failed verification).
+ **/
+ssize_t disk_checked_transfer(Disk *disk, size_t block, size_t count, char **data, bool write)
+{
+    DiskChecked *checked = disk->private;
+    ssize_t result = disk_transfer(checked->inner, block, count, data, write);
+    if (result == DISK_FAILURE)
+        return DISK_FAILURE;
+
+    if (write)
+    {
+        for (size_t i = 0; i < count; i++)
+            disk_checked_set(checked, block + i, crc32c(0, data[i], BLOCK_SIZE));
+    }
+    else if (checked->mode == DISK_CHECKSUM_READ)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!disk_checked_verify(disk, block + i, data[i]))
+            {
+                errno = EIO;
+                return DISK_FAILURE;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Check a block read from the wrapped disk against its checksum.  A
+ * mismatch is re-read a few times first: a concurrent write of the block
+ * may have landed between the data and the table update.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number.
+ * @param       data        Block contents (re-read in place on mismatch).
+ *
+ * @return      Whether the block matches (mismatches are logged and
+ *              counted).
+ **/
+bool disk_checked_verify(Disk *disk, size_t block, char *data)
+{
+    DiskChecked *checked = disk->private;
+    for (int attempt = 0; ; attempt++)
+    {
+        uint32_t expected = __atomic_load_n(&checked->table[block], __ATOMIC_ACQUIRE);
+        if (crc32c(0, data, BLOCK_SIZE) == expected)
+            return true;
+        if (attempt == DISK_CHECKED_RETRIES ||
+            disk_transfer(checked->inner, block, 1, &data, false) == DISK_FAILURE)
+            break;
+    }
+
+    error("checksum mismatch at block %zu", block);
+    __atomic_fetch_add(&disk->checksum_errors, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+/**
+ * Record the checksum of a block and mark its table block for write-back.
+ **/
+void disk_checked_set(DiskChecked *checked, size_t block, uint32_t crc)
+{
+    __atomic_store_n(&checked->table[block], crc, __ATOMIC_RELEASE);
+    __atomic_store_n(&checked->dirty[block / DISK_CHECKED_ENTRIES], true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Load the table from the wrapped disk if its header is clean and covers
+ * blocks data blocks.
+ *
+ * @return      Whether the table was loaded.
+ **/
+bool disk_checked_load(DiskChecked *checked, size_t blocks)
+{
+    DiskCheckedHeader *header = (DiskCheckedHeader *)checked->header;
+    if (disk_transfer(checked->inner, blocks, 1, &checked->header, false) == DISK_FAILURE ||
+        header->magic != DISK_CHECKED_MAGIC || header->version != DISK_CHECKED_VERSION ||
+        !header->clean || header->blocks != blocks)
+        return false;
+
+    for (size_t i = 0; i < checked->table_blocks; i++)
+    {
+        char *data = (char *)checked->table + i * BLOCK_SIZE;
+        if (disk_transfer(checked->inner, blocks + 1 + i, 1, &data, false) == DISK_FAILURE)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Compute the checksum of every data block, marking the whole table for
+ * write-back.
+ *
+ * @return      Whether every block could be read.
+ **/
+bool disk_checked_rebuild(DiskChecked *checked, size_t blocks)
+{
+    char *buffer;
+    if (posix_memalign((void **)&buffer, DISK_ALIGNMENT, DISK_CHECKED_RUN * BLOCK_SIZE) != 0)
+    {
+        error("failed to allocate rebuild buffer");
+        return false;
+    }
+    char *data[DISK_CHECKED_RUN];
+    for (size_t i = 0; i < DISK_CHECKED_RUN; i++)
+        data[i] = buffer + i * BLOCK_SIZE;
+
+    memset(checked->table, 0, checked->table_blocks * BLOCK_SIZE);
+    for (size_t block = 0; block < blocks; block += DISK_CHECKED_RUN)
+    {
+        size_t run = min(blocks - block, (size_t)DISK_CHECKED_RUN);
+        if (disk_transfer(checked->inner, block, run, data, false) == DISK_FAILURE)
+        {
+            free(buffer);
+            return false;
+        }
+        for (size_t i = 0; i < run; i++)
+            disk_checked_set(checked, block + i, crc32c(0, data[i], BLOCK_SIZE));
+    }
+
+    free(buffer);
+    return true;
+}
+
+/**
+ * Write every table block changed since it was last written.
+ *
+ * @return      0 on success, DISK_FAILURE on failure (the block stays
+ *              marked).
+ **/
+int disk_checked_sync(DiskChecked *checked, size_t blocks)
+{
+    int result = 0;
+    pthread_mutex_lock(&checked->lock);
+    for (size_t i = 0; i < checked->table_blocks; i++)
+    {
+        if (!__atomic_exchange_n(&checked->dirty[i], false, __ATOMIC_ACQ_REL))
+            continue;
+
+        char *data = (char *)checked->table + i * BLOCK_SIZE;
+        if (disk_transfer(checked->inner, blocks + 1 + i, 1, &data, true) == DISK_FAILURE)
+        {
+            __atomic_store_n(&checked->dirty[i], true, __ATOMIC_RELEASE);
+            result = DISK_FAILURE;
+        }
+    }
+    pthread_mutex_unlock(&checked->lock);
+    return result;
+}
+
+/**
+ * Write the header with the given clean flag and flush it.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_checked_mark(DiskChecked *checked, size_t blocks, bool clean)
+{
+    memset(checked->header, 0, BLOCK_SIZE);
+    DiskCheckedHeader *header = (DiskCheckedHeader *)checked->header;
+    header->magic = DISK_CHECKED_MAGIC;
+    header->version = DISK_CHECKED_VERSION;
+    header->clean = clean;
+    header->blocks = blocks;
+
+    if (disk_transfer(checked->inner, blocks, 1, &checked->header, true) == DISK_FAILURE)
+        return DISK_FAILURE;
+    return disk_flush(checked->inner);
+}
+
+/**
+ * Release the checksumming state (not the wrapped disk).
+ **/
+void disk_checked_free(DiskChecked *checked)
+{
+    pthread_mutex_destroy(&checked->lock);
+    free(checked->table);
+    free(checked->header);
+    free(checked->dirty);
+    free(checked);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,754 @@
+/* disk_compressed.c: SimpleFS disk backend that compresses blocks into another backend */
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+#include "sfs/lz.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Internal Constants */
+
+#define DISK_COMPRESSED_MAGIC   (0x5346535a) /* "SFSZ" */
+#define DISK_COMPRESSED_VERSION (1)
+#define DISK_COMPRESSED_UNIT    (256) /* Allocation unit of compressed blocks (bytes) */
+#define DISK_COMPRESSED_UNITS   (BLOCK_SIZE / DISK_COMPRESSED_UNIT) /* Units per block */
+#define DISK_COMPRESSED_LIMIT   (BLOCK_SIZE - DISK_COMPRESSED_UNIT) /* Largest compressed block kept */
+#define DISK_COMPRESSED_SPARE   (64) /* Data area blocks beyond one per logical block */
+#define DISK_COMPRESSED_NONE    (SIZE_MAX) /* No open segment (or no free block) */
+
+#define DISK_MAP_RAW      (1 << 0) /* Stored uncompressed in a block of its own */
+#define DISK_MAP_METADATA (1 << 1) /* Never compressed (disk_mark_metadata) */
+
+/* Internal Structures */
+
+typedef struct DiskCompressedHeader DiskCompressedHeader;
+
+struct DiskCompressedHeader
+{
+    uint32_t magic;   /* DISK_COMPRESSED_MAGIC */
+    uint16_t version; /* DISK_COMPRESSED_VERSION */
+    uint16_t unit;    /* DISK_COMPRESSED_UNIT */
+    uint64_t blocks;  /* Number of logical blocks */
+};
+
+typedef struct DiskMapEntry DiskMapEntry;
+
+struct DiskMapEntry
+{
+    uint32_t unit;    /* First unit in the data area */
+    uint16_t length;  /* Stored bytes (0 when unmapped: reads as zeros) */
+    uint8_t flags;    /* DISK_MAP_* */
+    uint8_t reserved; /* Zero */
+};
+
+#define DISK_MAP_ENTRIES (BLOCK_SIZE / sizeof(DiskMapEntry)) /* Entries per map block */
+
+typedef struct DiskCompressed DiskCompressed;
+
+struct DiskCompressed
+{
+    Disk *inner;           /* Wrapped disk: header, map, data area */
+    size_t map_blocks;     /* Blocks holding the map */
+    size_t physical;       /* Blocks in the data area */
+    DiskMapEntry *map;     /* Entry per logical block */
+    bool *dirty;           /* Map blocks changed since written */
+    uint8_t *live;         /* Units in use per data area block */
+    bool *held;            /* Emptied blocks the map on disk may still use */
+    size_t *pending;       /* Stack of held blocks */
+    size_t npending;       /* Number of held blocks */
+    uint64_t released;     /* Held blocks released so far (sequence of pending[0]) */
+    size_t cursor;         /* Next data area block to try allocating */
+    char *segment;         /* Block compressed blocks are packed into */
+    size_t open;           /* Data area block of segment (or DISK_COMPRESSED_NONE) */
+    size_t used;           /* Units used in segment */
+    bool segment_dirty;    /* Whether segment changed since written */
+    char *header;          /* Header block buffer */
+    pthread_rwlock_t lock; /* Write-locked to change the map or segment */
+};
+
+/* Internal Prototyes */
+
+int disk_compressed_open(Disk *disk, const char *path, const DiskOptions *options);
+ssize_t disk_compressed_read(Disk *disk, size_t block, char *data);
+ssize_t disk_compressed_write(Disk *disk, size_t block, char *data);
+ssize_t disk_compressed_readv(Disk *disk, size_t block, size_t count, char **data);
+ssize_t disk_compressed_writev(Disk *disk, size_t block, size_t count, char **data);
+int disk_compressed_flush(Disk *disk);
+int disk_compressed_discard(Disk *disk, size_t block, size_t count);
+void disk_compressed_close(Disk *disk);
+ssize_t disk_compressed_transfer(Disk *disk, size_t block, size_t count, char **data, bool write);
+bool disk_compressed_load(DiskCompressed *compressed, size_t block, char *data, char *buffer, size_t *cached);
+bool disk_compressed_store(Disk *disk, size_t block, char *data);
+bool disk_compressed_store_raw(DiskCompressed *compressed, size_t block, char *data);
+void disk_compressed_release(DiskCompressed *compressed, size_t block);
+size_t disk_compressed_allocate(DiskCompressed *compressed);
+int disk_compressed_sync(DiskCompressed *compressed);
+bool disk_compressed_close_segment(DiskCompressed *compressed);
+bool disk_compressed_read_map(DiskCompressed *compressed, Disk *disk, const char *path);
+ssize_t disk_compressed_io(DiskCompressed *compressed, size_t physical, char *data, bool write);
+void disk_compressed_free(DiskCompressed *compressed);
+
+/* Backends */
+
+const DiskOps disk_compressed_ops = {
+    .name = "compressed",
+    .open = disk_compressed_open,
+    .read = disk_compressed_read,
+    .write = disk_compressed_write,
+    .readv = disk_compressed_readv,
+    .writev = disk_compressed_writev,
+    .flush = disk_compressed_flush,
+    .discard = disk_compressed_discard,
+    .close = disk_compressed_close,
+};
+
+/* External Functions */
+
+/**
+ * Declare whether count blocks starting at block hold metadata.  Metadata
+ * blocks are stored uncompressed, each in a block of its own that later
+ * writes overwrite in place, so reading them costs one transfer and no
+ * decompression.  The declaration is saved with the map and applies from
+ * the next write of each block.  Does nothing on a disk without
+ * compression.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ * @param       metadata    Whether the blocks hold metadata.
+ **/
+void disk_mark_metadata(Disk *disk, size_t block, size_t count, bool metadata)
+{
+    if (!disk || disk->ops != &disk_compressed_ops || count == 0)
+        return;
+    if (block >= disk->blocks || count > disk->blocks - block)
+    {
+        error("disk_mark_metadata: blocks %zu..%zu out of range", block, block + count);
+        return;
+    }
+
+    DiskCompressed *compressed = disk->private;
+    pthread_rwlock_wrlock(&compressed->lock);
+    for (size_t i = block; i < block + count; i++)
+    {
+        uint8_t flags = metadata ? compressed->map[i].flags | DISK_MAP_METADATA
+                                 : compressed->map[i].flags & ~DISK_MAP_METADATA;
+        if (flags == compressed->map[i].flags)
+            continue;
+        compressed->map[i].flags = flags;
+        compressed->dirty[i / DISK_MAP_ENTRIES] = true;
+    }
+    pthread_rwlock_unlock(&compressed->lock);
+}
+
+/* Backend Functions */
+
+/**
+ * Attach the compressing backend by doing the following:
+ *
+ *  1. Opening the wrapped disk at path with the backend (checksums, shape)
+ *  the options select, large enough for a header block, the block map and
+ *  one block per logical block plus DISK_COMPRESSED_SPARE.
+ *
+ *  2. Loading the map, or starting an empty one if the image is blank.
+ *  Anything else (an uncompressed image, say) is refused rather than
+ *  overwritten.
+ *
+ *  3. Counting the units in use in each data area block.
+ *
+ * A data area block holds one raw block or several compressed ones, so
+ * the data area needs about as many blocks as there are logical blocks in
+ * use at worst, and the image file stays sparse beyond that.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image.
+ * @param       options     Disk options (options->compress is required).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_compressed_open(Disk *disk, const char *path, const DiskOptions *options)
+{
+    if (!options || !options->compress)
+    {
+        error("disk_compressed_ops needs DiskOptions.compress");
+        return DISK_FAILURE;
+    }
+
+    DiskCompressed *compressed = calloc(1, sizeof(DiskCompressed));
+    if (!compressed)
+    {
+        error("failed on calloc for DiskCompressed");
+        return DISK_FAILURE;
+    }
+    compressed->map_blocks = (disk->blocks + DISK_MAP_ENTRIES - 1) / DISK_MAP_ENTRIES;
+    compressed->physical = disk->blocks + DISK_COMPRESSED_SPARE;
+    compressed->open = DISK_COMPRESSED_NONE;
+    pthread_rwlock_init(&compressed->lock, NULL);
+
+    compressed->dirty = calloc(compressed->map_blocks, sizeof(bool));
+    compressed->live = calloc(compressed->physical, sizeof(uint8_t));
+    compressed->held = calloc(compressed->physical, sizeof(bool));
+    compressed->pending = calloc(compressed->physical, sizeof(size_t));
+    if (!compressed->dirty || !compressed->live || !compressed->held || !compressed->pending ||
+        posix_memalign((void **)&compressed->map, DISK_ALIGNMENT, max(compressed->map_blocks, (size_t)1) * BLOCK_SIZE) != 0 ||
+        posix_memalign((void **)&compressed->segment, DISK_ALIGNMENT, BLOCK_SIZE) != 0 ||
+        posix_memalign((void **)&compressed->header, DISK_ALIGNMENT, BLOCK_SIZE) != 0)
+    {
+        error("failed to allocate block map");
+        disk_compressed_free(compressed);
+        return DISK_FAILURE;
+    }
+
+    DiskOptions inner = {
+        .mode = options->mode,
+        .ops = options->ops == &disk_compressed_ops ? NULL : options->ops,
+        .direct = options->direct,
+        .pool_buffers = options->pool_buffers,
+        .huge_pages = options->huge_pages,
+        .shape = options->shape,
+        .checksums = options->checksums,
+        .stripe_blocks = options->stripe_blocks,
+        .mirror = options->mirror,
+    };
+    compressed->inner = disk_open_with(path, 1 + compressed->map_blocks + compressed->physical, &inner);
+    if (!compressed->inner)
+    {
+        disk_compressed_free(compressed);
+        return DISK_FAILURE;
+    }
+
+    if (!disk_compressed_read_map(compressed, disk, path))
+    {
+        disk_release(compressed->inner);
+        disk_compressed_free(compressed);
+        return DISK_FAILURE;
+    }
+
+    disk->private = compressed;
+    return 0;
+}
+
+/**
+ * Read and decompress one block.
+ **/
+ssize_t disk_compressed_read(Disk *disk, size_t block, char *data)
+{
+    return disk_compressed_transfer(disk, block, 1, &data, false);
+}
+
+/**
+ * Compress and store one block.
+ **/
+ssize_t disk_compressed_write(Disk *disk, size_t block, char *data)
+{
+    return disk_compressed_transfer(disk, block, 1, &data, true);
+}
+
+/**
+ * Read and decompress contiguous blocks (blocks packed together are read
+ * once).
+ **/
+ssize_t disk_compressed_readv(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_compressed_transfer(disk, block, count, data, false);
+}
+
+/**
+ * Compress and store contiguous blocks.
+ **/
+ssize_t disk_compressed_writev(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_compressed_transfer(disk, block, count, data, true);
+}
+
+/**
+ * Make completed writes durable by doing the following:
+ *
+ *  1. Writing the segment being filled and every changed map block.
+ *
+ *  2. Flushing the wrapped disk.
+ *
+ *  3. Releasing the data area blocks emptied before step 1 for reuse
+ *  (discarding them on the wrapped disk), now that the map on disk no
+ *  longer points into them.
+ **/
+int disk_compressed_flush(Disk *disk)
+{
+    DiskCompressed *compressed = disk->private;
+
+    pthread_rwlock_wrlock(&compressed->lock);
+    int result = disk_compressed_sync(compressed);
+    uint64_t synced = compressed->released + compressed->npending;
+    pthread_rwlock_unlock(&compressed->lock);
+
+    if (result == DISK_FAILURE || disk_flush(compressed->inner) == DISK_FAILURE)
+        return DISK_FAILURE;
+
+    // a write may have released held blocks while the lock was dropped, so
+    // release only those still pending from before the sync
+    pthread_rwlock_wrlock(&compressed->lock);
+    size_t released = synced > compressed->released ? synced - compressed->released : 0;
+    size_t area = 1 + compressed->map_blocks;
+    for (size_t i = 0; i < released; i++)
+    {
+        size_t physical = compressed->pending[i];
+        compressed->held[physical] = false;
+        if (compressed->inner->ops->discard)
+            disk_discard(compressed->inner, area + physical, 1);
+    }
+    compressed->npending -= released;
+    compressed->released += released;
+    memmove(compressed->pending, compressed->pending + released, compressed->npending * sizeof(size_t));
+    pthread_rwlock_unlock(&compressed->lock);
+    return 0;
+}
+
+/**
+ * Unmap blocks: they read back as zeros and their storage is released.
+ **/
+int disk_compressed_discard(Disk *disk, size_t block, size_t count)
+{
+    DiskCompressed *compressed = disk->private;
+    pthread_rwlock_wrlock(&compressed->lock);
+    for (size_t i = block; i < block + count; i++)
+        disk_compressed_release(compressed, i);
+    pthread_rwlock_unlock(&compressed->lock);
+    return 0;
+}
+
+/**
+ * Write back the segment and map and close the wrapped disk (without
+ * reporting its statistics).
+ **/
+void disk_compressed_close(Disk *disk)
+{
+    DiskCompressed *compressed = disk->private;
+    if (!compressed)
+        return;
+
+    if (disk_compressed_flush(disk) == DISK_FAILURE)
+        error("failed to save block map: recent writes are lost");
+
+    disk_release(compressed->inner);
+    disk_compressed_free(compressed);
+    disk->private = NULL;
+}
+
+/* Internal Functions */
+
+/**
+ * Store or load count contiguous blocks.  Reads keep the last data area
+ * block they read, so neighbours packed into it are not read again.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ * @param       data        Array of count data buffers.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t disk_compressed_transfer(Disk *disk, size_t block, size_t count, char **data, bool write)
+{
+    DiskCompressed *compressed = disk->private;
+    if (write)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!disk_compressed_store(disk, block + i, data[i]))
+                return DISK_FAILURE;
+        }
+        return count * BLOCK_SIZE;
+    }
+
+    char buffer[BLOCK_SIZE] __attribute__((aligned(DISK_ALIGNMENT)));
+    size_t cached = DISK_COMPRESSED_NONE;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!disk_compressed_load(compressed, block + i, data[i], buffer, &cached))
+            return DISK_FAILURE;
+    }
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Load one block: zeros if unmapped, a direct read if raw, otherwise
+ * decompress it from the segment, from buffer if it holds the right data
+ * area block, or from a fresh read of that block into buffer.
+ *
+ * @param       compressed  Compressing backend state.
+ * @param       block       Block number.
+ * @param       data        Buffer for the block.
+ * @param       buffer      Scratch data area block (aligned).
+ * @param       cached      Data area block buffer holds (updated).
+ *
+ * @return      Whether the block was loaded (errno EIO if its stored form
+ *              is corrupt).
+ **/
+bool disk_compressed_load(DiskCompressed *compressed, size_t block, char *data, char *buffer, size_t *cached)
+{
+    bool result = true;
+    pthread_rwlock_rdlock(&compressed->lock);
+    DiskMapEntry entry = compressed->map[block];
+    size_t physical = entry.unit / DISK_COMPRESSED_UNITS;
+    size_t offset = entry.unit % DISK_COMPRESSED_UNITS * DISK_COMPRESSED_UNIT;
+
+    if (entry.length == 0)
+        memset(data, 0, BLOCK_SIZE);
+    else if (entry.flags & DISK_MAP_RAW)
+        result = disk_compressed_io(compressed, physical, data, false) != DISK_FAILURE;
+    else
+    {
+        const char *source = compressed->segment;
+        if (physical != compressed->open)
+        {
+            if (*cached != physical)
+            {
+                *cached = DISK_COMPRESSED_NONE;
+                result = disk_compressed_io(compressed, physical, buffer, false) != DISK_FAILURE;
+                if (result)
+                    *cached = physical;
+            }
+            source = buffer;
+        }
+        if (result && lz_decompress(source + offset, entry.length, data, BLOCK_SIZE) != BLOCK_SIZE)
+        {
+            error("block %zu does not decompress", block);
+            errno = EIO;
+            result = false;
+        }
+    }
+    pthread_rwlock_unlock(&compressed->lock);
+    return result;
+}
+
+/**
+ * Store one block by doing the following:
+ *
+ *  1. Compressing it, unless it is metadata.
+ *
+ *  2. Storing it raw if it is metadata or compresses to more than
+ *  DISK_COMPRESSED_LIMIT bytes.
+ *
+ *  3. Otherwise appending it to the segment (writing out the segment and
+ *  starting a new one when it is full) and pointing the map at it, then
+ *  releasing where it was stored before.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number.
+ * @param       data        Block contents.
+ *
+ * @return      Whether the block was stored.
+ **/
+bool disk_compressed_store(Disk *disk, size_t block, char *data)
+{
+    DiskCompressed *compressed = disk->private;
+    char packed[DISK_COMPRESSED_LIMIT];
+    size_t length = 0;
+    if (!(__atomic_load_n(&compressed->map[block].flags, __ATOMIC_RELAXED) & DISK_MAP_METADATA))
+        length = lz_compress(data, BLOCK_SIZE, packed, sizeof(packed));
+    if (length == 0)
+        return disk_compressed_store_raw(compressed, block, data);
+
+    size_t units = (length + DISK_COMPRESSED_UNIT - 1) / DISK_COMPRESSED_UNIT;
+    pthread_rwlock_wrlock(&compressed->lock);
+    if (compressed->open == DISK_COMPRESSED_NONE || compressed->used + units > DISK_COMPRESSED_UNITS)
+    {
+        if (!disk_compressed_close_segment(compressed))
+        {
+            pthread_rwlock_unlock(&compressed->lock);
+            return false;
+        }
+        compressed->open = disk_compressed_allocate(compressed);
+        if (compressed->open == DISK_COMPRESSED_NONE)
+        {
+            pthread_rwlock_unlock(&compressed->lock);
+            return false;
+        }
+        compressed->used = 0;
+        memset(compressed->segment, 0, BLOCK_SIZE);
+    }
+
+    disk_compressed_release(compressed, block);
+    memcpy(compressed->segment + compressed->used * DISK_COMPRESSED_UNIT, packed, length);
+    DiskMapEntry *entry = &compressed->map[block];
+    entry->unit = compressed->open * DISK_COMPRESSED_UNITS + compressed->used;
+    entry->length = length;
+    entry->flags &= ~DISK_MAP_RAW;
+    compressed->dirty[block / DISK_MAP_ENTRIES] = true;
+    compressed->live[compressed->open] += units;
+    compressed->used += units;
+    compressed->segment_dirty = true;
+    pthread_rwlock_unlock(&compressed->lock);
+
+    __atomic_fetch_add(&disk->compressed_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&disk->compressed_bytes, length, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Store one block uncompressed: over itself if it is already stored raw,
+ * otherwise in a newly allocated data area block, written before the map
+ * points at it.
+ *
+ * @return      Whether the block was stored.
+ **/
+bool disk_compressed_store_raw(DiskCompressed *compressed, size_t block, char *data)
+{
+    /* The read lock keeps the block from being remapped while it is written */
+    pthread_rwlock_rdlock(&compressed->lock);
+    DiskMapEntry entry = compressed->map[block];
+    if (entry.length && (entry.flags & DISK_MAP_RAW))
+    {
+        ssize_t result = disk_compressed_io(compressed, entry.unit / DISK_COMPRESSED_UNITS, data, true);
+        pthread_rwlock_unlock(&compressed->lock);
+        return result != DISK_FAILURE;
+    }
+    pthread_rwlock_unlock(&compressed->lock);
+
+    pthread_rwlock_wrlock(&compressed->lock);
+    size_t physical = disk_compressed_allocate(compressed);
+    if (physical != DISK_COMPRESSED_NONE)
+        compressed->live[physical] = DISK_COMPRESSED_UNITS;
+    pthread_rwlock_unlock(&compressed->lock);
+    if (physical == DISK_COMPRESSED_NONE)
+        return false;
+
+    bool result = disk_compressed_io(compressed, physical, data, true) != DISK_FAILURE;
+
+    pthread_rwlock_wrlock(&compressed->lock);
+    if (result)
+    {
+        disk_compressed_release(compressed, block);
+        DiskMapEntry *entry = &compressed->map[block];
+        entry->unit = physical * DISK_COMPRESSED_UNITS;
+        entry->length = BLOCK_SIZE;
+        entry->flags |= DISK_MAP_RAW;
+        compressed->dirty[block / DISK_MAP_ENTRIES] = true;
+    }
+    else
+    {
+        /* Never referenced: free again at once */
+        compressed->live[physical] = 0;
+    }
+    pthread_rwlock_unlock(&compressed->lock);
+    return result;
+}
+
+/**
+ * Unmap a block (keeping its metadata flag), giving back its units.  A
+ * data area block left empty is held until the next flush has written a
+ * map that no longer refers to it.  Called with the lock held for writing.
+ **/
+void disk_compressed_release(DiskCompressed *compressed, size_t block)
+{
+    DiskMapEntry *entry = &compressed->map[block];
+    if (entry->length == 0)
+        return;
+
+    size_t physical = entry->unit / DISK_COMPRESSED_UNITS;
+    size_t units = entry->flags & DISK_MAP_RAW ? DISK_COMPRESSED_UNITS
+                                               : (entry->length + DISK_COMPRESSED_UNIT - 1) / DISK_COMPRESSED_UNIT;
+    compressed->live[physical] -= units;
+    if (compressed->live[physical] == 0 && physical != compressed->open)
+    {
+        compressed->held[physical] = true;
+        compressed->pending[compressed->npending++] = physical;
+    }
+
+    entry->unit = 0;
+    entry->length = 0;
+    entry->flags &= DISK_MAP_METADATA;
+    compressed->dirty[block / DISK_MAP_ENTRIES] = true;
+}
+
+/**
+ * Find an empty data area block, starting after the last one found.  Every
+ * block in use holds at least one logical block, the segment or a block
+ * being rewritten raw, so one is nearly always free.  Emptied blocks are
+ * held until a flush, though, so a disk rewritten over and over between
+ * flushes may have none: the map is then written early to reuse them.
+ * Called with the lock held for writing.
+ *
+ * @return      Data area block number (DISK_COMPRESSED_NONE, with errno
+ *              ENOSPC, if there is none).
+ **/
+size_t disk_compressed_allocate(DiskCompressed *compressed)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        for (size_t i = 0; i < compressed->physical; i++)
+        {
+            size_t physical = (compressed->cursor + i) % compressed->physical;
+            if (compressed->live[physical] == 0 && !compressed->held[physical] && physical != compressed->open)
+            {
+                compressed->cursor = physical + 1;
+                return physical;
+            }
+        }
+
+        if (compressed->npending == 0 || disk_compressed_sync(compressed) == DISK_FAILURE ||
+            disk_flush(compressed->inner) == DISK_FAILURE)
+            break;
+        for (size_t i = 0; i < compressed->npending; i++)
+            compressed->held[compressed->pending[i]] = false;
+        compressed->released += compressed->npending;
+        compressed->npending = 0;
+    }
+
+    error("no free block in compressed data area");
+    errno = ENOSPC;
+    return DISK_COMPRESSED_NONE;
+}
+
+/**
+ * Write the segment, if it changed, then every changed map block, so the
+ * map on disk only points at written data.  Called with the lock held for
+ * writing.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_compressed_sync(DiskCompressed *compressed)
+{
+    if (compressed->segment_dirty)
+    {
+        if (disk_compressed_io(compressed, compressed->open, compressed->segment, true) == DISK_FAILURE)
+            return DISK_FAILURE;
+        compressed->segment_dirty = false;
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < compressed->map_blocks; i++)
+    {
+        if (!compressed->dirty[i])
+            continue;
+        char *data = (char *)compressed->map + i * BLOCK_SIZE;
+        if (disk_transfer(compressed->inner, 1 + i, 1, &data, true) == DISK_FAILURE)
+            result = DISK_FAILURE;
+        else
+            compressed->dirty[i] = false;
+    }
+    return result;
+}
+
+/**
+ * Write out the segment (if it has unwritten blocks) and stop filling it.
+ * Called with the lock held for writing.
+ *
+ * @return      Whether the segment was written.
+ **/
+bool disk_compressed_close_segment(DiskCompressed *compressed)
+{
+    size_t open = compressed->open;
+    if (open == DISK_COMPRESSED_NONE)
+        return true;
+
+    if (compressed->segment_dirty)
+    {
+        if (disk_compressed_io(compressed, open, compressed->segment, true) == DISK_FAILURE)
+            return false;
+        compressed->segment_dirty = false;
+    }
+    compressed->open = DISK_COMPRESSED_NONE;
+    if (compressed->live[open] == 0)
+    {
+        compressed->held[open] = true;
+        compressed->pending[compressed->npending++] = open;
+    }
+    return true;
+}
+
+/**
+ * Load the header and map, or write a header for a blank image, then
+ * count the units in use in each data area block.
+ *
+ * @return      Whether the image is usable.
+ **/
+bool disk_compressed_read_map(DiskCompressed *compressed, Disk *disk, const char *path)
+{
+    DiskCompressedHeader *header = (DiskCompressedHeader *)compressed->header;
+    if (disk_transfer(compressed->inner, 0, 1, &compressed->header, false) == DISK_FAILURE)
+        return false;
+
+    if (header->magic != DISK_COMPRESSED_MAGIC)
+    {
+        static const char zero[BLOCK_SIZE];
+        if (memcmp(compressed->header, zero, BLOCK_SIZE) != 0)
+        {
+            error("%s is not a compressed image", path);
+            return false;
+        }
+
+        memset(compressed->map, 0, compressed->map_blocks * BLOCK_SIZE);
+        header->magic = DISK_COMPRESSED_MAGIC;
+        header->version = DISK_COMPRESSED_VERSION;
+        header->unit = DISK_COMPRESSED_UNIT;
+        header->blocks = disk->blocks;
+        return disk_transfer(compressed->inner, 0, 1, &compressed->header, true) != DISK_FAILURE;
+    }
+
+    if (header->version != DISK_COMPRESSED_VERSION || header->unit != DISK_COMPRESSED_UNIT)
+    {
+        error("%s: unsupported compressed image version %u", path, header->version);
+        return false;
+    }
+    if (header->blocks != disk->blocks)
+    {
+        error("%s: compressed image has %lu blocks, not %zu", path, (unsigned long)header->blocks, disk->blocks);
+        return false;
+    }
+
+    for (size_t i = 0; i < compressed->map_blocks; i++)
+    {
+        char *data = (char *)compressed->map + i * BLOCK_SIZE;
+        if (disk_transfer(compressed->inner, 1 + i, 1, &data, false) == DISK_FAILURE)
+            return false;
+    }
+
+    for (size_t block = 0; block < disk->blocks; block++)
+    {
+        DiskMapEntry *entry = &compressed->map[block];
+        if (entry->length == 0)
+            continue;
+
+        size_t physical = entry->unit / DISK_COMPRESSED_UNITS;
+        size_t units = entry->flags & DISK_MAP_RAW ? DISK_COMPRESSED_UNITS
+                                                   : (entry->length + DISK_COMPRESSED_UNIT - 1) / DISK_COMPRESSED_UNIT;
+        if (physical >= compressed->physical || entry->length > BLOCK_SIZE ||
+            compressed->live[physical] + units > DISK_COMPRESSED_UNITS)
+        {
+            error("%s: block map entry %zu is corrupt", path, block);
+            return false;
+        }
+        compressed->live[physical] += units;
+    }
+    return true;
+}
+
+/**
+ * Transfer one data area block with the wrapped disk.
+ **/
+ssize_t disk_compressed_io(DiskCompressed *compressed, size_t physical, char *data, bool write)
+{
+    return disk_transfer(compressed->inner, 1 + compressed->map_blocks + physical, 1, &data, write);
+}
+
+/**
+ * Release the compressing state (not the wrapped disk).
+ **/
+void disk_compressed_free(DiskCompressed *compressed)
+{
+    pthread_rwlock_destroy(&compressed->lock);
+    free(compressed->map);
+    free(compressed->dirty);
+    free(compressed->live);
+    free(compressed->held);
+    free(compressed->pending);
+    free(compressed->segment);
+    free(compressed->header);
+    free(compressed);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
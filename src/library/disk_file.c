@@ -0,0 +1,406 @@
+/* disk_file.c: SimpleFS image file disk backend (pread/pwrite, io_uring) */
+
+#define _GNU_SOURCE /* O_DIRECT, fallocate */
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+#include "sfs/uring.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* Internal Constants */
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+/* Internal Prototyes */
+
+int disk_file_open(Disk *disk, const char *path, const DiskOptions *options);
+int disk_file_open_uring(Disk *disk, const char *path, const DiskOptions *options);
+ssize_t disk_file_read(Disk *disk, size_t block, char *data);
+ssize_t disk_file_write(Disk *disk, size_t block, char *data);
+ssize_t disk_file_readv(Disk *disk, size_t block, size_t count, char **data);
+ssize_t disk_file_writev(Disk *disk, size_t block, size_t count, char **data);
+int disk_file_flush(Disk *disk);
+int disk_file_discard(Disk *disk, size_t block, size_t count);
+void disk_file_close(Disk *disk);
+ssize_t disk_file_transfer(Disk *disk, size_t block, char *data, bool write);
+ssize_t disk_file_vector(Disk *disk, size_t block, size_t count, char **data, bool write);
+ssize_t disk_file_pio(Disk *disk, char *data, size_t length, off_t offset, bool write);
+ssize_t disk_file_piov(Disk *disk, char **data, size_t count, off_t offset, bool write);
+
+/* Backends */
+
+const DiskOps disk_file_ops = {
+    .name = "file",
+    .open = disk_file_open,
+    .read = disk_file_read,
+    .write = disk_file_write,
+    .readv = disk_file_readv,
+    .writev = disk_file_writev,
+    .flush = disk_file_flush,
+    .discard = disk_file_discard,
+    .close = disk_file_close,
+};
+
+const DiskOps disk_uring_ops = {
+    .name = "uring",
+    .open = disk_file_open_uring,
+    .read = disk_file_read,
+    .write = disk_file_write,
+    .readv = disk_file_readv,
+    .writev = disk_file_writev,
+    .flush = disk_file_flush,
+    .discard = disk_file_discard,
+    .close = disk_file_close,
+};
+
+/* Backend Functions */
+
+/**
+ * Attach the file backend by doing the following:
+ *
+ *  1. Opening a file descriptor to the specified path (O_DIRECT if
+ *  requested).
+ *
+ *  2. Truncating the file to the desired size (blocks * BLOCK_SIZE).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image.
+ * @param       options     Disk options (NULL for defaults).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_file_open(Disk *disk, const char *path, const DiskOptions *options)
+{
+    disk->direct = options && options->direct;
+    disk->fd = open(path, O_RDWR | O_CREAT | (disk->direct ? O_DIRECT : 0), S_IRUSR | S_IWUSR);
+    if (disk->fd == -1)
+    {
+        error("failed to open file %s", path);
+        return DISK_FAILURE;
+    }
+
+    if (ftruncate(disk->fd, disk->blocks * BLOCK_SIZE) == -1)
+    {
+        int errsv = errno;
+        error("failed to truncate file %s, errno: [%d]", path, errsv);
+        close(disk->fd);
+        disk->fd = -1;
+        return DISK_FAILURE;
+    }
+
+    return 0;
+}
+
+/**
+ * Attach the file backend and set up an io_uring of queue_depth entries for
+ * asynchronous requests (falling back to pread/pwrite if io_uring is
+ * unavailable).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image.
+ * @param       options     Disk options (NULL for defaults).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_file_open_uring(Disk *disk, const char *path, const DiskOptions *options)
+{
+    if (disk_file_open(disk, path, options) == DISK_FAILURE)
+        return DISK_FAILURE;
+
+    size_t queue_depth = options && options->queue_depth ? options->queue_depth : DISK_QUEUE_DEPTH;
+    disk->ring = ring_open(queue_depth);
+    if (!disk->ring)
+        info("io_uring unavailable, falling back to pread/pwrite");
+    return 0;
+}
+
+/**
+ * Read one block with a positional read, so the shared file offset is never
+ * touched and several threads may read from the same Disk concurrently.
+ **/
+ssize_t disk_file_read(Disk *disk, size_t block, char *data)
+{
+    return disk_file_transfer(disk, block, data, false);
+}
+
+/**
+ * Write one block with a positional write.
+ **/
+ssize_t disk_file_write(Disk *disk, size_t block, char *data)
+{
+    return disk_file_transfer(disk, block, data, true);
+}
+
+/**
+ * Read count contiguous blocks with one preadv per IOV_MAX blocks.
+ **/
+ssize_t disk_file_readv(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_file_vector(disk, block, count, data, false);
+}
+
+/**
+ * Write count contiguous blocks with one pwritev per IOV_MAX blocks.
+ **/
+ssize_t disk_file_writev(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_file_vector(disk, block, count, data, true);
+}
+
+/**
+ * Flush the image file with fdatasync.
+ **/
+int disk_file_flush(Disk *disk)
+{
+    if (fdatasync(disk->fd) == -1)
+    {
+        error("disk_flush: fdatasync failed: %s", strerror(errno));
+        return DISK_FAILURE;
+    }
+    return 0;
+}
+
+/**
+ * Punch a hole over count blocks so the host file system releases them
+ * (the image keeps its size and the range reads back as zeroes).
+ **/
+int disk_file_discard(Disk *disk, size_t block, size_t count)
+{
+    off_t offset = (off_t)block * BLOCK_SIZE;
+    off_t length = (off_t)count * BLOCK_SIZE;
+    int result;
+    do
+    {
+        result = fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+    } while (result == -1 && errno == EINTR);
+
+    if (result == -1)
+    {
+        if (errno != EOPNOTSUPP)
+            error("disk_discard: fallocate failed at offset [%lld]: %s", (long long)offset, strerror(errno));
+        return DISK_FAILURE;
+    }
+    return 0;
+}
+
+/**
+ * Tear down the io_uring (if any) and close the image file descriptor.
+ **/
+void disk_file_close(Disk *disk)
+{
+    ring_close(disk->ring);
+    disk->ring = NULL;
+    if (close(disk->fd) == -1)
+        error("failed to close fd");
+    disk->fd = -1;
+}
+
+/* Internal Functions */
+
+/**
+ * Transfer a single block and report errors.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number (already sanity checked).
+ * @param       data        Data buffer.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      BLOCK_SIZE on success, DISK_FAILURE on failure.
+ **/
+ssize_t disk_file_transfer(Disk *disk, size_t block, char *data, bool write)
+{
+    const char *name = write ? "disk_write" : "disk_read";
+    off_t offset = (off_t)block * BLOCK_SIZE;
+    ssize_t nbytes = disk_file_pio(disk, data, BLOCK_SIZE, offset, write);
+    if (nbytes == -1)
+    {
+        error("%s: %s failed at offset [%lld]: %s", name, write ? "pwrite" : "pread",
+              (long long)offset, strerror(errno));
+        return DISK_FAILURE;
+    }
+    else if (nbytes != (ssize_t)BLOCK_SIZE)
+    {
+        error("%s: transfer incomplete (%zd/%d bytes)", name, nbytes, BLOCK_SIZE);
+        return DISK_FAILURE;
+    }
+    return nbytes;
+}
+
+/**
+ * Transfer count contiguous blocks, splitting the request into IOV_MAX
+ * sized vectored submissions.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number (already sanity checked).
+ * @param       count       Number of blocks.
+ * @param       data        Array of count data buffers.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      count * BLOCK_SIZE on success, DISK_FAILURE on failure.
+ **/
+ssize_t disk_file_vector(Disk *disk, size_t block, size_t count, char **data, bool write)
+{
+    const char *name = write ? "disk_writev" : "disk_readv";
+
+    for (size_t i = 0; i < count; i += IOV_MAX)
+    {
+        size_t n = min(count - i, (size_t)IOV_MAX);
+        off_t offset = (off_t)(block + i) * BLOCK_SIZE;
+        ssize_t nbytes = disk_file_piov(disk, data + i, n, offset, write);
+        if (nbytes == -1)
+        {
+            error("%s: failed at offset [%lld]: %s", name, (long long)offset, strerror(errno));
+            return DISK_FAILURE;
+        }
+        else if (nbytes != (ssize_t)(n * BLOCK_SIZE))
+        {
+            error("%s: incomplete (%zd/%zu bytes)", name, nbytes, n * BLOCK_SIZE);
+            return DISK_FAILURE;
+        }
+    }
+
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Perform a positional read or write of exactly length bytes at offset,
+ * retrying on short transfers and EINTR.  On an O_DIRECT disk an unaligned
+ * data buffer is bounced through an aligned pool buffer.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       data        Data buffer.
+ * @param       length      Number of bytes to transfer (at most BLOCK_SIZE
+ *                          when bouncing).
+ * @param       offset      Byte offset into disk image.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (less than length only at end of
+ *              file, -1 on error).
+ **/
+ssize_t disk_file_pio(Disk *disk, char *data, size_t length, off_t offset, bool write)
+{
+    char *buffer = data;
+    if (disk->direct && !DISK_ALIGNED(data))
+    {
+        buffer = disk_buffer_get(disk);
+        if (!buffer)
+            return -1;
+        if (write)
+            memcpy(buffer, data, length);
+    }
+
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = write ? pwrite(disk->fd, buffer + done, length - done, offset + done)
+                          : pread(disk->fd, buffer + done, length - done, offset + done);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            done = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    if (buffer != data)
+    {
+        int errsv = errno;
+        if (!write && done == length)
+            memcpy(data, buffer, length);
+        disk_buffer_put(disk, buffer);
+        errno = errsv;
+    }
+    return done;
+}
+
+/**
+ * Perform a vectored positional read or write of count BLOCK_SIZE buffers
+ * starting at offset, retrying on short transfers and EINTR.  On an
+ * O_DIRECT disk unaligned buffers are bounced through aligned pool buffers.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       data        Array of count data buffers.
+ * @param       count       Number of buffers (at most IOV_MAX).
+ * @param       offset      Byte offset into disk image.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (-1 on error).
+ **/
+ssize_t disk_file_piov(Disk *disk, char **data, size_t count, off_t offset, bool write)
+{
+    struct iovec iov[IOV_MAX];
+    char *buffers[IOV_MAX];
+    size_t length = count * BLOCK_SIZE;
+    size_t done = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        buffers[i] = data[i];
+        if (disk->direct && !DISK_ALIGNED(data[i]))
+        {
+            buffers[i] = disk_buffer_get(disk);
+            if (!buffers[i])
+            {
+                count = i;
+                done = -1;
+                goto release;
+            }
+            if (write)
+                memcpy(buffers[i], data[i], BLOCK_SIZE);
+        }
+    }
+
+    while (done < length)
+    {
+        /* Rebuild the iovec from the first incomplete buffer */
+        size_t first = done / BLOCK_SIZE;
+        size_t skip = done % BLOCK_SIZE;
+        int iovcnt = 0;
+        for (size_t i = first; i < count; i++, iovcnt++)
+        {
+            iov[iovcnt].iov_base = buffers[i] + (i == first ? skip : 0);
+            iov[iovcnt].iov_len = BLOCK_SIZE - (i == first ? skip : 0);
+        }
+
+        ssize_t n = write ? pwritev(disk->fd, iov, iovcnt, offset + done)
+                          : preadv(disk->fd, iov, iovcnt, offset + done);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            done = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+release:
+    for (size_t i = 0; i < count; i++)
+    {
+        if (buffers[i] == data[i])
+            continue;
+        if (!write && done == length)
+            memcpy(data[i], buffers[i], BLOCK_SIZE);
+        int errsv = errno;
+        disk_buffer_put(disk, buffers[i]);
+        errno = errsv;
+    }
+    return done;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,758 @@
+/* disk_mirrored.c: SimpleFS disk backend that mirrors blocks across several images */
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+#include "sfs/members.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/random.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define DISK_MIRRORED_MAGIC   (0x5346534d) /* "SFSM" */
+#define DISK_MIRRORED_VERSION (1)
+#define DISK_MIRRORED_RUN     (64) /* Blocks copied at once by resyncs */
+#define DISK_MIRRORED_SHARE   (8)  /* Fewest blocks worth a share of a split read */
+
+#define MIRROR_ACTIVE (0) /* In sync: read and written */
+#define MIRROR_RESYNC (1) /* Being brought up to date: written, not read */
+#define MIRROR_FAILED (2) /* Left out until disk_resync */
+
+/* Internal Structures */
+
+typedef struct DiskMirroredHeader DiskMirroredHeader;
+
+struct DiskMirroredHeader
+{
+    uint32_t magic;      /* DISK_MIRRORED_MAGIC */
+    uint16_t version;    /* DISK_MIRRORED_VERSION */
+    uint16_t clean;      /* Whether the mirror was closed cleanly */
+    uint64_t generation; /* Bumped whenever the set of members in sync changes */
+    uint64_t blocks;     /* Number of data blocks */
+    uint64_t history;    /* Random ID of the open that wrote the generation (0 in older headers) */
+};
+
+typedef struct DiskMirrored DiskMirrored;
+
+struct DiskMirrored
+{
+    Members *members;             /* Member images and their workers */
+    int state[MEMBERS_MAX];       /* MIRROR_* of each member (atomic) */
+    size_t inflight[MEMBERS_MAX]; /* Reads running on each member (atomic) */
+    size_t head[MEMBERS_MAX];     /* Block after each member's last transfer (atomic) */
+    uint64_t generation;          /* Generation of the members in sync */
+    uint64_t history;             /* Random ID of this open, written with each generation */
+    char *header;                 /* Header block buffer */
+    pthread_mutex_t lock;         /* Serializes state changes and header writes */
+    pthread_rwlock_t barrier;     /* Held for writing while a resync copies a run */
+    pthread_mutex_t resyncing;    /* Serializes disk_resync calls */
+};
+
+/* Internal Prototyes */
+
+int disk_mirrored_open(Disk *disk, const char *path, const DiskOptions *options);
+ssize_t disk_mirrored_read(Disk *disk, size_t block, char *data);
+ssize_t disk_mirrored_write(Disk *disk, size_t block, char *data);
+ssize_t disk_mirrored_readv(Disk *disk, size_t block, size_t count, char **data);
+ssize_t disk_mirrored_writev(Disk *disk, size_t block, size_t count, char **data);
+int disk_mirrored_flush(Disk *disk);
+int disk_mirrored_discard(Disk *disk, size_t block, size_t count);
+void disk_mirrored_close(Disk *disk);
+bool disk_mirrored_attach(Disk *disk, const char *path);
+size_t disk_mirrored_pick(DiskMirrored *mirrored, size_t block);
+ssize_t disk_mirrored_read_one(Disk *disk, size_t block, size_t count, char **data);
+ssize_t disk_mirrored_read_split(Disk *disk, size_t block, size_t count, char **data);
+ssize_t disk_mirrored_update(Disk *disk, size_t block, size_t count, char **data, int operation);
+void disk_mirrored_fail(Disk *disk, size_t member);
+bool disk_mirrored_mark(Disk *disk, bool clean);
+bool disk_mirrored_copy(Disk *disk, size_t member);
+void disk_mirrored_free(DiskMirrored *mirrored);
+uint64_t disk_mirrored_history(void);
+
+/* Backends */
+
+const DiskOps disk_mirrored_ops = {
+    .name = "mirrored",
+    .open = disk_mirrored_open,
+    .read = disk_mirrored_read,
+    .write = disk_mirrored_write,
+    .readv = disk_mirrored_readv,
+    .writev = disk_mirrored_writev,
+    .flush = disk_mirrored_flush,
+    .discard = disk_mirrored_discard,
+    .close = disk_mirrored_close,
+};
+
+/* External Functions */
+
+/**
+ * Bring failed mirror members back by doing the following:
+ *
+ *  1. Opening the image of each failed member again (a device that came
+ *  back, or a replacement image).
+ *
+ *  2. Copying every block to it from the members in sync, a run at a time,
+ *  while it already receives new writes (see disk_mirrored_copy).
+ *
+ * May run in a background thread while other threads use the disk.
+ *
+ * @param       disk        Pointer to Disk structure (opened with mirror).
+ *
+ * @return      Number of members brought back (DISK_FAILURE if the disk is
+ *              not mirrored).
+ **/
+ssize_t disk_resync(Disk *disk)
+{
+    if (!disk || disk->ops != &disk_mirrored_ops)
+    {
+        error("disk_resync: disk is not mirrored");
+        return DISK_FAILURE;
+    }
+
+    DiskMirrored *mirrored = disk->private;
+    ssize_t resynced = 0;
+    pthread_mutex_lock(&mirrored->resyncing);
+    for (size_t i = 0; i < mirrored->members->count; i++)
+    {
+        if (__atomic_load_n(&mirrored->state[i], __ATOMIC_ACQUIRE) != MIRROR_FAILED)
+            continue;
+
+        /* No request is using the member while the barrier is held */
+        pthread_rwlock_wrlock(&mirrored->barrier);
+        bool opened = members_reopen(mirrored->members, i);
+        pthread_rwlock_unlock(&mirrored->barrier);
+
+        if (opened && disk_mirrored_copy(disk, i))
+            resynced++;
+    }
+    pthread_mutex_unlock(&mirrored->resyncing);
+    return resynced;
+}
+
+/* Backend Functions */
+
+/**
+ * Attach the mirroring backend by doing the following:
+ *
+ *  1. Opening each image in path (see members_open) with the backend the
+ *  options select (options->ops or options->mode, shaped if options->shape
+ *  is set), one header block larger than the disk.  Images that cannot be
+ *  opened leave their members failed.
+ *
+ *  2. Reading the member headers to find the members in sync (see
+ *  disk_mirrored_attach), and starting a new generation on them.
+ *
+ *  3. Copying the data to the members that are behind.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Comma-separated paths of the member images.
+ * @param       options     Disk options (options->mirror is required).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_mirrored_open(Disk *disk, const char *path, const DiskOptions *options)
+{
+    if (!options || !options->mirror)
+    {
+        error("disk_mirrored_ops needs DiskOptions.mirror");
+        return DISK_FAILURE;
+    }
+    if (options->stripe_blocks)
+    {
+        error("a disk cannot be both mirrored and striped");
+        return DISK_FAILURE;
+    }
+
+    DiskMirrored *mirrored = calloc(1, sizeof(DiskMirrored));
+    if (!mirrored)
+    {
+        error("failed on calloc for DiskMirrored");
+        return DISK_FAILURE;
+    }
+    pthread_mutex_init(&mirrored->lock, NULL);
+    /* Steady reads and writes must not starve a resync waiting for the barrier */
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&mirrored->barrier, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+    pthread_mutex_init(&mirrored->resyncing, NULL);
+
+    if (posix_memalign((void **)&mirrored->header, DISK_ALIGNMENT, BLOCK_SIZE) != 0)
+    {
+        error("failed to allocate mirror header");
+        disk_mirrored_free(mirrored);
+        return DISK_FAILURE;
+    }
+
+    size_t nmembers = 1;
+    for (const char *c = path; *c; c++)
+        nmembers += *c == ',';
+
+    DiskOptions inner = {
+        .mode = options->mode,
+        .ops = options->ops == &disk_mirrored_ops ? NULL : options->ops,
+        .direct = options->direct,
+        .pool_buffers = options->pool_buffers,
+        .huge_pages = options->huge_pages,
+        .shape = options->shape,
+    };
+    mirrored->members = members_open(path, disk->blocks + 1, &inner, true);
+    if (!mirrored->members || mirrored->members->count != nmembers)
+    {
+        if (mirrored->members)
+            error("empty member path in %s", path);
+        disk_mirrored_free(mirrored);
+        return DISK_FAILURE;
+    }
+
+    disk->private = mirrored;
+    if (!disk_mirrored_attach(disk, path))
+    {
+        disk_mirrored_free(mirrored);
+        disk->private = NULL;
+        return DISK_FAILURE;
+    }
+    return 0;
+}
+
+/**
+ * Read one block from the least busy member in sync.
+ **/
+ssize_t disk_mirrored_read(Disk *disk, size_t block, char *data)
+{
+    DiskMirrored *mirrored = disk->private;
+    pthread_rwlock_rdlock(&mirrored->barrier);
+    ssize_t result = disk_mirrored_read_one(disk, block, 1, &data);
+    pthread_rwlock_unlock(&mirrored->barrier);
+    return result;
+}
+
+/**
+ * Write one block to every member.
+ **/
+ssize_t disk_mirrored_write(Disk *disk, size_t block, char *data)
+{
+    return disk_mirrored_update(disk, block, 1, &data, MEMBER_WRITE);
+}
+
+/**
+ * Read contiguous blocks, split across the members in sync when there are
+ * enough of them.
+ **/
+ssize_t disk_mirrored_readv(Disk *disk, size_t block, size_t count, char **data)
+{
+    DiskMirrored *mirrored = disk->private;
+    pthread_rwlock_rdlock(&mirrored->barrier);
+    ssize_t result = disk_mirrored_read_split(disk, block, count, data);
+    pthread_rwlock_unlock(&mirrored->barrier);
+    return result;
+}
+
+/**
+ * Write contiguous blocks to every member, in parallel.
+ **/
+ssize_t disk_mirrored_writev(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_mirrored_update(disk, block, count, data, MEMBER_WRITE);
+}
+
+/**
+ * Flush every member, in parallel.
+ **/
+int disk_mirrored_flush(Disk *disk)
+{
+    return disk_mirrored_update(disk, 0, 0, NULL, MEMBER_FLUSH) == DISK_FAILURE ? DISK_FAILURE : 0;
+}
+
+/**
+ * Discard blocks on every member, in parallel.
+ **/
+int disk_mirrored_discard(Disk *disk, size_t block, size_t count)
+{
+    return disk_mirrored_update(disk, block, count, NULL, MEMBER_DISCARD) == DISK_FAILURE ? DISK_FAILURE : 0;
+}
+
+/**
+ * Flush the members, mark their headers clean and close them (without
+ * reporting their statistics).
+ **/
+void disk_mirrored_close(Disk *disk)
+{
+    DiskMirrored *mirrored = disk->private;
+    if (!mirrored)
+        return;
+
+    if (disk_mirrored_flush(disk) == 0)
+    {
+        pthread_mutex_lock(&mirrored->lock);
+        disk_mirrored_mark(disk, true);
+        pthread_mutex_unlock(&mirrored->lock);
+    }
+    disk_mirrored_free(mirrored);
+    disk->private = NULL;
+}
+
+/* Internal Functions */
+
+/**
+ * Decide which members are in sync by doing the following:
+ *
+ *  1. Reading each open member's header.  A blank header marks a new (or
+ *  replacement) image; any other header must belong to a mirror of this
+ *  many blocks.
+ *
+ *  2. Keeping the members of the newest generation.  Generations are only
+ *  comparable within one history: a member left behind and later opened
+ *  without the newer ones counts up again from its own generation, under
+ *  a different history ID.  So the first member with the newest generation
+ *  decides the history, and members with the same generation from another
+ *  history are behind.  When that generation was not closed cleanly,
+ *  writes may have reached some of its members but not others, so only the
+ *  first is kept; a new mirror likewise starts from the data of its first
+ *  member.
+ *
+ *  3. Writing the next generation, not clean, under a new history ID to the
+ *  members kept, then copying the data to the others (a member that fails
+ *  is left out).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Paths of the member images (for messages).
+ *
+ * @return      Whether at least one member is in sync.
+ **/
+bool disk_mirrored_attach(Disk *disk, const char *path)
+{
+    DiskMirrored *mirrored = disk->private;
+    Members *members = mirrored->members;
+    DiskMirroredHeader *header = (DiskMirroredHeader *)mirrored->header;
+    uint64_t generations[MEMBERS_MAX] = {0};
+    uint64_t histories[MEMBERS_MAX] = {0};
+    bool cleans[MEMBERS_MAX] = {false};
+    uint64_t history = 0;
+
+    for (size_t i = 0; i < members->count; i++)
+    {
+        mirrored->state[i] = MIRROR_FAILED;
+        if (!members->members[i].disk)
+        {
+            info("%s: mirror member %s is missing", path, members->members[i].path);
+            continue;
+        }
+        if (disk_transfer(members->members[i].disk, disk->blocks, 1, &mirrored->header, false) == DISK_FAILURE)
+        {
+            info("%s: cannot read mirror member %s", path, members->members[i].path);
+            continue;
+        }
+        if (header->magic != 0 && (header->magic != DISK_MIRRORED_MAGIC ||
+                                   header->version != DISK_MIRRORED_VERSION || header->blocks != disk->blocks))
+        {
+            error("%s is not a mirror member of %zu blocks", members->members[i].path, disk->blocks);
+            return false;
+        }
+        mirrored->state[i] = MIRROR_RESYNC;
+        if (header->magic == 0)
+            continue;
+
+        generations[i] = header->generation;
+        histories[i] = header->history;
+        cleans[i] = header->clean;
+        if (header->generation > mirrored->generation)
+        {
+            mirrored->generation = header->generation;
+            history = header->history;
+        }
+    }
+
+    bool clean = mirrored->generation != 0;
+    for (size_t i = 0; i < members->count; i++)
+    {
+        if (generations[i] == mirrored->generation && histories[i] == history)
+            clean = clean && cleans[i];
+    }
+
+    bool kept = false;
+    for (size_t i = 0; i < members->count; i++)
+    {
+        if (mirrored->state[i] == MIRROR_RESYNC && generations[i] == mirrored->generation &&
+            histories[i] == history && (clean || !kept))
+        {
+            mirrored->state[i] = MIRROR_ACTIVE;
+            kept = true;
+        }
+    }
+    if (!kept)
+    {
+        error("%s: no mirror member could be opened", path);
+        return false;
+    }
+
+    mirrored->generation++;
+    mirrored->history = disk_mirrored_history();
+    if (!disk_mirrored_mark(disk, false))
+    {
+        error("%s: cannot write mirror headers", path);
+        return false;
+    }
+
+    for (size_t i = 0; i < members->count; i++)
+    {
+        if (mirrored->state[i] == MIRROR_RESYNC)
+        {
+            info("%s: resyncing mirror member %s", path, members->members[i].path);
+            disk_mirrored_copy(disk, i);
+        }
+    }
+    return true;
+}
+
+/**
+ * Choose the member in sync to read block from: the one with the fewest
+ * reads running, then the one whose last transfer ended nearest block.
+ *
+ * @return      Member index (SIZE_MAX if no member is in sync).
+ **/
+size_t disk_mirrored_pick(DiskMirrored *mirrored, size_t block)
+{
+    size_t best = SIZE_MAX;
+    size_t best_inflight = SIZE_MAX;
+    size_t best_distance = SIZE_MAX;
+
+    for (size_t i = 0; i < mirrored->members->count; i++)
+    {
+        if (__atomic_load_n(&mirrored->state[i], __ATOMIC_ACQUIRE) != MIRROR_ACTIVE)
+            continue;
+        size_t inflight = __atomic_load_n(&mirrored->inflight[i], __ATOMIC_RELAXED);
+        size_t head = __atomic_load_n(&mirrored->head[i], __ATOMIC_RELAXED);
+        size_t distance = head > block ? head - block : block - head;
+        if (inflight < best_inflight || (inflight == best_inflight && distance < best_distance))
+        {
+            best = i;
+            best_inflight = inflight;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+/**
+ * Read contiguous blocks from one member in sync, moving on to another one
+ * whenever a member fails.  The caller holds the barrier.
+ *
+ * @return      count * BLOCK_SIZE on success, DISK_FAILURE (EIO) when no
+ *              member could serve the read.
+ **/
+ssize_t disk_mirrored_read_one(Disk *disk, size_t block, size_t count, char **data)
+{
+    DiskMirrored *mirrored = disk->private;
+    while (true)
+    {
+        size_t member = disk_mirrored_pick(mirrored, block);
+        if (member == SIZE_MAX)
+        {
+            errno = EIO;
+            return DISK_FAILURE;
+        }
+
+        MemberJob job = {.member = member, .operation = MEMBER_READ, .block = block, .count = count, .data = data};
+        __atomic_fetch_add(&mirrored->inflight[member], 1, __ATOMIC_RELAXED);
+        members_run(mirrored->members, &job);
+        __atomic_fetch_sub(&mirrored->inflight[member], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&mirrored->head[member], block + count, __ATOMIC_RELAXED);
+
+        if (job.result != DISK_FAILURE)
+            return count * BLOCK_SIZE;
+        disk_mirrored_fail(disk, member);
+    }
+}
+
+/**
+ * Read contiguous blocks by doing the following:
+ *
+ *  1. Splitting them into one contiguous share per member in sync (but no
+ *  share smaller than DISK_MIRRORED_SHARE blocks), so one large read keeps
+ *  every copy busy at once.
+ *
+ *  2. Running the shares in parallel (see members_submit).
+ *
+ *  3. Reading any share whose member failed again from another member.
+ *
+ * The caller holds the barrier.
+ *
+ * @return      count * BLOCK_SIZE on success, DISK_FAILURE on failure.
+ **/
+ssize_t disk_mirrored_read_split(Disk *disk, size_t block, size_t count, char **data)
+{
+    DiskMirrored *mirrored = disk->private;
+    MemberJob jobs[MEMBERS_MAX];
+    size_t active[MEMBERS_MAX];
+    size_t nactive = 0;
+
+    for (size_t i = 0; i < mirrored->members->count; i++)
+    {
+        if (__atomic_load_n(&mirrored->state[i], __ATOMIC_ACQUIRE) == MIRROR_ACTIVE)
+            active[nactive++] = i;
+    }
+
+    size_t njobs = min(nactive, count / DISK_MIRRORED_SHARE);
+    if (njobs <= 1)
+        return disk_mirrored_read_one(disk, block, count, data);
+
+    for (size_t j = 0; j < njobs; j++)
+    {
+        size_t first = j * count / njobs;
+        size_t last = (j + 1) * count / njobs;
+        jobs[j] = (MemberJob){.member = active[j], .operation = MEMBER_READ, .block = block + first,
+                              .count = last - first, .data = data + first};
+        __atomic_fetch_add(&mirrored->inflight[active[j]], 1, __ATOMIC_RELAXED);
+    }
+    members_submit(mirrored->members, jobs, njobs);
+
+    for (size_t j = 0; j < njobs; j++)
+    {
+        __atomic_fetch_sub(&mirrored->inflight[jobs[j].member], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&mirrored->head[jobs[j].member], jobs[j].block + jobs[j].count, __ATOMIC_RELAXED);
+        if (jobs[j].result == DISK_FAILURE)
+            disk_mirrored_fail(disk, jobs[j].member);
+    }
+    for (size_t j = 0; j < njobs; j++)
+    {
+        if (jobs[j].result == DISK_FAILURE &&
+            disk_mirrored_read_one(disk, jobs[j].block, jobs[j].count, jobs[j].data) == DISK_FAILURE)
+            return DISK_FAILURE;
+    }
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Apply a write, flush or discard to every member in sync or being
+ * resynced, in parallel.  A member whose write or flush fails is left out
+ * of the mirror; the operation only fails when no member in sync completed
+ * it.  Discards are advisory, so their failures leave members alone.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ * @param       data        Array of count data buffers (writes only).
+ * @param       operation   MEMBER_WRITE, FLUSH or DISCARD.
+ *
+ * @return      count * BLOCK_SIZE on success, DISK_FAILURE on failure.
+ **/
+ssize_t disk_mirrored_update(Disk *disk, size_t block, size_t count, char **data, int operation)
+{
+    DiskMirrored *mirrored = disk->private;
+    MemberJob jobs[MEMBERS_MAX];
+    bool active[MEMBERS_MAX];
+    size_t njobs = 0;
+
+    pthread_rwlock_rdlock(&mirrored->barrier);
+    for (size_t i = 0; i < mirrored->members->count; i++)
+    {
+        int state = __atomic_load_n(&mirrored->state[i], __ATOMIC_ACQUIRE);
+        if (state == MIRROR_FAILED)
+            continue;
+        active[njobs] = state == MIRROR_ACTIVE;
+        jobs[njobs++] = (MemberJob){.member = i, .operation = operation, .block = block, .count = count, .data = data};
+    }
+    ssize_t result = members_submit(mirrored->members, jobs, njobs);
+
+    if (operation == MEMBER_DISCARD)
+    {
+        pthread_rwlock_unlock(&mirrored->barrier);
+        return result;
+    }
+
+    bool done = false;
+    for (size_t j = 0; j < njobs; j++)
+    {
+        if (operation == MEMBER_WRITE)
+            __atomic_store_n(&mirrored->head[jobs[j].member], block + count, __ATOMIC_RELAXED);
+        if (jobs[j].result == DISK_FAILURE)
+            disk_mirrored_fail(disk, jobs[j].member);
+        else if (active[j])
+            done = true;
+    }
+    pthread_rwlock_unlock(&mirrored->barrier);
+
+    if (!done)
+    {
+        errno = EIO;
+        return DISK_FAILURE;
+    }
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Leave a member out of the mirror after an error, and start a new
+ * generation on the members still in sync so the one left out is known to
+ * be behind the next time the mirror is opened.
+ **/
+void disk_mirrored_fail(Disk *disk, size_t member)
+{
+    DiskMirrored *mirrored = disk->private;
+    pthread_mutex_lock(&mirrored->lock);
+    if (mirrored->state[member] != MIRROR_FAILED)
+    {
+        error("mirror member %s failed, leaving it out", mirrored->members->members[member].path);
+        __atomic_store_n(&mirrored->state[member], MIRROR_FAILED, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&disk->mirror_failures, 1, __ATOMIC_RELAXED);
+
+        /* Writing the headers may fail more members, each needing another generation */
+        do
+            mirrored->generation++;
+        while (!disk_mirrored_mark(disk, false));
+    }
+    pthread_mutex_unlock(&mirrored->lock);
+}
+
+/**
+ * Write the current generation to the header of every member in sync, and
+ * flush it.  Members that fail are left out.  The caller holds the lock.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       clean       Whether the mirror is being closed cleanly.
+ *
+ * @return      Whether every member in sync was written (also true when no
+ *              member is left).
+ **/
+bool disk_mirrored_mark(Disk *disk, bool clean)
+{
+    DiskMirrored *mirrored = disk->private;
+    memset(mirrored->header, 0, BLOCK_SIZE);
+    DiskMirroredHeader *header = (DiskMirroredHeader *)mirrored->header;
+    header->magic = DISK_MIRRORED_MAGIC;
+    header->version = DISK_MIRRORED_VERSION;
+    header->clean = clean;
+    header->generation = mirrored->generation;
+    header->blocks = disk->blocks;
+    header->history = mirrored->history;
+
+    bool written = true;
+    for (size_t i = 0; i < mirrored->members->count; i++)
+    {
+        if (mirrored->state[i] != MIRROR_ACTIVE)
+            continue;
+        Disk *member = mirrored->members->members[i].disk;
+        if (disk_transfer(member, disk->blocks, 1, &mirrored->header, true) == DISK_FAILURE ||
+            disk_flush(member) == DISK_FAILURE)
+        {
+            error("mirror member %s failed: %s", mirrored->members->members[i].path, strerror(errno));
+            __atomic_store_n(&mirrored->state[i], MIRROR_FAILED, __ATOMIC_RELEASE);
+            __atomic_fetch_add(&disk->mirror_failures, 1, __ATOMIC_RELAXED);
+            written = false;
+        }
+    }
+    return written;
+}
+
+/**
+ * Bring a member up to date by doing the following:
+ *
+ *  1. Marking it as being resynced, so new writes reach it from now on.
+ *
+ *  2. Copying every block from the members in sync, DISK_MIRRORED_RUN
+ *  blocks at a time.  Each run is copied holding the barrier for writing,
+ *  so no write can land between reading a run and writing it out.  Runs of
+ *  zeros are discarded instead of written where the backend allows.
+ *
+ *  3. Flushing it, writing the current generation to its header and
+ *  putting it back in sync.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       member      Member index (open, not in sync).
+ *
+ * @return      Whether the member is back in sync.
+ **/
+bool disk_mirrored_copy(Disk *disk, size_t member)
+{
+    DiskMirrored *mirrored = disk->private;
+    Disk *target = mirrored->members->members[member].disk;
+    char *buffer;
+    if (posix_memalign((void **)&buffer, DISK_ALIGNMENT, DISK_MIRRORED_RUN * BLOCK_SIZE) != 0)
+    {
+        error("failed to allocate resync buffer");
+        return false;
+    }
+    char *data[DISK_MIRRORED_RUN];
+    for (size_t i = 0; i < DISK_MIRRORED_RUN; i++)
+        data[i] = buffer + i * BLOCK_SIZE;
+
+    pthread_mutex_lock(&mirrored->lock);
+    __atomic_store_n(&mirrored->state[member], MIRROR_RESYNC, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mirrored->lock);
+
+    bool copied = true;
+    for (size_t block = 0; copied && block < disk->blocks; block += DISK_MIRRORED_RUN)
+    {
+        size_t run = min(disk->blocks - block, (size_t)DISK_MIRRORED_RUN);
+        pthread_rwlock_wrlock(&mirrored->barrier);
+        if (disk_mirrored_read_one(disk, block, run, data) == DISK_FAILURE)
+        {
+            copied = false;
+        }
+        else
+        {
+            bool zero = buffer[0] == 0 && memcmp(buffer, buffer + 1, run * BLOCK_SIZE - 1) == 0;
+            if (!(zero && disk_discard(target, block, run) == 0) &&
+                disk_transfer(target, block, run, data, true) == DISK_FAILURE)
+            {
+                disk_mirrored_fail(disk, member);
+                copied = false;
+            }
+        }
+        pthread_rwlock_unlock(&mirrored->barrier);
+    }
+    free(buffer);
+    if (copied && disk_flush(target) == DISK_FAILURE)
+    {
+        disk_mirrored_fail(disk, member);
+        copied = false;
+    }
+    if (!copied)
+    {
+        pthread_mutex_lock(&mirrored->lock);
+        __atomic_store_n(&mirrored->state[member], MIRROR_FAILED, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&mirrored->lock);
+        return false;
+    }
+
+    pthread_mutex_lock(&mirrored->lock);
+    __atomic_store_n(&mirrored->state[member], MIRROR_ACTIVE, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&disk->mirror_resyncs, 1, __ATOMIC_RELAXED);
+    while (!disk_mirrored_mark(disk, false))
+        mirrored->generation++;
+    bool active = mirrored->state[member] == MIRROR_ACTIVE;
+    pthread_mutex_unlock(&mirrored->lock);
+    return active;
+}
+
+/**
+ * Draw a random, nonzero history ID for a new open of the mirror (falling
+ * back on the clock and process ID if the system has no random source).
+ **/
+uint64_t disk_mirrored_history(void)
+{
+    uint64_t history = 0;
+    if (getrandom(&history, sizeof(history), 0) != sizeof(history))
+        history = disk_clock() ^ ((uint64_t)getpid() << 32);
+    return history ? history : 1;
+}
+
+/**
+ * Release the members, locks and buffers of a mirror.
+ **/
+void disk_mirrored_free(DiskMirrored *mirrored)
+{
+    members_close(mirrored->members);
+    pthread_mutex_destroy(&mirrored->resyncing);
+    pthread_rwlock_destroy(&mirrored->barrier);
+    pthread_mutex_destroy(&mirrored->lock);
+    free(mirrored->header);
+    free(mirrored);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,168 @@
+/* disk_mmap.c: SimpleFS memory-mapped disk backend */
+
+#define _GNU_SOURCE /* MADV_REMOVE */
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Internal Prototyes */
+
+int disk_mmap_open(Disk *disk, const char *path, const DiskOptions *options);
+ssize_t disk_mmap_read(Disk *disk, size_t block, char *data);
+ssize_t disk_mmap_write(Disk *disk, size_t block, char *data);
+char *disk_mmap_ptr(Disk *disk, size_t block);
+int disk_mmap_flush(Disk *disk);
+int disk_mmap_discard(Disk *disk, size_t block, size_t count);
+void disk_mmap_close(Disk *disk);
+
+/* Backends */
+
+const DiskOps disk_mmap_ops = {
+    .name = "mmap",
+    .open = disk_mmap_open,
+    .read = disk_mmap_read,
+    .write = disk_mmap_write,
+    .flush = disk_mmap_flush,
+    .discard = disk_mmap_discard,
+    .ptr = disk_mmap_ptr,
+    .close = disk_mmap_close,
+};
+
+/* Backend Functions */
+
+/**
+ * Attach the mmap backend by doing the following:
+ *
+ *  1. Opening a file descriptor to the specified path.
+ *
+ *  2. Truncating the file to the desired size (blocks * BLOCK_SIZE).
+ *
+ *  3. Mapping the whole image MAP_SHARED (kept in disk->private).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image.
+ * @param       options     Disk options (NULL for defaults).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_mmap_open(Disk *disk, const char *path, const DiskOptions *options)
+{
+    if (options && options->direct)
+    {
+        error("O_DIRECT cannot be combined with DISK_MODE_MMAP");
+        return DISK_FAILURE;
+    }
+
+    disk->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (disk->fd == -1)
+    {
+        error("failed to open file %s", path);
+        return DISK_FAILURE;
+    }
+
+    if (ftruncate(disk->fd, disk->blocks * BLOCK_SIZE) == -1)
+    {
+        int errsv = errno;
+        error("failed to truncate file %s, errno: [%d]", path, errsv);
+        goto failure;
+    }
+
+    disk->private = NULL;
+    if (disk->blocks > 0)
+    {
+        char *map = mmap(NULL, disk->blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            error("failed to mmap file %s: %s", path, strerror(errno));
+            goto failure;
+        }
+        disk->private = map;
+    }
+    return 0;
+
+failure:
+    close(disk->fd);
+    disk->fd = -1;
+    return DISK_FAILURE;
+}
+
+/**
+ * Copy one block out of the mapping.
+ **/
+ssize_t disk_mmap_read(Disk *disk, size_t block, char *data)
+{
+    memcpy(data, disk_mmap_ptr(disk, block), BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+/**
+ * Copy one block into the mapping (reaches the image on flush).
+ **/
+ssize_t disk_mmap_write(Disk *disk, size_t block, char *data)
+{
+    memcpy(disk_mmap_ptr(disk, block), data, BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+/**
+ * Return a pointer to block inside the mapping.
+ **/
+char *disk_mmap_ptr(Disk *disk, size_t block)
+{
+    return (char *)disk->private + block * BLOCK_SIZE;
+}
+
+/**
+ * Flush the mapping with msync.
+ **/
+int disk_mmap_flush(Disk *disk)
+{
+    if (disk->private && msync(disk->private, disk->blocks * BLOCK_SIZE, MS_SYNC) == -1)
+    {
+        error("disk_flush: msync failed: %s", strerror(errno));
+        return DISK_FAILURE;
+    }
+    return 0;
+}
+
+/**
+ * Free count blocks of the mapping together with the image storage behind
+ * them (MADV_REMOVE punches a hole in the file, so the range reads back as
+ * zeroes through the mapping and the image alike).
+ **/
+int disk_mmap_discard(Disk *disk, size_t block, size_t count)
+{
+    if (madvise(disk_mmap_ptr(disk, block), count * BLOCK_SIZE, MADV_REMOVE) == -1)
+    {
+        if (errno != EOPNOTSUPP)
+            error("disk_discard: madvise failed at block [%zu]: %s", block, strerror(errno));
+        return DISK_FAILURE;
+    }
+    return 0;
+}
+
+/**
+ * Flush and unmap the image, then close its file descriptor.
+ **/
+void disk_mmap_close(Disk *disk)
+{
+    if (disk->private)
+    {
+        if (disk_mmap_flush(disk) == DISK_FAILURE)
+            error("failed to flush mapping");
+        if (munmap(disk->private, disk->blocks * BLOCK_SIZE) == -1)
+            error("failed to munmap disk image");
+        disk->private = NULL;
+    }
+    if (close(disk->fd) == -1)
+        error("failed to close fd");
+    disk->fd = -1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
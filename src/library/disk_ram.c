@@ -0,0 +1,283 @@
+/* disk_ram.c: SimpleFS in-memory RAM disk backend */
+
+#define _GNU_SOURCE /* MAP_HUGETLB, MADV_HUGEPAGE, MADV_DONTNEED */
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Internal Constants */
+
+#define DISK_RAM_HUGE_PAGE (2UL << 20) /* Default huge page size */
+
+/* Internal Structures */
+
+typedef struct DiskRam DiskRam;
+
+struct DiskRam
+{
+    char *data;    /* Anonymous mapping holding the blocks */
+    size_t length; /* Mapping length (rounded up for huge pages) */
+    bool huge;     /* Whether mapping is MAP_HUGETLB */
+};
+
+/* Internal Prototyes */
+
+int disk_ram_open(Disk *disk, const char *path, const DiskOptions *options);
+ssize_t disk_ram_read(Disk *disk, size_t block, char *data);
+ssize_t disk_ram_write(Disk *disk, size_t block, char *data);
+char *disk_ram_ptr(Disk *disk, size_t block);
+int disk_ram_discard(Disk *disk, size_t block, size_t count);
+void disk_ram_close(Disk *disk);
+int disk_ram_image(Disk *disk, const char *path, bool save);
+
+/* Backends */
+
+const DiskOps disk_ram_ops = {
+    .name = "ram",
+    .open = disk_ram_open,
+    .read = disk_ram_read,
+    .write = disk_ram_write,
+    .discard = disk_ram_discard,
+    .ptr = disk_ram_ptr,
+    .close = disk_ram_close,
+};
+
+/* External Functions */
+
+/**
+ * Fill a RAM disk from the image at path (see disk_ram_image).
+ *
+ * @param       disk        Pointer to Disk structure (disk_ram_ops).
+ * @param       path        Path to disk image to load.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_ram_load(Disk *disk, const char *path)
+{
+    return disk_ram_image(disk, path, false);
+}
+
+/**
+ * Write the contents of a RAM disk to the image at path (see
+ * disk_ram_image).
+ *
+ * @param       disk        Pointer to Disk structure (disk_ram_ops).
+ * @param       path        Path to disk image to save.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_ram_save(Disk *disk, const char *path)
+{
+    return disk_ram_image(disk, path, true);
+}
+
+/* Backend Functions */
+
+/**
+ * Attach the RAM backend by doing the following:
+ *
+ *  1. Mapping blocks * BLOCK_SIZE bytes of anonymous memory, with
+ *  MAP_HUGETLB when huge pages are requested.  If no huge pages are
+ *  reserved, fall back to a normal mapping and ask for transparent huge
+ *  pages with madvise instead.
+ *
+ *  2. Loading the image at path into the mapping, if path names an existing
+ *  file.
+ *
+ * The path is otherwise unused: writes are never persisted unless the
+ * caller saves the disk with disk_ram_save.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image to load (or NULL).
+ * @param       options     Disk options (NULL for defaults).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_ram_open(Disk *disk, const char *path, const DiskOptions *options)
+{
+    if (options && options->direct)
+    {
+        error("O_DIRECT cannot be combined with DISK_MODE_RAM");
+        return DISK_FAILURE;
+    }
+
+    DiskRam *ram = calloc(1, sizeof(DiskRam));
+    if (!ram)
+    {
+        error("failed on malloc for DiskRam");
+        return DISK_FAILURE;
+    }
+    disk->private = ram;
+
+    size_t length = max(disk->blocks * BLOCK_SIZE, (size_t)BLOCK_SIZE);
+    if (options && options->huge_pages)
+    {
+        ram->length = (length + DISK_RAM_HUGE_PAGE - 1) & ~(DISK_RAM_HUGE_PAGE - 1);
+        ram->data = mmap(NULL, ram->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        ram->huge = ram->data != MAP_FAILED;
+        if (!ram->huge)
+            info("huge pages unavailable, falling back to normal pages");
+    }
+
+    if (!ram->huge)
+    {
+        ram->length = length;
+        ram->data = mmap(NULL, ram->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ram->data == MAP_FAILED)
+        {
+            error("failed to map %zu bytes for RAM disk: %s", ram->length, strerror(errno));
+            free(ram);
+            disk->private = NULL;
+            return DISK_FAILURE;
+        }
+#ifdef MADV_HUGEPAGE
+        if (options && options->huge_pages)
+            madvise(ram->data, ram->length, MADV_HUGEPAGE);
+#endif
+    }
+
+    if (path && access(path, F_OK) == 0 && disk_ram_load(disk, path) == DISK_FAILURE)
+    {
+        disk_ram_close(disk);
+        return DISK_FAILURE;
+    }
+
+    return 0;
+}
+
+/**
+ * Copy one block out of memory.
+ **/
+ssize_t disk_ram_read(Disk *disk, size_t block, char *data)
+{
+    memcpy(data, disk_ram_ptr(disk, block), BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+/**
+ * Copy one block into memory.
+ **/
+ssize_t disk_ram_write(Disk *disk, size_t block, char *data)
+{
+    memcpy(disk_ram_ptr(disk, block), data, BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+/**
+ * Return a pointer to block inside the mapping.
+ **/
+char *disk_ram_ptr(Disk *disk, size_t block)
+{
+    return ((DiskRam *)disk->private)->data + block * BLOCK_SIZE;
+}
+
+/**
+ * Return the pages behind count blocks to the kernel (they fault back in as
+ * zeroes).  Huge pages cannot be released a block at a time, so they are
+ * just zeroed.
+ **/
+int disk_ram_discard(Disk *disk, size_t block, size_t count)
+{
+    DiskRam *ram = disk->private;
+    char *start = disk_ram_ptr(disk, block);
+    if (ram->huge || madvise(start, count * BLOCK_SIZE, MADV_DONTNEED) == -1)
+        memset(start, 0, count * BLOCK_SIZE);
+    return 0;
+}
+
+/**
+ * Release the mapping (contents are discarded).
+ **/
+void disk_ram_close(Disk *disk)
+{
+    DiskRam *ram = disk->private;
+    if (!ram)
+        return;
+    if (munmap(ram->data, ram->length) == -1)
+        error("failed to munmap RAM disk");
+    free(ram);
+    disk->private = NULL;
+}
+
+/* Internal Functions */
+
+/**
+ * Copy a RAM disk from or to a disk image by doing the following:
+ *
+ *  1. Opening the image (created and sized to blocks * BLOCK_SIZE when
+ *  saving).
+ *
+ *  2. Transferring the whole mapping with large read/write calls, retrying
+ *  on short transfers and EINTR.  A short image loads as zeroes past its
+ *  end.
+ *
+ * Transfers bypass the buffer cache and are not counted as disk reads or
+ * writes, so a caller should flush a cached RAM disk before saving it.
+ *
+ * @param       disk        Pointer to Disk structure (disk_ram_ops).
+ * @param       path        Path to disk image.
+ * @param       save        Whether to save (true) or load (false).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_ram_image(Disk *disk, const char *path, bool save)
+{
+    const char *name = save ? "disk_ram_save" : "disk_ram_load";
+    if (!disk || disk->ops != &disk_ram_ops || !path)
+    {
+        error("%s: not a RAM disk", name);
+        return DISK_FAILURE;
+    }
+
+    DiskRam *ram = disk->private;
+    size_t length = disk->blocks * BLOCK_SIZE;
+    int fd = save ? open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR) : open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        error("%s: failed to open file %s: %s", name, path, strerror(errno));
+        return DISK_FAILURE;
+    }
+
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = save ? write(fd, ram->data + done, length - done)
+                         : read(fd, ram->data + done, length - done);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error("%s: failed at offset [%zu]: %s", name, done, strerror(errno));
+            close(fd);
+            return DISK_FAILURE;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    if (!save)
+        memset(ram->data + done, 0, length - done);
+    else if (done != length)
+    {
+        error("%s: incomplete (%zu/%zu bytes)", name, done, length);
+        close(fd);
+        return DISK_FAILURE;
+    }
+
+    if (close(fd) == -1)
+    {
+        error("%s: failed to close file %s", name, path);
+        return DISK_FAILURE;
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
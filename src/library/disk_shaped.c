@@ -0,0 +1,349 @@
+/* disk_shaped.c: SimpleFS disk backend that shapes another backend's service times */
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+/* Internal Constants */
+
+#define DISK_SHAPED_JITTER_CAP (1000) /* Largest jitter sample, in means */
+
+/* Internal Structures */
+
+typedef struct DiskShaped DiskShaped;
+
+struct DiskShaped
+{
+    Disk *inner;       /* Wrapped disk (opened with the requested backend) */
+    DiskShape shape;   /* Service time model */
+    uint64_t busy;     /* Time the device finishes the work given so far (atomic) */
+    size_t head;       /* Block after the previous operation (atomic) */
+    uint64_t sequence; /* Random numbers drawn so far (atomic) */
+};
+
+/* Internal Prototyes */
+
+int disk_shaped_open(Disk *disk, const char *path, const DiskOptions *options);
+ssize_t disk_shaped_read(Disk *disk, size_t block, char *data);
+ssize_t disk_shaped_write(Disk *disk, size_t block, char *data);
+ssize_t disk_shaped_readv(Disk *disk, size_t block, size_t count, char **data);
+ssize_t disk_shaped_writev(Disk *disk, size_t block, size_t count, char **data);
+int disk_shaped_flush(Disk *disk);
+int disk_shaped_discard(Disk *disk, size_t block, size_t count);
+void disk_shaped_close(Disk *disk);
+ssize_t disk_shaped_transfer(Disk *disk, size_t block, size_t count, char **data, bool write);
+uint64_t disk_shaped_schedule(DiskShaped *shaped, size_t block, size_t count);
+uint64_t disk_shaped_jitter(DiskShaped *shaped);
+double disk_shaped_random(DiskShaped *shaped);
+void disk_shaped_wait(uint64_t deadline);
+
+/* Backends */
+
+const DiskOps disk_shaped_ops = {
+    .name = "shaped",
+    .open = disk_shaped_open,
+    .read = disk_shaped_read,
+    .write = disk_shaped_write,
+    .readv = disk_shaped_readv,
+    .writev = disk_shaped_writev,
+    .flush = disk_shaped_flush,
+    .discard = disk_shaped_discard,
+    .close = disk_shaped_close,
+};
+
+/* Shapes */
+
+const DiskShape disk_shape_hdd = {
+    .latency = 50000,         /* Controller overhead */
+    .bandwidth = 150000000,   /* Sustained media rate */
+    .track_seek = 1000000,
+    .full_seek = 15000000,    /* About 8.5 ms for a third of the disk */
+    .rotation = 8333333,      /* 7200 rpm */
+};
+
+const DiskShape disk_shape_network = {
+    .latency = 300000,        /* LAN round trip plus target overhead */
+    .jitter = 200000,
+    .distribution = DISK_JITTER_EXPONENTIAL,
+    .bandwidth = 117000000,   /* 1 GbE payload */
+};
+
+const DiskShape disk_shape_cloud = {
+    .latency = 800000,
+    .jitter = 200000,
+    .distribution = DISK_JITTER_PARETO,
+    .bandwidth = 125000000,   /* Provisioned throughput */
+    .iops = 3000,             /* Provisioned IOPS */
+};
+
+/* Backend Functions */
+
+/**
+ * Attach the shaping backend by doing the following:
+ *
+ *  1. Opening the wrapped disk at path with the backend the options select
+ *  (options->ops or options->mode), without any of the generic layers: those
+ *  run on top of the shaped disk instead.
+ *
+ *  2. Copying the shape, so the caller's DiskShape need not outlive open.
+ *
+ * The wrapped backend's zero-copy pointer is not exposed, so every block
+ * goes through the shaped operations.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image.
+ * @param       options     Disk options (options->shape is required).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_shaped_open(Disk *disk, const char *path, const DiskOptions *options)
+{
+    if (!options || !options->shape)
+    {
+        error("disk_shaped_ops needs DiskOptions.shape");
+        return DISK_FAILURE;
+    }
+
+    DiskShaped *shaped = calloc(1, sizeof(DiskShaped));
+    if (!shaped)
+    {
+        error("failed on calloc for DiskShaped");
+        return DISK_FAILURE;
+    }
+
+    DiskOptions inner = {
+        .mode = options->mode,
+        .ops = options->ops == &disk_shaped_ops ? NULL : options->ops,
+        .direct = options->direct,
+        .pool_buffers = options->pool_buffers,
+        .huge_pages = options->huge_pages,
+    };
+    shaped->inner = disk_open_with(path, disk->blocks, &inner);
+    if (!shaped->inner)
+    {
+        free(shaped);
+        return DISK_FAILURE;
+    }
+
+    shaped->shape = *options->shape;
+    disk->private = shaped;
+    return 0;
+}
+
+/**
+ * Read one block, taking the shaped service time.
+ **/
+ssize_t disk_shaped_read(Disk *disk, size_t block, char *data)
+{
+    return disk_shaped_transfer(disk, block, 1, &data, false);
+}
+
+/**
+ * Write one block, taking the shaped service time.
+ **/
+ssize_t disk_shaped_write(Disk *disk, size_t block, char *data)
+{
+    return disk_shaped_transfer(disk, block, 1, &data, true);
+}
+
+/**
+ * Read contiguous blocks as one operation (one seek, one latency).
+ **/
+ssize_t disk_shaped_readv(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_shaped_transfer(disk, block, count, data, false);
+}
+
+/**
+ * Write contiguous blocks as one operation (one seek, one latency).
+ **/
+ssize_t disk_shaped_writev(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_shaped_transfer(disk, block, count, data, true);
+}
+
+/**
+ * Flush the wrapped disk once the device has finished earlier work, plus
+ * one latency.
+ **/
+int disk_shaped_flush(Disk *disk)
+{
+    DiskShaped *shaped = disk->private;
+    uint64_t deadline = disk_shaped_schedule(shaped, SIZE_MAX, 0);
+    int result = disk_flush(shaped->inner);
+    disk_shaped_wait(deadline);
+    return result;
+}
+
+/**
+ * Discard blocks of the wrapped disk, plus one latency.
+ **/
+int disk_shaped_discard(Disk *disk, size_t block, size_t count)
+{
+    DiskShaped *shaped = disk->private;
+    uint64_t deadline = disk_shaped_schedule(shaped, SIZE_MAX, 0);
+    int result = disk_discard(shaped->inner, block, count);
+    int saved = errno;
+    disk_shaped_wait(deadline);
+    errno = saved;
+    return result;
+}
+
+/**
+ * Close the wrapped disk (without reporting its statistics).
+ **/
+void disk_shaped_close(Disk *disk)
+{
+    DiskShaped *shaped = disk->private;
+    if (!shaped)
+        return;
+    disk_release(shaped->inner);
+    free(shaped);
+    disk->private = NULL;
+}
+
+/* Internal Functions */
+
+/**
+ * Transfer count contiguous blocks with the wrapped disk, then sleep until
+ * the operation's shaped completion time (the real transfer counts against
+ * it).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ * @param       data        Array of count data buffers.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t disk_shaped_transfer(Disk *disk, size_t block, size_t count, char **data, bool write)
+{
+    DiskShaped *shaped = disk->private;
+    uint64_t deadline = disk_shaped_schedule(shaped, block, count);
+    ssize_t result = disk_transfer(shaped->inner, block, count, data, write);
+    disk_shaped_wait(deadline);
+    return result;
+}
+
+/**
+ * Compute when an operation completes under the shape by doing the
+ * following:
+ *
+ *  1. Charging device time: a seek and a random part of a rotation unless
+ *  the operation starts where the previous one ended, the transfer at the
+ *  shape's bandwidth, and at least 1 / iops.
+ *
+ *  2. Queueing that time behind the work the device already has (one
+ *  operation at a time, shared by every thread).
+ *
+ *  3. Adding the fixed latency and a random jitter on top.
+ *
+ * @param       shaped      Shaping backend state.
+ * @param       block       First block (SIZE_MAX for operations without a
+ *                          position, which only wait for the device).
+ * @param       count       Number of blocks transferred.
+ *
+ * @return      Completion deadline (disk_clock time).
+ **/
+uint64_t disk_shaped_schedule(DiskShaped *shaped, size_t block, size_t count)
+{
+    const DiskShape *shape = &shaped->shape;
+    uint64_t service = 0;
+
+    if (block != SIZE_MAX)
+    {
+        size_t head = __atomic_exchange_n(&shaped->head, block + count, __ATOMIC_RELAXED);
+        if (head != block)
+        {
+            size_t distance = block > head ? block - head : head - block;
+            if (shape->full_seek > shape->track_seek)
+                service += shape->track_seek +
+                           (shape->full_seek - shape->track_seek) * sqrt((double)distance / shaped->inner->blocks);
+            else
+                service += shape->track_seek;
+            service += shape->rotation * disk_shaped_random(shaped);
+        }
+        if (shape->bandwidth)
+            service += (uint64_t)count * BLOCK_SIZE * 1000000000ULL / shape->bandwidth;
+        if (shape->iops)
+            service = max(service, 1000000000ULL / shape->iops);
+    }
+
+    uint64_t now = disk_clock();
+    uint64_t busy = __atomic_load_n(&shaped->busy, __ATOMIC_RELAXED);
+    uint64_t done;
+    do
+    {
+        done = max(busy, now) + service;
+    } while (!__atomic_compare_exchange_n(&shaped->busy, &busy, done, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return done + shape->latency + disk_shaped_jitter(shaped);
+}
+
+/**
+ * Draw one random latency from the shape's jitter distribution.
+ *
+ * @param       shaped      Shaping backend state.
+ *
+ * @return      Random latency (ns, at most DISK_SHAPED_JITTER_CAP means).
+ **/
+uint64_t disk_shaped_jitter(DiskShaped *shaped)
+{
+    const DiskShape *shape = &shaped->shape;
+    if (shape->jitter == 0)
+        return 0;
+
+    double u = disk_shaped_random(shaped);
+    double sample;
+    switch (shape->distribution)
+    {
+    case DISK_JITTER_EXPONENTIAL:
+        sample = -log(u) * shape->jitter;
+        break;
+    case DISK_JITTER_PARETO:
+        /* Minimum jitter / 2 gives mean jitter for alpha 2 */
+        sample = shape->jitter / 2.0 / sqrt(u);
+        break;
+    default:
+        sample = 2.0 * u * shape->jitter;
+        break;
+    }
+    return min(sample, (double)shape->jitter * DISK_SHAPED_JITTER_CAP);
+}
+
+/**
+ * Draw a uniform random number in (0, 1] from a splitmix64 sequence, so
+ * draws are thread-safe and a replay of the same operations sees the same
+ * numbers.
+ *
+ * @param       shaped      Shaping backend state.
+ *
+ * @return      Random number in (0, 1].
+ **/
+double disk_shaped_random(DiskShaped *shaped)
+{
+    uint64_t x = shaped->shape.seed + 0x9e3779b97f4a7c15ULL * (__atomic_fetch_add(&shaped->sequence, 1, __ATOMIC_RELAXED) + 1);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return ((x >> 11) + 1) * 0x1.0p-53;
+}
+
+/**
+ * Sleep until disk_clock reaches deadline.
+ *
+ * @param       deadline    Wake-up time (disk_clock time).
+ **/
+void disk_shaped_wait(uint64_t deadline)
+{
+    struct timespec until = {deadline / 1000000000ULL, deadline % 1000000000ULL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+        ;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
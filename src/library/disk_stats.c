@@ -0,0 +1,258 @@
+/* disk_stats.c: SimpleFS disk statistics and latency histograms */
+
+#include "sfs/disk.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Internal Prototyes */
+
+size_t disk_histogram_bucket(uint64_t value);
+uint64_t disk_histogram_bound(size_t bucket);
+void disk_histogram_record(DiskHistogram *histogram, uint64_t value);
+void disk_histogram_load(DiskHistogram *snapshot, const DiskHistogram *histogram);
+void disk_histogram_print(const DiskHistogram *histogram, const char *name, FILE *stream);
+
+/* External Functions */
+
+/**
+ * Take a consistent-enough snapshot of the disk statistics.  Counters are
+ * loaded one at a time, so a snapshot taken while other threads perform I/O
+ * may be off by the operations in flight.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       stats       Snapshot to fill in.
+ **/
+void disk_stats(Disk *disk, DiskStats *stats)
+{
+    memset(stats, 0, sizeof(DiskStats));
+    if (!disk)
+        return;
+
+    stats->reads = __atomic_load_n(&disk->reads, __ATOMIC_RELAXED);
+    stats->writes = __atomic_load_n(&disk->writes, __ATOMIC_RELAXED);
+    stats->bytes_read = __atomic_load_n(&disk->bytes_read, __ATOMIC_RELAXED);
+    stats->bytes_written = __atomic_load_n(&disk->bytes_written, __ATOMIC_RELAXED);
+    stats->discards = __atomic_load_n(&disk->discards, __ATOMIC_RELAXED);
+    stats->sequential = __atomic_load_n(&disk->sequential, __ATOMIC_RELAXED);
+    stats->random = __atomic_load_n(&disk->random, __ATOMIC_RELAXED);
+    stats->cache_hits = __atomic_load_n(&disk->cache_hits, __ATOMIC_RELAXED);
+    stats->cache_misses = __atomic_load_n(&disk->cache_misses, __ATOMIC_RELAXED);
+    stats->readahead_hits = __atomic_load_n(&disk->readahead_hits, __ATOMIC_RELAXED);
+    stats->writes_absorbed = __atomic_load_n(&disk->writes_absorbed, __ATOMIC_RELAXED);
+    stats->write_queue_flushes = __atomic_load_n(&disk->write_queue_flushes, __ATOMIC_RELAXED);
+    stats->checksum_errors = __atomic_load_n(&disk->checksum_errors, __ATOMIC_RELAXED);
+    stats->compressed_blocks = __atomic_load_n(&disk->compressed_blocks, __ATOMIC_RELAXED);
+    stats->compressed_bytes = __atomic_load_n(&disk->compressed_bytes, __ATOMIC_RELAXED);
+    stats->mirror_failures = __atomic_load_n(&disk->mirror_failures, __ATOMIC_RELAXED);
+    stats->mirror_resyncs = __atomic_load_n(&disk->mirror_resyncs, __ATOMIC_RELAXED);
+    stats->commits = __atomic_load_n(&disk->commits, __ATOMIC_RELAXED);
+    stats->commit_flushes = __atomic_load_n(&disk->commit_flushes, __ATOMIC_RELAXED);
+    disk_histogram_load(&stats->read_latency, &disk->read_latency);
+    disk_histogram_load(&stats->write_latency, &disk->write_latency);
+}
+
+/**
+ * Print a statistics snapshot: byte totals, access pattern and the read and
+ * write latency distributions.  Nothing is printed for an idle disk.
+ *
+ * @param       stats       Statistics snapshot (see disk_stats).
+ * @param       stream      Output stream.
+ **/
+void disk_stats_print(const DiskStats *stats, FILE *stream)
+{
+    size_t operations = stats->sequential + stats->random;
+    if (operations == 0 && stats->cache_hits == 0 && stats->discards == 0)
+        return;
+
+    fprintf(stream, "disk: %zu bytes read, %zu bytes written, %zu blocks discarded\n",
+            stats->bytes_read, stats->bytes_written, stats->discards);
+    fprintf(stream, "disk: %zu operations (%zu sequential, %zu random)\n", operations, stats->sequential, stats->random);
+    if (stats->cache_hits || stats->cache_misses)
+        fprintf(stream, "disk: %zu cache hits, %zu cache misses\n", stats->cache_hits, stats->cache_misses);
+    if (stats->readahead_hits)
+        fprintf(stream, "disk: %zu readahead hits\n", stats->readahead_hits);
+    if (stats->write_queue_flushes)
+        fprintf(stream, "disk: %zu write queue flushes, %zu queued writes absorbed\n",
+                stats->write_queue_flushes, stats->writes_absorbed);
+    if (stats->checksum_errors)
+        fprintf(stream, "disk: %zu checksum errors\n", stats->checksum_errors);
+    if (stats->compressed_blocks)
+        fprintf(stream, "disk: %zu blocks compressed to %zu bytes (%.2fx)\n", stats->compressed_blocks,
+                stats->compressed_bytes, (double)stats->compressed_blocks * BLOCK_SIZE / stats->compressed_bytes);
+    if (stats->mirror_failures || stats->mirror_resyncs)
+        fprintf(stream, "disk: %zu mirror members failed, %zu resynced\n", stats->mirror_failures,
+                stats->mirror_resyncs);
+    if (stats->commits)
+        fprintf(stream, "disk: %zu commits in %zu flushes\n", stats->commits, stats->commit_flushes);
+    disk_histogram_print(&stats->read_latency, "read", stream);
+    disk_histogram_print(&stats->write_latency, "write", stream);
+}
+
+/**
+ * Estimate a percentile from a latency histogram.
+ *
+ * @param       histogram   Latency histogram.
+ * @param       percentile  Percentile to estimate (0.0 to 100.0).
+ *
+ * @return      Upper bound of the bucket holding the percentile (capped at
+ *              the largest sample, 0 for an empty histogram), in ns.
+ **/
+uint64_t disk_histogram_percentile(const DiskHistogram *histogram, double percentile)
+{
+    if (histogram->count == 0)
+        return 0;
+
+    /* Rank of the sample at the percentile (1-based, rounded up) */
+    double exact = percentile / 100.0 * histogram->count;
+    size_t rank = (size_t)exact;
+    if (rank < exact || rank == 0)
+        rank++;
+
+    size_t seen = 0;
+    for (size_t bucket = 0; bucket < DISK_HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += histogram->buckets[bucket];
+        if (seen >= rank)
+        {
+            uint64_t bound = disk_histogram_bound(bucket);
+            return bound < histogram->max ? bound : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/**
+ * Return a monotonic timestamp in nanoseconds.
+ **/
+uint64_t disk_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Account one completed backend operation by doing the following:
+ *
+ *  1. Adding count blocks to the read or write counters and byte totals.
+ *
+ *  2. Classifying the operation as sequential if it starts at the block
+ *  right after the previous operation, and as random otherwise.
+ *
+ *  3. Recording the time since start in the read or write histogram.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block transferred.
+ * @param       count       Number of blocks transferred.
+ * @param       write       Whether operation was a write (true) or read (false).
+ * @param       start       Time operation started (disk_clock).
+ **/
+void disk_account(Disk *disk, size_t block, size_t count, bool write, uint64_t start)
+{
+    uint64_t elapsed = disk_clock() - start;
+
+    __atomic_fetch_add(write ? &disk->writes : &disk->reads, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(write ? &disk->bytes_written : &disk->bytes_read, count * BLOCK_SIZE, __ATOMIC_RELAXED);
+
+    size_t previous = __atomic_exchange_n(&disk->next_block, block + count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(previous == block ? &disk->sequential : &disk->random, 1, __ATOMIC_RELAXED);
+
+    disk_histogram_record(write ? &disk->write_latency : &disk->read_latency, elapsed);
+}
+
+/* Internal Functions */
+
+/**
+ * Map a value to its log-linear histogram bucket: values below
+ * 2^(DISK_HISTOGRAM_BITS + 1) map to themselves, larger values to the
+ * power of two below them plus the next DISK_HISTOGRAM_BITS bits.
+ *
+ * @param       value       Value to map.
+ *
+ * @return      Bucket index (below DISK_HISTOGRAM_BUCKETS).
+ **/
+size_t disk_histogram_bucket(uint64_t value)
+{
+    const uint64_t sub = 1ULL << DISK_HISTOGRAM_BITS;
+    if (value < sub)
+        return value;
+
+    unsigned exponent = 63 - __builtin_clzll(value);
+    unsigned shift = exponent - DISK_HISTOGRAM_BITS;
+    return ((shift + 1) << DISK_HISTOGRAM_BITS) + ((value >> shift) - sub);
+}
+
+/**
+ * Return the largest value that maps to bucket.
+ *
+ * @param       bucket      Bucket index.
+ *
+ * @return      Inclusive upper bound of bucket.
+ **/
+uint64_t disk_histogram_bound(size_t bucket)
+{
+    const uint64_t sub = 1ULL << DISK_HISTOGRAM_BITS;
+    if (bucket < sub)
+        return bucket;
+
+    unsigned shift = (bucket >> DISK_HISTOGRAM_BITS) - 1;
+    uint64_t mantissa = sub + (bucket & (sub - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+/**
+ * Add one sample to a histogram (safe against concurrent recorders).
+ *
+ * @param       histogram   Latency histogram.
+ * @param       value       Sample (ns).
+ **/
+void disk_histogram_record(DiskHistogram *histogram, uint64_t value)
+{
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[disk_histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Copy a live histogram into a snapshot with atomic loads.
+ *
+ * @param       snapshot    Histogram to fill in.
+ * @param       histogram   Live histogram.
+ **/
+void disk_histogram_load(DiskHistogram *snapshot, const DiskHistogram *histogram)
+{
+    snapshot->count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    snapshot->total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+    snapshot->max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    for (size_t bucket = 0; bucket < DISK_HISTOGRAM_BUCKETS; bucket++)
+        snapshot->buckets[bucket] = __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+}
+
+/**
+ * Print one latency distribution in microseconds (nothing if empty).
+ *
+ * @param       histogram   Latency histogram.
+ * @param       name        Operation name.
+ * @param       stream      Output stream.
+ **/
+void disk_histogram_print(const DiskHistogram *histogram, const char *name, FILE *stream)
+{
+    if (histogram->count == 0)
+        return;
+
+    fprintf(stream, "disk: %s latency (us): %zu ops, mean %.1f, p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+            name, histogram->count,
+            histogram->total / 1000.0 / histogram->count,
+            disk_histogram_percentile(histogram, 50.0) / 1000.0,
+            disk_histogram_percentile(histogram, 99.0) / 1000.0,
+            disk_histogram_percentile(histogram, 99.9) / 1000.0,
+            histogram->max / 1000.0);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
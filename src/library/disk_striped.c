@@ -0,0 +1,270 @@
+/* disk_striped.c: SimpleFS disk backend that stripes blocks across several images */
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+#include "sfs/members.h"
+#include "sfs/utils.h"
+
+#include <string.h>
+
+/* Internal Structures */
+
+typedef struct DiskStriped DiskStriped;
+
+struct DiskStriped
+{
+    size_t unit;       /* Stripe unit (blocks) */
+    Members *members;  /* Member images and their workers */
+};
+
+/* Internal Prototyes */
+
+int disk_striped_open(Disk *disk, const char *path, const DiskOptions *options);
+ssize_t disk_striped_read(Disk *disk, size_t block, char *data);
+ssize_t disk_striped_write(Disk *disk, size_t block, char *data);
+ssize_t disk_striped_readv(Disk *disk, size_t block, size_t count, char **data);
+ssize_t disk_striped_writev(Disk *disk, size_t block, size_t count, char **data);
+int disk_striped_flush(Disk *disk);
+int disk_striped_discard(Disk *disk, size_t block, size_t count);
+void disk_striped_close(Disk *disk);
+void disk_striped_locate(DiskStriped *striped, size_t block, size_t *member, size_t *member_block);
+ssize_t disk_striped_split(Disk *disk, size_t block, size_t count, char **data, int operation);
+
+/* Backends */
+
+const DiskOps disk_striped_ops = {
+    .name = "striped",
+    .open = disk_striped_open,
+    .read = disk_striped_read,
+    .write = disk_striped_write,
+    .readv = disk_striped_readv,
+    .writev = disk_striped_writev,
+    .flush = disk_striped_flush,
+    .discard = disk_striped_discard,
+    .close = disk_striped_close,
+};
+
+/* Backend Functions */
+
+/**
+ * Attach the striping backend by doing the following:
+ *
+ *  1. Sizing the members to hold an equal share of the stripes.
+ *
+ *  2. Opening each image in path (see members_open) with the backend the
+ *  options select (options->ops or options->mode, shaped if options->shape
+ *  is set, so each member models its own device).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Comma-separated paths of the member images.
+ * @param       options     Disk options (options->stripe_blocks is required).
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int disk_striped_open(Disk *disk, const char *path, const DiskOptions *options)
+{
+    if (!options || !options->stripe_blocks)
+    {
+        error("disk_striped_ops needs DiskOptions.stripe_blocks");
+        return DISK_FAILURE;
+    }
+
+    DiskStriped *striped = calloc(1, sizeof(DiskStriped));
+    if (!striped)
+    {
+        error("failed on calloc for DiskStriped");
+        return DISK_FAILURE;
+    }
+
+    /* Every member holds the same number of whole stripe units */
+    size_t nmembers = 1;
+    for (const char *c = path; *c; c++)
+        nmembers += *c == ',';
+    size_t row = options->stripe_blocks * nmembers;
+    striped->unit = options->stripe_blocks;
+
+    DiskOptions inner = {
+        .mode = options->mode,
+        .ops = options->ops == &disk_striped_ops ? NULL : options->ops,
+        .direct = options->direct,
+        .pool_buffers = options->pool_buffers,
+        .huge_pages = options->huge_pages,
+        .shape = options->shape,
+    };
+    striped->members = members_open(path, (disk->blocks + row - 1) / row * striped->unit, &inner, false);
+    if (!striped->members || striped->members->count != nmembers)
+    {
+        if (striped->members)
+            error("empty member path in %s", path);
+        members_close(striped->members);
+        free(striped);
+        return DISK_FAILURE;
+    }
+
+    disk->private = striped;
+    return 0;
+}
+
+/**
+ * Read one block from the member holding it.
+ **/
+ssize_t disk_striped_read(Disk *disk, size_t block, char *data)
+{
+    return disk_striped_split(disk, block, 1, &data, MEMBER_READ);
+}
+
+/**
+ * Write one block to the member holding it.
+ **/
+ssize_t disk_striped_write(Disk *disk, size_t block, char *data)
+{
+    return disk_striped_split(disk, block, 1, &data, MEMBER_WRITE);
+}
+
+/**
+ * Read contiguous blocks, one vectored read per member, in parallel.
+ **/
+ssize_t disk_striped_readv(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_striped_split(disk, block, count, data, MEMBER_READ);
+}
+
+/**
+ * Write contiguous blocks, one vectored write per member, in parallel.
+ **/
+ssize_t disk_striped_writev(Disk *disk, size_t block, size_t count, char **data)
+{
+    return disk_striped_split(disk, block, count, data, MEMBER_WRITE);
+}
+
+/**
+ * Flush every member in parallel.
+ **/
+int disk_striped_flush(Disk *disk)
+{
+    DiskStriped *striped = disk->private;
+    MemberJob jobs[MEMBERS_MAX];
+    for (size_t i = 0; i < striped->members->count; i++)
+        jobs[i] = (MemberJob){.member = i, .operation = MEMBER_FLUSH};
+    return members_submit(striped->members, jobs, striped->members->count) == DISK_FAILURE ? DISK_FAILURE : 0;
+}
+
+/**
+ * Discard blocks, one contiguous discard per member, in parallel.
+ **/
+int disk_striped_discard(Disk *disk, size_t block, size_t count)
+{
+    return disk_striped_split(disk, block, count, NULL, MEMBER_DISCARD) == DISK_FAILURE ? DISK_FAILURE : 0;
+}
+
+/**
+ * Stop the workers and close the members (without reporting their
+ * statistics).
+ **/
+void disk_striped_close(Disk *disk)
+{
+    DiskStriped *striped = disk->private;
+    if (!striped)
+        return;
+    members_close(striped->members);
+    free(striped);
+    disk->private = NULL;
+}
+
+/* Internal Functions */
+
+/**
+ * Find the member and member block behind a block: stripe units are dealt
+ * to the members in turn.
+ **/
+void disk_striped_locate(DiskStriped *striped, size_t block, size_t *member, size_t *member_block)
+{
+    size_t stripe = block / striped->unit;
+    *member = stripe % striped->members->count;
+    *member_block = stripe / striped->members->count * striped->unit + block % striped->unit;
+}
+
+/**
+ * Split an operation on count contiguous blocks into one share per member
+ * by doing the following:
+ *
+ *  1. Walking the range a stripe unit at a time.  The units a contiguous
+ *  range puts on one member are adjacent there, so each member's share is a
+ *  single contiguous run of member blocks.
+ *
+ *  2. Gathering each member's data buffers in member block order.
+ *
+ *  3. Running the shares in parallel (see members_submit).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ * @param       data        Array of count data buffers (NULL to discard).
+ * @param       operation   MEMBER_READ, WRITE or DISCARD.
+ *
+ * @return      count * BLOCK_SIZE on success, DISK_FAILURE on failure.
+ **/
+ssize_t disk_striped_split(Disk *disk, size_t block, size_t count, char **data, int operation)
+{
+    DiskStriped *striped = disk->private;
+    MemberJob jobs[MEMBERS_MAX];
+    size_t slot[MEMBERS_MAX];
+    size_t njobs = 0;
+
+    for (size_t i = 0; i < striped->members->count; i++)
+        slot[i] = SIZE_MAX;
+
+    for (size_t i = 0; i < count;)
+    {
+        size_t member, member_block;
+        disk_striped_locate(striped, block + i, &member, &member_block);
+        size_t n = min(striped->unit - (block + i) % striped->unit, count - i);
+        if (slot[member] == SIZE_MAX)
+        {
+            slot[member] = njobs;
+            jobs[njobs++] = (MemberJob){.member = member, .operation = operation, .block = member_block};
+        }
+        jobs[slot[member]].count += n;
+        i += n;
+    }
+
+    /* A single share keeps the caller's buffers, which are already in order */
+    char **gathered = NULL;
+    if (data && njobs == 1)
+    {
+        jobs[0].data = data;
+    }
+    else if (data)
+    {
+        gathered = malloc(count * sizeof(char *));
+        if (!gathered)
+        {
+            error("failed on malloc for striped transfer");
+            return DISK_FAILURE;
+        }
+
+        size_t offset = 0;
+        for (size_t j = 0; j < njobs; j++)
+        {
+            jobs[j].data = gathered + offset;
+            offset += jobs[j].count;
+            jobs[j].count = 0;
+        }
+        for (size_t i = 0; i < count;)
+        {
+            size_t member, member_block;
+            disk_striped_locate(striped, block + i, &member, &member_block);
+            size_t n = min(striped->unit - (block + i) % striped->unit, count - i);
+            MemberJob *job = &jobs[slot[member]];
+            memcpy(job->data + job->count, data + i, n * sizeof(char *));
+            job->count += n;
+            i += n;
+        }
+    }
+
+    ssize_t result = members_submit(striped->members, jobs, njobs);
+    free(gathered);
+    return result == DISK_FAILURE ? DISK_FAILURE : (ssize_t)(count * BLOCK_SIZE);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,390 @@
+/* elevator.c: SimpleFS elevator write queue */
+
+#include "sfs/elevator.h"
+#include "sfs/logging.h"
+#include "sfs/readahead.h"
+
+#include <limits.h>
+#include <string.h>
+
+/* Internal Constants */
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+/* Internal Prototyes */
+
+size_t elevator_search(Elevator *elevator, size_t block);
+void elevator_insert(Elevator *elevator, size_t index, size_t block, const char *data);
+void elevator_remove(Elevator *elevator, size_t block, size_t count);
+int elevator_sweep(Elevator *elevator, Disk *disk);
+int elevator_write_runs(Elevator *elevator, Disk *disk, size_t begin, size_t end);
+
+/* External Functions */
+
+/**
+ * Create a write queue of capacity DISK_ALIGNMENT aligned frames.
+ *
+ * @param       capacity    Number of blocks that may be queued at once.
+ * @param       delay       Queue age that forces a flush (ns).
+ *
+ * @return      Pointer to newly allocated Elevator (NULL on failure).
+ **/
+Elevator *elevator_create(size_t capacity, uint64_t delay)
+{
+    Elevator *elevator = calloc(1, sizeof(Elevator));
+    if (!elevator)
+    {
+        error("failed on calloc for Elevator");
+        return NULL;
+    }
+
+    elevator->capacity = capacity;
+    elevator->delay = delay;
+    elevator->entries = calloc(capacity, sizeof(ElevatorEntry));
+    elevator->free_frames = calloc(capacity, sizeof(char *));
+    if (!elevator->entries || !elevator->free_frames ||
+        posix_memalign((void **)&elevator->frames, DISK_ALIGNMENT, capacity * BLOCK_SIZE) != 0)
+    {
+        error("failed to allocate write queue of %zu blocks", capacity);
+        free(elevator->free_frames);
+        free(elevator->entries);
+        free(elevator);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < capacity; i++)
+        elevator->free_frames[i] = elevator->frames + (capacity - 1 - i) * BLOCK_SIZE;
+
+    pthread_mutex_init(&elevator->lock, NULL);
+    return elevator;
+}
+
+/**
+ * Release write queue memory.  Queued blocks are lost, so flush first (see
+ * elevator_flush).
+ *
+ * @param       elevator    Pointer to Elevator structure.
+ **/
+void elevator_destroy(Elevator *elevator)
+{
+    if (!elevator)
+        return;
+
+    if (elevator->count > 0)
+        error("%zu queued writes lost", elevator->count);
+    pthread_mutex_destroy(&elevator->lock);
+    free(elevator->frames);
+    free(elevator->free_frames);
+    free(elevator->entries);
+    free(elevator);
+}
+
+/**
+ * Queue count contiguous block writes by doing the following:
+ *
+ *  1. Writing runs at least as long as the queue straight to the backend,
+ *  after dropping the queued copies they supersede.
+ *
+ *  2. Otherwise copying each block into the queue: a block that is already
+ *  queued is overwritten in place (the earlier write is absorbed), a new
+ *  one takes a frame, sweeping the queue first if it is full (and failing
+ *  if blocks whose writes failed still fill it).
+ *
+ *  3. Sweeping the queue once it is full or its oldest block has waited
+ *  longer than the delay.  The age is only checked here, so an idle queue
+ *  waits for the next write, barrier or flush.
+ *
+ * @param       elevator    Pointer to Elevator structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number (already sanity checked).
+ * @param       count       Number of blocks.
+ * @param       data        Array of count data buffers.
+ *
+ * @return      Number of bytes queued or written (DISK_FAILURE if a sweep
+ *              failed).
+ **/
+ssize_t elevator_write(Elevator *elevator, Disk *disk, size_t block, size_t count, char **data)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&elevator->lock);
+    if (count >= elevator->capacity)
+    {
+        elevator_remove(elevator, block, count);
+        if (disk->readahead)
+            readahead_invalidate(disk->readahead, block, count);
+        if (disk_transfer(disk, block, count, data, true) == DISK_FAILURE)
+            result = DISK_FAILURE;
+        pthread_mutex_unlock(&elevator->lock);
+        return result == DISK_FAILURE ? DISK_FAILURE : (ssize_t)(count * BLOCK_SIZE);
+    }
+
+    for (size_t i = 0; i < count && result != DISK_FAILURE; i++)
+    {
+        size_t index = elevator_search(elevator, block + i);
+        if (index < elevator->count && elevator->entries[index].block == block + i)
+        {
+            memcpy(elevator->entries[index].data, data[i], BLOCK_SIZE);
+            __atomic_fetch_add(&disk->writes_absorbed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (elevator->count == elevator->capacity)
+        {
+            result = elevator_sweep(elevator, disk);
+            if (elevator->count == elevator->capacity)
+                break;
+            index = elevator_search(elevator, block + i);
+        }
+        elevator_insert(elevator, index, block + i, data[i]);
+    }
+
+    if (result != DISK_FAILURE && elevator->count > 0 &&
+        (elevator->count == elevator->capacity || disk_clock() - elevator->oldest >= elevator->delay))
+        result = elevator_sweep(elevator, disk);
+    pthread_mutex_unlock(&elevator->lock);
+
+    return result == DISK_FAILURE ? DISK_FAILURE : (ssize_t)(count * BLOCK_SIZE);
+}
+
+/**
+ * Serve a read from the write queue, so readers see queued writes.
+ *
+ * @param       elevator    Pointer to Elevator structure.
+ * @param       block       Block number to read.
+ * @param       data        Data buffer.
+ *
+ * @return      Whether block was queued (and copied into data).
+ **/
+bool elevator_read(Elevator *elevator, size_t block, char *data)
+{
+    if (__atomic_load_n(&elevator->count, __ATOMIC_ACQUIRE) == 0)
+        return false;
+
+    pthread_mutex_lock(&elevator->lock);
+    size_t index = elevator_search(elevator, block);
+    bool hit = index < elevator->count && elevator->entries[index].block == block;
+    if (hit)
+        memcpy(data, elevator->entries[index].data, BLOCK_SIZE);
+    pthread_mutex_unlock(&elevator->lock);
+
+    return hit;
+}
+
+/**
+ * Check whether a write to block is queued.
+ *
+ * @param       elevator    Pointer to Elevator structure.
+ * @param       block       Block number.
+ *
+ * @return      Whether block is queued.
+ **/
+bool elevator_queued(Elevator *elevator, size_t block)
+{
+    if (__atomic_load_n(&elevator->count, __ATOMIC_ACQUIRE) == 0)
+        return false;
+
+    pthread_mutex_lock(&elevator->lock);
+    size_t index = elevator_search(elevator, block);
+    bool queued = index < elevator->count && elevator->entries[index].block == block;
+    pthread_mutex_unlock(&elevator->lock);
+
+    return queued;
+}
+
+/**
+ * Drop queued writes to count blocks starting at block because they are
+ * being discarded.
+ *
+ * @param       elevator    Pointer to Elevator structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ **/
+void elevator_discard(Elevator *elevator, size_t block, size_t count)
+{
+    pthread_mutex_lock(&elevator->lock);
+    elevator_remove(elevator, block, count);
+    pthread_mutex_unlock(&elevator->lock);
+}
+
+/**
+ * Write every queued block to the backend (see elevator_sweep).
+ *
+ * @param       elevator    Pointer to Elevator structure.
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int elevator_flush(Elevator *elevator, Disk *disk)
+{
+    pthread_mutex_lock(&elevator->lock);
+    int result = elevator_sweep(elevator, disk);
+    pthread_mutex_unlock(&elevator->lock);
+    return result;
+}
+
+/* Internal Functions */
+
+/**
+ * Find the first queued entry whose block is not below block.
+ *
+ * @param       elevator    Pointer to Elevator structure.
+ * @param       block       Block number.
+ *
+ * @return      Entry index (count if every queued block is below block).
+ **/
+size_t elevator_search(Elevator *elevator, size_t block)
+{
+    size_t low = 0;
+    size_t high = elevator->count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (elevator->entries[middle].block < block)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/**
+ * Queue a copy of block at entry index, taking a frame from the free stack
+ * (the queue must not be full).
+ *
+ * @param       elevator    Pointer to Elevator structure.
+ * @param       index       Entry index keeping the queue sorted.
+ * @param       block       Block number.
+ * @param       data        Block contents.
+ **/
+void elevator_insert(Elevator *elevator, size_t index, size_t block, const char *data)
+{
+    size_t count = elevator->count;
+    if (count == 0)
+        elevator->oldest = disk_clock();
+
+    ElevatorEntry *entry = &elevator->entries[index];
+    memmove(entry + 1, entry, (count - index) * sizeof(ElevatorEntry));
+    entry->block = block;
+    entry->data = elevator->free_frames[elevator->capacity - count - 1];
+    entry->failed = false;
+    memcpy(entry->data, data, BLOCK_SIZE);
+    __atomic_store_n(&elevator->count, count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Remove queued entries for count blocks starting at block, returning their
+ * frames to the free stack.
+ *
+ * @param       elevator    Pointer to Elevator structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ **/
+void elevator_remove(Elevator *elevator, size_t block, size_t count)
+{
+    size_t begin = elevator_search(elevator, block);
+    size_t end = elevator_search(elevator, block + count);
+    if (begin == end)
+        return;
+
+    size_t queued = elevator->count;
+    for (size_t i = begin; i < end; i++)
+        elevator->free_frames[elevator->capacity - queued + (i - begin)] = elevator->entries[i].data;
+    memmove(&elevator->entries[begin], &elevator->entries[end], (queued - end) * sizeof(ElevatorEntry));
+    __atomic_store_n(&elevator->count, queued - (end - begin), __ATOMIC_RELEASE);
+}
+
+/**
+ * Write every queued block to the backend in one elevator sweep by doing
+ * the following:
+ *
+ *  1. Starting at the first queued block at or after the block following
+ *  the last disk operation, writing upwards to the end of the queue, then
+ *  wrapping around to the lowest block (C-SCAN order).
+ *
+ *  2. Coalescing runs of consecutive blocks into single vectored writes.
+ *
+ *  3. Emptying the queue of the blocks written.  Blocks whose write failed
+ *  stay queued (still served to readers) and are retried by the next
+ *  sweep, so every flush fails until they reach the backend.
+ *
+ * @param       elevator    Pointer to Elevator structure (locked).
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      0 on success, DISK_FAILURE on failure.
+ **/
+int elevator_sweep(Elevator *elevator, Disk *disk)
+{
+    size_t count = elevator->count;
+    if (count == 0)
+        return 0;
+
+    size_t head = elevator_search(elevator, __atomic_load_n(&disk->next_block, __ATOMIC_RELAXED));
+    int result = 0;
+    if (elevator_write_runs(elevator, disk, head, count) == DISK_FAILURE)
+        result = DISK_FAILURE;
+    if (elevator_write_runs(elevator, disk, 0, head) == DISK_FAILURE)
+        result = DISK_FAILURE;
+
+    size_t kept = 0;
+    size_t freed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (elevator->entries[i].failed)
+            elevator->entries[kept++] = elevator->entries[i];
+        else
+            elevator->free_frames[elevator->capacity - count + freed++] = elevator->entries[i].data;
+    }
+    if (kept > 0)
+        elevator->oldest = disk_clock();
+    __atomic_store_n(&elevator->count, kept, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&disk->write_queue_flushes, 1, __ATOMIC_RELAXED);
+    return result;
+}
+
+/**
+ * Write queued entries [begin, end) with one vectored write per run of
+ * consecutive blocks, invalidating prefetched copies as they are replaced
+ * and marking the entries of runs that failed.
+ *
+ * @param       elevator    Pointer to Elevator structure (locked).
+ * @param       disk        Pointer to Disk structure.
+ * @param       begin       First entry index.
+ * @param       end         Entry index after the last one.
+ *
+ * @return      0 on success, DISK_FAILURE if any run failed.
+ **/
+int elevator_write_runs(Elevator *elevator, Disk *disk, size_t begin, size_t end)
+{
+    char *data[IOV_MAX];
+    int result = 0;
+
+    size_t i = begin;
+    while (i < end)
+    {
+        ElevatorEntry *first = &elevator->entries[i];
+        size_t run = 0;
+        do
+        {
+            data[run] = first[run].data;
+            run++;
+        } while (i + run < end && run < IOV_MAX && first[run].block == first->block + run);
+
+        if (disk->readahead)
+            readahead_invalidate(disk->readahead, first->block, run);
+        bool failed = disk_transfer(disk, first->block, run, data, true) == DISK_FAILURE;
+        if (failed)
+        {
+            error("write queue: failed to write %zu blocks at block [%zu]", run, first->block);
+            result = DISK_FAILURE;
+        }
+        for (size_t r = 0; r < run; r++)
+            first[r].failed = failed;
+        i += run;
+    }
+    return result;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
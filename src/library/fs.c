@@ -6,6 +6,13 @@
 #include <math.h>
 #include <string.h>
 
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define INODE_TABLE_BATCH (64) /* Number of disk blocks of inode table read at once */
+#define BLOCK_VECTOR (64)      /* Number of disk blocks per disk_readv/disk_writev */
+
 /**
  * Debug FileSystem by doing the following
  *
@@ -17,20 +24,44 @@
  **/
 void fs_debug(Disk *disk)
 {
-    Block block;
+    FileSystem fs = {.disk = disk};
+    Block *block = fs_alloc_blocks(1, BLOCK_SIZE);
+    if (block == NULL)
+    {
+        error("failed to allocate block buffer");
+        return;
+    }
 
     /* Read SuperBlock */
-    if (disk_read(disk, 0, (char *)&block.data) == DISK_FAILURE)
+    if (disk_read(disk, 0, block->data) == DISK_FAILURE)
     {
         error("failed on disk_read for superblock");
+        free(block);
         return;
     }
 
-    SuperBlock sb = block.super;
+    SuperBlock sb = block->super;
+    free(block);
     printf("SuperBlock:\n");
     printf("    %u blocks\n", sb.blocks);
     printf("    %u inode blocks\n", sb.inode_blocks);
     printf("    %u inodes\n", sb.inodes);
+    if (sb.block_size != 0 && sb.block_size != BLOCK_SIZE)
+        printf("    %u bytes per block\n", sb.block_size);
+    if (sb.bitmap_blocks != 0)
+        printf("    %u bitmap blocks (%s)\n", sb.bitmap_blocks, sb.clean ? "clean" : "unclean");
+
+    if (!fs_set_geometry(&fs, sb.block_size))
+    {
+        error("unsupported block size %u", sb.block_size);
+        return;
+    }
+    block = fs_alloc_blocks(1, fs.block_size);
+    if (block == NULL)
+    {
+        error("failed to allocate block buffer");
+        return;
+    }
 
     /* Read Inodes */
     // printf("    %u inodes\n", block.);
@@ -41,16 +72,17 @@ void fs_debug(Disk *disk)
     int inodeBlockOffSet = 1;
     for (int b = inodeBlockOffSet; b < inodeBlockOffSet + sb.inode_blocks; b++)
     {
-        if (disk_read(disk, b, (char *)block.inodes) == DISK_FAILURE)
+        if (fs_read_blocks(&fs, b, 1, block->data) == DISK_FAILURE)
         {
             error("failed on disk_read at inodeBlockOffSet: %d", b);
+            free(block);
             return;
         }
 
-        for (int inode_idx = 0; inode_idx < INODES_PER_BLOCK; inode_idx++)
+        for (int inode_idx = 0; inode_idx < fs.inodes_per_block; inode_idx++)
         {
             // // for each inode
-            Inode inode = block.inodes[inode_idx];
+            Inode inode = block->inodes[inode_idx];
             printf("inodes[%d][%d]: ", b - 1, inode_idx);
             // uint32_t valid;                      /* Whether or not inode is valid */
             // uint32_t size;                       /* Size of file */
@@ -66,6 +98,7 @@ void fs_debug(Disk *disk)
             printf("    indirect block location: block[%d]\n", inode.indirect);
         }
     }
+    free(block);
 }
 
 void print_direct_blocks(uint32_t *pDirect)
@@ -79,10 +112,10 @@ void print_direct_blocks(uint32_t *pDirect)
     printf("]\n");
 }
 
-void print_indirect_blocks(uint32_t *pIndir)
+void print_indirect_blocks(uint32_t *pIndir, size_t count)
 {
     printf("[");
-    for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+    for (int i = 0; i < count; i++)
     {
         if (*(pIndir + i) != 0)
         {
@@ -98,388 +131,914 @@ void print_indirect_blocks(uint32_t *pIndir)
 }
 
 /**
- * Format Disk by doing the following:
- *
- *  1. Write SuperBlock (with appropriate magic number, number of blocks,
- *  number of inode blocks, and number of inodes).
- *
- *  2. Clear all remaining blocks.
- *
- * Note: Do not format a mounted Disk!
+ * Format Disk with BLOCK_SIZE blocks (see fs_format_with).
  *
  * @param       disk        Pointer to Disk structure.
  * @return      Whether or not all disk operations were successful.
  **/
 bool fs_format(Disk *disk)
 {
-    return false;
+    return fs_format_with(disk, BLOCK_SIZE);
 }
 
 /**
- * Mount specified FileSystem to given Disk by doing the following:
+ * Format Disk with blocks of block_size bytes by doing the following:
  *
- *  1. Read and check SuperBlock (verify attributes).
+ *  1. Write SuperBlock (with appropriate magic number, number of blocks,
+ *  number of inode blocks, number of inodes, block size and number of
+ *  bitmap blocks, marked unclean).
  *
- *  2. Record FileSystem disk attribute and set Disk mount status.
+ *  2. Clear all remaining blocks (discarding them when the disk supports it,
+ *  writing zeroes otherwise).
  *
- *  3. Copy SuperBlock to FileSystem meta data attribute
+ *  3. Write the free maps, with every data block and inode free, and only
+ *  once they are flushed mark the SuperBlock clean.
  *
- *  4. Initialize FileSystem free blocks bitmap.
+ *  4. Commit the format (see fs_commit).
  *
- * Note: Do not mount a Disk that has already been mounted!
+ * Each block is block_size / BLOCK_SIZE consecutive disk blocks; disk
+ * blocks past the last whole block are left unused.
  *
- * @param       fs      Pointer to FileSystem structure.
- * @param       disk    Pointer to Disk structure.
- * @return      Whether or not the mount operation was successful.
+ * Note: Do not format a mounted Disk!
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block_size  Bytes per block (a power of two from
+ *                          FS_MIN_BLOCK_SIZE to FS_MAX_BLOCK_SIZE).
+ * @return      Whether or not all disk operations were successful.
  **/
-bool fs_mount(FileSystem *fs, Disk *disk)
+bool fs_format_with(Disk *disk, size_t block_size)
 {
     if (disk->mounted)
     {
-        error("disk is already mounted");
-        return FS_FAILURE;
+        error("failed on fs_format: disk is mounted");
+        return false;
     }
 
-    fs->disk = disk;
-
-    fs->meta_data.blocks = disk->blocks;
-
-    // Read superblock
-    Block block;
-    ssize_t nread = disk_read(disk, 0, (char *)block.data);
-    if (nread == DISK_FAILURE)
+    FileSystem fs = {.disk = disk};
+    if (!fs_set_geometry(&fs, block_size))
     {
-        error("failed on disk_read for superblock");
+        error("failed on fs_format: unsupported block size %zu", block_size);
         return false;
     }
 
-    memcpy(&fs->meta_data, &block.data, sizeof(fs->meta_data));
-
-    fs->meta_data = block.super;
-    if (fs->meta_data.magic_number != MAGIC_NUMBER)
+    size_t blocks = disk->blocks / fs.disk_blocks;
+    if (blocks == 0)
     {
-        error("wrong magic number, got %x want %x", fs->meta_data.magic_number, MAGIC_NUMBER);
-    };
+        error("failed on fs_format: disk is smaller than one %zu byte block", block_size);
+        return false;
+    }
 
-    // See doc of SuperBlock.blocks for more example about value of inode_blocks.
-    fs->meta_data.inode_blocks = ceil((double)fs->meta_data.blocks / (double)10);
-    // FIXME: We should read inode blocks to set these inode-related values
+    Block *block = fs_alloc_blocks(1, block_size);
+    if (block == NULL)
+    {
+        error("failed on fs_format: cannot allocate block buffer");
+        return false;
+    }
+    memset(block->data, 0, block_size);
+    block->super.magic_number = MAGIC_NUMBER;
+    block->super.blocks = blocks;
+    block->super.inode_blocks = (blocks + 9) / 10;
+    block->super.inodes = block->super.inode_blocks * fs.inodes_per_block;
+    block->super.block_size = block_size;
 
-    ssize_t inodes = fs_count_inodes(fs);
-    if (inodes == FS_FAILURE)
+    /* Disks too small to spare blocks for free maps are scanned at mount */
+    size_t bitmap_blocks = fs_bitmap_blocks(blocks, block->super.inodes, block_size);
+    if (1 + block->super.inode_blocks + bitmap_blocks < blocks)
     {
-        error("failed on fs_count_inodes");
-        return FS_FAILURE;
+        block->super.bitmap_blocks = bitmap_blocks;
     }
-    fs->meta_data.inodes = inodes;
-    debug("inodes: %ld", fs->meta_data.inodes);
 
-    // All blocks are free ?
-    if (fs_build_free_block_map(fs, disk) == FS_FAILURE)
+    /* Keep the superblock, inode table and free maps uncompressed on compressed disks */
+    size_t metadata = min(blocks, (size_t)1 + block->super.inode_blocks + block->super.bitmap_blocks);
+    fs_mark_metadata(&fs, 0, metadata, true);
+    fs_mark_metadata(&fs, metadata, blocks - metadata, false);
+
+    fs.meta_data = block->super;
+    ssize_t written = fs_write_blocks(&fs, 0, 1, block->data);
+    free(block);
+    if (written == DISK_FAILURE)
     {
-        error("failed on fs_build_free_block_map");
+        error("failed on disk_write for superblock");
         return false;
-    };
+    }
 
-    if (fs_build_free_inode_map(fs, disk) == FS_FAILURE)
+    /* Release the remaining blocks: discarded blocks read back as zeroes */
+    size_t first = fs.disk_blocks;
+    if (disk->blocks > first && disk_discard(disk, first, disk->blocks - first) == 0)
+        return fs_format_bitmaps(&fs) && fs_commit(&fs);
+
+    /* Discard unsupported: clear in vectored batches of one shared zero block */
+    char *zero = disk_buffer_get(disk);
+    if (zero == NULL)
     {
-        error("failed on fs_build_free_inode_map");
+        error("failed on fs_format: cannot allocate zero block");
         return false;
-    };
+    }
+    memset(zero, 0, BLOCK_SIZE);
+    char *data[BLOCK_VECTOR];
+    for (size_t i = 0; i < BLOCK_VECTOR; i++)
+        data[i] = zero;
 
-    // fs->meta_data.inodes = disk->blocks;
-    disk->mounted = true;
+    bool cleared = true;
+    for (size_t b = first; b < disk->blocks && cleared; b += BLOCK_VECTOR)
+    {
+        size_t n = min((size_t)BLOCK_VECTOR, disk->blocks - b);
+        if (disk_writev(disk, b, n, data) == DISK_FAILURE)
+        {
+            error("failed on disk_writev at block: %zu", b);
+            cleared = false;
+        }
+    }
+    disk_buffer_put(disk, zero);
 
-    return true;
+    return cleared && fs_format_bitmaps(&fs) && fs_commit(&fs);
 }
 
 /*
- * fs_count_inodes counts the number of inodes in fs.
- * RETURN:
- * -1 if any error occured.
- * number of inodes if it's fs_count_inodes is executed successfully.
+ * Write the free maps of a freshly formatted FileSystem (if it has any):
+ * every block after the free maps and every inode is free.  The maps are
+ * flushed before the SuperBlock is marked clean, so a format that stops
+ * early leaves it unclean and the next mount scans.
+ *
+ * @param       fs          Pointer to FileSystem structure (meta_data set).
+ * @return      Whether or not all disk operations were successful.
  */
-ssize_t fs_count_inodes(FileSystem *fs)
+bool fs_format_bitmaps(FileSystem *fs)
 {
-    size_t inode_cnt = 0;
-    Block block;
-    /* Skip super block */
-    int inodeBlockOffSet = 1;
-    for (size_t b = inodeBlockOffSet; b < inodeBlockOffSet + fs->meta_data.inode_blocks; b++)
+    if (fs->meta_data.bitmap_blocks == 0)
+        return true;
+
+    fs->free_blocks = bitmap_create(fs->meta_data.blocks, true);
+    fs->free_inodes = bitmap_create(fs_get_total_inodes(fs), true);
+    bool saved = false;
+    if (fs->free_blocks && fs->free_inodes)
     {
-        if (disk_read(fs->disk, b, (char *)block.inodes) == DISK_FAILURE)
-        {
-            error("failed on disk_read for inode block at inodeBlockOffSet: %d", b);
-            return FS_FAILURE;
-        }
-        inode_cnt += fs_count_inodes_from_block(&block);
+        bitmap_clear_range(fs->free_blocks, 0, fs_data_start(fs));
+        saved = fs_save_bitmaps(fs, true) && disk_flush(fs->disk) != DISK_FAILURE && fs_write_super(fs, true);
     }
-    return inode_cnt;
+    bitmap_destroy(fs->free_blocks);
+    bitmap_destroy(fs->free_inodes);
+    fs->free_blocks = NULL;
+    fs->free_inodes = NULL;
+    return saved;
 }
 
-size_t fs_count_inodes_from_block(Block *block)
+/*
+ * Derive the per-block geometry of a FileSystem from its block size.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block_size  Bytes per block (0 means BLOCK_SIZE, as in images
+ *                          formatted before the size was recorded).
+ * @return      Whether or not the block size is supported.
+ */
+bool fs_set_geometry(FileSystem *fs, size_t block_size)
 {
-    size_t cnt = 0;
-    for (size_t i = 0; i < INODES_PER_BLOCK; i++)
-    {
-        if (block->inodes[i].valid == true)
-        {
-            info("block->inodes[%d] is valid", i);
-            cnt++;
-        }
-    }
-    return cnt;
+    if (block_size == 0)
+        block_size = BLOCK_SIZE;
+    if (block_size < FS_MIN_BLOCK_SIZE || block_size > FS_MAX_BLOCK_SIZE || (block_size & (block_size - 1)))
+        return false;
+
+    fs->block_size = block_size;
+    fs->disk_blocks = block_size / BLOCK_SIZE;
+    fs->inodes_per_block = block_size / sizeof(Inode);
+    fs->pointers_per_block = block_size / sizeof(uint32_t);
+    fs->max_file_size = min((size_t)UINT32_MAX, (POINTERS_PER_INODE + fs->pointers_per_block) * block_size);
+    return true;
 }
 
-ssize_t fs_build_free_inode_map(FileSystem *fs, Disk *disk)
+/*
+ * Allocate count DISK_ALIGNMENT aligned blocks of block_size bytes on the
+ * heap (release with free), so bulk reads on an O_DIRECT disk need no
+ * bounce buffers.  Index them with fs_block_at.
+ *
+ * @param       count       Number of blocks.
+ * @param       block_size  Bytes per block.
+ * @return      Pointer to the blocks (NULL on failure).
+ */
+Block *fs_alloc_blocks(size_t count, size_t block_size)
 {
-    // malloc fs->free_inodes
-    fs->free_inodes = malloc(fs->meta_data.inode_blocks * INODES_PER_BLOCK);
-    if (fs->free_inodes == NULL)
-    {
-        error("failed to malloc fs->free_indoes");
-        return FS_FAILURE;
-    }
+    void *blocks = NULL;
+    if (posix_memalign(&blocks, DISK_ALIGNMENT, count * block_size) != 0)
+        return NULL;
+    return blocks;
+}
 
-    // skip superblock
-    size_t inodeBlockOffset = 1;
+/*
+ * Find a block in an array of blocks packed at block_size bytes.
+ */
+Block *fs_block_at(Block *blocks, size_t index, size_t block_size)
+{
+    return (Block *)((char *)blocks + index * block_size);
+}
+
+/*
+ * Read count contiguous blocks into data (count * block_size bytes) with
+ * vectored reads of their disk blocks.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       First block number to read.
+ * @param       count       Number of blocks.
+ * @param       data        Buffer to read into.
+ * @return      Number of bytes read (DISK_FAILURE on failure).
+ */
+ssize_t fs_read_blocks(FileSystem *fs, size_t block, size_t count, char *data)
+{
+    size_t first = block * fs->disk_blocks;
+    size_t total = count * fs->disk_blocks;
+    if (total == 1)
+        return disk_read(fs->disk, first, data);
 
-    for (size_t b = inodeBlockOffset; b < inodeBlockOffset + fs->meta_data.inode_blocks; b++)
+    char *vector[BLOCK_VECTOR];
+    for (size_t i = 0; i < total; i += BLOCK_VECTOR)
     {
-        Block block;
-        if (disk_read(disk, b, (char *)block.inodes) == DISK_FAILURE)
-        {
-            error("failed on disk_read at inodeBlockOffSet: %d", b);
-            return FS_FAILURE;
-        }
-        for (size_t i = 0; i < INODES_PER_BLOCK; i++)
-        {
-            size_t inodeNum = INODES_PER_BLOCK * (b - 1) + i;
-            // if inode is in use (valid)
-            if (block.inodes[i].valid == true)
-            {
-                // mark it as invalid
-                fs->free_inodes[inodeNum] = INODE_UNAVAILABLE;
-            }
-            else
-            {
-                fs->free_inodes[inodeNum] = INODE_AVAILABLE;
-            }
-        }
+        size_t n = min((size_t)BLOCK_VECTOR, total - i);
+        for (size_t j = 0; j < n; j++)
+            vector[j] = data + (i + j) * BLOCK_SIZE;
+        if (disk_readv(fs->disk, first + i, n, vector) == DISK_FAILURE)
+            return DISK_FAILURE;
     }
-
-    // for (size_t i = 0; i < fs_get_total_inodes(fs); i++)
-    // {
-    //     info("free inode map[%ld] = %d\n", i, fs->free_inodes[i]);
-    // }
-
-    return FS_SUCCESS;
-    // fetch inode block
-    // if valid, set free_inodes[i] to false
+    return total * BLOCK_SIZE;
 }
 
 /*
-[sb, i, i]
-fs->meta_data.inode_blocks = 2
-*/
-int fs_build_free_block_map(FileSystem *fs, Disk *disk)
+ * Write count contiguous blocks from data (count * block_size bytes) with
+ * vectored writes of their disk blocks.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       First block number to write.
+ * @param       count       Number of blocks.
+ * @param       data        Buffer to write from.
+ * @return      Number of bytes written (DISK_FAILURE on failure).
+ */
+ssize_t fs_write_blocks(FileSystem *fs, size_t block, size_t count, char *data)
 {
-    fs->free_blocks = malloc(fs->meta_data.blocks * sizeof(fs->free_blocks));
-    if (fs->free_blocks == NULL)
-        return FS_FAILURE;
+    size_t first = block * fs->disk_blocks;
+    size_t total = count * fs->disk_blocks;
+    if (total == 1)
+        return disk_write(fs->disk, first, data);
 
-    // set all blocks to be free except superblock and inode blocks
-    for (int i = 0; i < fs->meta_data.blocks; i++)
+    char *vector[BLOCK_VECTOR];
+    for (size_t i = 0; i < total; i += BLOCK_VECTOR)
     {
-        // i == 0: superblock, i == 1: inode block
-        fs->free_blocks[i] = true;
+        size_t n = min((size_t)BLOCK_VECTOR, total - i);
+        for (size_t j = 0; j < n; j++)
+            vector[j] = data + (i + j) * BLOCK_SIZE;
+        if (disk_writev(fs->disk, first + i, n, vector) == DISK_FAILURE)
+            return DISK_FAILURE;
     }
+    return total * BLOCK_SIZE;
+}
 
-    // set super block to false;
-    fs->free_blocks[0] = false;
+/*
+ * Tell a compressed disk whether count blocks starting at block hold
+ * metadata (see disk_mark_metadata).
+ */
+void fs_mark_metadata(FileSystem *fs, size_t block, size_t count, bool metadata)
+{
+    disk_mark_metadata(fs->disk, block * fs->disk_blocks, count * fs->disk_blocks, metadata);
+}
 
-    for (size_t i = 0; i < fs->meta_data.inode_blocks; i++)
+/*
+ * Make a finished operation durable as the disk's durability mode asks
+ * (see disk_commit), writing the free map blocks it changed first.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @return      Whether or not the operation is durable.
+ */
+bool fs_commit(FileSystem *fs)
+{
+    if (fs->dirty_maps && !fs_save_bitmaps(fs, false))
+        return false;
+    if (disk_commit(fs->disk) == DISK_FAILURE)
     {
-        size_t num_of_superblock = 1;
-        fs->free_blocks[num_of_superblock + i] = false;
+        error("failed on disk_commit");
+        return false;
     }
+    return true;
+}
 
-    for (int i = 0; i < fs->meta_data.blocks; i++)
+/*
+ * Load count contiguous inode table blocks starting at block start.  On a
+ * memory-mapped disk this returns the mapping itself, otherwise the blocks
+ * are copied into scratch with vectored reads.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       start       First block number to read.
+ * @param       count       Number of blocks.
+ * @param       scratch     Room for at least count blocks (fs_alloc_blocks).
+ * @return      Pointer to the count loaded blocks (NULL on failure).
+ */
+Block *fs_read_inode_blocks(FileSystem *fs, size_t start, size_t count, Block *scratch)
+{
+    Disk *disk = fs->disk;
+    size_t first = start * fs->disk_blocks;
+    size_t total = count * fs->disk_blocks;
+    Block *view = first + total <= disk->blocks ? (Block *)disk_block_ptr(disk, first) : NULL;
+    if (view)
     {
-        printf("before set: free_blocks[%d]: %d\n", i, fs->free_blocks[i]);
+        /* The mapping is contiguous; touch the rest so each block is counted */
+        for (size_t i = 1; i < total; i++)
+            disk_block_ptr(disk, first + i);
+        return view;
     }
 
-    // FIXME: Why memset will cause seg fault ?
-    // memset(&fs->free_blocks, true, fs->meta_data.blocks * sizeof(bool));
-
-    Block block;
-    /* Skip super block */
-    int inodeBlockOffSet = 1;
-    for (int b = inodeBlockOffSet; b < inodeBlockOffSet + fs->meta_data.inode_blocks; b++)
+    if (fs_read_blocks(fs, start, count, scratch->data) == DISK_FAILURE)
     {
-        if (disk_read(disk, b, (char *)block.inodes) == DISK_FAILURE)
-        {
-            error("failed on disk_read at inodeBlockOffSet: %d", b);
-            return FS_FAILURE;
-        }
-
-        for (int inode_idx = 0; inode_idx < INODES_PER_BLOCK; inode_idx++)
-        {
-
-            //         set fs->free_blocks(offset)
-            // int offset = b * INODES_PER_BLOCK + inode_idx;
-            Inode inode = block.inodes[inode_idx];
-            if (inode.valid)
-            {
-                // fs->free_blocks[offset] = valid;
-                // scan direct blocks
-                for (int direct_idx = 0; direct_idx < POINTERS_PER_INODE; direct_idx++)
-                {
-                    uint32_t ptr = inode.direct[direct_idx];
-                    if (ptr != 0)
-                    {
-                        // this block is in use
-                        fs->free_blocks[ptr] = false;
-                    }
-                }
-
-                if (inode.indirect > 0)
-                {
-                    // mark indirect blocks in-use
-                    fs->free_blocks[inode.indirect] = false;
-                    // read indirect block
-                    Block indir_block;
-                    if (disk_read(disk, inode.indirect, (char *)indir_block.pointers) == DISK_FAILURE)
-                    {
-                        error("failed on disk_read at indirect block: block_number: %d", b);
-                        return FS_FAILURE;
-                    }
-                    // for every indir pointers inside indir_block
-                    // set fs->free_blocks
-                    for (int i = 0; i < POINTERS_PER_BLOCK; i++)
-                    {
-                        size_t ptr = indir_block.pointers[i];
-                        if (ptr != 0)
-                            // this block is in use
-                            fs->free_blocks[ptr] = false;
-                    }
-                }
-            }
-        }
+        error("failed on disk_readv for inode blocks [%zu, %zu)", start, start + count);
+        return NULL;
     }
+    return scratch;
+}
 
-    for (int i = 0; i < fs->meta_data.blocks; i++)
+/*
+ * Load a single block: the mapping itself on memory-mapped disks, otherwise
+ * a copy in scratch.  The result must be treated as read-only.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Block number to read.
+ * @param       scratch     Block to copy into if the disk is not mapped.
+ * @return      Pointer to the loaded Block (NULL on failure).
+ */
+Block *fs_read_block(FileSystem *fs, size_t block, Block *scratch)
+{
+    Disk *disk = fs->disk;
+    size_t first = block * fs->disk_blocks;
+    Block *view = first + fs->disk_blocks <= disk->blocks ? (Block *)disk_block_ptr(disk, first) : NULL;
+    if (view)
     {
-        printf("free_blocks[%d]: %d\n", i, fs->free_blocks[i]);
+        for (size_t i = 1; i < fs->disk_blocks; i++)
+            disk_block_ptr(disk, first + i);
+        return view;
     }
 
-    return FS_SUCCESS;
+    if (fs_read_blocks(fs, block, 1, scratch->data) == DISK_FAILURE)
+        return NULL;
+    return scratch;
 }
 
 /**
- * Unmount FileSystem from internal Disk by doing the following:
- *
- *  1. Set Disk mounted status and FileSystem disk attribute.
- *
- *  2. Release free blocks bitmap.
+ * Mount specified FileSystem to given Disk, scanning with one thread (see
+ * fs_mount_with).
  *
  * @param       fs      Pointer to FileSystem structure.
+ * @param       disk    Pointer to Disk structure.
+ * @return      Whether or not the mount operation was successful.
  **/
-void fs_unmount(FileSystem *fs)
+bool fs_mount(FileSystem *fs, Disk *disk)
 {
+    return fs_mount_with(fs, disk, 1);
 }
 
 /**
- * Allocate an Inode in the FileSystem Inode table by doing the following:
+ * Mount specified FileSystem to given Disk by doing the following:
  *
- *  1. Search Inode table for free inode.
+ *  1. Read and check SuperBlock (verify attributes).
  *
- *  2. Reserve free inode in Inode table.
+ *  2. Record FileSystem disk attribute and set Disk mount status.
  *
- * Note: Be sure to record updates to Inode table to Disk.
+ *  3. Copy SuperBlock to FileSystem meta data attribute
+ *
+ *  4. Initialize FileSystem free blocks bitmap: read the free maps from
+ *  disk after a clean unmount, otherwise rebuild them (and count the
+ *  inodes) in one pass over the inode table and indirect blocks, split
+ *  across threads (see fs_scan_inode_table).
+ *
+ *  5. Mark the SuperBlock unclean while mounted (if the disk has free maps).
+ *
+ * Note: Do not mount a Disk that has already been mounted!
  *
  * @param       fs      Pointer to FileSystem structure.
- * @return      Inode number of allocated Inode.
+ * @param       disk    Pointer to Disk structure.
+ * @param       threads Threads scanning the inode table (0 for one per
+ *                      online CPU).
+ * @return      Whether or not the mount operation was successful.
  **/
-ssize_t fs_create(FileSystem *fs)
+bool fs_mount_with(FileSystem *fs, Disk *disk, size_t threads)
 {
-    // FIXME: What is the maximum inodes in fs ?
-    // Sanity Check: if num of indoes >= maximum inode capacity, we return false;
-    size_t max_inodes = INODES_PER_BLOCK * fs->meta_data.inode_blocks;
-    if (fs->meta_data.inodes >= max_inodes)
+    if (disk->mounted)
     {
-        error("failed on fs_create: exceed max num of inodes %ld", max_inodes);
-        return FS_FAILURE;
+        error("disk is already mounted");
+        return false;
     }
 
-    // find first available inode number
-    ssize_t res = fs_find_first_available_inode(fs);
-    if (res == FS_FAILURE)
+    fs->disk = disk;
+
+    // Read superblock
+    char *block = disk_buffer_get(disk);
+    if (block == NULL)
+        return fs_mount_abort(fs);
+
+    ssize_t nread = disk_read(disk, 0, block);
+    if (nread == DISK_FAILURE)
     {
-        error("failed on fs_find_first_available_inode");
-        return FS_FAILURE;
+        error("failed on disk_read for superblock");
+        disk_buffer_put(disk, block);
+        return fs_mount_abort(fs);
     }
 
-    size_t inode_num = res;
-    size_t inodeBlockOffset = 1;
-    size_t block_idx = inode_num / INODES_PER_BLOCK + inodeBlockOffset;
-    size_t cur_idx = inode_num % INODES_PER_BLOCK;
+    memcpy(&fs->meta_data, block, sizeof(fs->meta_data));
+    disk_buffer_put(disk, block);
 
-    Block block;
-    if (disk_read(fs->disk, block_idx, (char *)block.inodes) == DISK_FAILURE)
+    if (fs->meta_data.magic_number != MAGIC_NUMBER)
     {
-        error("failed on disk_read at block_index: %d", block_idx);
-        return FS_FAILURE;
+        error("wrong magic number, got %x want %x", fs->meta_data.magic_number, MAGIC_NUMBER);
+    };
+
+    // Geometry comes from the superblock, not the compiled-in BLOCK_SIZE
+    if (!fs_set_geometry(fs, fs->meta_data.block_size))
+    {
+        error("unsupported block size %u", fs->meta_data.block_size);
+        return fs_mount_abort(fs);
+    }
+    if ((size_t)fs->meta_data.blocks * fs->disk_blocks > disk->blocks)
+    {
+        error("file system needs %zu disk blocks, disk has %zu",
+              (size_t)fs->meta_data.blocks * fs->disk_blocks, disk->blocks);
+        return fs_mount_abort(fs);
     }
 
-    Inode *inode_ptr = &(block.inodes[cur_idx]);
-    inode_ptr->valid = true;
-    inode_ptr->size = 0;
-    memset(inode_ptr->direct, 0, POINTERS_PER_INODE);
+    // See doc of SuperBlock.blocks for more example about value of inode_blocks.
+    fs->meta_data.inode_blocks = ceil((double)fs->meta_data.blocks / (double)10);
+    if (fs->meta_data.bitmap_blocks != 0 &&
+        fs->meta_data.bitmap_blocks != fs_bitmap_blocks(fs->meta_data.blocks, fs_get_total_inodes(fs), fs->block_size))
+    {
+        error("bad number of bitmap blocks %u", fs->meta_data.bitmap_blocks);
+        return fs_mount_abort(fs);
+    }
+    fs_mark_metadata(fs, 0, fs_data_start(fs), true);
 
-    if (disk_write(fs->disk, block_idx, (char *)block.inodes) == DISK_FAILURE)
+    // A clean unmount left the free maps on disk: no scan needed
+    if (fs->meta_data.bitmap_blocks != 0 && fs->meta_data.clean)
     {
-        error("failed on disk_write at block_index: %d", block_idx);
-        return FS_FAILURE;
+        if (!fs_load_bitmaps(fs))
+            return fs_mount_abort(fs);
+        fs->meta_data.inodes = fs_get_total_inodes(fs) - bitmap_count(fs->free_inodes);
+        return fs_mount_finish(fs, false) || fs_mount_abort(fs);
     }
+    if (fs->meta_data.bitmap_blocks != 0)
+        info("file system was not unmounted cleanly: rebuilding free maps");
 
-    fs->meta_data.inodes++;
-    fs_mark_inode_status(fs, inode_num, INODE_UNAVAILABLE);
+    ssize_t inodes = fs_scan_inode_table(fs, threads);
+    if (inodes == FS_FAILURE)
+    {
+        error("failed on fs_scan_inode_table");
+        return fs_mount_abort(fs);
+    }
+    fs->meta_data.inodes = inodes;
+    debug("inodes: %ld", fs->meta_data.inodes);
 
-    return inode_num;
+    return fs_mount_finish(fs, true) || fs_mount_abort(fs);
 }
 
 /*
- * Find first available inode number from fs->free_inodes.
- * @param       fs              Pointer to FileSystem structure.
- * @return      return available inode number if found, if not, return FS_FAILURE.
+ * Finish mounting once the free maps are built: on disks with free maps,
+ * mark the SuperBlock unclean (flushed before anything else is written, so
+ * a crash leaves it unclean) and save rebuilt maps.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       rebuilt     Whether the free maps were rebuilt by a scan.
+ * @return      Whether or not the mount operation was successful.
  */
-ssize_t fs_find_first_available_inode(FileSystem *fs)
+bool fs_mount_finish(FileSystem *fs, bool rebuilt)
 {
-    size_t total_inodes = INODES_PER_BLOCK * fs->meta_data.inode_blocks;
-    for (size_t i = 0; i < total_inodes; i++)
+    if (fs->meta_data.bitmap_blocks != 0)
     {
-        // if invalid (false), return it
-        if (fs->free_inodes[i] == INODE_AVAILABLE)
+        fs->dirty_maps = bitmap_create(fs->meta_data.bitmap_blocks, rebuilt);
+        if (!fs->dirty_maps || !fs_write_super(fs, false) || disk_flush(fs->disk) == DISK_FAILURE)
         {
-            return i;
+            error("failed to mark the file system unclean");
+            return false;
         }
+        if (rebuilt && !fs_save_bitmaps(fs, false))
+            return false;
     }
-    return FS_FAILURE;
+
+    fs->disk->mounted = true;
+    return true;
 }
 
-size_t fs_get_total_inodes(FileSystem *fs)
+/*
+ * Undo a failed mount: release the free maps and detach the Disk, so the
+ * FileSystem holds nothing and can be mounted again.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @return      false, for returning from fs_mount_with.
+ */
+bool fs_mount_abort(FileSystem *fs)
 {
-    return INODES_PER_BLOCK * fs->meta_data.inode_blocks;
+    bitmap_destroy(fs->free_blocks);
+    bitmap_destroy(fs->free_inodes);
+    bitmap_destroy(fs->dirty_maps);
+    fs->free_blocks = NULL;
+    fs->free_inodes = NULL;
+    fs->dirty_maps = NULL;
+    fs->disk = NULL;
+    return false;
 }
 
 /*
- * @param       fs              Pointer to FileSystem structure.
- * @param       inode_num       inode number.
- * @param       available       available means this inode is ready to be used.
- * @return      return fS_SUCCESS if no error, else return FS_FAILURE.
+ * Build the free maps and count the valid inodes in a single pass over the
+ * Inode table, split across threads, by doing the following:
+ *
+ *  1. Giving each share a contiguous run of inode table blocks and
+ *  scanning the shares in parallel (see fs_scan_share).
+ *
+ *  2. Merging the shares' block maps in parallel, each thread a slice of
+ *  the words (see fs_scan_merge).
+ *
+ *  3. Summarizing both free maps and marking the indirect blocks found as
+ *  metadata.
+ *
+ * Pointers past the end of the file system are ignored.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       threads     Number of threads (0 for one per online CPU).
+ * @return      Number of valid inodes (FS_FAILURE on failure).
  */
-ssize_t fs_mark_inode_status(FileSystem *fs, size_t inode_num, bool available)
+ssize_t fs_scan_inode_table(FileSystem *fs, size_t threads)
+{
+    if (threads == 0)
+        threads = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    threads = max(min(threads, min((size_t)FS_MOUNT_THREADS_MAX, (size_t)fs->meta_data.inode_blocks)), (size_t)1);
+
+    // every inode starts out used; free blocks are filled in by the merge
+    fs->free_inodes = bitmap_create(fs_get_total_inodes(fs), false);
+    fs->free_blocks = bitmap_create(fs->meta_data.blocks, false);
+    FileSystemScan *scans = calloc(threads, sizeof(FileSystemScan));
+    if (fs->free_inodes == NULL || fs->free_blocks == NULL || scans == NULL)
+    {
+        error("failed to allocate free maps");
+        free(scans);
+        return FS_FAILURE;
+    }
+
+    size_t words = fs->free_blocks->nwords;
+    for (size_t t = 0; t < threads; t++)
+    {
+        scans[t].fs = fs;
+        scans[t].start = 1 + fs->meta_data.inode_blocks * t / threads;
+        scans[t].end = 1 + fs->meta_data.inode_blocks * (t + 1) / threads;
+        scans[t].first_word = words * t / threads;
+        scans[t].last_word = words * (t + 1) / threads;
+        scans[t].shares = scans;
+        scans[t].nshares = threads;
+    }
+
+    ssize_t inodes = 0;
+    fs_scan_run(scans, threads, fs_scan_share);
+    for (size_t t = 0; t < threads && inodes != FS_FAILURE; t++)
+        inodes = scans[t].failed ? FS_FAILURE : inodes + (ssize_t)scans[t].inodes;
+
+    if (inodes != FS_FAILURE)
+    {
+        fs_scan_run(scans, threads, fs_scan_merge);
+        bitmap_summarize(fs->free_inodes);
+        bitmap_summarize(fs->free_blocks);
+        bitmap_clear_range(fs->free_blocks, 0, fs_data_start(fs));
+
+        /* Each share's indirect blocks are sorted: mark them a run at a time */
+        for (size_t t = 0; t < threads; t++)
+        {
+            for (size_t i = 0, j; i < scans[t].nindirect; i = j)
+            {
+                for (j = i + 1; j < scans[t].nindirect && scans[t].indirect[j] <= scans[t].indirect[j - 1] + 1; j++)
+                    ;
+                fs_mark_metadata(fs, scans[t].indirect[i], scans[t].indirect[j - 1] - scans[t].indirect[i] + 1, true);
+            }
+        }
+    }
+
+    for (size_t t = 0; t < threads; t++)
+    {
+        bitmap_destroy(scans[t].used);
+        free(scans[t].indirect);
+    }
+    free(scans);
+    return inodes;
+}
+
+/*
+ * Run a mount scan phase on every share: all but the first on threads of
+ * their own, the first (and any whose thread could not be started) on the
+ * calling thread, then wait for them all.
+ *
+ * @param       scans       Array of shares.
+ * @param       count       Number of shares.
+ * @param       phase       Phase to run (fs_scan_share or fs_scan_merge).
+ */
+void fs_scan_run(FileSystemScan *scans, size_t count, void *(*phase)(void *))
+{
+    for (size_t t = 1; t < count; t++)
+        scans[t].started = pthread_create(&scans[t].thread, NULL, phase, &scans[t]) == 0;
+
+    for (size_t t = 0; t < count; t++)
+    {
+        if (t == 0 || !scans[t].started)
+            phase(&scans[t]);
+    }
+
+    for (size_t t = 1; t < count; t++)
+    {
+        if (scans[t].started)
+            pthread_join(scans[t].thread, NULL);
+        scans[t].started = false;
+    }
+}
+
+/*
+ * Scan one share of the Inode table by doing the following:
+ *
+ *  1. Reading its blocks in batches and, for each inode, marking it free in
+ *  the free inode map if invalid.  An inode table block covers whole words
+ *  of that map, so no two shares touch the same word.
+ *
+ *  2. For each valid inode, marking its direct and indirect blocks in the
+ *  share's own block map (a set bit meaning used) and noting its indirect
+ *  block.
+ *
+ *  3. Reading the noted indirect blocks and marking the blocks they point
+ *  to (see fs_scan_indirect_blocks).
+ *
+ * @param       arg         Pointer to the share's FileSystemScan (failed is
+ *                          set on failure).
+ * @return      NULL.
+ */
+void *fs_scan_share(void *arg)
+{
+    FileSystemScan *scan = arg;
+    FileSystem *fs = scan->fs;
+    size_t batch = max((size_t)1, INODE_TABLE_BATCH / fs->disk_blocks);
+    size_t capacity = 0;
+
+    scan->used = bitmap_create(fs->meta_data.blocks, false);
+    Block *blocks = fs_alloc_blocks(batch, fs->block_size);
+    if (scan->used == NULL || blocks == NULL)
+    {
+        error("failed to allocate mount scan share");
+        goto failure;
+    }
+
+    for (size_t start = scan->start; start < scan->end; start += batch)
+    {
+        size_t n = min(batch, scan->end - start);
+        Block *table = fs_read_inode_blocks(fs, start, n, blocks);
+        if (table == NULL)
+            goto failure;
+
+        for (size_t b = 0; b < n; b++)
+        {
+            Block *block = fs_block_at(table, b, fs->block_size);
+            for (size_t i = 0; i < fs->inodes_per_block; i++)
+            {
+                Inode *inode = &block->inodes[i];
+                if (!inode->valid)
+                {
+                    size_t inode_num = (start - 1 + b) * fs->inodes_per_block + i;
+                    fs->free_inodes->words[inode_num / BITMAP_WORD_BITS] |= UINT64_C(1) << (inode_num % BITMAP_WORD_BITS);
+                    continue;
+                }
+
+                scan->inodes++;
+                for (size_t d = 0; d < POINTERS_PER_INODE; d++)
+                {
+                    if (inode->direct[d] != 0)
+                        bitmap_set(scan->used, inode->direct[d]);
+                }
+
+                if (inode->indirect == 0 || inode->indirect >= fs->meta_data.blocks)
+                    continue;
+                bitmap_set(scan->used, inode->indirect);
+                if (scan->nindirect == capacity)
+                {
+                    capacity = max((size_t)64, 2 * capacity);
+                    uint32_t *grown = realloc(scan->indirect, capacity * sizeof(uint32_t));
+                    if (grown == NULL)
+                    {
+                        error("failed to grow indirect block list");
+                        goto failure;
+                    }
+                    scan->indirect = grown;
+                }
+                scan->indirect[scan->nindirect++] = inode->indirect;
+            }
+        }
+    }
+
+    if (!fs_scan_indirect_blocks(fs, scan->used, scan->indirect, scan->nindirect, blocks, batch))
+        goto failure;
+    free(blocks);
+    return NULL;
+
+failure:
+    scan->failed = true;
+    free(blocks);
+    return NULL;
+}
+
+/*
+ * Merge one slice of the shares' block maps into the free block map: a
+ * block is free unless some share's map marks it used, so each word is the
+ * complement of the word-wise OR of the shares' words.  The caller then
+ * summarizes the map (see bitmap_summarize).
+ *
+ * @param       arg         Pointer to the share's FileSystemScan.
+ * @return      NULL.
+ */
+void *fs_scan_merge(void *arg)
+{
+    FileSystemScan *scan = arg;
+    uint64_t *free_words = scan->fs->free_blocks->words;
+
+    for (size_t w = scan->first_word; w < scan->last_word; w++)
+    {
+        uint64_t used = 0;
+        for (size_t t = 0; t < scan->nshares; t++)
+            used |= scan->shares[t].used->words[w];
+        free_words[w] = ~used;
+    }
+    return NULL;
+}
+
+/*
+ * Mark the blocks that indirect blocks point to in a block map of used
+ * blocks.  The indirect blocks are sorted, and each run of adjacent ones
+ * (up to batch blocks) is loaded with one vectored read instead of one
+ * read each.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       used        Block map to mark (a set bit meaning used).
+ * @param       indirect    Indirect block numbers (sorted in place).
+ * @param       count       Number of indirect blocks.
+ * @param       scratch     Room for batch blocks (fs_alloc_blocks).
+ * @param       batch       Most blocks per read.
+ * @return      Whether or not all disk operations were successful.
+ */
+bool fs_scan_indirect_blocks(FileSystem *fs, Bitmap *used, uint32_t *indirect, size_t count, Block *scratch, size_t batch)
+{
+    if (count > 1)
+        qsort(indirect, count, sizeof(uint32_t), fs_compare_blocks);
+
+    for (size_t i = 0; i < count;)
+    {
+        /* Extend the run over adjacent (or repeated) blocks */
+        size_t j = i + 1;
+        while (j < count && indirect[j] - indirect[i] < batch && indirect[j] <= indirect[j - 1] + 1)
+            j++;
+
+        size_t first = indirect[i];
+        size_t n = indirect[j - 1] - first + 1;
+        Block *run = fs_read_inode_blocks(fs, first, n, scratch);
+        if (run == NULL)
+        {
+            error("failed on disk_read for indirect blocks [%zu, %zu)", first, first + n);
+            return false;
+        }
+
+        for (size_t b = 0; b < n; b++)
+        {
+            Block *block = fs_block_at(run, b, fs->block_size);
+            for (size_t p = 0; p < fs->pointers_per_block; p++)
+            {
+                if (block->pointers[p] != 0)
+                    bitmap_set(used, block->pointers[p]);
+            }
+        }
+        i = j;
+    }
+    return true;
+}
+
+/**
+ * Unmount FileSystem from internal Disk by doing the following:
+ *
+ *  1. Set Disk mounted status and FileSystem disk attribute.
+ *
+ *  2. Release free blocks bitmap.
+ *
+ *  On disks with free maps, the maps are saved and flushed, then the
+ *  SuperBlock is marked clean so the next mount can skip the scan.  Queued
+ *  writes are pushed to the image first (see disk_barrier).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ **/
+void fs_unmount(FileSystem *fs)
+{
+    if (fs->disk)
+    {
+        if (fs->dirty_maps && fs->disk->mounted &&
+            (!fs_save_bitmaps(fs, false) || disk_flush(fs->disk) == DISK_FAILURE || !fs_write_super(fs, true)))
+            error("failed to save free maps: next mount rebuilds them");
+        if (disk_barrier(fs->disk) == DISK_FAILURE)
+            error("failed on disk_barrier while unmounting");
+        fs->disk->mounted = false;
+        fs->disk = NULL;
+    }
+
+    bitmap_destroy(fs->free_blocks);
+    bitmap_destroy(fs->free_inodes);
+    bitmap_destroy(fs->dirty_maps);
+    fs->free_blocks = NULL;
+    fs->free_inodes = NULL;
+    fs->dirty_maps = NULL;
+    memset(fs->streams, 0, sizeof(fs->streams));
+}
+
+/**
+ * Allocate an Inode in the FileSystem Inode table by doing the following:
+ *
+ *  1. Search Inode table for free inode.
+ *
+ *  2. Reserve free inode in Inode table.
+ *
+ *  3. Commit the operation (see fs_commit).
+ *
+ * Note: Be sure to record updates to Inode table to Disk.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Inode number of allocated Inode.
+ **/
+ssize_t fs_create(FileSystem *fs)
+{
+    // FIXME: What is the maximum inodes in fs ?
+    // Sanity Check: if num of indoes >= maximum inode capacity, we return false;
+    size_t max_inodes = fs->inodes_per_block * fs->meta_data.inode_blocks;
+    if (fs->meta_data.inodes >= max_inodes)
+    {
+        error("failed on fs_create: exceed max num of inodes %ld", max_inodes);
+        return FS_FAILURE;
+    }
+
+    // find first available inode number
+    ssize_t res = fs_find_first_available_inode(fs);
+    if (res == FS_FAILURE)
+    {
+        error("failed on fs_find_first_available_inode");
+        return FS_FAILURE;
+    }
+
+    size_t inode_num = res;
+    size_t inodeBlockOffset = 1;
+    size_t block_idx = inode_num / fs->inodes_per_block + inodeBlockOffset;
+    size_t cur_idx = inode_num % fs->inodes_per_block;
+
+    Block *block = fs_alloc_blocks(1, fs->block_size);
+    if (block == NULL)
+    {
+        error("failed on fs_create: cannot allocate block buffer");
+        return FS_FAILURE;
+    }
+
+    if (fs_read_blocks(fs, block_idx, 1, (char *)block->inodes) == DISK_FAILURE)
+    {
+        error("failed on disk_read at block_index: %d", block_idx);
+        free(block);
+        return FS_FAILURE;
+    }
+
+    Inode *inode_ptr = &(block->inodes[cur_idx]);
+    inode_ptr->valid = true;
+    inode_ptr->size = 0;
+    memset(inode_ptr->direct, 0, sizeof(inode_ptr->direct));
+    inode_ptr->indirect = 0;
+
+    ssize_t written = fs_write_blocks(fs, block_idx, 1, (char *)block->inodes);
+    free(block);
+    if (written == DISK_FAILURE)
+    {
+        error("failed on disk_write at block_index: %d", block_idx);
+        return FS_FAILURE;
+    }
+
+    fs->meta_data.inodes++;
+    fs_mark_inode_status(fs, inode_num, INODE_UNAVAILABLE);
+
+    return fs_commit(fs) ? (ssize_t)inode_num : FS_FAILURE;
+}
+
+/*
+ * Find first available inode number from fs->free_inodes (a word of the
+ * bitmap at a time, see bitmap_find).
+ * @param       fs              Pointer to FileSystem structure.
+ * @return      return available inode number if found, if not, return FS_FAILURE.
+ */
+ssize_t fs_find_first_available_inode(FileSystem *fs)
+{
+    ssize_t inode_num = bitmap_find(fs->free_inodes, 0);
+    return inode_num < 0 ? FS_FAILURE : inode_num;
+}
+
+size_t fs_get_total_inodes(FileSystem *fs)
+{
+    return fs->inodes_per_block * fs->meta_data.inode_blocks;
+}
+
+/*
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_num       inode number.
+ * @param       available       available means this inode is ready to be used.
+ * @return      return fS_SUCCESS if no error, else return FS_FAILURE.
+ */
+ssize_t fs_mark_inode_status(FileSystem *fs, size_t inode_num, bool available)
 {
     info("inodenum:[%ld]\n", inode_num);
     size_t total_inodes = fs_get_total_inodes(fs);
@@ -488,7 +1047,11 @@ ssize_t fs_mark_inode_status(FileSystem *fs, size_t inode_num, bool available)
         error("inode_num [%ld] exceed total_inodes [%ld]", inode_num, total_inodes);
         return FS_FAILURE;
     }
-    fs->free_inodes[inode_num] = available;
+    if (available == INODE_AVAILABLE)
+        bitmap_set(fs->free_inodes, inode_num);
+    else
+        bitmap_clear(fs->free_inodes, inode_num);
+    fs_dirty_bitmap(fs, fs->free_inodes, inode_num);
 
     return FS_SUCCESS;
 }
@@ -504,15 +1067,150 @@ ssize_t fs_mark_inode_status(FileSystem *fs, size_t inode_num, bool available)
  *
  *  4. Mark Inode as free in Inode table.
  *
+ *  5. Discard the released blocks (see fs_discard_blocks).
+ *
+ *  6. Commit the operation (see fs_commit).
+ *
  * @param       fs              Pointer to FileSystem structure.
  * @param       inode_number    Inode to remove.
  * @return      Whether or not removing the specified Inode was successful.
  **/
 bool fs_remove(FileSystem *fs, size_t inode_number)
 {
+    if (!fs->disk || inode_number >= fs_get_total_inodes(fs))
+    {
+        error("failed on fs_remove: invalid inode_number %zu", inode_number);
+        return false;
+    }
+
+    size_t inodeBlockOffset = 1;
+    size_t block_idx = inode_number / fs->inodes_per_block + inodeBlockOffset;
+    uint32_t *released = NULL;
+    Block *blocks = fs_alloc_blocks(2, fs->block_size);
+    if (blocks == NULL)
+    {
+        error("failed on fs_remove: cannot allocate block buffers");
+        return false;
+    }
+
+    Block *block = fs_block_at(blocks, 0, fs->block_size);
+    if (fs_read_blocks(fs, block_idx, 1, block->data) == DISK_FAILURE)
+    {
+        error("failed on disk_read at block_index: %zu", block_idx);
+        goto failure;
+    }
+
+    Inode *inode = &block->inodes[inode_number % fs->inodes_per_block];
+    if (!inode->valid)
+    {
+        error("failed on fs_remove: inode %zu is not valid", inode_number);
+        goto failure;
+    }
+
+    // collect direct, indirect data and indirect pointer blocks, skipping
+    // pointers outside the data region so a corrupt Inode cannot free or
+    // discard metadata
+    released = malloc((POINTERS_PER_INODE + fs->pointers_per_block + 1) * sizeof(uint32_t));
+    if (released == NULL)
+    {
+        error("failed to malloc released blocks");
+        goto failure;
+    }
+    size_t nreleased = 0;
+    for (int direct_idx = 0; direct_idx < POINTERS_PER_INODE; direct_idx++)
+    {
+        if (fs_data_block(fs, inode->direct[direct_idx]))
+            released[nreleased++] = inode->direct[direct_idx];
+    }
+
+    if (fs_data_block(fs, inode->indirect))
+    {
+        Block *indir_block = fs_read_block(fs, inode->indirect, fs_block_at(blocks, 1, fs->block_size));
+        if (indir_block == NULL)
+        {
+            error("failed on disk_read at indirect block: block_number: %u", inode->indirect);
+            goto failure;
+        }
+        for (int i = 0; i < fs->pointers_per_block; i++)
+        {
+            if (fs_data_block(fs, indir_block->pointers[i]))
+                released[nreleased++] = indir_block->pointers[i];
+        }
+        released[nreleased++] = inode->indirect;
+    }
+
+    // record the free inode before releasing its blocks
+    memset(inode, 0, sizeof(Inode));
+    if (fs_write_blocks(fs, block_idx, 1, block->data) == DISK_FAILURE)
+    {
+        error("failed on disk_write at block_index: %zu", block_idx);
+        goto failure;
+    }
+    free(blocks);
+
+    for (size_t i = 0; i < nreleased; i++)
+    {
+        bitmap_set(fs->free_blocks, released[i]);
+        fs_dirty_bitmap(fs, fs->free_blocks, released[i]);
+    }
+    fs_discard_blocks(fs, released, nreleased);
+    free(released);
+
+    if (fs->meta_data.inodes > 0)
+        fs->meta_data.inodes--;
+    fs_mark_inode_status(fs, inode_number, INODE_AVAILABLE);
+
+    // forget readahead state of the removed file
+    for (size_t i = 0; i < FS_STREAMS; i++)
+    {
+        if (fs->streams[i].inode_number == inode_number)
+            fs->streams[i].valid = false;
+    }
+
+    return fs_commit(fs);
+
+failure:
+    free(released);
+    free(blocks);
     return false;
 }
 
+/*
+ * Discard freed blocks on the disk so the host can reclaim their storage,
+ * sorting them and coalescing consecutive blocks into single discards.
+ * Discard is best effort: failures only leave the storage allocated.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       blocks      Block numbers (sorted in place).
+ * @param       count       Number of block numbers.
+ */
+void fs_discard_blocks(FileSystem *fs, uint32_t *blocks, size_t count)
+{
+    qsort(blocks, count, sizeof(uint32_t), fs_compare_blocks);
+
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t run = 1;
+        while (i + run < count && blocks[i + run] == blocks[i] + run)
+            run++;
+        if (blocks[i] + run <= fs->meta_data.blocks &&
+            disk_discard(fs->disk, blocks[i] * fs->disk_blocks, run * fs->disk_blocks) == DISK_FAILURE)
+            debug("discard of %zu blocks at %u failed", run, blocks[i]);
+        i += run;
+    }
+}
+
+/*
+ * qsort comparator ordering block numbers.
+ */
+int fs_compare_blocks(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
 /**
  * Return size of specified Inode.
  *
@@ -525,6 +1223,28 @@ ssize_t fs_stat(FileSystem *fs, size_t inode_number)
     return -1;
 }
 
+/**
+ * Report the space usage of the mounted FileSystem.  The counts come from
+ * the free maps, which keep them up to date, so this does no I/O and no
+ * scan however large the disk is.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       stats           Where to store the usage.
+ * @return      Whether or not the FileSystem is mounted.
+ **/
+bool fs_statfs(FileSystem *fs, FileSystemStats *stats)
+{
+    if (!fs->disk || !fs->free_blocks || !fs->free_inodes)
+        return false;
+
+    stats->block_size = fs->block_size;
+    stats->blocks = fs->meta_data.blocks;
+    stats->free_blocks = bitmap_count(fs->free_blocks);
+    stats->inodes = fs_get_total_inodes(fs);
+    stats->free_inodes = bitmap_count(fs->free_inodes);
+    return true;
+}
+
 /**
  * Read from the specified Inode into the data buffer exactly length bytes
  * beginning from the specified offset by doing the following:
@@ -534,6 +1254,7 @@ ssize_t fs_stat(FileSystem *fs, size_t inode_number)
  *  2. Continuously read blocks and copy data to buffer.
  *
  *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  Each read also feeds the Inode's readahead stream (see fs_readahead).
  *
  * @param       fs              Pointer to FileSystem structure.
  * @param       inode_number    Inode to read data from.
@@ -544,7 +1265,215 @@ ssize_t fs_stat(FileSystem *fs, size_t inode_number)
  **/
 ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset)
 {
-    return -1;
+    Inode inode;
+    if (!fs_load_inode(fs, inode_number, &inode) || !inode.valid)
+        return -1;
+
+    if (offset >= inode.size)
+        return 0;
+    length = min(length, inode.size - offset);
+
+    size_t start = offset / fs->block_size;
+    size_t end = (offset + length + fs->block_size - 1) / fs->block_size;
+
+    // scratch for the indirect block and for each data block
+    Block *scratch = fs_alloc_blocks(2, fs->block_size);
+    if (scratch == NULL)
+    {
+        error("failed on fs_read: cannot allocate block buffers");
+        return -1;
+    }
+
+    // load indirect pointers only when this read reaches them
+    Block *indirect = NULL;
+    if (end > POINTERS_PER_INODE && inode.indirect != 0)
+    {
+        indirect = fs_read_block(fs, inode.indirect, scratch);
+        if (indirect == NULL)
+        {
+            error("failed on disk_read at indirect block: block_number: %u", inode.indirect);
+            free(scratch);
+            return -1;
+        }
+    }
+
+    // start prefetching past this read before serving it
+    fs_readahead(fs, inode_number, &inode, indirect, start, end);
+
+    size_t done = 0;
+    while (done < length)
+    {
+        size_t logical = (offset + done) / fs->block_size;
+        size_t within = (offset + done) % fs->block_size;
+        size_t n = min(fs->block_size - within, length - done);
+
+        uint32_t pointer = fs_block_pointer(fs, &inode, indirect, logical);
+        if (pointer == 0)
+        {
+            // sparse block reads as zeroes
+            memset(data + done, 0, n);
+        }
+        else
+        {
+            Block *block = fs_read_block(fs, pointer, fs_block_at(scratch, 1, fs->block_size));
+            if (block == NULL)
+            {
+                error("failed on disk_read at data block: block_number: %u", pointer);
+                free(scratch);
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            memcpy(data + done, block->data + within, n);
+        }
+        done += n;
+    }
+
+    free(scratch);
+    return done;
+}
+
+/*
+ * Load a copy of an Inode from the Inode table.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to load.
+ * @param       inode           Inode to fill in.
+ * @return      Whether or not the Inode could be read (it may be invalid).
+ */
+bool fs_load_inode(FileSystem *fs, size_t inode_number, Inode *inode)
+{
+    if (!fs->disk || inode_number >= fs_get_total_inodes(fs))
+    {
+        error("invalid inode_number %zu", inode_number);
+        return false;
+    }
+
+    size_t inodeBlockOffset = 1;
+    Block *scratch = fs_alloc_blocks(1, fs->block_size);
+    if (scratch == NULL)
+    {
+        error("failed on fs_load_inode: cannot allocate block buffer");
+        return false;
+    }
+
+    Block *block = fs_read_block(fs, inode_number / fs->inodes_per_block + inodeBlockOffset, scratch);
+    if (block == NULL)
+    {
+        error("failed on disk_read for inode %zu", inode_number);
+        free(scratch);
+        return false;
+    }
+
+    *inode = block->inodes[inode_number % fs->inodes_per_block];
+    free(scratch);
+    return true;
+}
+
+/*
+ * Map a logical block of a file to its disk block.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       inode       Inode of the file.
+ * @param       indirect    Indirect pointer block (NULL if not loaded).
+ * @param       logical     Logical block number within the file.
+ * @return      Disk block number (0 if unallocated or not loaded).
+ */
+uint32_t fs_block_pointer(FileSystem *fs, Inode *inode, Block *indirect, size_t logical)
+{
+    if (logical < POINTERS_PER_INODE)
+        return inode->direct[logical];
+
+    logical -= POINTERS_PER_INODE;
+    if (indirect == NULL || logical >= fs->pointers_per_block)
+        return 0;
+    return indirect->pointers[logical];
+}
+
+/*
+ * Detect sequential reads of an Inode and prefetch ahead of them by doing
+ * the following:
+ *
+ *  1. Find the Inode's stream (or recycle the least recently used one).
+ *
+ *  2. Adapt the window: a read starting where the previous one ended
+ *  doubles it up to FS_READAHEAD_MAX, any other read halves it (to nothing
+ *  below FS_READAHEAD_MIN).  A new stream reading from the start of the
+ *  file begins with FS_READAHEAD_MIN.
+ *
+ *  3. Prefetch the disk blocks behind the next window of logical blocks
+ *  that are not prefetched yet.  When the window enters the indirect range
+ *  before its pointers are loaded, the indirect block itself is prefetched
+ *  and its data blocks follow on a later read.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode being read.
+ * @param       inode           Inode being read.
+ * @param       indirect        Indirect pointer block (NULL if not loaded).
+ * @param       start           First logical block of the current read.
+ * @param       end             Logical block after the current read.
+ */
+void fs_readahead(FileSystem *fs, size_t inode_number, Inode *inode, Block *indirect, size_t start, size_t end)
+{
+    FileStream *stream = NULL;
+    FileStream *victim = &fs->streams[0];
+    for (size_t i = 0; i < FS_STREAMS; i++)
+    {
+        FileStream *candidate = &fs->streams[i];
+        if (candidate->valid && candidate->inode_number == inode_number)
+        {
+            stream = candidate;
+            break;
+        }
+        if (victim->valid && (!candidate->valid || candidate->used < victim->used))
+            victim = candidate;
+    }
+
+    if (stream == NULL)
+    {
+        stream = victim;
+        stream->valid = true;
+        stream->inode_number = inode_number;
+        stream->window = start == 0 ? FS_READAHEAD_MIN : 0;
+        stream->ahead = end;
+    }
+    else if (start == stream->next)
+    {
+        stream->window = stream->window ? min(stream->window * 2, (size_t)FS_READAHEAD_MAX) : FS_READAHEAD_MIN;
+    }
+    else
+    {
+        stream->window = stream->window / 2 >= FS_READAHEAD_MIN ? stream->window / 2 : 0;
+        stream->ahead = end;
+    }
+    stream->next = end;
+    stream->used = ++fs->stream_clock;
+
+    size_t file_blocks = (inode->size + fs->block_size - 1) / fs->block_size;
+    size_t target = min(end + stream->window, file_blocks);
+    size_t blocks[(FS_READAHEAD_MAX + 1) * (FS_MAX_BLOCK_SIZE / BLOCK_SIZE)];
+    size_t count = 0;
+
+    size_t logical = max(stream->ahead, end);
+    for (; logical < target; logical++)
+    {
+        uint32_t pointer;
+        if (logical >= POINTERS_PER_INODE && indirect == NULL)
+            pointer = inode->indirect;
+        else
+            pointer = fs_block_pointer(fs, inode, indirect, logical);
+
+        // prefetch every disk block of the block
+        if (pointer != 0 && pointer < fs->meta_data.blocks)
+        {
+            for (size_t i = 0; i < fs->disk_blocks; i++)
+                blocks[count++] = pointer * fs->disk_blocks + i;
+        }
+        if (logical >= POINTERS_PER_INODE && indirect == NULL)
+            break;
+    }
+    stream->ahead = logical;
+
+    if (count > 0 && disk_prefetch(fs->disk, blocks, count) == DISK_FAILURE)
+        debug("readahead of %zu blocks for inode %zu failed", count, inode_number);
 }
 
 /**
@@ -553,20 +1482,366 @@ ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length,
  *
  *  1. Load Inode information.
  *
- *  2. Continuously copy data from buffer to blocks.
+ *  2. Continuously copy data from buffer to blocks, allocating missing
+ *  blocks (and the indirect block) as needed.  Partial blocks are read and
+ *  merged; new blocks start out zeroed.
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  3. Write back the indirect block and Inode, and commit the write (see
+ *  fs_commit).
+ *
+ *  Note: Data is written to direct blocks first, and then to indirect blocks.
+ *  Writing stops early when the disk is full.
  *
  * @param       fs              Pointer to FileSystem structure.
  * @param       inode_number    Inode to write data to.
  * @param       data            Buffer with data to copy
  * @param       length          Number of bytes to write.
  * @param       offset          Byte offset from which to begin writing.
- * @return      Number of bytes read (-1 on error).
+ * @return      Number of bytes written (-1 on error).
  **/
 ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset)
 {
-    return -1;
+    if (!fs->disk || inode_number >= fs_get_total_inodes(fs))
+    {
+        error("failed on fs_write: invalid inode_number %zu", inode_number);
+        return -1;
+    }
+
+    size_t inodeBlockOffset = 1;
+    size_t block_idx = inode_number / fs->inodes_per_block + inodeBlockOffset;
+    ssize_t result = -1;
+    // Inode table block, indirect pointers and partial block scratch
+    Block *blocks = fs_alloc_blocks(3, fs->block_size);
+    if (blocks == NULL)
+    {
+        error("failed on fs_write: cannot allocate block buffers");
+        return -1;
+    }
+    Block *table = fs_block_at(blocks, 0, fs->block_size);
+    Block *indirect = fs_block_at(blocks, 1, fs->block_size);
+    Block *scratch = fs_block_at(blocks, 2, fs->block_size);
+
+    if (fs_read_blocks(fs, block_idx, 1, table->data) == DISK_FAILURE)
+    {
+        error("failed on disk_read at block_index: %zu", block_idx);
+        goto cleanup;
+    }
+
+    Inode *inode = &table->inodes[inode_number % fs->inodes_per_block];
+    if (!inode->valid)
+    {
+        error("failed on fs_write: inode %zu is not valid", inode_number);
+        goto cleanup;
+    }
+
+    size_t max_size = fs->max_file_size;
+    if (offset >= max_size)
+    {
+        result = 0;
+        goto cleanup;
+    }
+    length = min(length, max_size - offset);
+
+    bool indirect_loaded = false;
+    bool indirect_dirty = false;
+    bool inode_dirty = false;
+
+    size_t done = 0;
+    while (done < length)
+    {
+        size_t logical = (offset + done) / fs->block_size;
+        size_t within = (offset + done) % fs->block_size;
+        size_t n = min(fs->block_size - within, length - done);
+
+        // load (or allocate) indirect pointers once the write reaches them
+        if (logical >= POINTERS_PER_INODE && !indirect_loaded)
+        {
+            if (inode->indirect == 0)
+            {
+                ssize_t allocated = fs_allocate_block(fs);
+                if (allocated == FS_FAILURE)
+                    break;
+                inode->indirect = allocated;
+                fs_mark_metadata(fs, allocated, 1, true);
+                inode_dirty = true;
+                memset(indirect->data, 0, fs->block_size);
+                indirect_dirty = true;
+            }
+            else if (fs_read_blocks(fs, inode->indirect, 1, indirect->data) == DISK_FAILURE)
+            {
+                error("failed on disk_read at indirect block: block_number: %u", inode->indirect);
+                break;
+            }
+            indirect_loaded = true;
+        }
+
+        uint32_t *pointer = logical < POINTERS_PER_INODE ? &inode->direct[logical]
+                                                         : &indirect->pointers[logical - POINTERS_PER_INODE];
+        bool fresh = *pointer == 0;
+        if (fresh)
+        {
+            ssize_t allocated = fs_allocate_block(fs);
+            if (allocated == FS_FAILURE)
+                break;
+            *pointer = allocated;
+            fs_mark_metadata(fs, allocated, 1, false);
+            if (logical < POINTERS_PER_INODE)
+                inode_dirty = true;
+            else
+                indirect_dirty = true;
+        }
+
+        ssize_t nwritten;
+        if (n == fs->block_size)
+        {
+            nwritten = fs_write_blocks(fs, *pointer, 1, data + done);
+        }
+        else
+        {
+            // merge partial block with its old contents (or zeroes)
+            if (fresh)
+                memset(scratch->data, 0, fs->block_size);
+            else if (fs_read_blocks(fs, *pointer, 1, scratch->data) == DISK_FAILURE)
+            {
+                error("failed on disk_read at data block: block_number: %u", *pointer);
+                break;
+            }
+            memcpy(scratch->data + within, data + done, n);
+            nwritten = fs_write_blocks(fs, *pointer, 1, scratch->data);
+        }
+        if (nwritten == DISK_FAILURE)
+        {
+            error("failed on disk_write at data block: block_number: %u", *pointer);
+            break;
+        }
+        done += n;
+    }
+
+    if (indirect_dirty && fs_write_blocks(fs, inode->indirect, 1, indirect->data) == DISK_FAILURE)
+    {
+        error("failed on disk_write at indirect block: block_number: %u", inode->indirect);
+        goto cleanup;
+    }
+
+    if (offset + done > inode->size)
+    {
+        inode->size = offset + done;
+        inode_dirty = true;
+    }
+    if (inode_dirty && fs_write_blocks(fs, block_idx, 1, table->data) == DISK_FAILURE)
+    {
+        error("failed on disk_write at block_index: %zu", block_idx);
+        goto cleanup;
+    }
+
+    if (done > 0 && !fs_commit(fs))
+        goto cleanup;
+    result = done > 0 || length == 0 ? (ssize_t)done : -1;
+
+cleanup:
+    free(blocks);
+    return result;
+}
+
+/*
+ * Allocate the first free data block (blocks after the Inode table and free
+ * maps), a word of the bitmap at a time (see bitmap_find).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Allocated block number (FS_FAILURE if the disk is full).
+ */
+ssize_t fs_allocate_block(FileSystem *fs)
+{
+    ssize_t b = bitmap_find(fs->free_blocks, fs_data_start(fs));
+    if (b < 0)
+    {
+        debug("no free blocks left");
+        return FS_FAILURE;
+    }
+    bitmap_clear(fs->free_blocks, b);
+    fs_dirty_bitmap(fs, fs->free_blocks, b);
+    return b;
+}
+
+/*
+ * First data block: after the SuperBlock, Inode table and free maps.
+ */
+size_t fs_data_start(FileSystem *fs)
+{
+    return 1 + fs->meta_data.inode_blocks + fs->meta_data.bitmap_blocks;
+}
+
+/*
+ * Whether a block pointer names a data block (0 means unallocated).
+ */
+bool fs_data_block(FileSystem *fs, uint32_t block)
+{
+    return block >= fs_data_start(fs) && block < fs->meta_data.blocks;
+}
+
+/*
+ * Number of blocks holding the free maps of a file system: the words of the
+ * free block map followed by those of the free inode map.
+ */
+size_t fs_bitmap_blocks(size_t blocks, size_t inodes, size_t block_size)
+{
+    size_t words = (blocks + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS +
+                   (inodes + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    return (words * sizeof(uint64_t) + block_size - 1) / block_size;
+}
+
+/*
+ * Copy one block of the on-disk free maps between data and the free maps'
+ * words (which are stored as they are in memory).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Block index within the free maps.
+ * @param       data        Block buffer (block_size bytes).
+ * @param       save        Whether to copy from the maps into data (zero
+ *                          filling the rest) instead of from data.
+ */
+void fs_bitmap_transfer(FileSystem *fs, size_t block, char *data, bool save)
+{
+    Bitmap *maps[] = {fs->free_blocks, fs->free_inodes};
+    size_t start = block * fs->block_size;
+    size_t offset = 0;
+
+    if (save)
+        memset(data, 0, fs->block_size);
+    for (size_t m = 0; m < 2; m++)
+    {
+        size_t bytes = maps[m]->nwords * sizeof(uint64_t);
+        size_t first = max(start, offset);
+        size_t last = min(start + fs->block_size, offset + bytes);
+        if (first < last && save)
+            memcpy(data + first - start, (char *)maps[m]->words + first - offset, last - first);
+        else if (first < last)
+            memcpy((char *)maps[m]->words + first - offset, data + first - start, last - first);
+        offset += bytes;
+    }
+}
+
+/*
+ * Read the free maps from disk (see fs_bitmap_transfer), in one vectored
+ * read, instead of scanning the Inode table.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @return      Whether or not the free maps were read.
+ */
+bool fs_load_bitmaps(FileSystem *fs)
+{
+    size_t count = fs->meta_data.bitmap_blocks;
+    fs->free_blocks = bitmap_create(fs->meta_data.blocks, false);
+    fs->free_inodes = bitmap_create(fs_get_total_inodes(fs), false);
+    Block *blocks = fs_alloc_blocks(count, fs->block_size);
+    if (!fs->free_blocks || !fs->free_inodes || !blocks)
+    {
+        error("failed to allocate free maps");
+        free(blocks);
+        return false;
+    }
+
+    if (fs_read_blocks(fs, 1 + fs->meta_data.inode_blocks, count, blocks->data) == DISK_FAILURE)
+    {
+        error("failed on disk_readv for free maps");
+        free(blocks);
+        return false;
+    }
+    for (size_t b = 0; b < count; b++)
+        fs_bitmap_transfer(fs, b, fs_block_at(blocks, b, fs->block_size)->data, false);
+    free(blocks);
+
+    bitmap_summarize(fs->free_blocks);
+    bitmap_summarize(fs->free_inodes);
+    bitmap_clear_range(fs->free_blocks, 0, fs_data_start(fs));
+    return true;
+}
+
+/*
+ * Write free map blocks to disk: every block, or only those changed since
+ * they were last saved (see fs_dirty_bitmap).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       all         Whether to write every block.
+ * @return      Whether or not all disk operations were successful.
+ */
+bool fs_save_bitmaps(FileSystem *fs, bool all)
+{
+    size_t count = fs->meta_data.bitmap_blocks;
+    ssize_t b = all ? 0 : bitmap_find(fs->dirty_maps, 0);
+    if (b < 0 || (size_t)b >= count)
+        return true;
+
+    Block *block = fs_alloc_blocks(1, fs->block_size);
+    if (block == NULL)
+    {
+        error("failed to allocate free map block");
+        return false;
+    }
+
+    bool saved = true;
+    while (b >= 0 && (size_t)b < count)
+    {
+        fs_bitmap_transfer(fs, b, block->data, true);
+        if (fs_write_blocks(fs, 1 + fs->meta_data.inode_blocks + b, 1, block->data) == DISK_FAILURE)
+        {
+            error("failed on disk_write for free map block %zd", b);
+            saved = false;
+            break;
+        }
+        if (fs->dirty_maps)
+            bitmap_clear(fs->dirty_maps, b);
+        b = all ? b + 1 : bitmap_find(fs->dirty_maps, b + 1);
+    }
+    free(block);
+    return saved;
+}
+
+/*
+ * Note that a bit of a free map changed, so its block is written at the
+ * next fs_commit (nothing to do without on-disk free maps).
+ */
+void fs_dirty_bitmap(FileSystem *fs, const Bitmap *bitmap, size_t bit)
+{
+    if (!fs->dirty_maps || bit >= bitmap->bits)
+        return;
+
+    size_t word = bit / BITMAP_WORD_BITS;
+    if (bitmap == fs->free_inodes)
+        word += fs->free_blocks->nwords;
+    bitmap_set(fs->dirty_maps, word * sizeof(uint64_t) / fs->block_size);
+}
+
+/*
+ * Write the SuperBlock with the given clean flag.  The inode count on disk
+ * stays the Inode table's capacity, as fs_format_with records it.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       clean       Whether the free maps on disk are up to date.
+ * @return      Whether or not the SuperBlock was written.
+ */
+bool fs_write_super(FileSystem *fs, bool clean)
+{
+    Block *block = fs_alloc_blocks(1, fs->block_size);
+    if (block == NULL)
+    {
+        error("failed to allocate superblock");
+        return false;
+    }
+
+    memset(block->data, 0, fs->block_size);
+    block->super = fs->meta_data;
+    block->super.inodes = fs_get_total_inodes(fs);
+    block->super.clean = clean;
+    fs->meta_data.clean = clean;
+    ssize_t written = fs_write_blocks(fs, 0, 1, block->data);
+    free(block);
+    if (written == DISK_FAILURE)
+    {
+        error("failed on disk_write for superblock");
+        return false;
+    }
+    return true;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
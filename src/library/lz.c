@@ -0,0 +1,254 @@
+/* lz.c: SimpleFS LZ77 block compression */
+
+#include "sfs/lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Internal Constants */
+
+#define LZ_MIN_MATCH     (4)  /* Shortest match encoded */
+#define LZ_LAST_LITERALS (5)  /* Bytes at the end that are always literals */
+#define LZ_MATCH_LIMIT   (12) /* No match starts this close to the end */
+#define LZ_HASH_BITS     (12) /* log2 of hash table entries */
+#define LZ_MAX_OFFSET    (65535)
+#define LZ_SKIP_TRIGGER  (6)  /* Misses before the search step grows (log2) */
+
+/* Internal Prototyes */
+
+uint32_t lz_read32(const uint8_t *p);
+uint32_t lz_hash(uint32_t sequence);
+bool lz_length(uint8_t **out, uint8_t *end, size_t length);
+bool lz_emit(uint8_t **out, uint8_t *end, const uint8_t *literals, size_t nliterals, size_t offset, size_t match);
+
+/* External Functions */
+
+/**
+ * Compress length bytes of source into destination by doing the following:
+ *
+ *  1. Looking up each position's next four bytes in a hash table of
+ *  earlier positions, searching faster the longer nothing matches.
+ *
+ *  2. On a match, extending it backwards over pending literals and forwards
+ *  as far as it goes, then emitting the literals before it and the match.
+ *
+ *  3. Emitting the remaining bytes as literals.
+ *
+ * @param       source      Data to compress.
+ * @param       length      Number of bytes (at most LZ_MAX_INPUT).
+ * @param       destination Buffer for compressed data.
+ * @param       capacity    Size of destination.
+ *
+ * @return      Size of compressed data (0 if it does not fit in capacity).
+ **/
+size_t lz_compress(const void *source, size_t length, void *destination, size_t capacity)
+{
+    const uint8_t *in = source;
+    const uint8_t *end = in + length;
+    uint8_t *out = destination;
+    uint8_t *out_end = out + capacity;
+    const uint8_t *anchor = in;
+
+    if (length > LZ_MAX_INPUT)
+        return 0;
+
+    if (length > LZ_MATCH_LIMIT)
+    {
+        uint16_t table[1 << LZ_HASH_BITS] = {0};
+        const uint8_t *limit = end - LZ_MATCH_LIMIT;
+        const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+        const uint8_t *ip = in + 1;
+        size_t misses = 0;
+
+        while (ip < limit)
+        {
+            uint32_t sequence = lz_read32(ip);
+            uint32_t hash = lz_hash(sequence);
+            const uint8_t *ref = in + table[hash];
+            table[hash] = ip - in;
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != sequence)
+            {
+                ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > in && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t *mp = ip + LZ_MIN_MATCH;
+            const uint8_t *mr = ref + LZ_MIN_MATCH;
+            while (mp < match_limit && *mp == *mr)
+            {
+                mp++;
+                mr++;
+            }
+
+            if (!lz_emit(&out, out_end, anchor, ip - anchor, ip - ref, mp - ip - LZ_MIN_MATCH))
+                return 0;
+
+            /* Index a position inside the match so the next one can chain */
+            if (mp - 2 > in)
+                table[lz_hash(lz_read32(mp - 2))] = mp - 2 - in;
+            ip = anchor = mp;
+        }
+    }
+
+    if (!lz_emit(&out, out_end, anchor, end - anchor, 0, 0))
+        return 0;
+    return out - (uint8_t *)destination;
+}
+
+/**
+ * Decompress length bytes of source into destination, checking every
+ * length and offset against both buffers.
+ *
+ * @param       source      Compressed data.
+ * @param       length      Number of compressed bytes.
+ * @param       destination Buffer for decompressed data.
+ * @param       capacity    Size of destination.
+ *
+ * @return      Size of decompressed data (-1 if source is malformed or
+ *              does not fit in capacity).
+ **/
+ssize_t lz_decompress(const void *source, size_t length, void *destination, size_t capacity)
+{
+    const uint8_t *ip = source;
+    const uint8_t *end = ip + length;
+    uint8_t *op = destination;
+    uint8_t *out_end = op + capacity;
+
+    while (ip < end)
+    {
+        uint8_t token = *ip++;
+
+        size_t nliterals = token >> 4;
+        if (nliterals == 15)
+        {
+            uint8_t byte;
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                byte = *ip++;
+                nliterals += byte;
+            } while (byte == 255);
+        }
+        if (nliterals > (size_t)(end - ip) || nliterals > (size_t)(out_end - op))
+            return -1;
+        memcpy(op, ip, nliterals);
+        ip += nliterals;
+        op += nliterals;
+
+        /* The last sequence has literals only */
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)destination))
+            return -1;
+
+        size_t match = token & 15;
+        if (match == 15)
+        {
+            uint8_t byte;
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                byte = *ip++;
+                match += byte;
+            } while (byte == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if (match > (size_t)(out_end - op))
+            return -1;
+
+        /* Byte by byte: the match may overlap the bytes it produces */
+        const uint8_t *mp = op - offset;
+        for (size_t i = 0; i < match; i++)
+            op[i] = mp[i];
+        op += match;
+    }
+
+    return op - (uint8_t *)destination;
+}
+
+/* Internal Functions */
+
+/**
+ * Load four bytes from any alignment.
+ **/
+uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * Hash a four-byte sequence to a table index (Fibonacci hashing).
+ **/
+uint32_t lz_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Append the extension bytes of a length that did not fit in its token
+ * nibble (runs of 255, then the remainder).
+ **/
+bool lz_length(uint8_t **out, uint8_t *end, size_t length)
+{
+    while (length >= 255)
+    {
+        if (*out >= end)
+            return false;
+        *(*out)++ = 255;
+        length -= 255;
+    }
+    if (*out >= end)
+        return false;
+    *(*out)++ = length;
+    return true;
+}
+
+/**
+ * Append one sequence: a token, nliterals literals and, unless offset is 0
+ * (the final sequence), a match of match + LZ_MIN_MATCH bytes at offset.
+ *
+ * @return      Whether the sequence fit before end.
+ **/
+bool lz_emit(uint8_t **out, uint8_t *end, const uint8_t *literals, size_t nliterals, size_t offset, size_t match)
+{
+    if (*out >= end)
+        return false;
+    uint8_t *token = (*out)++;
+    *token = (nliterals < 15 ? nliterals : 15) << 4;
+    if (nliterals >= 15 && !lz_length(out, end, nliterals - 15))
+        return false;
+
+    if (nliterals > (size_t)(end - *out))
+        return false;
+    memcpy(*out, literals, nliterals);
+    *out += nliterals;
+
+    if (offset == 0)
+        return true;
+
+    if (end - *out < 2)
+        return false;
+    *(*out)++ = offset & 0xff;
+    *(*out)++ = offset >> 8;
+    *token |= match < 15 ? match : 15;
+    return match < 15 || lz_length(out, end, match - 15);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,278 @@
+/* members.c: SimpleFS member disks of a multi-image backend */
+
+#include "sfs/members.h"
+#include "sfs/logging.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Internal Prototyes */
+
+void *members_worker(void *arg);
+
+/* External Functions */
+
+/**
+ * Open the member images of a multi-image backend by doing the following:
+ *
+ *  1. Splitting paths at commas.
+ *
+ *  2. Opening each member with the backend and shape options select (the
+ *  options are kept so members_reopen can open a member again).
+ *
+ *  3. Starting one worker thread per member.
+ *
+ * @param       paths       Comma-separated paths of the member images.
+ * @param       blocks      Number of blocks of each member.
+ * @param       options     Options to open each member with.
+ * @param       partial     Whether members that fail to open are left
+ *                          closed (with a NULL disk) instead of failing.
+ *
+ * @return      Pointer to newly allocated Members (NULL on failure).
+ **/
+Members *members_open(const char *paths, size_t blocks, const DiskOptions *options, bool partial)
+{
+    Members *members = calloc(1, sizeof(Members));
+    char *list = strdup(paths);
+    if (!members || !list)
+    {
+        error("failed on calloc for Members");
+        free(members);
+        free(list);
+        return NULL;
+    }
+
+    pthread_mutex_init(&members->lock, NULL);
+    pthread_cond_init(&members->done, NULL);
+    for (size_t i = 0; i < MEMBERS_MAX; i++)
+    {
+        members->members[i].owner = members;
+        pthread_cond_init(&members->members[i].ready, NULL);
+    }
+    members->blocks = blocks;
+    members->options = *options;
+    if (options->shape)
+    {
+        members->shape = *options->shape;
+        members->options.shape = &members->shape;
+    }
+
+    char *state = NULL;
+    for (char *path = strtok_r(list, ",", &state); path; path = strtok_r(NULL, ",", &state))
+    {
+        if (members->count == MEMBERS_MAX)
+        {
+            error("more than %d member images in %s", MEMBERS_MAX, paths);
+            goto failure;
+        }
+        members->members[members->count].path = strdup(path);
+        if (!members->members[members->count++].path)
+            goto failure;
+    }
+    if (members->count == 0)
+    {
+        error("no member images in %s", paths);
+        goto failure;
+    }
+
+    for (size_t i = 0; i < members->count; i++)
+    {
+        Member *member = &members->members[i];
+        member->disk = disk_open_with(member->path, blocks, &members->options);
+        if (!member->disk && !partial)
+            goto failure;
+    }
+
+    for (size_t i = 0; i < members->count; i++)
+    {
+        Member *member = &members->members[i];
+        if (pthread_create(&member->thread, NULL, members_worker, member) != 0)
+        {
+            error("failed on pthread_create for member %zu", i);
+            goto failure;
+        }
+        member->started = true;
+    }
+
+    free(list);
+    return members;
+
+failure:
+    free(list);
+    members_close(members);
+    return NULL;
+}
+
+/**
+ * Stop the workers and close the members (without reporting their
+ * statistics).
+ *
+ * @param       members     Pointer to Members (may be NULL).
+ **/
+void members_close(Members *members)
+{
+    if (!members)
+        return;
+
+    pthread_mutex_lock(&members->lock);
+    members->stop = true;
+    for (size_t i = 0; i < members->count; i++)
+        pthread_cond_signal(&members->members[i].ready);
+    pthread_mutex_unlock(&members->lock);
+
+    for (size_t i = 0; i < MEMBERS_MAX; i++)
+    {
+        Member *member = &members->members[i];
+        if (member->started)
+            pthread_join(member->thread, NULL);
+        if (member->disk)
+            disk_release(member->disk);
+        free(member->path);
+        pthread_cond_destroy(&member->ready);
+    }
+    pthread_cond_destroy(&members->done);
+    pthread_mutex_destroy(&members->lock);
+    free(members);
+}
+
+/**
+ * Close a member (if open) and open its image again, for a member whose
+ * device has come back.  No request may be using the member.
+ *
+ * @param       members     Pointer to Members.
+ * @param       member      Member index.
+ *
+ * @return      Whether the member is open.
+ **/
+bool members_reopen(Members *members, size_t member)
+{
+    Member *target = &members->members[member];
+    if (target->disk)
+        disk_release(target->disk);
+    target->disk = disk_open_with(target->path, members->blocks, &members->options);
+    return target->disk != NULL;
+}
+
+/**
+ * Run the shares of one request: all but the first are queued for their
+ * members' workers, the first runs on the calling thread, then the caller
+ * waits for the rest.  Several threads may submit at once.
+ *
+ * @param       members     Pointer to Members.
+ * @param       jobs        Shares of the request (one per member at most).
+ * @param       njobs       Number of shares.
+ *
+ * @return      0 on success, DISK_FAILURE if any share failed (errno is
+ *              that share's; every job's result is set either way).
+ **/
+ssize_t members_submit(Members *members, MemberJob *jobs, size_t njobs)
+{
+    size_t pending = njobs > 0 ? njobs - 1 : 0;
+    if (njobs > 1)
+    {
+        pthread_mutex_lock(&members->lock);
+        for (size_t j = 1; j < njobs; j++)
+        {
+            Member *member = &members->members[jobs[j].member];
+            jobs[j].next = NULL;
+            jobs[j].pending = &pending;
+            if (member->tail)
+                member->tail->next = &jobs[j];
+            else
+                member->head = &jobs[j];
+            member->tail = &jobs[j];
+            pthread_cond_signal(&member->ready);
+        }
+        pthread_mutex_unlock(&members->lock);
+    }
+
+    if (njobs > 0)
+        members_run(members, &jobs[0]);
+
+    if (njobs > 1)
+    {
+        pthread_mutex_lock(&members->lock);
+        while (pending > 0)
+            pthread_cond_wait(&members->done, &members->lock);
+        pthread_mutex_unlock(&members->lock);
+    }
+
+    for (size_t j = 0; j < njobs; j++)
+    {
+        if (jobs[j].result == DISK_FAILURE)
+        {
+            errno = jobs[j].error;
+            return DISK_FAILURE;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Perform one share on its member disk (failing with EIO if the member is
+ * not open).
+ *
+ * @param       members     Pointer to Members.
+ * @param       job         Share to perform (result and error are set).
+ **/
+void members_run(Members *members, MemberJob *job)
+{
+    Disk *member = members->members[job->member].disk;
+    if (!member)
+    {
+        job->result = DISK_FAILURE;
+        job->error = EIO;
+        return;
+    }
+
+    switch (job->operation)
+    {
+    case MEMBER_READ:
+    case MEMBER_WRITE:
+        job->result = disk_transfer(member, job->block, job->count, job->data, job->operation == MEMBER_WRITE);
+        break;
+    case MEMBER_FLUSH:
+        job->result = disk_flush(member);
+        break;
+    case MEMBER_DISCARD:
+        job->result = disk_discard(member, job->block, job->count);
+        break;
+    }
+    job->error = job->result == DISK_FAILURE ? errno : 0;
+}
+
+/* Internal Functions */
+
+/**
+ * Worker of one member: run its queued jobs in order until the members
+ * close.
+ **/
+void *members_worker(void *arg)
+{
+    Member *member = arg;
+    Members *members = member->owner;
+
+    pthread_mutex_lock(&members->lock);
+    while (true)
+    {
+        while (!member->head && !members->stop)
+            pthread_cond_wait(&member->ready, &members->lock);
+        MemberJob *job = member->head;
+        if (!job)
+            break;
+        member->head = job->next;
+        if (!member->head)
+            member->tail = NULL;
+        pthread_mutex_unlock(&members->lock);
+
+        members_run(members, job);
+
+        pthread_mutex_lock(&members->lock);
+        (*job->pending)--;
+        pthread_cond_broadcast(&members->done);
+    }
+    pthread_mutex_unlock(&members->lock);
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,329 @@
+/* readahead.c: SimpleFS block readahead buffer */
+
+#include "sfs/readahead.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <string.h>
+
+/* Internal Constants */
+
+#define READAHEAD_BATCH (64) /* Blocks prefetched per vectored read */
+
+/* Internal Structures */
+
+typedef struct ReadaheadRequest ReadaheadRequest;
+
+struct ReadaheadRequest
+{
+    size_t block; /* Block number to prefetch */
+    size_t slot;  /* Slot receiving the block */
+};
+
+/* Internal Prototyes */
+
+ssize_t readahead_lookup(Readahead *readahead, size_t block);
+ssize_t readahead_victim(Readahead *readahead);
+void readahead_complete(Disk *disk, size_t block, ssize_t result, void *arg);
+void readahead_fetch(Readahead *readahead, Disk *disk, ReadaheadRequest *requests, size_t count);
+int readahead_compare_requests(const void *a, const void *b);
+
+/* External Functions */
+
+/**
+ * Create a readahead buffer of capacity DISK_ALIGNMENT aligned slots.
+ *
+ * @param       capacity    Number of blocks that may be prefetched at once.
+ *
+ * @return      Pointer to newly allocated Readahead (NULL on failure).
+ **/
+Readahead *readahead_create(size_t capacity)
+{
+    Readahead *readahead = calloc(1, sizeof(Readahead));
+    if (!readahead)
+    {
+        error("failed on calloc for Readahead");
+        return NULL;
+    }
+
+    readahead->capacity = capacity;
+    readahead->slots = calloc(capacity, sizeof(ReadaheadSlot));
+    if (!readahead->slots ||
+        posix_memalign((void **)&readahead->frames, DISK_ALIGNMENT, capacity * BLOCK_SIZE) != 0)
+    {
+        error("failed to allocate readahead buffer of %zu blocks", capacity);
+        free(readahead->slots);
+        free(readahead);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < capacity; i++)
+        readahead->slots[i].data = readahead->frames + i * BLOCK_SIZE;
+
+    pthread_mutex_init(&readahead->lock, NULL);
+    return readahead;
+}
+
+/**
+ * Release readahead buffer memory.  Prefetches must have completed (see
+ * disk_drain).
+ *
+ * @param       readahead   Pointer to Readahead structure.
+ **/
+void readahead_destroy(Readahead *readahead)
+{
+    if (!readahead)
+        return;
+
+    pthread_mutex_destroy(&readahead->lock);
+    free(readahead->frames);
+    free(readahead->slots);
+    free(readahead);
+}
+
+/**
+ * Prefetch blocks into the readahead buffer by doing the following:
+ *
+ *  1. Skipping blocks that are already prefetched or in flight.
+ *
+ *  2. Claiming a slot for each remaining block, reusing empty slots first
+ *  and then the oldest unread ones; in-flight slots are never reused.
+ *
+ *  3. Queueing asynchronous reads when the disk has an io_uring (and no
+ *  buffer cache or write queue), otherwise reading the blocks right away, sorted and
+ *  coalesced into vectored reads.
+ *
+ * @param       readahead   Pointer to Readahead structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to prefetch (already sanity checked).
+ * @param       count       Number of block numbers.
+ *
+ * @return      Number of prefetches started.
+ **/
+size_t readahead_prefetch(Readahead *readahead, Disk *disk, const size_t *blocks, size_t count)
+{
+    ReadaheadRequest requests[READAHEAD_BATCH];
+    size_t nrequests = 0;
+    size_t started = 0;
+    bool async = disk->ring && !disk->cache && !disk->elevator;
+
+    pthread_mutex_lock(&readahead->lock);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (readahead_lookup(readahead, blocks[i]) >= 0)
+            continue;
+
+        ssize_t slot = readahead_victim(readahead);
+        if (slot < 0)
+            break;
+
+        ReadaheadSlot *entry = &readahead->slots[slot];
+        entry->block = blocks[i];
+        __atomic_store_n(&entry->state, READAHEAD_PENDING, __ATOMIC_RELEASE);
+
+        if (async)
+        {
+            if (disk_queue_read(disk, entry->block, entry->data, readahead_complete, entry) == DISK_FAILURE)
+            {
+                __atomic_store_n(&entry->state, READAHEAD_EMPTY, __ATOMIC_RELEASE);
+                break;
+            }
+            started++;
+            continue;
+        }
+
+        requests[nrequests].block = entry->block;
+        requests[nrequests].slot = slot;
+        nrequests++;
+        started++;
+        if (nrequests == READAHEAD_BATCH)
+        {
+            readahead_fetch(readahead, disk, requests, nrequests);
+            nrequests = 0;
+        }
+    }
+
+    if (nrequests > 0)
+        readahead_fetch(readahead, disk, requests, nrequests);
+    if (async && started > 0 && disk_submit(disk) == DISK_FAILURE)
+        error("readahead: disk_submit failed");
+    pthread_mutex_unlock(&readahead->lock);
+
+    return started;
+}
+
+/**
+ * Serve a read from the readahead buffer: if block was prefetched, wait for
+ * it if still in flight, copy it into data and free its slot (streams
+ * rarely read a block twice, and the buffer cache keeps blocks that are).
+ *
+ * @param       readahead   Pointer to Readahead structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to read.
+ * @param       data        Data buffer.
+ *
+ * @return      Whether block was served from the readahead buffer.
+ **/
+bool readahead_read(Readahead *readahead, Disk *disk, size_t block, char *data)
+{
+    bool hit = false;
+
+    pthread_mutex_lock(&readahead->lock);
+    ssize_t slot = readahead_lookup(readahead, block);
+    if (slot >= 0)
+    {
+        ReadaheadSlot *entry = &readahead->slots[slot];
+        while (__atomic_load_n(&entry->state, __ATOMIC_ACQUIRE) == READAHEAD_PENDING)
+        {
+            if (disk_poll(disk, true) == DISK_FAILURE)
+                break;
+        }
+
+        if (__atomic_load_n(&entry->state, __ATOMIC_ACQUIRE) == READAHEAD_READY)
+        {
+            memcpy(data, entry->data, BLOCK_SIZE);
+            __atomic_store_n(&entry->state, READAHEAD_EMPTY, __ATOMIC_RELEASE);
+            hit = true;
+        }
+    }
+    pthread_mutex_unlock(&readahead->lock);
+
+    return hit;
+}
+
+/**
+ * Forget prefetched copies of count blocks starting at block because they
+ * are being overwritten or discarded.  Copies still in flight are marked
+ * stale and dropped when they complete.
+ *
+ * @param       readahead   Pointer to Readahead structure.
+ * @param       block       First block number.
+ * @param       count       Number of blocks.
+ **/
+void readahead_invalidate(Readahead *readahead, size_t block, size_t count)
+{
+    for (size_t i = 0; i < readahead->capacity; i++)
+    {
+        ReadaheadSlot *entry = &readahead->slots[i];
+        int state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+        if (state == READAHEAD_EMPTY || entry->block < block || entry->block - block >= count)
+            continue;
+
+        if (state == READAHEAD_PENDING &&
+            __atomic_compare_exchange_n(&entry->state, &state, READAHEAD_STALE, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+        if (state == READAHEAD_READY)
+            __atomic_compare_exchange_n(&entry->state, &state, READAHEAD_EMPTY, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Find the slot holding block (ready or in flight).
+ *
+ * @param       readahead   Pointer to Readahead structure.
+ * @param       block       Block number.
+ *
+ * @return      Slot index (-1 if block is not prefetched).
+ **/
+ssize_t readahead_lookup(Readahead *readahead, size_t block)
+{
+    for (size_t i = 0; i < readahead->capacity; i++)
+    {
+        int state = __atomic_load_n(&readahead->slots[i].state, __ATOMIC_ACQUIRE);
+        if ((state == READAHEAD_READY || state == READAHEAD_PENDING) && readahead->slots[i].block == block)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Pick a slot for a new prefetch: the first empty slot, or else the oldest
+ * unread one (slots are claimed in round-robin order, so the hand points at
+ * the oldest).
+ *
+ * @param       readahead   Pointer to Readahead structure.
+ *
+ * @return      Slot index (-1 if every slot is in flight).
+ **/
+ssize_t readahead_victim(Readahead *readahead)
+{
+    ssize_t ready = -1;
+    for (size_t n = 0; n < readahead->capacity; n++)
+    {
+        size_t i = (readahead->hand + n) % readahead->capacity;
+        int state = __atomic_load_n(&readahead->slots[i].state, __ATOMIC_ACQUIRE);
+        if (state == READAHEAD_EMPTY)
+        {
+            ready = i;
+            break;
+        }
+        if (state == READAHEAD_READY && ready < 0)
+            ready = i;
+    }
+
+    if (ready >= 0)
+        readahead->hand = (ready + 1) % readahead->capacity;
+    return ready;
+}
+
+/**
+ * Completion callback for asynchronous prefetches: publish the block, or
+ * free the slot if the read failed or the block went stale meanwhile.
+ **/
+void readahead_complete(Disk *disk, size_t block, ssize_t result, void *arg)
+{
+    ReadaheadSlot *entry = arg;
+    int pending = READAHEAD_PENDING;
+    if (result != BLOCK_SIZE ||
+        !__atomic_compare_exchange_n(&entry->state, &pending, READAHEAD_READY, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        __atomic_store_n(&entry->state, READAHEAD_EMPTY, __ATOMIC_RELEASE);
+}
+
+/**
+ * Read prefetch requests synchronously, straight from the backend: sort
+ * them by block and issue one vectored read per run of consecutive blocks.
+ *
+ * @param       readahead   Pointer to Readahead structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       requests    Prefetch requests (sorted in place).
+ * @param       count       Number of requests (at most READAHEAD_BATCH).
+ **/
+void readahead_fetch(Readahead *readahead, Disk *disk, ReadaheadRequest *requests, size_t count)
+{
+    qsort(requests, count, sizeof(ReadaheadRequest), readahead_compare_requests);
+
+    size_t i = 0;
+    while (i < count)
+    {
+        char *data[READAHEAD_BATCH];
+        size_t run = 0;
+        do
+        {
+            data[run] = readahead->slots[requests[i + run].slot].data;
+            run++;
+        } while (i + run < count && requests[i + run].block == requests[i].block + run);
+
+        ssize_t nbytes = disk_transfer(disk, requests[i].block, run, data, false);
+        for (size_t r = 0; r < run; r++)
+            readahead_complete(disk, requests[i + r].block, nbytes == DISK_FAILURE ? DISK_FAILURE : BLOCK_SIZE,
+                               &readahead->slots[requests[i + r].slot]);
+        i += run;
+    }
+}
+
+/**
+ * qsort comparator ordering prefetch requests by block number.
+ **/
+int readahead_compare_requests(const void *a, const void *b)
+{
+    size_t x = ((const ReadaheadRequest *)a)->block;
+    size_t y = ((const ReadaheadRequest *)b)->block;
+    return (x > y) - (x < y);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
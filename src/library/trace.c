@@ -0,0 +1,188 @@
+/* trace.c: SimpleFS block I/O traces */
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+#include "sfs/trace.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Internal Constants */
+
+#define TRACE_BUFFER (1 << 16) /* stdio buffer size for trace files */
+
+/* Internal Prototyes */
+
+Trace *trace_alloc(const char *path, bool writing);
+
+/* External Functions */
+
+/**
+ * Start recording a trace of a disk of blocks blocks by doing the
+ * following:
+ *
+ *  1. Creating (or truncating) the trace file at path, fully buffered.
+ *
+ *  2. Writing the header.
+ *
+ * @param       path        Path to trace file.
+ * @param       blocks      Number of blocks of the traced disk.
+ *
+ * @return      Pointer to newly allocated Trace (NULL on failure).
+ **/
+Trace *trace_create(const char *path, size_t blocks)
+{
+    Trace *trace = trace_alloc(path, true);
+    if (!trace)
+        return NULL;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    trace->header.magic = TRACE_MAGIC;
+    trace->header.version = TRACE_VERSION;
+    trace->header.record_size = sizeof(TraceRecord);
+    trace->header.block_size = BLOCK_SIZE;
+    trace->header.blocks = blocks;
+    trace->header.created = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    trace->origin = disk_clock();
+
+    if (fwrite(&trace->header, sizeof(TraceHeader), 1, trace->stream) != 1)
+    {
+        error("failed to write trace header to %s: %s", path, strerror(errno));
+        fclose(trace->stream);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+/**
+ * Append one completed operation to a trace.  Records are written with a
+ * single buffered fwrite, so several threads may record at once.
+ *
+ * @param       trace       Pointer to Trace structure (being recorded).
+ * @param       op          Operation (TRACE_*).
+ * @param       block       First block.
+ * @param       count       Number of blocks.
+ * @param       start       Time operation started (disk_clock).
+ * @param       failed      Whether operation failed.
+ **/
+void trace_record(Trace *trace, int op, size_t block, size_t count, uint64_t start, bool failed)
+{
+    uint64_t latency = disk_clock() - start;
+    TraceRecord record = {
+        .timestamp = start - trace->origin,
+        .block = block,
+        .count = count,
+        .latency = latency > UINT32_MAX ? UINT32_MAX : latency,
+        .op = op,
+        .failed = failed,
+    };
+
+    fwrite(&record, sizeof(TraceRecord), 1, trace->stream);
+}
+
+/**
+ * Open a recorded trace for reading and check its header.
+ *
+ * @param       path        Path to trace file.
+ *
+ * @return      Pointer to newly allocated Trace (NULL on failure or if the
+ *              file is not a trace this build can read).
+ **/
+Trace *trace_open(const char *path)
+{
+    Trace *trace = trace_alloc(path, false);
+    if (!trace)
+        return NULL;
+
+    TraceHeader *header = &trace->header;
+    if (fread(header, sizeof(TraceHeader), 1, trace->stream) != 1 || header->magic != TRACE_MAGIC)
+        error("%s is not a block I/O trace", path);
+    else if (header->version != TRACE_VERSION || header->record_size != sizeof(TraceRecord))
+        error("%s: unsupported trace version %u", path, header->version);
+    else if (header->block_size != BLOCK_SIZE)
+        error("%s: trace block size %u differs from BLOCK_SIZE", path, header->block_size);
+    else
+        return trace;
+
+    fclose(trace->stream);
+    free(trace);
+    return NULL;
+}
+
+/**
+ * Read the next record of a trace.
+ *
+ * @param       trace       Pointer to Trace structure (opened for reading).
+ * @param       record      Record to fill in.
+ *
+ * @return      Whether a record was read (false at the end of the trace; a
+ *              truncated final record is ignored).
+ **/
+bool trace_next(Trace *trace, TraceRecord *record)
+{
+    return fread(record, sizeof(TraceRecord), 1, trace->stream) == 1;
+}
+
+/**
+ * Finish a trace: write out buffered records if recording, then close the
+ * file and release the Trace.
+ *
+ * @param       trace       Pointer to Trace structure (NULL is ignored).
+ *
+ * @return      0 on success, DISK_FAILURE if records could not be written.
+ **/
+int trace_close(Trace *trace)
+{
+    if (!trace)
+        return 0;
+
+    int result = 0;
+    if (trace->writing && ferror(trace->stream))
+    {
+        error("failed to write trace records");
+        result = DISK_FAILURE;
+    }
+    if (fclose(trace->stream) == EOF && trace->writing)
+    {
+        error("failed to close trace: %s", strerror(errno));
+        result = DISK_FAILURE;
+    }
+    free(trace);
+    return result;
+}
+
+/* Internal Functions */
+
+/**
+ * Allocate a Trace and open its file with a large stdio buffer.
+ *
+ * @param       path        Path to trace file.
+ * @param       writing     Whether to create the file (true) or read it.
+ *
+ * @return      Pointer to newly allocated Trace (NULL on failure).
+ **/
+Trace *trace_alloc(const char *path, bool writing)
+{
+    Trace *trace = calloc(1, sizeof(Trace));
+    if (!trace)
+    {
+        error("failed on calloc for Trace");
+        return NULL;
+    }
+
+    trace->writing = writing;
+    trace->stream = fopen(path, writing ? "wb" : "rb");
+    if (!trace->stream)
+    {
+        error("failed to open trace %s: %s", path, strerror(errno));
+        free(trace);
+        return NULL;
+    }
+    setvbuf(trace->stream, NULL, _IOFBF, TRACE_BUFFER);
+    return trace;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
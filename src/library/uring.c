@@ -0,0 +1,238 @@
+/* uring.c: Minimal io_uring submission/completion ring */
+
+#include "sfs/uring.h"
+#include "sfs/logging.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Internal Prototyes */
+
+void ring_unmap(Ring *ring);
+
+/* External Functions */
+
+/**
+ * Create an io_uring instance with the specified number of submission
+ * entries by doing the following:
+ *
+ *  1. Calling io_uring_setup.
+ *
+ *  2. Mapping the submission ring, completion ring and submission entries.
+ *
+ * @param       entries     Queue depth (rounded up to a power of two by the
+ *                          kernel).
+ *
+ * @return      Pointer to newly allocated Ring (NULL if io_uring is not
+ *              available or setup failed).
+ **/
+Ring *ring_open(unsigned entries)
+{
+    Ring *ring = calloc(1, sizeof(Ring));
+    if (!ring)
+    {
+        error("failed on calloc for Ring");
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)
+    {
+        debug("io_uring_setup failed: %s", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        error("failed to mmap submission ring: %s", strerror(errno));
+        ring->sq_ring = NULL;
+        goto failure;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            error("failed to mmap completion ring: %s", strerror(errno));
+            ring->cq_ring = NULL;
+            goto failure;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        error("failed to mmap submission entries: %s", strerror(errno));
+        ring->sqes = NULL;
+        goto failure;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return ring;
+
+failure:
+    ring_unmap(ring);
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+/**
+ * Tear down ring mappings, close the io_uring descriptor and release the
+ * Ring structure.
+ *
+ * @param       ring        Pointer to Ring structure.
+ **/
+void ring_close(Ring *ring)
+{
+    if (!ring)
+        return;
+
+    ring_unmap(ring);
+    if (close(ring->fd) == -1)
+        error("failed to close io_uring fd");
+    free(ring);
+}
+
+/**
+ * Prepare a single block read or write in the next free submission entry.
+ * The entry is only handed to the kernel by the next ring_submit.
+ *
+ * @param       ring        Pointer to Ring structure.
+ * @param       write       Whether to write (true) or read (false).
+ * @param       fd          File descriptor to perform operation on.
+ * @param       data        Data buffer.
+ * @param       length      Number of bytes to transfer.
+ * @param       offset      Byte offset into file.
+ * @param       user_data   Value returned with the completion.
+ *
+ * @return      Whether or not an entry was available (false when full).
+ **/
+bool ring_prep(Ring *ring, bool write, int fd, char *data, size_t length, off_t offset, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries)
+        return false;
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return true;
+}
+
+/**
+ * Submit all prepared entries and optionally wait for completions.
+ *
+ * @param       ring        Pointer to Ring structure.
+ * @param       wait        Minimum number of completions to wait for.
+ *
+ * @return      Number of entries submitted (-1 on error).
+ **/
+int ring_submit(Ring *ring, unsigned wait)
+{
+    while (true)
+    {
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, flags, NULL, 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error("io_uring_enter failed: %s", strerror(errno));
+            return -1;
+        }
+        ring->pending -= n;
+        return n;
+    }
+}
+
+/**
+ * Pop one completion from the completion queue, if any.
+ *
+ * @param       ring        Pointer to Ring structure.
+ * @param       user_data   Where to store the user_data of the completion.
+ * @param       result      Where to store the result (bytes or -errno).
+ *
+ * @return      Whether or not a completion was available.
+ **/
+bool ring_reap(Ring *ring, uint64_t *user_data, int32_t *result)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return false;
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Internal Functions */
+
+/**
+ * Unmap whichever ring mappings have been established.
+ *
+ * @param       ring        Pointer to Ring structure.
+ **/
+void ring_unmap(Ring *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,264 @@
+/* sfs_replay.c: SimpleFS block I/O trace replay */
+
+#include "sfs/disk.h"
+#include "sfs/trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Macros */
+
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+/* Replay State */
+
+typedef struct Replay Replay;
+
+struct Replay {
+  Disk *disk;        /* Disk being replayed against */
+  char *buffers;     /* Aligned transfer buffers */
+  char **data;       /* Pointers into buffers */
+  size_t capacity;   /* Number of transfer buffers */
+  size_t operations; /* Records replayed */
+  size_t skipped;    /* Records out of range of the disk */
+  size_t failed;     /* Replayed operations that failed */
+  uint64_t traced;   /* Sum of traced latencies (ns) */
+  uint64_t replayed; /* Sum of replayed latencies (ns) */
+};
+
+/* Utility Prototypes */
+
+void usage(const char *program);
+int parse_mode(const char *name);
+const DiskShape *parse_shape(const char *name);
+bool replay_record(Replay *replay, const TraceRecord *record);
+bool replay_reserve(Replay *replay, size_t count);
+void replay_wait(uint64_t deadline);
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+  DiskOptions options = {0};
+  bool fast = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:s:S:Mc:r:w:dxh")) != -1) {
+    switch (opt) {
+    case 'm':
+      options.mode = parse_mode(optarg);
+      if (options.mode < 0) {
+        fprintf(stderr, "Unknown mode: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 's':
+      options.shape = parse_shape(optarg);
+      if (!options.shape) {
+        fprintf(stderr, "Unknown shape: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'S':
+      options.stripe_blocks = strtoul(optarg, NULL, 10);
+      break;
+    case 'M':
+      options.mirror = true;
+      break;
+    case 'c':
+      options.cache_blocks = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      options.readahead_blocks = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      options.write_queue_blocks = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      options.direct = true;
+      break;
+    case 'x':
+      fast = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Trace *trace = trace_open(argv[optind]);
+  if (!trace) {
+    return EXIT_FAILURE;
+  }
+
+  Replay replay = {0};
+  replay.disk = disk_open_with(argv[optind + 1], trace->header.blocks, &options);
+  if (!replay.disk) {
+    fprintf(stderr, "disk not opened\n");
+    trace_close(trace);
+    return EXIT_FAILURE;
+  }
+
+  TraceRecord record;
+  uint64_t begin = disk_clock();
+  while (trace_next(trace, &record)) {
+    if (!fast) {
+      replay_wait(begin + record.timestamp);
+    }
+    if (!replay_record(&replay, &record)) {
+      break;
+    }
+  }
+  double elapsed = (disk_clock() - begin) / 1e9;
+  trace_close(trace);
+
+  size_t operations = replay.operations ? replay.operations : 1;
+  printf("%zu operations replayed in %.3f s (%.0f ops/s), %zu skipped, %zu failed\n",
+         replay.operations, elapsed, elapsed > 0 ? replay.operations / elapsed : 0.0,
+         replay.skipped, replay.failed);
+  printf("mean latency %.1f us traced, %.1f us replayed\n",
+         replay.traced / 1000.0 / operations, replay.replayed / 1000.0 / operations);
+
+  disk_close(replay.disk);
+  free(replay.data);
+  free(replay.buffers);
+  return replay.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Utility Functions */
+
+void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [options] <tracefile> <diskfile>\n\n", program);
+  fprintf(stderr, "Replays a block I/O trace against a disk image at the traced pace.\n\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "    -m MODE    Disk backend: file, mmap, uring or ram (default file)\n");
+  fprintf(stderr, "    -s SHAPE   Emulate a device: hdd, network or cloud\n");
+  fprintf(stderr, "    -S BLOCKS  Stripe across <diskfile>=a,b,... in units of BLOCKS\n");
+  fprintf(stderr, "    -M         Mirror across <diskfile>=a,b,...\n");
+  fprintf(stderr, "    -c BLOCKS  Buffer cache capacity\n");
+  fprintf(stderr, "    -r BLOCKS  Readahead buffer capacity\n");
+  fprintf(stderr, "    -w BLOCKS  Write queue capacity\n");
+  fprintf(stderr, "    -d         Open the image with O_DIRECT\n");
+  fprintf(stderr, "    -x         Replay as fast as possible\n");
+}
+
+int parse_mode(const char *name) {
+  if (streq(name, "file")) {
+    return DISK_MODE_FILE;
+  } else if (streq(name, "mmap")) {
+    return DISK_MODE_MMAP;
+  } else if (streq(name, "uring")) {
+    return DISK_MODE_URING;
+  } else if (streq(name, "ram")) {
+    return DISK_MODE_RAM;
+  }
+  return -1;
+}
+
+const DiskShape *parse_shape(const char *name) {
+  if (streq(name, "hdd")) {
+    return &disk_shape_hdd;
+  } else if (streq(name, "network")) {
+    return &disk_shape_network;
+  } else if (streq(name, "cloud")) {
+    return &disk_shape_cloud;
+  }
+  return NULL;
+}
+
+/* Replay one traced operation, writing a block-numbered pattern for
+ * writes (traces do not record data). */
+bool replay_record(Replay *replay, const TraceRecord *record) {
+  Disk *disk = replay->disk;
+  size_t end = (size_t)record->block + record->count;
+  if (record->op > TRACE_FLUSH || end > disk->blocks) {
+    replay->skipped++;
+    return true;
+  }
+  if (!replay_reserve(replay, record->count)) {
+    return false;
+  }
+
+  if (record->op == TRACE_WRITE) {
+    for (size_t i = 0; i < record->count; i++) {
+      memset(replay->data[i], (record->block + i) & 0xff, BLOCK_SIZE);
+    }
+  }
+
+  uint64_t start = disk_clock();
+  ssize_t result = 0;
+  switch (record->op) {
+  case TRACE_READ:
+    result = record->count == 1 ? disk_read(disk, record->block, replay->data[0])
+                                : disk_readv(disk, record->block, record->count, replay->data);
+    break;
+  case TRACE_WRITE:
+    result = record->count == 1 ? disk_write(disk, record->block, replay->data[0])
+                                : disk_writev(disk, record->block, record->count, replay->data);
+    break;
+  case TRACE_DISCARD:
+    result = disk_discard(disk, record->block, record->count);
+    break;
+  case TRACE_BARRIER:
+    result = disk_barrier(disk);
+    break;
+  case TRACE_FLUSH:
+    result = disk_flush(disk);
+    break;
+  }
+
+  replay->replayed += disk_clock() - start;
+  replay->traced += record->latency;
+  replay->operations++;
+  /* Discards the backend cannot perform fail in the trace too */
+  if (result == DISK_FAILURE && !record->failed && record->op != TRACE_DISCARD) {
+    replay->failed++;
+  }
+  return true;
+}
+
+/* Make sure at least count aligned transfer buffers exist. */
+bool replay_reserve(Replay *replay, size_t count) {
+  if (count <= replay->capacity) {
+    return true;
+  }
+
+  free(replay->buffers);
+  free(replay->data);
+  replay->data = calloc(count, sizeof(char *));
+  if (!replay->data ||
+      posix_memalign((void **)&replay->buffers, DISK_ALIGNMENT, count * BLOCK_SIZE) != 0) {
+    fprintf(stderr, "Unable to allocate %zu transfer buffers\n", count);
+    replay->buffers = NULL;
+    replay->capacity = 0;
+    return false;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    replay->data[i] = replay->buffers + i * BLOCK_SIZE;
+  }
+  replay->capacity = count;
+  return true;
+}
+
+/* Sleep until disk_clock reaches deadline. */
+void replay_wait(uint64_t deadline) {
+  uint64_t now = disk_clock();
+  if (now >= deadline) {
+    return;
+  }
+
+  uint64_t delay = deadline - now;
+  struct timespec pause = {delay / 1000000000ULL, delay % 1000000000ULL};
+  while (nanosleep(&pause, &pause) == -1 && errno == EINTR)
+    ;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
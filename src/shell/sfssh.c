@@ -29,6 +29,7 @@ void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 
 bool copyout(FileSystem *fs, size_t inode_number, const char *path);
 bool copyin(FileSystem *fs, const char *path, size_t inode_number);
+int parse_durability(const char *name);
 
 /* Main Execution */
 
@@ -38,7 +39,22 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
-  Disk *disk = disk_open(argv[1], atoi(argv[2]));
+  /* SFS_TRACE=path records a block I/O trace for bin/sfs_replay,
+   * SFS_STRIPE=blocks stripes the disk across <diskfile>=a,b,...,
+   * SFS_MIRROR mirrors it across them instead,
+   * SFS_DURABILITY=sync|group makes every command durable, and
+   * SFS_MOUNT_THREADS=n scans the inode table at mount with n threads
+   * (0 for one per CPU) */
+  const char *stripe = getenv("SFS_STRIPE");
+  const char *durability = getenv("SFS_DURABILITY");
+  DiskOptions options = {.readahead_blocks = DISK_READAHEAD_BLOCKS,
+                         .write_queue_blocks = DISK_WRITE_QUEUE_BLOCKS,
+                         .trace_path = getenv("SFS_TRACE"),
+                         .compress = getenv("SFS_COMPRESS") != NULL,
+                         .stripe_blocks = stripe ? strtoul(stripe, NULL, 10) : 0,
+                         .mirror = getenv("SFS_MIRROR") != NULL,
+                         .durability = parse_durability(durability ? durability : "none")};
+  Disk *disk = disk_open_with(argv[1], atoi(argv[2]), &options);
   if (!disk) {
     fprintf(stderr, "disk not opened\n");
     return EXIT_FAILURE;
@@ -106,12 +122,13 @@ void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 }
 
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-  if (args != 1) {
-    printf("Usage: format\n");
+  if (args != 1 && args != 2) {
+    printf("Usage: format [block size]\n");
     return;
   }
 
-  if (fs_format(disk)) {
+  size_t block_size = args == 2 ? strtoul(arg1, NULL, 10) : BLOCK_SIZE;
+  if (fs_format_with(disk, block_size)) {
     printf("disk formatted.\n");
   } else {
     printf("format failed!\n");
@@ -124,7 +141,8 @@ void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     return;
   }
 
-  if (fs_mount(fs, disk)) {
+  const char *threads = getenv("SFS_MOUNT_THREADS");
+  if (fs_mount_with(fs, disk, threads ? strtoul(threads, NULL, 10) : 1)) {
     printf("disk mounted.\n");
   } else {
     printf("mount failed!\n");
@@ -209,7 +227,7 @@ void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
   printf("Commands are:\n");
-  printf("    format\n");
+  printf("    format  [block size]\n");
   printf("    mount\n");
   printf("    debug\n");
   printf("    create\n");
@@ -278,4 +296,15 @@ bool copyout(FileSystem *fs, size_t inode_number, const char *path) {
   return true;
 }
 
+int parse_durability(const char *name) {
+  if (streq(name, "none")) {
+    return DISK_DURABILITY_NONE;
+  } else if (streq(name, "sync")) {
+    return DISK_DURABILITY_SYNC;
+  } else if (streq(name, "group")) {
+    return DISK_DURABILITY_GROUP;
+  }
+  return -1;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
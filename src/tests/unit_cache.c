@@ -0,0 +1,142 @@
+/* unit_cache.c: Unit tests for SimpleFS buffer cache */
+
+#include "sfs/cache.h"
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define DISK_PATH   "unit_cache.image"
+#define DISK_BLOCKS (8)
+#define CACHE_BLOCKS (2)
+
+/* Functions */
+
+void test_cleanup() {
+    unlink(DISK_PATH);
+}
+
+Disk *test_open_cached() {
+    DiskOptions options = {.cache_blocks = CACHE_BLOCKS};
+    Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->cache);
+    assert(disk->cache->capacity == CACHE_BLOCKS);
+    return disk;
+}
+
+int test_00_cache_read() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    char data[BLOCK_SIZE];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    disk_close(disk);
+
+    disk = test_open_cached();
+
+    debug("Check miss then hit");
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 1);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 1);
+    assert(disk->cache_misses == 1);
+    assert(disk->cache_hits   == 1);
+    assert(disk->reads        == 1);
+
+    debug("Check LRU eviction");
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE && data[0] == 2);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE && data[0] == 3);
+    assert(disk->cache_hits == 2);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE);
+    assert(disk->cache_hits == 3);
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE);
+    assert(disk->cache_misses == 4);
+
+    debug("Check vectored read");
+    char blocks[4][BLOCK_SIZE];
+    char *vec[] = {blocks[0], blocks[1], blocks[2], blocks[3]};
+    assert(disk_readv(disk, 1, 4, vec) == 4*BLOCK_SIZE);
+    for (size_t i = 0; i < 4; i++) {
+        assert(blocks[i][BLOCK_SIZE - 1] == i + 1);
+    }
+    assert(disk->cache_hits == 5);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_01_cache_write() {
+    Disk *disk = test_open_cached();
+    char data[BLOCK_SIZE];
+
+    debug("Check write-back");
+    memset(data, 0x11, BLOCK_SIZE);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    memset(data, 0x22, BLOCK_SIZE);
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    assert(disk->writes == 0);
+    assert(disk->cache->dirty == 2);
+
+    debug("Check dirty read hit");
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE && data[0] == 0x11);
+    assert(disk->reads == 0);
+
+    debug("Check write-back on eviction");
+    memset(data, 0x33, BLOCK_SIZE);
+    assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+    assert(disk->writes == 1);
+
+    debug("Check vectored write updates cached copies");
+    memset(data, 0x44, BLOCK_SIZE);
+    char *vec[] = {data};
+    assert(disk_writev(disk, 2, 1, vec) == BLOCK_SIZE);
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE && data[0] == 0x44);
+
+    debug("Check explicit flush");
+    assert(disk_flush(disk) == 0);
+    assert(disk->cache->dirty == 0);
+    disk_close(disk);
+
+    disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE && data[0] == 0x11);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 0x22);
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE && data[0] == 0x44);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test cache_read\n");
+        fprintf(stderr, "    1. Test cache_write\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    atexit(test_cleanup);
+
+    switch (number) {
+        case 0:  status = test_00_cache_read(); break;
+        case 1:  status = test_01_cache_write(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
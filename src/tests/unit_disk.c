@@ -1,23 +1,33 @@
 /* unit_disk.c: Unit tests for SimpleFS disk emulator */
 
+#include "sfs/crc32c.h"
 #include "sfs/disk.h"
 #include "sfs/logging.h"
+#include "sfs/lz.h"
+#include "sfs/trace.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 /* Constants */
 
 #define DISK_PATH   "unit_disk.image"
+#define TRACE_PATH  "unit_disk.trace"
 #define DISK_BLOCKS (4)
+#define DISK_THREADS (4)
+#define DISK_ROUNDS  (256)
 
 /* Functions */
 
 void test_cleanup() {
     unlink(DISK_PATH);
+    unlink(TRACE_PATH);
 }
 
 int test_00_disk_open() {
@@ -107,6 +117,1386 @@ int test_02_disk_write() {
     return EXIT_SUCCESS;
 }
 
+void *test_03_disk_worker(void *arg) {
+    Disk *disk = arg;
+    char data[BLOCK_SIZE];
+
+    for (size_t r = 0; r < DISK_ROUNDS; r++) {
+        size_t b = r % DISK_BLOCKS;
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert(data[i] == b);
+        }
+    }
+    return NULL;
+}
+
+int test_03_disk_concurrent() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[BLOCK_SIZE];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+
+    debug("Check concurrent reads");
+    pthread_t threads[DISK_THREADS];
+    for (size_t t = 0; t < DISK_THREADS; t++) {
+        assert(pthread_create(&threads[t], NULL, test_03_disk_worker, disk) == 0);
+    }
+    for (size_t t = 0; t < DISK_THREADS; t++) {
+        assert(pthread_join(threads[t], NULL) == 0);
+    }
+
+    assert(disk->reads  == DISK_THREADS * DISK_ROUNDS);
+    assert(disk->writes == DISK_BLOCKS);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_04_disk_vector() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char blocks[DISK_BLOCKS][BLOCK_SIZE];
+    char *data[DISK_BLOCKS];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(blocks[b], b + 1, BLOCK_SIZE);
+        data[b] = blocks[b];
+    }
+
+    debug("Check bad range");
+    assert(disk_writev(disk, 1, DISK_BLOCKS, data) == DISK_FAILURE);
+    assert(disk_readv(disk, 0, 0, data) == DISK_FAILURE);
+
+    debug("Check disk_writev");
+    assert(disk_writev(disk, 0, DISK_BLOCKS, data) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->writes == DISK_BLOCKS);
+
+    debug("Check disk_readv");
+    memset(blocks, 0, sizeof(blocks));
+    assert(disk_readv(disk, 0, DISK_BLOCKS, data) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->reads == DISK_BLOCKS);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert(blocks[b][i] == b + 1);
+        }
+    }
+
+    debug("Check disk_read_list");
+    memset(blocks, 0, sizeof(blocks));
+    DiskIO ios[] = {
+        {3, blocks[0]}, {0, blocks[1]}, {1, blocks[2]}, {2, blocks[3]},
+    };
+    assert(disk_read_list(disk, ios, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(blocks[0][0] == 4 && blocks[1][0] == 1);
+    assert(blocks[2][0] == 2 && blocks[3][0] == 3);
+
+    debug("Check disk_write_list");
+    assert(disk_write_list(disk, ios, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk_read(disk, 3, blocks[0]) == BLOCK_SIZE);
+    assert(blocks[0][BLOCK_SIZE - 1] == 4);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_disk_mmap() {
+    DiskOptions options = {.mode = DISK_MODE_MMAP};
+
+    Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->ops == &disk_mmap_ops);
+
+    char data[BLOCK_SIZE];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        debug("Check mapped write block %lu", b);
+        memset(data, b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+
+        char *ptr = disk_block_ptr(disk, b);
+        assert(ptr);
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert(ptr[i] == b);
+        }
+    }
+    assert(disk->writes == DISK_BLOCKS);
+    assert(disk->reads  == DISK_BLOCKS);
+
+    debug("Check bad block pointer");
+    assert(disk_block_ptr(disk, DISK_BLOCKS) == NULL);
+
+    debug("Check flush");
+    memset(disk_block_ptr(disk, 0), 0x7f, BLOCK_SIZE);
+    assert(disk_flush(disk) == 0);
+    disk_close(disk);
+
+    disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    assert(disk_block_ptr(disk, 0) == NULL);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(data[0] == 0x7f && data[BLOCK_SIZE - 1] == 0x7f);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE);
+    assert(data[0] == 3);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+void test_06_disk_callback(Disk *disk, size_t block, ssize_t result, void *arg) {
+    size_t *completed = arg;
+    assert(result == BLOCK_SIZE);
+    completed[block]++;
+}
+
+int test_06_disk_async() {
+    int modes[] = {DISK_MODE_URING, DISK_MODE_FILE};
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        DiskOptions options = {.mode = modes[m], .queue_depth = 2, .readahead_blocks = 2, .trace_path = TRACE_PATH};
+        Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+        assert(disk);
+        assert(disk->queue_depth == 2);
+
+        char blocks[DISK_BLOCKS][BLOCK_SIZE];
+        size_t completed[DISK_BLOCKS] = {0};
+
+        debug("Check bad block (mode %d)", modes[m]);
+        assert(disk_queue_read(disk, DISK_BLOCKS, blocks[0], NULL, NULL) == DISK_FAILURE);
+
+        debug("Check queued writes beyond queue depth (mode %d)", modes[m]);
+        for (size_t b = 0; b < DISK_BLOCKS; b++) {
+            memset(blocks[b], b + m, BLOCK_SIZE);
+            assert(disk_queue_write(disk, b, blocks[b], test_06_disk_callback, completed) == 0);
+        }
+        assert(disk_submit(disk) >= 0);
+        assert(disk_drain(disk) == 0);
+        assert(disk->writes == DISK_BLOCKS);
+        for (size_t b = 0; b < DISK_BLOCKS; b++) {
+            assert(completed[b] == 1);
+        }
+
+        debug("Check queued reads (mode %d)", modes[m]);
+        memset(blocks, 0, sizeof(blocks));
+        for (size_t b = 0; b < DISK_BLOCKS; b++) {
+            assert(disk_queue_read(disk, b, blocks[b], test_06_disk_callback, completed) == 0);
+        }
+        while (disk_poll(disk, true) > 0);
+        assert(disk->reads == DISK_BLOCKS);
+        for (size_t b = 0; b < DISK_BLOCKS; b++) {
+            assert(completed[b] == 2);
+            assert(blocks[b][0] == b + m && blocks[b][BLOCK_SIZE - 1] == b + m);
+        }
+
+        debug("Check queued writes replace prefetched blocks (mode %d)", modes[m]);
+        size_t prefetch[] = {1};
+        assert(disk_prefetch(disk, prefetch, 1) == 1);
+        assert(disk_drain(disk) == 0);
+        memset(blocks[1], 0x5a, BLOCK_SIZE);
+        assert(disk_queue_write(disk, 1, blocks[1], NULL, NULL) == 0);
+        assert(disk_drain(disk) == 0);
+        char data[BLOCK_SIZE];
+        assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 0x5a);
+        assert(disk->writes == DISK_BLOCKS + 1);
+        disk_close(disk);
+
+        debug("Check queued requests are traced (mode %d)", modes[m]);
+        Trace *trace = trace_open(TRACE_PATH);
+        assert(trace);
+        size_t records[2] = {0};
+        TraceRecord record;
+        while (trace_next(trace, &record)) {
+            assert(record.op == TRACE_READ || record.op == TRACE_WRITE);
+            records[record.op]++;
+        }
+        assert(records[TRACE_WRITE] == DISK_BLOCKS + 1);
+        assert(records[TRACE_READ] >= DISK_BLOCKS + 1);
+        assert(trace_close(trace) == 0);
+        unlink(TRACE_PATH);
+    }
+    return EXIT_SUCCESS;
+}
+
+int test_07_disk_direct() {
+    DiskOptions options = {.direct = true, .pool_buffers = 2};
+    Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->direct);
+
+    debug("Check buffer pool");
+    char *a = disk_buffer_get(disk);
+    char *b = disk_buffer_get(disk);
+    char *c = disk_buffer_get(disk);
+    assert(a && b && c);
+    assert(DISK_ALIGNED(a) && DISK_ALIGNED(b) && DISK_ALIGNED(c));
+    assert(disk->pool_nfree == 0);
+    disk_buffer_put(disk, c);
+    disk_buffer_put(disk, b);
+    assert(disk->pool_nfree == 1);
+
+    debug("Check aligned and unaligned transfers");
+    static char unaligned[BLOCK_SIZE + 1];
+    for (size_t n = 0; n < DISK_BLOCKS; n++) {
+        char *data = (n % 2) ? unaligned + 1 : a;
+        memset(data, n, BLOCK_SIZE);
+        assert(disk_write(disk, n, data) == BLOCK_SIZE);
+        memset(data, 0, BLOCK_SIZE);
+        assert(disk_read(disk, n, data) == BLOCK_SIZE);
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert(data[i] == n);
+        }
+    }
+
+    debug("Check unaligned vectored read");
+    char *data[] = {a, unaligned + 1};
+    assert(disk_readv(disk, 2, 2, data) == 2*BLOCK_SIZE);
+    assert(a[0] == 2 && unaligned[1] == 3);
+    assert(disk->pool_nfree == 1);
+
+    disk_buffer_put(disk, a);
+    assert(disk->pool_nfree == 2);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_08_open(Disk *disk, const char *path, const DiskOptions *options) {
+    disk->private = calloc(disk->blocks, BLOCK_SIZE);
+    return disk->private ? 0 : DISK_FAILURE;
+}
+
+ssize_t test_08_read(Disk *disk, size_t block, char *data) {
+    memcpy(data, (char *)disk->private + block * BLOCK_SIZE, BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+ssize_t test_08_write(Disk *disk, size_t block, char *data) {
+    memcpy((char *)disk->private + block * BLOCK_SIZE, data, BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+void test_08_close(Disk *disk) {
+    free(disk->private);
+}
+
+const DiskOps test_08_ops = {
+    .name  = "test",
+    .open  = test_08_open,
+    .read  = test_08_read,
+    .write = test_08_write,
+    .close = test_08_close,
+};
+
+int test_08_disk_ops() {
+    debug("Check built-in backends");
+    assert(disk_backend(DISK_MODE_FILE)  == &disk_file_ops);
+    assert(disk_backend(DISK_MODE_MMAP)  == &disk_mmap_ops);
+    assert(disk_backend(DISK_MODE_URING) == &disk_uring_ops);
+    assert(disk_backend(DISK_MODE_RAM)   == &disk_ram_ops);
+    assert(disk_backend(-1) == NULL);
+
+    DiskOptions options = {.mode = -1};
+    assert(disk_open_with(DISK_PATH, DISK_BLOCKS, &options) == NULL);
+
+    debug("Check custom backend");
+    options.ops = &test_08_ops;
+    Disk *disk = disk_open_with(NULL, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->ops == &test_08_ops);
+    assert(disk->fd == -1);
+
+    char blocks[DISK_BLOCKS][BLOCK_SIZE];
+    char *data[DISK_BLOCKS];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(blocks[b], b + 1, BLOCK_SIZE);
+        data[b] = blocks[b];
+    }
+    assert(disk_write(disk, DISK_BLOCKS, blocks[0]) == DISK_FAILURE);
+    assert(disk_writev(disk, 0, DISK_BLOCKS, data) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->writes == DISK_BLOCKS);
+
+    memset(blocks, 0, sizeof(blocks));
+    assert(disk_read(disk, 2, blocks[2]) == BLOCK_SIZE && blocks[2][0] == 3);
+    assert(disk_readv(disk, 0, DISK_BLOCKS, data) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(blocks[3][BLOCK_SIZE - 1] == 4);
+    assert(disk->reads == DISK_BLOCKS + 1);
+
+    assert(disk_block_ptr(disk, 0) == NULL);
+    assert(disk_flush(disk) == 0);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_09_ram() {
+    debug("Check RAM disk is created empty");
+    unlink(DISK_PATH);
+    DiskOptions options = {.mode = DISK_MODE_RAM, .huge_pages = true};
+    Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->ops == &disk_ram_ops);
+    assert(access(DISK_PATH, F_OK) == -1);
+
+    char data[BLOCK_SIZE];
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE && data[0] == 0);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, b + 1, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(disk_block_ptr(disk, 2)[0] == 3);
+
+    debug("Check disk_ram_save");
+    assert(disk_ram_save(disk, DISK_PATH) == 0);
+    disk_close(disk);
+
+    Disk *file = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(file);
+    assert(disk_read(file, 3, data) == BLOCK_SIZE && data[BLOCK_SIZE - 1] == 4);
+    assert(disk_ram_load(file, DISK_PATH) == DISK_FAILURE);
+    memset(data, 0x77, BLOCK_SIZE);
+    assert(disk_write(file, 0, data) == BLOCK_SIZE);
+    disk_close(file);
+
+    debug("Check RAM disk loads existing image");
+    options.huge_pages = false;
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE && data[0] == 0x77);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 2);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_10_stats() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char blocks[DISK_BLOCKS][BLOCK_SIZE];
+    char *data[] = {blocks[0], blocks[1], blocks[2], blocks[3]};
+    memset(blocks, 0, sizeof(blocks));
+
+    debug("Check sequential and random accesses");
+    assert(disk_write(disk, 0, blocks[0]) == BLOCK_SIZE);
+    assert(disk_writev(disk, 1, 3, data) == 3*BLOCK_SIZE);
+    assert(disk_read(disk, 2, blocks[2]) == BLOCK_SIZE);
+    assert(disk_read(disk, 3, blocks[3]) == BLOCK_SIZE);
+    assert(disk_read(disk, DISK_BLOCKS, blocks[0]) == DISK_FAILURE);
+
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.reads == 2 && stats.writes == 4);
+    assert(stats.bytes_read == 2*BLOCK_SIZE);
+    assert(stats.bytes_written == 4*BLOCK_SIZE);
+    assert(stats.sequential == 3 && stats.random == 1);
+    assert(stats.read_latency.count == 2);
+    assert(stats.write_latency.count == 2);
+    assert(stats.read_latency.max >= disk_histogram_percentile(&stats.read_latency, 50.0));
+    disk_close(disk);
+
+    debug("Check histogram percentiles");
+    DiskHistogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    assert(disk_histogram_percentile(&histogram, 50.0) == 0);
+
+    disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    uint64_t now = disk_clock();
+    for (size_t i = 0; i < 1000; i++) {
+        disk_account(disk, 0, 1, false, now - (i < 990 ? 1000 : 1000000));
+    }
+    disk_stats(disk, &stats);
+    uint64_t p50 = disk_histogram_percentile(&stats.read_latency, 50.0);
+    uint64_t p999 = disk_histogram_percentile(&stats.read_latency, 99.9);
+    assert(p50 >= 1000 && p50 < 1000000);
+    assert(p999 >= 1000000 && p999 <= stats.read_latency.max);
+    assert(stats.sequential == 1 && stats.random == 999);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_11_discard() {
+    debug("Check disk_discard on image file");
+    unlink(DISK_PATH);
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[BLOCK_SIZE];
+    memset(data, 0x5a, BLOCK_SIZE);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(disk_flush(disk) == 0);
+
+    struct stat before, after;
+    assert(stat(DISK_PATH, &before) == 0);
+    assert(disk_discard(disk, 1, 2) == 0);
+    assert(disk_discard(disk, 3, 0) == DISK_FAILURE);
+    assert(disk_discard(disk, 3, 2) == DISK_FAILURE);
+    assert(stat(DISK_PATH, &after) == 0);
+    assert(after.st_size == before.st_size);
+    assert(after.st_blocks < before.st_blocks);
+
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 0 && data[BLOCK_SIZE - 1] == 0);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE && data[0] == 0x5a);
+    disk_close(disk);
+
+    debug("Check disk_discard drops cached blocks");
+    DiskOptions options = {.cache_blocks = DISK_BLOCKS};
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    memset(data, 0x66, BLOCK_SIZE);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE);
+    assert(disk_discard(disk, 0, DISK_BLOCKS) == 0);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE && data[0] == 0);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE && data[0] == 0);
+    disk_close(disk);
+
+    debug("Check disk_discard on mmap and RAM disks");
+    int modes[] = {DISK_MODE_MMAP, DISK_MODE_RAM};
+    for (size_t m = 0; m < sizeof(modes)/sizeof(modes[0]); m++) {
+        DiskOptions options = {.mode = modes[m]};
+        disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+        assert(disk);
+        memset(data, 0x77, BLOCK_SIZE);
+        assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+        assert(disk_discard(disk, 2, 1) == 0);
+        assert(disk_block_ptr(disk, 2)[0] == 0);
+        disk_close(disk);
+    }
+    return EXIT_SUCCESS;
+}
+
+int test_12_readahead() {
+    int modes[] = {DISK_MODE_FILE, DISK_MODE_URING};
+    for (size_t m = 0; m < sizeof(modes)/sizeof(modes[0]); m++) {
+        debug("Check disk_prefetch in mode %d", modes[m]);
+        DiskOptions options = {.mode = modes[m], .readahead_blocks = 2};
+        Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+        assert(disk);
+        assert(disk->readahead);
+
+        char data[BLOCK_SIZE];
+        for (size_t b = 0; b < DISK_BLOCKS; b++) {
+            memset(data, b + 1, BLOCK_SIZE);
+            assert(disk_write(disk, b, data) == BLOCK_SIZE);
+        }
+
+        size_t blocks[] = {1, 2, 3};
+        size_t bad[] = {DISK_BLOCKS};
+        assert(disk_prefetch(disk, bad, 1) == DISK_FAILURE);
+        assert(disk_prefetch(disk, blocks, 3) == 2);
+        assert(disk_prefetch(disk, blocks, 2) == 0);
+
+        debug("Check prefetched blocks are served once");
+        assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 2);
+        assert(disk->readahead_hits == 1);
+        assert(disk_drain(disk) == 0);
+        size_t reads = disk->reads;
+        assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 2);
+        assert(disk->readahead_hits == 1);
+        assert(disk->reads == reads + 1);
+
+        debug("Check writes invalidate prefetched blocks");
+        memset(data, 0x42, BLOCK_SIZE);
+        assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+        assert(disk_read(disk, 2, data) == BLOCK_SIZE && data[0] == 0x42);
+        assert(disk->readahead_hits == 1);
+
+        debug("Check vectored reads mix prefetched and missing blocks");
+        assert(disk_prefetch(disk, blocks + 1, 1) == 1);
+        char vec[3][BLOCK_SIZE];
+        char *vecs[] = {vec[0], vec[1], vec[2]};
+        assert(disk_readv(disk, 1, 3, vecs) == 3*BLOCK_SIZE);
+        assert(vec[0][0] == 2 && vec[1][0] == 0x42 && vec[2][0] == 4);
+        assert(disk->readahead_hits == 2);
+        disk_close(disk);
+    }
+    return EXIT_SUCCESS;
+}
+
+size_t test_13_failures = 0; /* Writes test_13_ops fails */
+
+ssize_t test_13_write(Disk *disk, size_t block, char *data) {
+    if (test_13_failures > 0) {
+        test_13_failures--;
+        errno = EIO;
+        return DISK_FAILURE;
+    }
+    return test_08_write(disk, block, data);
+}
+
+const DiskOps test_13_ops = {
+    .name  = "failing writes",
+    .open  = test_08_open,
+    .read  = test_08_read,
+    .write = test_13_write,
+    .close = test_08_close,
+};
+
+int test_13_write_queue() {
+    debug("Check writes are queued and absorbed");
+    DiskOptions options = {.write_queue_blocks = 3, .write_queue_delay = 60000, .readahead_blocks = 2};
+    Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->elevator);
+
+    char data[BLOCK_SIZE];
+    memset(data, 0x22, BLOCK_SIZE);
+    assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+    memset(data, 0x10, BLOCK_SIZE);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    memset(data, 0x23, BLOCK_SIZE);
+    assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+    assert(disk->writes == 0);
+    assert(disk->writes_absorbed == 1);
+
+    debug("Check reads see queued writes");
+    memset(data, 0, BLOCK_SIZE);
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE && data[0] == 0x23);
+    assert(disk->reads == 0);
+
+    debug("Check disk_barrier writes the queue");
+    assert(disk_barrier(disk) == 0);
+    assert(disk->writes == 2);
+    assert(disk->write_queue_flushes == 1);
+    assert(disk_barrier(disk) == 0);
+    assert(disk->write_queue_flushes == 1);
+
+    debug("Check a full queue is swept in one coalesced write");
+    size_t operations = disk->write_latency.count;
+    for (size_t b = 3; b-- > 0;) {
+        memset(data, b + 1, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(disk->writes == 5);
+    assert(disk->write_latency.count == operations + 1);
+
+    debug("Check swept writes replace prefetched blocks");
+    memset(data, 0x55, BLOCK_SIZE);
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    size_t blocks[] = {1};
+    assert(disk_prefetch(disk, blocks, 1) == 1);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 0x55);
+    assert(disk_barrier(disk) == 0);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 0x55);
+
+    debug("Check discards drop queued writes");
+    memset(data, 0x77, BLOCK_SIZE);
+    assert(disk_write(disk, 3, data) == BLOCK_SIZE);
+    if (disk_discard(disk, 3, 1) == 0) {
+        assert(disk_barrier(disk) == 0);
+        assert(disk_read(disk, 3, data) == BLOCK_SIZE && data[0] == 0);
+    }
+
+    debug("Check long runs bypass the queue");
+    char vec[DISK_BLOCKS][BLOCK_SIZE];
+    char *vecs[DISK_BLOCKS];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(vec[b], 0x60 + b, BLOCK_SIZE);
+        vecs[b] = vec[b];
+    }
+    size_t writes = disk->writes;
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    assert(disk_writev(disk, 0, DISK_BLOCKS, vecs) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->writes == writes + DISK_BLOCKS);
+    assert(disk_barrier(disk) == 0);
+    assert(disk->writes == writes + DISK_BLOCKS);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE && data[0] == 0x61);
+    disk_close(disk);
+
+    debug("Check old queued writes are swept");
+    options.write_queue_delay = 1;
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    assert(disk->writes == 0);
+    usleep(2000);
+    assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+    assert(disk->writes == 2);
+    disk_close(disk);
+
+    debug("Check disk_close writes the queue");
+    options.write_queue_delay = 60000;
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    memset(data, 0x31, BLOCK_SIZE);
+    assert(disk_write(disk, 3, data) == BLOCK_SIZE);
+    disk_close(disk);
+    disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE && data[0] == 0x31);
+    disk_close(disk);
+
+    debug("Check block pointers flush the queue only for queued blocks");
+    options.mode = DISK_MODE_MMAP;
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    memset(data, 0x35, BLOCK_SIZE);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+    assert(disk_block_ptr(disk, 1));
+    assert(disk->write_queue_flushes == 0);
+    assert(disk_block_ptr(disk, 2)[0] == 0x35);
+    assert(disk->write_queue_flushes == 1);
+    disk_close(disk);
+    options.mode = DISK_MODE_FILE;
+
+    debug("Check failed queued writes stay queued until they succeed");
+    options.ops = &test_13_ops;
+    options.readahead_blocks = 0;
+    disk = disk_open_with(NULL, DISK_BLOCKS, &options);
+    assert(disk);
+    memset(data, 0x41, BLOCK_SIZE);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    memset(data, 0x42, BLOCK_SIZE);
+    assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+    test_13_failures = SIZE_MAX;
+    assert(disk_flush(disk) == DISK_FAILURE);
+    assert(disk_flush(disk) == DISK_FAILURE);
+    assert(disk->writes == 0);
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE && data[0] == 0x42);
+    assert(disk_write(disk, 1, data) == DISK_FAILURE);
+    assert(disk_write(disk, 3, data) == DISK_FAILURE);
+    assert(disk->writes == 0);
+
+    test_13_failures = 0;
+    assert(disk_flush(disk) == 0);
+    assert(disk->writes == 3);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE && data[0] == 0x41);
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE && data[0] == 0x42);
+    assert(disk->reads == 2);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_14_trace() {
+    debug("Check recording a trace");
+    DiskOptions options = {.trace_path = TRACE_PATH, .cache_blocks = 2};
+    Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->trace);
+
+    char data[BLOCK_SIZE] = {0};
+    char vec[2][BLOCK_SIZE];
+    char *vecs[] = {vec[0], vec[1]};
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE);
+    assert(disk_read(disk, DISK_BLOCKS, data) == DISK_FAILURE);
+    assert(disk_writev(disk, 2, 2, vecs) == 2*BLOCK_SIZE);
+    assert(disk_readv(disk, 0, 2, vecs) == 2*BLOCK_SIZE);
+    disk_discard(disk, 3, 1);
+    assert(disk_barrier(disk) == 0);
+    assert(disk_flush(disk) == 0);
+    disk_close(disk);
+
+    debug("Check reading the trace back");
+    Trace *trace = trace_open(TRACE_PATH);
+    assert(trace);
+    assert(trace->header.blocks == DISK_BLOCKS);
+    assert(trace->header.block_size == BLOCK_SIZE);
+
+    struct { int op; size_t block; size_t count; } expected[] = {
+        {TRACE_WRITE, 1, 1}, {TRACE_READ, 1, 1}, {TRACE_WRITE, 2, 2}, {TRACE_READ, 0, 2},
+        {TRACE_DISCARD, 3, 1}, {TRACE_BARRIER, 0, 0}, {TRACE_FLUSH, 0, 0},
+    };
+    TraceRecord record;
+    uint64_t timestamp = 0;
+    for (size_t i = 0; i < sizeof(expected)/sizeof(expected[0]); i++) {
+        assert(trace_next(trace, &record));
+        assert(record.op == expected[i].op);
+        assert(record.block == expected[i].block);
+        assert(record.count == expected[i].count);
+        assert(record.timestamp >= timestamp);
+        assert(record.op == TRACE_DISCARD || !record.failed);
+        timestamp = record.timestamp;
+    }
+    assert(!trace_next(trace, &record));
+    assert(trace_close(trace) == 0);
+
+    debug("Check opening something that is not a trace");
+    assert(trace_open(DISK_PATH) == NULL);
+    assert(trace_open("unit_disk.missing") == NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_15_shaped() {
+    debug("Check shaping a backend");
+    DiskShape shape = {
+        .latency = 2000000,     /* 2 ms */
+        .bandwidth = 4096000,   /* 1 ms per block */
+        .track_seek = 1000000,
+        .full_seek = 5000000,
+    };
+    DiskOptions options = {.mode = DISK_MODE_RAM, .shape = &shape};
+    Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->ops == &disk_shaped_ops);
+    assert(disk->ops->ptr == NULL);
+
+    char data[BLOCK_SIZE];
+    char vec[2][BLOCK_SIZE];
+    char *vecs[] = {vec[0], vec[1]};
+    for (size_t i = 0; i < 2; i++)
+        memset(vec[i], 'a' + i, BLOCK_SIZE);
+
+    debug("Check latency and bandwidth (head starts at block 0)");
+    uint64_t start = disk_clock();
+    assert(disk_writev(disk, 0, 2, vecs) == 2*BLOCK_SIZE);
+    uint64_t elapsed = disk_clock() - start;
+    assert(elapsed >= 4000000);
+    assert(elapsed < 4000000 + 50000000);
+
+    debug("Check sequential access skips the seek");
+    start = disk_clock();
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE);
+    elapsed = disk_clock() - start;
+    assert(elapsed >= 3000000);
+    assert(elapsed < 3000000 + 50000000);
+
+    debug("Check random access pays a seek growing with distance");
+    start = disk_clock();
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE);
+    assert(disk_clock() - start >= 3000000 + 1000000 + 2000000);
+    assert(memcmp(data, vec[1], BLOCK_SIZE) == 0);
+
+    assert(disk_read(disk, DISK_BLOCKS - 1, data) == BLOCK_SIZE);
+    start = disk_clock();
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(disk_clock() - start >= 3000000 + 5000000);
+    assert(memcmp(data, vec[0], BLOCK_SIZE) == 0);
+
+    debug("Check flush waits for latency");
+    start = disk_clock();
+    assert(disk_flush(disk) == 0);
+    assert(disk_clock() - start >= 2000000);
+    disk_close(disk);
+
+    debug("Check jitter distributions stay bounded");
+    DiskShape jittery = {.jitter = 100000, .seed = 42};
+    for (int distribution = DISK_JITTER_UNIFORM; distribution <= DISK_JITTER_PARETO; distribution++) {
+        jittery.distribution = distribution;
+        options.shape = &jittery;
+        disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+        assert(disk);
+        start = disk_clock();
+        for (size_t i = 0; i < 10; i++)
+            assert(disk_read(disk, i % DISK_BLOCKS, data) == BLOCK_SIZE);
+        assert(disk_clock() - start < 10 * 100000000ULL);
+        disk_close(disk);
+    }
+
+    debug("Check presets and missing shape");
+    assert(disk_shape_hdd.rotation > 0);
+    assert(disk_shape_network.jitter > 0);
+    assert(disk_shape_cloud.iops > 0);
+    DiskOptions missing = {.ops = &disk_shaped_ops};
+    assert(disk_open_with(DISK_PATH, DISK_BLOCKS, &missing) == NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_16_checksums() {
+    debug("Check crc32c");
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(crc32c_portable(0, "123456789", 9) == 0xe3069283);
+    char random[BLOCK_SIZE + 7];
+    for (size_t i = 0; i < sizeof(random); i++)
+        random[i] = rand();
+    for (size_t offset = 0; offset < 8; offset++) {
+        assert(crc32c(0, random + offset, BLOCK_SIZE - offset) == crc32c_portable(0, random + offset, BLOCK_SIZE - offset));
+        assert(crc32c(crc32c(0, random, offset), random + offset, BLOCK_SIZE - offset) == crc32c(0, random, BLOCK_SIZE));
+    }
+
+    debug("Check checksums are stored with the image");
+    unlink(DISK_PATH);
+    DiskOptions options = {.checksums = DISK_CHECKSUM_READ};
+    Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->ops == &disk_checked_ops);
+    assert(disk->ops->ptr == NULL);
+
+    char data[BLOCK_SIZE];
+    char vec[2][BLOCK_SIZE];
+    char *vecs[] = {vec[0], vec[1]};
+    for (size_t i = 0; i < DISK_BLOCKS; i++) {
+        memset(data, 'a' + i, BLOCK_SIZE);
+        assert(disk_write(disk, i, data) == BLOCK_SIZE);
+    }
+    assert(disk_readv(disk, 1, 2, vecs) == 2*BLOCK_SIZE);
+    assert(vec[1][0] == 'c');
+    assert(disk_scrub(disk, 0, DISK_BLOCKS) == 0);
+    assert(disk_scrub(disk, 1, DISK_BLOCKS) == DISK_FAILURE);
+    disk_close(disk);
+
+    struct stat st;
+    assert(stat(DISK_PATH, &st) == 0);
+    assert(st.st_size == (DISK_BLOCKS + 2) * BLOCK_SIZE);
+
+    debug("Check corruption fails verified reads");
+    FILE *image = fopen(DISK_PATH, "r+");
+    assert(image);
+    fseek(image, 2 * BLOCK_SIZE + 100, SEEK_SET);
+    fputc('z', image);
+    fclose(image);
+
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE);
+    errno = 0;
+    assert(disk_read(disk, 2, data) == DISK_FAILURE);
+    assert(errno == EIO);
+    assert(disk_readv(disk, 1, 2, vecs) == DISK_FAILURE);
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.checksum_errors == 2);
+
+    debug("Check rewriting and discarding fix checksums");
+    memset(data, 'c', BLOCK_SIZE);
+    assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE);
+    if (disk_discard(disk, 3, 1) == 0) {
+        assert(disk_read(disk, 3, data) == BLOCK_SIZE);
+        assert(data[0] == 0);
+    }
+    disk_close(disk);
+
+    debug("Check scrub-only mode reads without verifying");
+    image = fopen(DISK_PATH, "r+");
+    assert(image);
+    fseek(image, 0, SEEK_SET);
+    fputc('z', image);
+    fclose(image);
+
+    options.checksums = DISK_CHECKSUM_SCRUB;
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(data[0] == 'z');
+    assert(disk_scrub(disk, 0, DISK_BLOCKS) == 1);
+    disk_close(disk);
+
+    debug("Check checksums are rebuilt after writes without them");
+    disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    assert(disk_scrub(disk, 0, DISK_BLOCKS) == DISK_FAILURE);
+    memset(data, 'q', BLOCK_SIZE);
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    disk_close(disk);
+
+    options.checksums = DISK_CHECKSUM_READ;
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk_scrub(disk, 0, DISK_BLOCKS) == 0);
+    for (size_t i = 0; i < DISK_BLOCKS; i++)
+        assert(disk_read(disk, i, data) == BLOCK_SIZE);
+    disk_close(disk);
+
+    debug("Check checksums under a shaped RAM disk");
+    DiskShape shape = {.latency = 1000};
+    DiskOptions layered = {.mode = DISK_MODE_RAM, .shape = &shape, .checksums = DISK_CHECKSUM_READ, .cache_blocks = 2};
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &layered);
+    assert(disk);
+    assert(disk->ops == &disk_checked_ops);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE);
+    assert(data[0] == 'q');
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+void test_17_fill(char *data, size_t seed) {
+    size_t length = 0;
+    while (length < BLOCK_SIZE)
+        length += snprintf(data + length, BLOCK_SIZE - length, "line %zu of block %zu\n", length % 97, seed);
+}
+
+int test_17_compression() {
+    debug("Check lz_compress and lz_decompress");
+    char data[BLOCK_SIZE], copy[BLOCK_SIZE], packed[2*BLOCK_SIZE];
+    test_17_fill(data, 1);
+    size_t length = lz_compress(data, BLOCK_SIZE, packed, sizeof(packed));
+    assert(length > 0 && length < BLOCK_SIZE / 2);
+    assert(lz_decompress(packed, length, copy, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+    assert(lz_decompress(packed, length - 1, copy, BLOCK_SIZE) != BLOCK_SIZE);
+    assert(lz_decompress(packed, length, copy, BLOCK_SIZE / 2) == -1);
+
+    char random[BLOCK_SIZE];
+    for (size_t i = 0; i < BLOCK_SIZE; i++)
+        random[i] = rand();
+    assert(lz_compress(random, BLOCK_SIZE, packed, BLOCK_SIZE) == 0);
+    length = lz_compress(random, BLOCK_SIZE, packed, sizeof(packed));
+    assert(lz_decompress(packed, length, copy, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(random, copy, BLOCK_SIZE) == 0);
+
+    debug("Check compressed blocks read back");
+    unlink(DISK_PATH);
+    DiskOptions options = {.compress = true};
+    Disk *disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk->ops == &disk_compressed_ops);
+
+    disk_mark_metadata(disk, 0, 1, true);
+    test_17_fill(data, 0);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    test_17_fill(data, 1);
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    assert(disk_write(disk, 2, random) == BLOCK_SIZE);
+
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.compressed_blocks == 1);
+    assert(stats.compressed_bytes < BLOCK_SIZE / 2);
+
+    char vec[DISK_BLOCKS][BLOCK_SIZE];
+    char *vecs[] = {vec[0], vec[1], vec[2], vec[3]};
+    assert(disk_readv(disk, 0, DISK_BLOCKS, vecs) == DISK_BLOCKS*BLOCK_SIZE);
+    test_17_fill(data, 0);
+    assert(memcmp(vec[0], data, BLOCK_SIZE) == 0);
+    test_17_fill(data, 1);
+    assert(memcmp(vec[1], data, BLOCK_SIZE) == 0);
+    assert(memcmp(vec[2], random, BLOCK_SIZE) == 0);
+    assert(vec[3][0] == 0 && memcmp(vec[3], vec[3] + 1, BLOCK_SIZE - 1) == 0);
+
+    debug("Check rewriting without flushing reuses space");
+    for (size_t i = 0; i < 64 * DISK_BLOCKS; i++) {
+        test_17_fill(data, i);
+        assert(disk_write(disk, 1 + i % 2, data) == BLOCK_SIZE);
+    }
+    for (size_t i = 64 * DISK_BLOCKS - 2; i < 64 * DISK_BLOCKS; i++) {
+        test_17_fill(copy, i);
+        assert(disk_read(disk, 1 + i % 2, data) == BLOCK_SIZE);
+        assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+    }
+
+    debug("Check discarded blocks read as zeros");
+    assert(disk_discard(disk, 3, 1) == 0);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE);
+    assert(data[0] == 0 && memcmp(data, data + 1, BLOCK_SIZE - 1) == 0);
+    disk_close(disk);
+
+    debug("Check the block map survives reopening");
+    disk = disk_open_with(DISK_PATH, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    test_17_fill(copy, 0);
+    assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+    for (size_t i = 64 * DISK_BLOCKS - 2; i < 64 * DISK_BLOCKS; i++) {
+        test_17_fill(copy, i);
+        assert(disk_read(disk, 1 + i % 2, data) == BLOCK_SIZE);
+        assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+    }
+    disk_close(disk);
+
+    debug("Check a compressed image under checksums");
+    options.checksums = DISK_CHECKSUM_READ;
+    disk = disk_open_with(DISK_PATH ".checked", DISK_BLOCKS, &options);
+    assert(disk);
+    test_17_fill(data, 7);
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    assert(disk_read(disk, 1, copy) == BLOCK_SIZE);
+    assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+    disk_close(disk);
+    unlink(DISK_PATH ".checked");
+
+    debug("Check uncompressed images are refused");
+    unlink(DISK_PATH);
+    disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    disk_mark_metadata(disk, 0, 1, true);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    disk_close(disk);
+    options.checksums = DISK_CHECKSUM_NONE;
+    assert(disk_open_with(DISK_PATH, DISK_BLOCKS, &options) == NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_18_striped() {
+    const char *members[] = {DISK_PATH ".0", DISK_PATH ".1", DISK_PATH ".2"};
+    const char *path = DISK_PATH ".0," DISK_PATH ".1," DISK_PATH ".2";
+    for (size_t i = 0; i < 3; i++)
+        unlink(members[i]);
+
+    debug("Check striping across three images");
+    DiskOptions options = {.stripe_blocks = 2};
+    Disk *disk = disk_open_with(path, 12, &options);
+    assert(disk);
+    assert(disk->ops == &disk_striped_ops);
+    assert(disk->ops->ptr == NULL);
+
+    char vec[12][BLOCK_SIZE];
+    char *vecs[12];
+    for (size_t i = 0; i < 12; i++) {
+        memset(vec[i], 'a' + i, BLOCK_SIZE);
+        vecs[i] = vec[i];
+    }
+    assert(disk_writev(disk, 0, 12, vecs) == 12*BLOCK_SIZE);
+    assert(disk_flush(disk) == 0);
+
+    char data[BLOCK_SIZE];
+    for (size_t i = 0; i < 12; i++) {
+        assert(disk_read(disk, i, data) == BLOCK_SIZE);
+        assert(memcmp(data, vec[i], BLOCK_SIZE) == 0);
+    }
+
+    debug("Check an unaligned vectored read spanning every member");
+    char out[9][BLOCK_SIZE];
+    char *outs[9];
+    for (size_t i = 0; i < 9; i++)
+        outs[i] = out[i];
+    assert(disk_readv(disk, 1, 9, outs) == 9*BLOCK_SIZE);
+    for (size_t i = 0; i < 9; i++)
+        assert(memcmp(out[i], vec[1 + i], BLOCK_SIZE) == 0);
+
+    debug("Check discards reach every member");
+    assert(disk_discard(disk, 3, 6) == 0);
+    assert(disk_readv(disk, 1, 9, outs) == 9*BLOCK_SIZE);
+    assert(memcmp(out[1], vec[2], BLOCK_SIZE) == 0);
+    assert(out[2][0] == 0 && memcmp(out[2], out[2] + 1, BLOCK_SIZE - 1) == 0);
+    assert(out[7][0] == 0 && memcmp(out[7], out[7] + 1, BLOCK_SIZE - 1) == 0);
+    assert(memcmp(out[8], vec[9], BLOCK_SIZE) == 0);
+    disk_close(disk);
+
+    debug("Check stripe units are dealt to the members in turn");
+    disk = disk_open(members[1], 4);
+    assert(disk);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[2], BLOCK_SIZE) == 0);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[9], BLOCK_SIZE) == 0);
+    disk_close(disk);
+
+    debug("Check members serve a transfer in parallel");
+    DiskShape shape = {.latency = 30000000}; /* 30 ms */
+    options = (DiskOptions){.mode = DISK_MODE_RAM, .shape = &shape, .stripe_blocks = 2};
+    disk = disk_open_with(path, 12, &options);
+    assert(disk);
+    uint64_t start = disk_clock();
+    assert(disk_writev(disk, 0, 6, vecs) == 6*BLOCK_SIZE);
+    uint64_t elapsed = disk_clock() - start;
+    assert(elapsed >= 30000000);
+    assert(elapsed < 80000000);
+    assert(disk_readv(disk, 0, 6, outs) == 6*BLOCK_SIZE);
+    assert(memcmp(out[5], vec[5], BLOCK_SIZE) == 0);
+    disk_close(disk);
+
+    debug("Check a missing member fails the open");
+    options = (DiskOptions){.stripe_blocks = 2};
+    assert(disk_open_with(DISK_PATH ".0,/root/NOPE/image", 12, &options) == NULL);
+
+    for (size_t i = 0; i < 3; i++)
+        unlink(members[i]);
+    return EXIT_SUCCESS;
+}
+
+int test_19_failures = 0; /* Reads test_19_ops fails before passing them on */
+
+int test_19_open(Disk *disk, const char *path, const DiskOptions *options) {
+    return disk_file_ops.open(disk, path, options);
+}
+
+ssize_t test_19_read(Disk *disk, size_t block, char *data) {
+    if (test_19_failures > 0) {
+        test_19_failures--;
+        errno = EIO;
+        return DISK_FAILURE;
+    }
+    return disk_file_ops.read(disk, block, data);
+}
+
+ssize_t test_19_write(Disk *disk, size_t block, char *data) {
+    return disk_file_ops.write(disk, block, data);
+}
+
+int test_19_flush(Disk *disk) {
+    return disk_file_ops.flush(disk);
+}
+
+void test_19_close(Disk *disk) {
+    disk_file_ops.close(disk);
+}
+
+const DiskOps test_19_ops = {
+    .name  = "failing",
+    .open  = test_19_open,
+    .read  = test_19_read,
+    .write = test_19_write,
+    .flush = test_19_flush,
+    .close = test_19_close,
+};
+
+void test_19_unlink() {
+    unlink(DISK_PATH ".0");
+    unlink(DISK_PATH ".1");
+    unlink(DISK_PATH ".mirror/2");
+    unlink(DISK_PATH ".other/3");
+    rmdir(DISK_PATH ".mirror");
+    rmdir(DISK_PATH ".other");
+    rmdir(DISK_PATH ".away");
+}
+
+int test_19_mirrored() {
+    /* The third member is in a directory that can be moved away and back */
+    const char *path = DISK_PATH ".0," DISK_PATH ".1," DISK_PATH ".mirror/2";
+    test_19_unlink();
+    assert(mkdir(DISK_PATH ".mirror", 0755) == 0);
+
+    debug("Check writes reach every member");
+    DiskOptions options = {.mirror = true};
+    Disk *disk = disk_open_with(path, 8, &options);
+    assert(disk);
+    assert(disk->ops == &disk_mirrored_ops);
+
+    char vec[8][BLOCK_SIZE];
+    char *vecs[8];
+    for (size_t i = 0; i < 8; i++) {
+        memset(vec[i], 'a' + i, BLOCK_SIZE);
+        vecs[i] = vec[i];
+    }
+    assert(disk_writev(disk, 0, 8, vecs) == 8*BLOCK_SIZE);
+
+    char data[BLOCK_SIZE];
+    for (size_t i = 0; i < 8; i++) {
+        assert(disk_read(disk, i, data) == BLOCK_SIZE);
+        assert(memcmp(data, vec[i], BLOCK_SIZE) == 0);
+    }
+    disk_close(disk);
+
+    disk = disk_open(DISK_PATH ".mirror/2", 9);
+    assert(disk);
+    assert(disk_read(disk, 5, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[5], BLOCK_SIZE) == 0);
+    disk_close(disk);
+
+    debug("Check a missing member is resynced when it comes back");
+    assert(rename(DISK_PATH ".mirror", DISK_PATH ".away") == 0);
+    disk = disk_open_with(path, 8, &options);
+    assert(disk);
+    assert(disk_write(disk, 0, vec[7]) == BLOCK_SIZE);
+    disk_close(disk);
+
+    assert(rename(DISK_PATH ".away", DISK_PATH ".mirror") == 0);
+    disk = disk_open_with(path, 8, &options);
+    assert(disk);
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.mirror_resyncs == 1);
+    disk_close(disk);
+
+    disk = disk_open(DISK_PATH ".mirror/2", 9);
+    assert(disk);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[7], BLOCK_SIZE) == 0);
+    disk_close(disk);
+
+    debug("Check disk_resync brings a member back while the disk is open");
+    assert(disk_resync(NULL) == DISK_FAILURE);
+    assert(rename(DISK_PATH ".mirror", DISK_PATH ".away") == 0);
+    disk = disk_open_with(path, 8, &options);
+    assert(disk);
+    assert(disk_write(disk, 1, vec[6]) == BLOCK_SIZE);
+    assert(disk_resync(disk) == 0);
+    assert(rename(DISK_PATH ".away", DISK_PATH ".mirror") == 0);
+    assert(disk_resync(disk) == 1);
+    assert(disk_write(disk, 2, vec[5]) == BLOCK_SIZE);
+    disk_close(disk);
+
+    disk = disk_open(DISK_PATH ".mirror/2", 9);
+    assert(disk);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[6], BLOCK_SIZE) == 0);
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[5], BLOCK_SIZE) == 0);
+    disk_close(disk);
+
+    debug("Check a failed read falls back to another member");
+    options.ops = &test_19_ops;
+    disk = disk_open_with(path, 8, &options);
+    assert(disk);
+    test_19_failures = 1;
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[7], BLOCK_SIZE) == 0);
+    test_19_failures = 1;
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[3], BLOCK_SIZE) == 0);
+    disk_stats(disk, &stats);
+    assert(stats.mirror_failures == 2);
+    assert(disk_resync(disk) == 2);
+    assert(disk_read(disk, 4, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[4], BLOCK_SIZE) == 0);
+
+    debug("Check a read fails once every member has failed");
+    test_19_failures = 3;
+    assert(disk_read(disk, 4, data) == DISK_FAILURE);
+    assert(disk_write(disk, 4, data) == DISK_FAILURE);
+    disk_close(disk);
+
+    debug("Check the last member to fail is the one kept");
+    options.ops = NULL;
+    disk = disk_open_with(path, 8, &options);
+    assert(disk);
+    disk_stats(disk, &stats);
+    assert(stats.mirror_resyncs == 2);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(memcmp(data, vec[7], BLOCK_SIZE) == 0);
+    disk_close(disk);
+
+    debug("Check members that diverged at the same generation are resynced");
+    const char *pair = DISK_PATH ".mirror/2," DISK_PATH ".other/3";
+    assert(mkdir(DISK_PATH ".other", 0755) == 0);
+    disk = disk_open_with(pair, 8, &options);
+    assert(disk);
+    assert(disk_write(disk, 0, vec[0]) == BLOCK_SIZE);
+    disk_close(disk);
+    for (size_t i = 1; i <= 2; i++) {
+        /* First the second member is missing, then the first */
+        const char *missing = i == 1 ? DISK_PATH ".other" : DISK_PATH ".mirror";
+        assert(rename(missing, DISK_PATH ".away") == 0);
+        disk = disk_open_with(pair, 8, &options);
+        assert(disk);
+        assert(disk_write(disk, 0, vec[i]) == BLOCK_SIZE);
+        disk_close(disk);
+        assert(rename(DISK_PATH ".away", missing) == 0);
+    }
+    disk = disk_open_with(pair, 8, &options);
+    assert(disk);
+    disk_stats(disk, &stats);
+    assert(stats.mirror_resyncs == 1);
+    disk_close(disk);
+
+    char other[BLOCK_SIZE];
+    disk = disk_open(DISK_PATH ".mirror/2", 9);
+    assert(disk);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    disk_close(disk);
+    disk = disk_open(DISK_PATH ".other/3", 9);
+    assert(disk);
+    assert(disk_read(disk, 0, other) == BLOCK_SIZE);
+    disk_close(disk);
+    assert(memcmp(data, other, BLOCK_SIZE) == 0);
+    assert(memcmp(data, vec[1], BLOCK_SIZE) == 0);
+
+    debug("Check a large read is split across the members");
+    DiskShape shape = {.bandwidth = 4096000}; /* 1 ms per block */
+    options = (DiskOptions){.mode = DISK_MODE_RAM, .shape = &shape, .mirror = true};
+    char big[64][BLOCK_SIZE];
+    char *bigs[64];
+    for (size_t i = 0; i < 64; i++) {
+        memset(big[i], i, BLOCK_SIZE);
+        bigs[i] = big[i];
+    }
+    disk = disk_open_with(DISK_PATH ".ram0," DISK_PATH ".ram1", 64, &options);
+    assert(disk);
+    assert(disk_writev(disk, 0, 64, bigs) == 64*BLOCK_SIZE);
+    memset(big, 0xff, sizeof(big));
+    uint64_t start = disk_clock();
+    assert(disk_readv(disk, 0, 64, bigs) == 64*BLOCK_SIZE);
+    uint64_t elapsed = disk_clock() - start;
+    assert(elapsed >= 32000000);
+    assert(elapsed < 52000000);
+    assert(big[63][0] == 63 && big[0][BLOCK_SIZE - 1] == 0);
+    disk_close(disk);
+
+    debug("Check mirroring and striping do not combine");
+    options = (DiskOptions){.mirror = true, .stripe_blocks = 2};
+    assert(disk_open_with(path, 8, &options) == NULL);
+
+    test_19_unlink();
+    return EXIT_SUCCESS;
+}
+
+size_t test_20_flushes = 0; /* Flushes test_20_ops has made (atomic) */
+bool test_20_failing = false; /* Whether test_20_ops fails its flushes */
+
+int test_20_flush(Disk *disk) {
+    usleep(5000);
+    __atomic_fetch_add(&test_20_flushes, 1, __ATOMIC_RELAXED);
+    if (test_20_failing) {
+        errno = EIO;
+        return DISK_FAILURE;
+    }
+    return 0;
+}
+
+const DiskOps test_20_ops = {
+    .name  = "slow flush",
+    .open  = test_08_open,
+    .read  = test_08_read,
+    .write = test_08_write,
+    .flush = test_20_flush,
+    .close = test_08_close,
+};
+
+void *test_20_committer(void *arg) {
+    Disk *disk = arg;
+    char data[BLOCK_SIZE] = {0};
+    for (size_t i = 0; i < 8; i++) {
+        assert(disk_write(disk, i % DISK_BLOCKS, data) == BLOCK_SIZE);
+        assert(disk_commit(disk) == 0);
+    }
+    return NULL;
+}
+
+int test_20_durability() {
+    debug("Check commits do nothing without durability");
+    DiskOptions options = {.ops = &test_20_ops};
+    Disk *disk = disk_open_with(NULL, DISK_BLOCKS, &options);
+    assert(disk);
+    assert(disk_commit(disk) == 0);
+    assert(test_20_flushes == 0);
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.commits == 0);
+    disk_close(disk);
+
+    debug("Check every commit flushes with DISK_DURABILITY_SYNC");
+    test_20_flushes = 0;
+    options.durability = DISK_DURABILITY_SYNC;
+    disk = disk_open_with(NULL, DISK_BLOCKS, &options);
+    assert(disk);
+    for (size_t i = 0; i < 3; i++)
+        assert(disk_commit(disk) == 0);
+    assert(test_20_flushes == 3);
+    disk_stats(disk, &stats);
+    assert(stats.commits == 3 && stats.commit_flushes == 3);
+    disk_close(disk);
+
+    debug("Check a lone committer never waits for a group");
+    test_20_flushes = 0;
+    options.durability = DISK_DURABILITY_GROUP;
+    options.commit_delay = 100000; /* 100 ms */
+    disk = disk_open_with(NULL, DISK_BLOCKS, &options);
+    assert(disk);
+    uint64_t start = disk_clock();
+    for (size_t i = 0; i < 4; i++)
+        assert(disk_commit(disk) == 0);
+    assert(disk_clock() - start < 100000000);
+    assert(test_20_flushes == 4);
+
+    debug("Check concurrent commits share flushes");
+    test_20_flushes = 0;
+    pthread_t threads[DISK_THREADS * 2];
+    for (size_t t = 0; t < DISK_THREADS * 2; t++)
+        assert(pthread_create(&threads[t], NULL, test_20_committer, disk) == 0);
+    for (size_t t = 0; t < DISK_THREADS * 2; t++)
+        assert(pthread_join(threads[t], NULL) == 0);
+    disk_stats(disk, &stats);
+    assert(stats.commits == 4 + DISK_THREADS * 2 * 8);
+    assert(stats.commit_flushes == 4 + test_20_flushes);
+    assert(test_20_flushes < DISK_THREADS * 2 * 8 / 2);
+
+    debug("Check a failed flush fails its commits and every later one");
+    test_20_failing = true;
+    assert(disk_commit(disk) == DISK_FAILURE);
+    assert(errno == EIO);
+    test_20_failing = false;
+    assert(disk_commit(disk) == DISK_FAILURE);
+    disk_close(disk);
+
+    debug("Check unknown durability modes");
+    options.durability = 3;
+    assert(disk_open_with(NULL, DISK_BLOCKS, &options) == NULL);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -116,6 +1506,24 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    0. Test disk_open\n");
         fprintf(stderr, "    1. Test disk_read\n");
         fprintf(stderr, "    2. Test disk_write\n");
+        fprintf(stderr, "    3. Test concurrent disk_read\n");
+        fprintf(stderr, "    4. Test disk_readv and disk_writev\n");
+        fprintf(stderr, "    5. Test DISK_MODE_MMAP\n");
+        fprintf(stderr, "    6. Test asynchronous disk I/O\n");
+        fprintf(stderr, "    7. Test O_DIRECT and aligned buffer pool\n");
+        fprintf(stderr, "    8. Test disk backend operations\n");
+        fprintf(stderr, "    9. Test DISK_MODE_RAM\n");
+        fprintf(stderr, "    10. Test disk_stats\n");
+        fprintf(stderr, "    11. Test disk_discard\n");
+        fprintf(stderr, "    12. Test disk_prefetch\n");
+        fprintf(stderr, "    13. Test write queue\n");
+        fprintf(stderr, "    14. Test block I/O traces\n");
+        fprintf(stderr, "    15. Test shaped disk backend\n");
+        fprintf(stderr, "    16. Test block checksums\n");
+        fprintf(stderr, "    17. Test block compression\n");
+        fprintf(stderr, "    18. Test striped disks\n");
+        fprintf(stderr, "    19. Test mirrored disks\n");
+        fprintf(stderr, "    20. Test durability modes\n");
         return EXIT_FAILURE;
     }
 
@@ -128,6 +1536,24 @@ int main(int argc, char *argv[]) {
         case 0:  status = test_00_disk_open(); break;
         case 1:  status = test_01_disk_read(); break;
         case 2:  status = test_02_disk_write(); break;
+        case 3:  status = test_03_disk_concurrent(); break;
+        case 4:  status = test_04_disk_vector(); break;
+        case 5:  status = test_05_disk_mmap(); break;
+        case 6:  status = test_06_disk_async(); break;
+        case 7:  status = test_07_disk_direct(); break;
+        case 8:  status = test_08_disk_ops(); break;
+        case 9:  status = test_09_ram(); break;
+        case 10: status = test_10_stats(); break;
+        case 11: status = test_11_discard(); break;
+        case 12: status = test_12_readahead(); break;
+        case 13: status = test_13_write_queue(); break;
+        case 14: status = test_14_trace(); break;
+        case 15: status = test_15_shaped(); break;
+        case 16: status = test_16_checksums(); break;
+        case 17: status = test_17_compression(); break;
+        case 18: status = test_18_striped(); break;
+        case 19: status = test_19_mirrored(); break;
+        case 20: status = test_20_durability(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
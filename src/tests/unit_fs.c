@@ -2,10 +2,12 @@
 
 #include "sfs/fs.h"
 #include "sfs/logging.h"
+#include "sfs/utils.h"
 
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <unistd.h>
 
@@ -27,11 +29,11 @@ int test_00_fs_mount()
     assert(fs.disk == disk);
     assert(fs.disk->mounted == true);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == true);
+    assert(!bitmap_test(fs.free_blocks, 0));
+    assert(!bitmap_test(fs.free_blocks, 1));
+    assert(!bitmap_test(fs.free_blocks, 2));
+    assert(bitmap_test(fs.free_blocks, 3));
+    assert(bitmap_test(fs.free_blocks, 4));
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
@@ -47,32 +49,47 @@ int test_00_fs_mount()
     assert(fs.disk == disk);
     assert(fs.disk->mounted == true);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == false);
-    assert(fs.free_blocks[5] == false);
-    assert(fs.free_blocks[6] == false);
-    assert(fs.free_blocks[7] == false);
-    assert(fs.free_blocks[8] == false);
-    assert(fs.free_blocks[9] == false);
-    assert(fs.free_blocks[10] == false);
-    assert(fs.free_blocks[11] == false);
-    assert(fs.free_blocks[12] == false);
-    assert(fs.free_blocks[13] == false);
-    assert(fs.free_blocks[14] == false);
-    assert(fs.free_blocks[15] == true);
-    assert(fs.free_blocks[16] == true);
-    assert(fs.free_blocks[17] == true);
-    assert(fs.free_blocks[18] == true);
-    assert(fs.free_blocks[19] == true);
+    assert(!bitmap_test(fs.free_blocks, 0));
+    assert(!bitmap_test(fs.free_blocks, 1));
+    assert(!bitmap_test(fs.free_blocks, 2));
+    assert(bitmap_test(fs.free_blocks, 3));
+    assert(!bitmap_test(fs.free_blocks, 4));
+    assert(!bitmap_test(fs.free_blocks, 5));
+    assert(!bitmap_test(fs.free_blocks, 6));
+    assert(!bitmap_test(fs.free_blocks, 7));
+    assert(!bitmap_test(fs.free_blocks, 8));
+    assert(!bitmap_test(fs.free_blocks, 9));
+    assert(!bitmap_test(fs.free_blocks, 10));
+    assert(!bitmap_test(fs.free_blocks, 11));
+    assert(!bitmap_test(fs.free_blocks, 12));
+    assert(!bitmap_test(fs.free_blocks, 13));
+    assert(!bitmap_test(fs.free_blocks, 14));
+    assert(bitmap_test(fs.free_blocks, 15));
+    assert(bitmap_test(fs.free_blocks, 16));
+    assert(bitmap_test(fs.free_blocks, 17));
+    assert(bitmap_test(fs.free_blocks, 18));
+    assert(bitmap_test(fs.free_blocks, 19));
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
+    assert(fs.disk == disk && fs.free_blocks);
 
     fs_unmount(&fs);
     disk_close(disk);
+
+    debug("Check a failed mount leaves nothing attached");
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+    disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_format(disk));
+    Block block;
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    block.super.bitmap_blocks++;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk) == false);
+    assert(fs.disk == NULL && fs.free_blocks == NULL && fs.free_inodes == NULL && fs.dirty_maps == NULL);
+    assert(!disk->mounted);
+    disk_close(disk);
     return EXIT_SUCCESS;
 }
 
@@ -128,14 +145,14 @@ int test_02_fs_remove()
 
     debug("Check removing inode 2");
     assert(fs_remove(&fs, 2));
-    assert(fs.free_blocks[4]);
-    assert(fs.free_blocks[5]);
-    assert(fs.free_blocks[6]);
-    assert(fs.free_blocks[7]);
-    assert(fs.free_blocks[8]);
-    assert(fs.free_blocks[9]);
-    assert(fs.free_blocks[13]);
-    assert(fs.free_blocks[14]);
+    assert(bitmap_test(fs.free_blocks, 4));
+    assert(bitmap_test(fs.free_blocks, 5));
+    assert(bitmap_test(fs.free_blocks, 6));
+    assert(bitmap_test(fs.free_blocks, 7));
+    assert(bitmap_test(fs.free_blocks, 8));
+    assert(bitmap_test(fs.free_blocks, 9));
+    assert(bitmap_test(fs.free_blocks, 13));
+    assert(bitmap_test(fs.free_blocks, 14));
 
     Block block;
     assert(disk_read(fs.disk, 1, block.data) != DISK_FAILURE);
@@ -178,6 +195,545 @@ int test_03_fs_stat()
     return EXIT_SUCCESS;
 }
 
+int test_04_fs_read()
+{
+    DiskOptions options = {.readahead_blocks = DISK_READAHEAD_BLOCKS};
+    Disk *disk = disk_open_with("data/image.200", 200, &options);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    FILE *stream = fopen("data/image.200.9.txt", "r");
+    assert(stream);
+    static char expected[409305];
+    assert(fread(expected, 1, sizeof(expected), stream) == sizeof(expected));
+    fclose(stream);
+
+    debug("Check sequential fs_read of inode 9 (direct and indirect blocks)");
+    char buffer[4 * BUFSIZ];
+    size_t offset = 0;
+    ssize_t result;
+    while ((result = fs_read(&fs, 9, buffer, sizeof(buffer), offset)) > 0)
+    {
+        assert(memcmp(buffer, expected + offset, result) == 0);
+        offset += result;
+    }
+    assert(result == 0);
+    assert(offset == sizeof(expected));
+
+    debug("Check readahead served the stream");
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.readahead_hits > 0);
+    assert(fs.streams[0].valid && fs.streams[0].inode_number == 9);
+    assert(fs.streams[0].window == FS_READAHEAD_MAX);
+
+    debug("Check random fs_read shrinks the window");
+    assert(fs_read(&fs, 9, buffer, 100, 200000) == 100);
+    assert(memcmp(buffer, expected + 200000, 100) == 0);
+    assert(fs.streams[0].window == FS_READAHEAD_MAX / 2);
+
+    debug("Check fs_read past end and on invalid inode");
+    assert(fs_read(&fs, 9, buffer, sizeof(buffer), sizeof(expected)) == 0);
+    assert(fs_read(&fs, 9, buffer, sizeof(buffer), sizeof(expected) - 5) == 5);
+    assert(fs_read(&fs, 3, buffer, sizeof(buffer), 0) == -1);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_fs_write()
+{
+    DiskOptions options = {.write_queue_blocks = DISK_WRITE_QUEUE_BLOCKS};
+    Disk *disk = disk_open_with("data/image.unit", 200, &options);
+    assert(disk);
+    assert(fs_format(disk));
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+
+    FILE *stream = fopen("data/image.200.9.txt", "r");
+    assert(stream);
+    static char expected[409305];
+    assert(fread(expected, 1, sizeof(expected), stream) == sizeof(expected));
+    fclose(stream);
+
+    debug("Check fs_write in unaligned chunks (direct and indirect blocks)");
+    size_t chunk = 3 * BLOCK_SIZE + 100;
+    for (size_t offset = 0; offset < sizeof(expected); offset += chunk)
+    {
+        size_t length = min(chunk, sizeof(expected) - offset);
+        assert(fs_write(&fs, inode_number, expected + offset, length, offset) == (ssize_t)length);
+    }
+
+    debug("Check written data reads back (through the write queue)");
+    static char buffer[409305];
+    assert(fs_read(&fs, inode_number, buffer, sizeof(buffer), 0) == sizeof(expected));
+    assert(memcmp(buffer, expected, sizeof(expected)) == 0);
+
+    debug("Check overwriting the middle of the file");
+    memset(expected + 20000, 'x', 5000);
+    assert(fs_write(&fs, inode_number, expected + 20000, 5000, 20000) == 5000);
+
+    debug("Check queued writes merged into fewer backend operations");
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.writes_absorbed > 0);
+    assert(stats.write_latency.count < stats.writes);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check written data reached the image");
+    disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_mount(&fs, disk));
+    memset(buffer, 0, sizeof(buffer));
+    assert(fs_read(&fs, inode_number, buffer, sizeof(buffer), 0) == sizeof(expected));
+    assert(memcmp(buffer, expected, sizeof(expected)) == 0);
+
+    debug("Check fs_write on invalid inode");
+    assert(fs_write(&fs, inode_number + 1, buffer, 1, 0) == -1);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_06_fs_block_size()
+{
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    debug("Check unsupported block sizes");
+    assert(fs_format_with(disk, 3 * BLOCK_SIZE) == false);
+    assert(fs_format_with(disk, BLOCK_SIZE / 2) == false);
+    assert(fs_format_with(disk, 2 * FS_MAX_BLOCK_SIZE) == false);
+
+    debug("Check formatting with 64 KiB blocks");
+    assert(fs_format_with(disk, 1 << 16));
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+    assert(fs.block_size == 1 << 16);
+    assert(fs.inodes_per_block == (1 << 16) / sizeof(Inode));
+    assert(fs.pointers_per_block == (1 << 16) / sizeof(uint32_t));
+    assert(fs.meta_data.blocks == 200 / 16);
+    assert(fs.meta_data.inode_blocks == 2);
+    assert(fs_get_total_inodes(&fs) == 2 * fs.inodes_per_block);
+
+    FILE *stream = fopen("data/image.200.9.txt", "r");
+    assert(stream);
+    static char expected[409305];
+    assert(fread(expected, 1, sizeof(expected), stream) == sizeof(expected));
+    fclose(stream);
+
+    debug("Check fs_write and fs_read across direct and indirect 64 KiB blocks");
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number == 0);
+    assert(fs_write(&fs, inode_number, expected, sizeof(expected), 0) == sizeof(expected));
+    assert(fs_write(&fs, inode_number, expected + 70000, 100, 70000) == 100);
+    static char buffer[409305];
+    assert(fs_read(&fs, inode_number, buffer, sizeof(buffer), 0) == sizeof(expected));
+    assert(memcmp(buffer, expected, sizeof(expected)) == 0);
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check the block size is read back from the superblock");
+    DiskOptions options = {.mode = DISK_MODE_MMAP};
+    disk = disk_open_with("data/image.unit", 200, &options);
+    assert(disk);
+    assert(fs_mount(&fs, disk));
+    assert(fs.block_size == 1 << 16);
+    memset(buffer, 0, sizeof(buffer));
+    assert(fs_read(&fs, inode_number, buffer, sizeof(buffer), 0) == sizeof(expected));
+    assert(memcmp(buffer, expected, sizeof(expected)) == 0);
+
+    debug("Check fs_remove releases 64 KiB blocks");
+    assert(fs_remove(&fs, inode_number));
+    for (size_t b = fs_data_start(&fs); b < fs.meta_data.blocks; b++)
+        assert(bitmap_test(fs.free_blocks, b));
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check a disk too small for one block");
+    disk = disk_open("data/image.unit", 8);
+    assert(disk);
+    assert(fs_format_with(disk, 1 << 16) == false);
+    assert(fs_format_with(disk, 1 << 15));
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_07_fs_durability()
+{
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+    DiskOptions options = {.durability = DISK_DURABILITY_SYNC};
+    Disk *disk = disk_open_with("data/image.unit", 20, &options);
+    assert(disk);
+
+    debug("Check fs operations commit with DISK_DURABILITY_SYNC");
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.commits == 0);
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    char data[] = "durable";
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_write(&fs, inode_number, data, 0, 0) == 0);
+    assert(fs_remove(&fs, inode_number));
+    disk_stats(disk, &stats);
+    assert(stats.commits == 3);
+    assert(stats.commit_flushes == 3);
+
+    debug("Check reads do not commit");
+    assert(fs_read(&fs, 2, data, sizeof(data), 0) == sizeof(data));
+    disk_stats(disk, &stats);
+    assert(stats.commits == 3);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_08_fs_free_maps()
+{
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_format(disk));
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+    size_t first = fs_data_start(&fs);
+    assert(fs.free_blocks->bits == fs.meta_data.blocks);
+    assert(fs.free_blocks->nwords == (fs.meta_data.blocks + 63) / 64);
+    assert(bitmap_count(fs.free_blocks) == fs.meta_data.blocks - first);
+    assert(bitmap_count(fs.free_inodes) == fs_get_total_inodes(&fs));
+
+    debug("Check fs_allocate_block hands out blocks in order across words");
+    for (size_t b = first; b < fs.meta_data.blocks; b++)
+        assert(fs_allocate_block(&fs) == (ssize_t)b);
+    assert(fs_allocate_block(&fs) == FS_FAILURE);
+    assert(bitmap_count(fs.free_blocks) == 0);
+    bitmap_set(fs.free_blocks, 130);
+    bitmap_set(fs.free_blocks, 190);
+    assert(fs_allocate_block(&fs) == 130);
+    assert(fs_allocate_block(&fs) == 190);
+    assert(fs_allocate_block(&fs) == FS_FAILURE);
+
+    debug("Check bits past the end of the bitmap are never found");
+    bitmap_set(fs.free_blocks, fs.meta_data.blocks);
+    assert(!bitmap_test(fs.free_blocks, fs.meta_data.blocks));
+    assert(bitmap_find(fs.free_blocks, 0) == -1);
+
+    debug("Check fs_create reuses the first free inode");
+    size_t total = fs_get_total_inodes(&fs);
+    for (size_t i = 0; i < total; i++)
+        fs_mark_inode_status(&fs, i, INODE_UNAVAILABLE);
+    assert(fs_find_first_available_inode(&fs) == FS_FAILURE);
+    fs_mark_inode_status(&fs, total - 1, INODE_AVAILABLE);
+    fs_mark_inode_status(&fs, 100, INODE_AVAILABLE);
+    assert(fs_find_first_available_inode(&fs) == 100);
+    fs_mark_inode_status(&fs, 100, INODE_UNAVAILABLE);
+    assert(fs_find_first_available_inode(&fs) == (ssize_t)(total - 1));
+    fs_unmount(&fs);
+    assert(fs.free_blocks == NULL && fs.free_inodes == NULL);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_09_fs_free_summary()
+{
+    debug("Check summary levels over a bitmap of three levels");
+    size_t bits = 2 * BITMAP_REGION_BITS * BITMAP_WORD_BITS + 5;
+    Bitmap *bitmap = bitmap_create(bits, false);
+    assert(bitmap);
+    assert(bitmap->nlevels == 4);
+    assert(bitmap->level_words[bitmap->nlevels - 1] == 1);
+    assert(bitmap_find(bitmap, 0) == -1);
+
+    size_t marked[] = {3, 64, 4095, 4096, 300000, 262143, bits - 1};
+    for (size_t i = 0; i < sizeof(marked) / sizeof(marked[0]); i++)
+        bitmap_set(bitmap, marked[i]);
+    assert(bitmap_count(bitmap) == 7);
+    assert(bitmap_find(bitmap, 0) == 3);
+    assert(bitmap_find(bitmap, 4) == 64);
+    assert(bitmap_find(bitmap, 65) == 4095);
+    assert(bitmap_find(bitmap, 4097) == 262143);
+    assert(bitmap_find(bitmap, 262144) == 300000);
+    assert(bitmap_find(bitmap, 300001) == (ssize_t)(bits - 1));
+    assert(bitmap_find(bitmap, bits) == -1);
+    assert(bitmap_count_range(bitmap, 0, 4096) == 3);
+    assert(bitmap_count_range(bitmap, 4095, 2) == 2);
+    assert(bitmap_count_range(bitmap, 4096, bits) == 4);
+
+    debug("Check clearing the last bit below a summary bit");
+    bitmap_clear(bitmap, 262143);
+    bitmap_clear(bitmap, 300000);
+    assert(bitmap_find(bitmap, 4097) == (ssize_t)(bits - 1));
+    bitmap_clear_range(bitmap, 0, bits);
+    assert(bitmap_count(bitmap) == 0);
+    assert(bitmap_find(bitmap, 0) == -1);
+    for (size_t k = 1; k < bitmap->nlevels; k++)
+        for (size_t i = 0; i < bitmap->level_words[k]; i++)
+            assert(bitmap->levels[k][i] == 0);
+    bitmap_destroy(bitmap);
+
+    debug("Check fs_statfs follows allocations");
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_format(disk));
+    FileSystem fs = {0};
+    FileSystemStats stats;
+    assert(fs_statfs(&fs, &stats) == false);
+    assert(fs_mount(&fs, disk));
+    assert(fs_statfs(&fs, &stats));
+    assert(stats.block_size == BLOCK_SIZE);
+    assert(stats.blocks == 200);
+    assert(stats.free_blocks == 200 - fs_data_start(&fs));
+    assert(stats.free_inodes == stats.inodes);
+
+    static char data[3 * BLOCK_SIZE];
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    FileSystemStats after;
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == stats.free_blocks - 3);
+    assert(after.free_inodes == stats.free_inodes - 1);
+    assert(fs_remove(&fs, inode_number));
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == stats.free_blocks);
+    assert(after.free_inodes == stats.free_inodes);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_10_fs_bitmaps()
+{
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_format(disk));
+
+    debug("Check fs_format lays out free maps after the inode table");
+    Block block;
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(block.super.bitmap_blocks == 1);
+    assert(block.super.clean);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+    assert(fs_data_start(&fs) == 1 + fs.meta_data.inode_blocks + 1);
+    assert(fs.dirty_maps);
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(!block.super.clean);
+
+    static char data[3 * BLOCK_SIZE];
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number == 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_create(&fs) == 1);
+    assert(fs_remove(&fs, 1));
+    FileSystemStats expected;
+    assert(fs_statfs(&fs, &expected));
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check a clean mount reads only the superblock and free maps");
+    disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_mount(&fs, disk));
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.reads == 2);
+    FileSystemStats found;
+    assert(fs_statfs(&fs, &found));
+    assert(found.free_blocks == expected.free_blocks);
+    assert(found.free_inodes == expected.free_inodes);
+    assert(fs.meta_data.inodes == 1);
+    assert(fs_create(&fs) == 1);
+    assert(fs_write(&fs, 1, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_statfs(&fs, &expected));
+    size_t nwords = fs.free_blocks->nwords;
+    uint64_t words[nwords];
+    memcpy(words, fs.free_blocks->words, sizeof(words));
+
+    debug("Check an unclean shutdown falls back to the scan");
+    disk_close(disk);
+    fs.disk = NULL;
+    fs_unmount(&fs);
+    disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_mount(&fs, disk));
+    disk_stats(disk, &stats);
+    assert(stats.reads > 2);
+    assert(fs_statfs(&fs, &found));
+    assert(found.free_blocks == expected.free_blocks);
+    assert(found.free_inodes == expected.free_inodes);
+    assert(memcmp(words, fs.free_blocks->words, sizeof(words)) == 0);
+
+    debug("Check fs_remove leaves metadata named by a corrupt inode alone");
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    block.inodes[1].direct[1] = 1;
+    block.inodes[1].direct[2] = fs_data_start(&fs) - 1;
+    block.inodes[1].indirect = 2;
+    assert(disk_write(disk, 1, block.data) == BLOCK_SIZE);
+    assert(fs_remove(&fs, 1));
+    assert(fs_statfs(&fs, &found));
+    assert(found.free_blocks == expected.free_blocks + 1);
+    for (size_t b = 0; b < fs_data_start(&fs); b++)
+        assert(!bitmap_test(fs.free_blocks, b));
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(block.inodes[0].valid && !block.inodes[1].valid);
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check images without free maps still mount by scanning");
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+    disk = disk_open("data/image.unit", 20);
+    assert(disk);
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.bitmap_blocks == 0);
+    assert(fs.dirty_maps == NULL);
+    assert(fs_data_start(&fs) == 1 + fs.meta_data.inode_blocks);
+    fs_unmount(&fs);
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(block.super.bitmap_blocks == 0 && !block.super.clean);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_11_fs_mount_scan()
+{
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    debug("Check mount reads the inode table and each indirect block once");
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+    DiskStats stats;
+    disk_stats(disk, &stats);
+
+    Bitmap *used = bitmap_create(fs.meta_data.blocks, false);
+    assert(used);
+    size_t valid = 0;
+    size_t indirect = 0;
+    for (size_t i = 0; i < fs_get_total_inodes(&fs); i++)
+    {
+        Inode inode;
+        assert(fs_load_inode(&fs, i, &inode));
+        assert(bitmap_test(fs.free_inodes, i) == !inode.valid);
+        if (!inode.valid)
+            continue;
+        valid++;
+        for (size_t d = 0; d < POINTERS_PER_INODE; d++)
+            bitmap_set(used, inode.direct[d]);
+        if (inode.indirect == 0)
+            continue;
+        indirect++;
+        bitmap_set(used, inode.indirect);
+        Block block;
+        assert(fs_read_blocks(&fs, inode.indirect, 1, block.data) == BLOCK_SIZE);
+        for (size_t p = 0; p < fs.pointers_per_block; p++)
+            bitmap_set(used, block.pointers[p]);
+    }
+    assert(indirect > 0);
+    assert(stats.reads == 1 + fs.meta_data.inode_blocks + indirect);
+    assert(fs.meta_data.inodes == valid);
+
+    debug("Check the block map matches the inodes");
+    for (size_t b = 0; b < fs.meta_data.blocks; b++)
+        assert(bitmap_test(fs.free_blocks, b) == (b >= fs_data_start(&fs) && !bitmap_test(used, b)));
+    bitmap_destroy(used);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_12_fs_parallel_mount()
+{
+    debug("Check parallel mounts match a single-threaded one");
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    FileSystem single = {0};
+    assert(fs_mount_with(&single, disk, 1));
+    size_t threads[] = {2, 3, 8, 0, 1000};
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+    {
+        FileSystem fs = {0};
+        single.disk->mounted = false;
+        assert(fs_mount_with(&fs, disk, threads[t]));
+        assert(fs.meta_data.inodes == single.meta_data.inodes);
+        assert(memcmp(fs.free_blocks->words, single.free_blocks->words, single.free_blocks->nwords * sizeof(uint64_t)) == 0);
+        assert(memcmp(fs.free_inodes->words, single.free_inodes->words, single.free_inodes->nwords * sizeof(uint64_t)) == 0);
+        fs_unmount(&fs);
+    }
+    fs_unmount(&single);
+    disk_close(disk);
+
+    debug("Check a parallel scan after an unclean shutdown of a larger disk");
+    size_t blocks = 4096;
+    assert(system("rm -f data/image.unit && truncate -s 16M data/image.unit") == EXIT_SUCCESS);
+    disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+    assert(fs_format(disk));
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+    static char data[(POINTERS_PER_INODE + 3) * BLOCK_SIZE];
+    for (size_t i = 0; i < 300; i++)
+    {
+        ssize_t inode_number = fs_create(&fs);
+        assert(inode_number == (ssize_t)i);
+        size_t length = i % 3 ? BLOCK_SIZE : sizeof(data);
+        assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+    }
+    for (size_t i = 0; i < 300; i += 7)
+        assert(fs_remove(&fs, i));
+    FileSystemStats expected;
+    assert(fs_statfs(&fs, &expected));
+    Bitmap *free_blocks = bitmap_create(blocks, false);
+    Bitmap *free_inodes = bitmap_create(fs_get_total_inodes(&fs), false);
+    assert(free_blocks && free_inodes);
+    memcpy(free_blocks->words, fs.free_blocks->words, free_blocks->nwords * sizeof(uint64_t));
+    memcpy(free_inodes->words, fs.free_inodes->words, free_inodes->nwords * sizeof(uint64_t));
+    disk_close(disk);
+    fs.disk = NULL;
+    fs_unmount(&fs);
+
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+    {
+        disk = disk_open("data/image.unit", blocks);
+        assert(disk);
+        assert(fs_mount_with(&fs, disk, threads[t]));
+        FileSystemStats found;
+        assert(fs_statfs(&fs, &found));
+        assert(found.free_blocks == expected.free_blocks);
+        assert(found.free_inodes == expected.free_inodes);
+        assert(memcmp(free_blocks->words, fs.free_blocks->words, free_blocks->nwords * sizeof(uint64_t)) == 0);
+        assert(memcmp(free_inodes->words, fs.free_inodes->words, free_inodes->nwords * sizeof(uint64_t)) == 0);
+
+        /* Leave the disk unclean so the next mount scans again */
+        disk_close(disk);
+        fs.disk = NULL;
+        fs_unmount(&fs);
+    }
+    bitmap_destroy(free_blocks);
+    bitmap_destroy(free_inodes);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[])
@@ -190,6 +746,15 @@ int main(int argc, char *argv[])
         fprintf(stderr, "    1. Test fs_create\n");
         fprintf(stderr, "    2. Test fs_remove\n");
         fprintf(stderr, "    3. Test fs_stat\n");
+        fprintf(stderr, "    4. Test fs_read\n");
+        fprintf(stderr, "    5. Test fs_write\n");
+        fprintf(stderr, "    6. Test fs block sizes\n");
+        fprintf(stderr, "    7. Test fs durability\n");
+        fprintf(stderr, "    8. Test fs free maps\n");
+        fprintf(stderr, "    9. Test fs free map summaries\n");
+        fprintf(stderr, "    10. Test fs persistent free maps\n");
+        fprintf(stderr, "    11. Test fs mount scan\n");
+        fprintf(stderr, "    12. Test fs parallel mount\n");
         return EXIT_FAILURE;
     }
 
@@ -213,6 +778,33 @@ int main(int argc, char *argv[])
     case 3:
         status = test_03_fs_stat();
         break;
+    case 4:
+        status = test_04_fs_read();
+        break;
+    case 5:
+        status = test_05_fs_write();
+        break;
+    case 6:
+        status = test_06_fs_block_size();
+        break;
+    case 7:
+        status = test_07_fs_durability();
+        break;
+    case 8:
+        status = test_08_fs_free_maps();
+        break;
+    case 9:
+        status = test_09_fs_free_summary();
+        break;
+    case 10:
+        status = test_10_fs_bitmaps();
+        break;
+    case 11:
+        status = test_11_fs_mount_scan();
+        break;
+    case 12:
+        status = test_12_fs_parallel_mount();
+        break;
     default:
         fprintf(stderr, "Unknown NUMBER: %d\n", number);
         break;